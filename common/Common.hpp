@@ -32,6 +32,8 @@ constexpr int MAX_MESSAGE_SIZE = 2 * 1024 * READ_BUFFER_SIZE;
 constexpr auto JAILED_DOCUMENT_ROOT = "/user/docs/";
 constexpr auto CHILD_URI = "/loolws/child?";
 constexpr auto NEW_CHILD_URI = "/loolws/newchild?";
+/// The abstract Unix socket the kits connect to, suffixed with the master port.
+constexpr auto PRISONER_SOCKET_NAME = "loolwsd-prisoner-";
 constexpr auto LO_JAIL_SUBPATH = "lo";
 
 /// The HTTP response User-Agent.
@@ -44,6 +46,11 @@ constexpr auto WOPI_AGENT_STRING = "LOOLWSD WOPI Agent " LOOLWSD_VERSION;
 extern int ClientPortNumber;
 extern int MasterPortNumber;
 
+// Whether the kits connect over the Unix socket rather than the master port,
+// and the size of their shared tile ring in KB, 0 when disabled.
+extern bool UseLocalSocket;
+extern int TileRingSizeKb;
+
 #endif
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
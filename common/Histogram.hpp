@@ -0,0 +1,195 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_HISTOGRAM_HPP
+#define INCLUDED_HISTOGRAM_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+/// A histogram of values in logarithmic buckets, each power of two
+/// split in SubBuckets linear ones, as HdrHistogram does, so that the
+/// bucket of a value is within 1/SubBuckets of it.
+/// Lock-free, may be updated and read from any thread.
+class Histogram
+{
+public:
+    static constexpr int SubBucketBits = 2;
+    static constexpr int SubBuckets = 1 << SubBucketBits;
+
+    /// Enough for values up to 2^33, the last bucket counts everything else.
+    static constexpr int Buckets = 32 * SubBuckets;
+
+    explicit Histogram(const std::string& unit) :
+        _unit(unit),
+        _count(0),
+        _sum(0),
+        _max(0)
+    {
+        for (auto& bucket : _buckets)
+            bucket = 0;
+    }
+
+    const std::string& getUnit() const { return _unit; }
+
+    void add(const uint64_t value)
+    {
+        _buckets[getIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(value, std::memory_order_relaxed);
+        updateMax(value);
+    }
+
+    uint64_t getCount() const { return _count.load(std::memory_order_relaxed); }
+    uint64_t getSum() const { return _sum.load(std::memory_order_relaxed); }
+    uint64_t getMax() const { return _max.load(std::memory_order_relaxed); }
+    uint64_t getBucket(const int index) const { return _buckets[index].load(std::memory_order_relaxed); }
+
+    /// The bucket counting the given value.
+    static int getIndex(const uint64_t value)
+    {
+        if (value < static_cast<uint64_t>(2 * SubBuckets))
+            return static_cast<int>(value);
+
+        const int octave = 63 - __builtin_clzll(value);
+        const int sub = (value >> (octave - SubBucketBits)) & (SubBuckets - 1);
+        return std::min(Buckets - 1, (octave - SubBucketBits + 1) * SubBuckets + sub);
+    }
+
+    /// The values of the given bucket are below this bound.
+    static uint64_t getUpperBound(const int index)
+    {
+        if (index < 2 * SubBuckets)
+            return index + 1;
+
+        const int octave = index / SubBuckets + SubBucketBits - 1;
+        const uint64_t sub = index % SubBuckets;
+        return (SubBuckets + sub + 1) << (octave - SubBucketBits);
+    }
+
+    /// The highest value the bucket of the given percentile may count.
+    uint64_t getPercentile(const double percentile) const
+    {
+        const uint64_t count = getCount();
+        const uint64_t rank = static_cast<uint64_t>(count * percentile / 100.0);
+        uint64_t seen = 0;
+        for (int i = 0; i < Buckets - 1; ++i)
+        {
+            seen += getBucket(i);
+            if (seen > rank)
+                return std::min(getUpperBound(i) - 1, getMax());
+        }
+
+        return getMax();
+    }
+
+    void dumpState(std::ostream& os) const
+    {
+        const uint64_t count = getCount();
+        os << "count: " << count;
+        if (count > 0)
+        {
+            os << ", mean: " << getSum() / count << ' ' << _unit
+               << ", p50 <= " << getPercentile(50) << ' ' << _unit
+               << ", p99 <= " << getPercentile(99) << ' ' << _unit
+               << ", max: " << getMax() << ' ' << _unit;
+        }
+
+        os << '\n';
+    }
+
+    /// Serializes the samples as "sum=<sum> max=<max> buckets=<index>:<count>,...",
+    /// listing the non-empty buckets only, to be merged in another process.
+    std::string serialize() const
+    {
+        std::ostringstream oss;
+        oss << "sum=" << getSum() << " max=" << getMax() << " buckets=";
+        bool first = true;
+        for (int i = 0; i < Buckets; ++i)
+        {
+            const uint64_t count = getBucket(i);
+            if (count > 0)
+            {
+                oss << (first ? "" : ",") << i << ':' << count;
+                first = false;
+            }
+        }
+
+        return oss.str();
+    }
+
+    /// Adds the samples serialized by another histogram.
+    void merge(const std::string& state)
+    {
+        std::istringstream iss(state);
+        std::string token;
+        while (iss >> token)
+        {
+            if (token.compare(0, 4, "sum=") == 0)
+            {
+                _sum.fetch_add(std::strtoull(token.c_str() + 4, nullptr, 10), std::memory_order_relaxed);
+            }
+            else if (token.compare(0, 4, "max=") == 0)
+            {
+                updateMax(std::strtoull(token.c_str() + 4, nullptr, 10));
+            }
+            else if (token.compare(0, 8, "buckets=") == 0)
+            {
+                const char* p = token.c_str() + 8;
+                while (*p)
+                {
+                    char* end;
+                    const long index = std::strtol(p, &end, 10);
+                    if (*end != ':' || index < 0 || index >= Buckets)
+                        break;
+
+                    const uint64_t count = std::strtoull(end + 1, &end, 10);
+                    _buckets[index].fetch_add(count, std::memory_order_relaxed);
+                    _count.fetch_add(count, std::memory_order_relaxed);
+                    p = (*end == ',' ? end + 1 : end);
+                }
+            }
+        }
+    }
+
+    /// Forget all samples, by the thread that adds them.
+    void reset()
+    {
+        for (auto& bucket : _buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        _count.store(0, std::memory_order_relaxed);
+        _sum.store(0, std::memory_order_relaxed);
+        _max.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    void updateMax(const uint64_t value)
+    {
+        uint64_t max = _max.load(std::memory_order_relaxed);
+        while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+private:
+    const std::string _unit;
+    std::atomic<uint64_t> _buckets[Buckets];
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _sum;
+    std::atomic<uint64_t> _max;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -15,10 +15,16 @@
 
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <ctime>
 #include <iomanip>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <Poco/ConsoleChannel.h>
 #include <Poco/DateTimeFormatter.h>
@@ -57,6 +63,257 @@ namespace Log
     };
     static StaticNames Source;
 
+    /// The lines queued by one thread, written by the background one.
+    /// Lock-free: the thread only moves Head, the writer only Tail.
+    struct LineQueue
+    {
+        explicit LineQueue(const size_t size) :
+            Lines(size),
+            Head(0),
+            Tail(0),
+            Orphaned(false)
+        {
+        }
+
+        struct Line
+        {
+            Message::Priority Priority;
+            std::string Text;
+        };
+
+        std::vector<Line> Lines;
+        std::atomic<uint64_t> Head;
+        std::atomic<uint64_t> Tail;
+        /// Set when the thread exits, to release the queue once empty.
+        std::atomic<bool> Orphaned;
+    };
+
+    /// The queue of the current thread, for the channel with the given id.
+    struct ThreadLineQueue
+    {
+        ThreadLineQueue() :
+            ChannelId(0)
+        {
+        }
+
+        ~ThreadLineQueue()
+        {
+            if (Queue)
+                Queue->Orphaned = true;
+        }
+
+        unsigned ChannelId;
+        std::shared_ptr<LineQueue> Queue;
+    };
+
+    static thread_local ThreadLineQueue CurrentLineQueue;
+
+    /// A channel that has each thread queue its lines, and writes
+    /// them to the real channel from a background thread. Errors
+    /// are written at once, after the queued lines.
+    class AsyncChannel : public Channel
+    {
+    public:
+        AsyncChannel(const AutoPtr<Channel>& channel, const std::string& source,
+                     const size_t queueSize, const bool dropOnOverflow) :
+            _channel(channel),
+            _source(source),
+            _queueSize(roundUpToPowerOfTwo(queueSize)),
+            _dropOnOverflow(dropOnOverflow),
+            _id(++LastId),
+            _stop(false),
+            _dropped(0),
+            _reportedDropped(0)
+        {
+            _thread = std::thread([this]() { run(); });
+        }
+
+        ~AsyncChannel()
+        {
+            close();
+        }
+
+        void log(const Message& msg) override
+        {
+            push(msg.getPriority(), std::string(msg.getText()));
+        }
+
+        void close() override
+        {
+            if (_thread.joinable())
+            {
+                _stop = true;
+                _wakeup.notify_one();
+                _thread.join();
+
+                std::lock_guard<std::mutex> lock(_writeMutex);
+                drain();
+            }
+        }
+
+        void push(const Message::Priority priority, std::string&& text)
+        {
+            if (priority <= Message::PRIO_ERROR || _stop)
+            {
+                writeNow(priority, text);
+                return;
+            }
+
+            LineQueue& queue = getThreadQueue();
+            const uint64_t head = queue.Head.load(std::memory_order_relaxed);
+            while (head - queue.Tail.load(std::memory_order_acquire) >= _queueSize)
+            {
+                if (_dropOnOverflow)
+                {
+                    ++_dropped;
+                    return;
+                }
+
+                if (_stop)
+                {
+                    writeNow(priority, text);
+                    return;
+                }
+
+                _wakeup.notify_one();
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+
+            LineQueue::Line& line = queue.Lines[head & (_queueSize - 1)];
+            line.Priority = priority;
+            line.Text = std::move(text);
+            queue.Head.store(head + 1, std::memory_order_release);
+
+            // Don't wait for the next flush if the queue is filling up.
+            if (head - queue.Tail.load(std::memory_order_relaxed) == _queueSize / 2)
+                _wakeup.notify_one();
+        }
+
+        uint64_t getDropped() const { return _dropped; }
+
+    private:
+        static size_t roundUpToPowerOfTwo(const size_t size)
+        {
+            size_t result = 16;
+            while (result < size)
+                result *= 2;
+            return result;
+        }
+
+        LineQueue& getThreadQueue()
+        {
+            ThreadLineQueue& current = CurrentLineQueue;
+            if (current.ChannelId != _id)
+            {
+                if (current.Queue)
+                    current.Queue->Orphaned = true;
+
+                current.Queue = std::make_shared<LineQueue>(_queueSize);
+                current.ChannelId = _id;
+
+                std::lock_guard<std::mutex> lock(_queuesMutex);
+                _queues.push_back(current.Queue);
+            }
+
+            return *current.Queue;
+        }
+
+        void writeNow(const Message::Priority priority, const std::string& text)
+        {
+            std::lock_guard<std::mutex> lock(_writeMutex);
+            drain();
+            _channel->log(Message(_source, text, priority));
+        }
+
+        /// Writes out all the queued lines, with _writeMutex held.
+        void drain()
+        {
+            std::vector<std::shared_ptr<LineQueue>> queues;
+            {
+                std::lock_guard<std::mutex> lock(_queuesMutex);
+                queues = _queues;
+            }
+
+            for (const auto& queue : queues)
+            {
+                uint64_t tail = queue->Tail.load(std::memory_order_relaxed);
+                const uint64_t head = queue->Head.load(std::memory_order_acquire);
+                for (; tail != head; ++tail)
+                {
+                    LineQueue::Line& line = queue->Lines[tail & (_queueSize - 1)];
+                    _channel->log(Message(_source, line.Text, line.Priority));
+                    line.Text.clear();
+                    queue->Tail.store(tail + 1, std::memory_order_release);
+                }
+            }
+
+            const uint64_t dropped = _dropped;
+            if (dropped != _reportedDropped)
+            {
+                char buffer[1024];
+                std::string text = prefix(buffer, "WRN", false);
+                text += "Dropped " + std::to_string(dropped - _reportedDropped) +
+                        " log lines, the queues were full.";
+                _channel->log(Message(_source, text, Message::PRIO_WARNING));
+                _reportedDropped = dropped;
+            }
+
+            // Release the queues of the threads that are gone.
+            std::lock_guard<std::mutex> lock(_queuesMutex);
+            for (auto it = _queues.begin(); it != _queues.end(); )
+            {
+                if ((*it)->Orphaned &&
+                    (*it)->Tail.load(std::memory_order_relaxed) == (*it)->Head.load(std::memory_order_acquire))
+                    it = _queues.erase(it);
+                else
+                    ++it;
+            }
+        }
+
+        void run()
+        {
+            Util::setThreadName("log_writer");
+
+            while (!_stop)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(_wakeupMutex);
+                    _wakeup.wait_for(lock, std::chrono::milliseconds(FlushIntervalMs));
+                }
+
+                std::lock_guard<std::mutex> lock(_writeMutex);
+                drain();
+            }
+        }
+
+    private:
+        AutoPtr<Channel> _channel;
+        const std::string _source;
+        const size_t _queueSize;
+        const bool _dropOnOverflow;
+        /// Tells the queues of the threads apart from those of a previous channel.
+        const unsigned _id;
+        std::atomic<bool> _stop;
+        std::atomic<uint64_t> _dropped;
+        uint64_t _reportedDropped;
+
+        std::mutex _queuesMutex;
+        std::vector<std::shared_ptr<LineQueue>> _queues;
+        /// Serializes the writes to the channel.
+        std::mutex _writeMutex;
+        std::mutex _wakeupMutex;
+        std::condition_variable _wakeup;
+        std::thread _thread;
+
+        static std::atomic<unsigned> LastId;
+        static constexpr int FlushIntervalMs = 20;
+    };
+
+    std::atomic<unsigned> AsyncChannel::LastId(0);
+    constexpr int AsyncChannel::FlushIntervalMs;
+
+    static AutoPtr<AsyncChannel> AsyncLog;
+
     // We need a signal safe means of writing messages
     //   $ man 7 signal
     void signalLog(const char *message)
@@ -191,6 +448,36 @@ namespace Log
         info(oss.str());
     }
 
+    void enableAsync(const size_t queueSize, const bool dropOnOverflow)
+    {
+        auto& logger = Log::logger();
+        AutoPtr<Channel> channel(logger.getChannel(), true);
+        AsyncLog = new AsyncChannel(channel, logger.name(), queueSize, dropOnOverflow);
+        logger.setChannel(AsyncLog);
+
+        LOG_INF("Logging asynchronously, queueing up to " << queueSize << " lines per thread, " <<
+                (dropOnOverflow ? "dropping" : "waiting") << " when full.");
+    }
+
+    void shutdown()
+    {
+        if (AsyncLog)
+            AsyncLog->close();
+    }
+
+    uint64_t getDroppedCount()
+    {
+        return AsyncLog ? AsyncLog->getDropped() : 0;
+    }
+
+    void log(Poco::Logger& logger, const Poco::Message::Priority priority, std::string&& text)
+    {
+        if (AsyncLog && logger.getChannel() == AsyncLog.get())
+            AsyncLog->push(priority, std::move(text));
+        else
+            logger.log(Poco::Message(logger.name(), text, priority));
+    }
+
     Poco::Logger& logger()
     {
         return Poco::Logger::get(Source.inited ? Source.name : std::string());
@@ -13,6 +13,7 @@
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include <cstdint>
 #include <functional>
 #include <sstream>
 #include <string>
@@ -28,6 +29,21 @@ namespace Log
                     std::map<std::string, std::string> config);
     Poco::Logger& logger();
 
+    /// Moves the writing of the log to a background thread: threads
+    /// only queue their lines, up to queueSize each, lock-free. When a
+    /// queue is full, the line is dropped, or the thread waits.
+    /// Errors are still written at once. Call after initialize().
+    void enableAsync(size_t queueSize, bool dropOnOverflow);
+
+    /// Writes out the queued lines, and stops the background thread.
+    void shutdown();
+
+    /// The number of lines dropped because a queue was full.
+    uint64_t getDroppedCount();
+
+    /// Logs a formatted line, moved to the queue when asynchronous.
+    void log(Poco::Logger& logger, Poco::Message::Priority priority, std::string&& text);
+
     char* prefix(char* buffer, const char* level, bool sigSafe);
 
     void trace(const std::string& msg);
@@ -177,7 +193,7 @@ namespace Log
     }
 }
 
-#define LOG_BODY_(PRIO, LVL, X) Poco::Message m_(l_.name(), "", Poco::Message::PRIO_##PRIO); char b_[1024]; std::ostringstream oss_(Log::prefix(b_, LVL, false), std::ostringstream::ate); oss_ << std::boolalpha << X << "| " << __FILE__ << ':' << __LINE__; m_.setText(oss_.str()); l_.log(m_);
+#define LOG_BODY_(PRIO, LVL, X) char b_[1024]; std::ostringstream oss_(Log::prefix(b_, LVL, false), std::ostringstream::ate); oss_ << std::boolalpha << X << "| " << __FILE__ << ':' << __LINE__; Log::log(l_, Poco::Message::PRIO_##PRIO, oss_.str());
 #define LOG_TRC(X) do { auto& l_ = Log::logger(); if (l_.trace()) { LOG_BODY_(TRACE, "TRC", X); } } while (false)
 #define LOG_DBG(X) do { auto& l_ = Log::logger(); if (l_.debug()) { LOG_BODY_(DEBUG, "DBG", X); } } while (false)
 #define LOG_INF(X) do { auto& l_ = Log::logger(); if (l_.information()) { LOG_BODY_(INFORMATION, "INF", X); } } while (false)
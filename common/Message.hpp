@@ -10,7 +10,11 @@
 #ifndef INCLUDED_MESSAGE_HPP
 #define INCLUDED_MESSAGE_HPP
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -18,6 +22,9 @@
 #include "Log.hpp"
 
 /// The payload type used to send/receive data.
+/// Only the forward token and the type are extracted upfront,
+/// the tokens, first line and abbreviation are built on first
+/// use, as most messages are only forwarded as they are.
 class Message
 {
 public:
@@ -25,19 +32,34 @@ public:
     enum class Type { Text, JSON, Binary };
     enum class Dir { In, Out };
 
+    /// A read-only view of the payload, valid as long as the Message.
+    class Payload
+    {
+    public:
+        Payload(const char* data, const size_t size) :
+            _data(data),
+            _size(size)
+        {
+        }
+
+        const char* data() const { return _data; }
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        const char* begin() const { return _data; }
+        const char* end() const { return _data + _size; }
+        char operator[](const size_t index) const { return _data[index]; }
+
+    private:
+        const char* _data;
+        size_t _size;
+    };
+
     /// Construct a text message.
     /// message must include the full first-line.
     Message(const std::string& message,
             const enum Dir dir) :
-        _forwardToken(getForwardToken(message.data(), message.size())),
-        _data(skipWhitespace(message.data() + _forwardToken.size()), message.data() + message.size()),
-        _tokens(LOOLProtocol::tokenize(_data.data(), _data.size())),
-        _id(makeId(dir)),
-        _firstLine(LOOLProtocol::getFirstLine(_data.data(), _data.size())),
-        _abbr(_id + ' ' + LOOLProtocol::getAbbreviatedMessage(_data.data(), _data.size())),
-        _type(detectType())
+        Message(message.data(), message.size(), dir)
     {
-        LOG_TRC("Message " << _abbr);
     }
 
     /// Construct a message from a string with type and
@@ -46,18 +68,14 @@ public:
     Message(const std::string& message,
             const enum Dir dir,
             const size_t reserve) :
-        _forwardToken(getForwardToken(message.data(), message.size())),
-        _data(std::max(reserve, message.size())),
-        _tokens(LOOLProtocol::tokenize(message.data() + _forwardToken.size(), message.size() - _forwardToken.size())),
+        _forwardToken(message.data(), getForwardTokenSize(message.data(), message.size())),
+        _data(copyPayload(message.data(), message.size(), _forwardToken.size(), reserve)),
+        _offset(0),
         _id(makeId(dir)),
-        _firstLine(LOOLProtocol::getFirstLine(message)),
-        _abbr(_id + ' ' + LOOLProtocol::getAbbreviatedMessage(message)),
+        _created(std::chrono::steady_clock::now()),
         _type(detectType())
     {
-        _data.resize(message.size());
-        const auto offset = skipWhitespace(message.data() + _forwardToken.size());
-        std::memcpy(_data.data(), offset, message.size() - (offset - message.data()));
-        LOG_TRC("Message " << _abbr);
+        LOG_TRC("Message " << abbr());
     }
 
     /// Construct a message from a character array with type.
@@ -65,48 +83,91 @@ public:
     Message(const char* p,
             const size_t len,
             const enum Dir dir) :
-        _forwardToken(getForwardToken(p, len)),
-        _data(skipWhitespace(p + _forwardToken.size()), p + len),
-        _tokens(LOOLProtocol::tokenize(_data.data(), _data.size())),
+        _forwardToken(p, getForwardTokenSize(p, len)),
+        _data(copyPayload(p, len, _forwardToken.size(), 0)),
+        _offset(0),
         _id(makeId(dir)),
-        _firstLine(LOOLProtocol::getFirstLine(_data.data(), _data.size())),
-        _abbr(_id + ' ' + LOOLProtocol::getAbbreviatedMessage(_data.data(), _data.size())),
+        _created(std::chrono::steady_clock::now()),
         _type(detectType())
     {
-        LOG_TRC("Message " << _abbr);
+        LOG_TRC("Message " << abbr());
     }
 
-    size_t size() const { return _data.size(); }
-    const std::vector<char>& data() const { return _data; }
+    /// Construct a message by adopting the given buffer, without copying
+    /// or moving its payload: the forward token is skipped, not erased.
+    /// Note: data must include the full first-line.
+    Message(std::vector<char>&& data,
+            const enum Dir dir) :
+        _forwardToken(data.data(), getForwardTokenSize(data.data(), data.size())),
+        _data(std::move(data)),
+        _offset(getPayloadOffset(_data, _forwardToken.size())),
+        _id(makeId(dir)),
+        _created(std::chrono::steady_clock::now()),
+        _type(detectType())
+    {
+        LOG_TRC("Message " << abbr());
+    }
+
+    size_t size() const { return _data.size() - _offset; }
+
+    /// The payload, without the forward token.
+    Payload data() const { return Payload(_data.data() + _offset, size()); }
+
+    const std::vector<std::string>& tokens() const
+    {
+        std::call_once(_tokensFlag, [this]() {
+            _tokens = LOOLProtocol::tokenize(data().data(), size());
+        });
+        return _tokens;
+    }
 
-    const std::vector<std::string>& tokens() const { return _tokens; }
     const std::string& forwardToken() const { return _forwardToken; }
-    const std::string& firstToken() const { return _tokens[0]; }
-    const std::string& firstLine() const { return _firstLine; }
-    const std::string& operator[](size_t index) const { return _tokens[index]; }
+    const std::string& firstToken() const { return tokens()[0]; }
+
+    const std::string& firstLine() const
+    {
+        std::call_once(_firstLineFlag, [this]() {
+            _firstLine = LOOLProtocol::getFirstLine(data().data(), size());
+        });
+        return _firstLine;
+    }
+
+    const std::string& operator[](size_t index) const { return tokens()[index]; }
 
     bool getTokenInteger(const std::string& name, int& value)
     {
-        return LOOLProtocol::getTokenInteger(_tokens, name, value);
+        return LOOLProtocol::getTokenInteger(tokens(), name, value);
     }
 
     /// Return the abbreviated message for logging purposes.
-    const std::string& abbr() const { return _abbr; }
+    const std::string& abbr() const
+    {
+        std::call_once(_abbrFlag, [this]() {
+            _abbr = _id + ' ' + LOOLProtocol::getAbbreviatedMessage(data().data(), size());
+        });
+        return _abbr;
+    }
+
     const std::string& id() const { return _id; }
 
+    /// When the message was created, to measure how long it waits to be sent.
+    std::chrono::steady_clock::time_point created() const { return _created; }
+
     /// Returns the json part of the message, if any.
     std::string jsonString() const
     {
-        if (_tokens.size() > 1 && _tokens[1] == "{")
+        const auto& tokens = this->tokens();
+        if (tokens.size() > 1 && tokens[1] == "{")
         {
-            const auto firstTokenSize = _tokens[0].size();
-            return std::string(_data.data() + firstTokenSize, _data.size() - firstTokenSize);
+            const auto firstTokenSize = tokens[0].size();
+            return std::string(data().data() + firstTokenSize, size() - firstTokenSize);
         }
 
         return std::string();
     }
 
     /// Append more data to the message.
+    /// Only before the message is shared, the first line must be complete.
     void append(const char* p, const size_t len)
     {
         const auto curSize = _data.size();
@@ -126,16 +187,25 @@ private:
         return (dir == Dir::In ? 'i' : 'o') + std::to_string(++Counter);
     }
 
+    /// Matches the first token, without tokenizing.
+    bool firstTokenIs(const char* token) const
+    {
+        const Payload payload = data();
+        const size_t len = std::strlen(token);
+        return payload.size() >= len && std::memcmp(payload.data(), token, len) == 0 &&
+               (payload.size() == len || payload[len] == ' ' || payload[len] == '\n');
+    }
+
     Type detectType() const
     {
-        if (_tokens[0] == "tile:" ||
-            _tokens[0] == "tilecombine:" ||
-            _tokens[0] == "renderfont:")
+        if (firstTokenIs("tile:") ||
+            firstTokenIs("tilecombine:") ||
+            firstTokenIs("renderfont:"))
         {
             return Type::Binary;
         }
 
-        if (_data[_data.size() - 1] == '}')
+        if (size() > 0 && _data.back() == '}')
         {
             return Type::JSON;
         }
@@ -144,30 +214,58 @@ private:
         return Type::Text;
     }
 
-    std::string getForwardToken(const char* buffer, int length)
+    /// Returns the size of the forward token, if the first token is one.
+    static size_t getForwardTokenSize(const char* buffer, const size_t length)
     {
-        auto forward = LOOLProtocol::getFirstToken(buffer, length);
-        return (forward.find('-') != std::string::npos ? forward : std::string());
+        const size_t size = LOOLProtocol::getDelimiterPosition(buffer, length, ' ');
+        return (size > 0 && std::memchr(buffer, '-', size) != nullptr ? size : 0);
     }
 
-    const char* skipWhitespace(const char* p)
+    /// Returns the number of spaces at the start of the payload.
+    static size_t countWhitespace(const char* p, const size_t len)
     {
-        while (p && *p == ' ')
+        size_t count = 0;
+        while (count < len && p[count] == ' ')
         {
-            ++p;
+            ++count;
         }
 
-        return p;
+        return count;
+    }
+
+    /// Copies the payload that follows the forward token.
+    static std::vector<char> copyPayload(const char* p, const size_t len,
+                                         size_t skip, const size_t reserve)
+    {
+        skip += countWhitespace(p + skip, len - skip);
+
+        std::vector<char> data;
+        data.reserve(std::max(reserve, len - skip));
+        data.insert(data.end(), p + skip, p + len);
+        return data;
+    }
+
+    /// Returns where the payload starts in the buffer, past the forward token.
+    static size_t getPayloadOffset(const std::vector<char>& data, const size_t skip)
+    {
+        return skip + countWhitespace(data.data() + skip, data.size() - skip);
     }
 
 private:
     const std::string _forwardToken;
     std::vector<char> _data;
-    const std::vector<std::string> _tokens;
+    /// Where the payload starts in _data.
+    const size_t _offset;
     const std::string _id;
-    const std::string _firstLine;
-    const std::string _abbr;
+    const std::chrono::steady_clock::time_point _created;
     const Type _type;
+
+    mutable std::once_flag _tokensFlag;
+    mutable std::vector<std::string> _tokens;
+    mutable std::once_flag _firstLineFlag;
+    mutable std::string _firstLine;
+    mutable std::once_flag _abbrFlag;
+    mutable std::string _abbr;
 };
 
 #endif
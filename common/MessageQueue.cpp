@@ -12,10 +12,11 @@
 #include "MessageQueue.hpp"
 
 #include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 
-#include <Poco/JSON/JSON.h>
-#include <Poco/JSON/Object.h>
-#include <Poco/JSON/Parser.h>
 #include <Poco/StringTokenizer.h>
 
 #include <Protocol.hpp>
@@ -26,6 +27,12 @@ using Poco::StringTokenizer;
 
 void TileQueue::put_impl(const Payload& value)
 {
+    if (isCallback(value))
+    {
+        putCallback_impl(value);
+        return;
+    }
+
     const auto msg = std::string(value.data(), value.size());
     const std::string firstToken = LOOLProtocol::getFirstToken(value);
 
@@ -37,6 +44,9 @@ void TileQueue::put_impl(const Payload& value)
         _queue.erase(std::remove_if(_queue.begin(), _queue.end(),
                 [&tokens](const Payload& v)
                 {
+                    if (isCallback(v))
+                        return false;
+
                     const std::string s(v.data(), v.size());
                     // Tile is for a thumbnail, don't cancel it
                     if (s.find("id=") != std::string::npos)
@@ -82,18 +92,24 @@ void TileQueue::put_impl(const Payload& value)
     }
     else if (firstToken == "callback")
     {
-        const std::string newMsg = removeCallbackDuplicate(msg);
-
-        if (newMsg.empty())
+        // "callback <target> <type> <payload>", as callbacks used to be queued.
+        const auto tokens = LOOLProtocol::tokenize(msg);
+        if (tokens.size() >= 3)
         {
-            MessageQueue::put_impl(value);
+            const auto offset = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3; // including spaces
+            const std::string payload = (offset < msg.size() ? msg.substr(offset) : std::string());
+
+            Callback callback = parseCallback(std::atoi(tokens[2].c_str()), payload);
+            if (tokens[1] == "all")
+                callback.ViewId = Callback::AllViews;
+            else if (LOOLProtocol::matchPrefix("except-", tokens[1]))
+                callback.ExceptViewId = std::atoi(tokens[1].c_str() + 7);
+            else
+                callback.ViewId = std::atoi(tokens[1].c_str());
+
+            putCallback_impl(makeCallbackRecord(callback, payload));
+            return;
         }
-        else
-        {
-            MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
-        }
-
-        return;
     }
 
     MessageQueue::put_impl(value);
@@ -128,81 +144,221 @@ void TileQueue::removeTileDuplicate(const std::string& tileMsg)
 
 namespace {
 
-/// Read the viewId from the tokens.
-std::string extractViewId(const std::string& origMsg, const std::vector<std::string>& tokens)
+/// Parses up to count integers separated by commas and spaces, as LOK
+/// formats rectangles, e.g. "284, 1418, 11105, 275, 0".
+/// @return the number of integers parsed.
+int parseIntegers(const char* p, int* values, const int count)
 {
-    size_t nonJson = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3; // including spaces
-    std::string jsonString(origMsg.data() + nonJson, origMsg.size() - nonJson);
+    int parsed = 0;
+    while (parsed < count)
+    {
+        while (*p == ' ' || *p == ',')
+            ++p;
+
+        char* end;
+        const long value = std::strtol(p, &end, 10);
+        if (end == p)
+            break;
 
-    Poco::JSON::Parser parser;
-    const auto result = parser.parse(jsonString);
-    const auto& json = result.extract<Poco::JSON::Object::Ptr>();
-    return json->get("viewId").toString();
+        values[parsed++] = static_cast<int>(value);
+        p = end;
+    }
+
+    return parsed;
 }
 
-/// Extract the .uno: command ID from the potential command.
-std::string extractUnoCommand(const std::string& command)
+/// The value of the given key in the flat JSON objects of the view callbacks,
+/// e.g. { "viewId": "1", "rectangle": "3999, 1418, 0, 298", "part": "0" },
+/// without parsing all of it.
+std::string getJsonValue(const std::string& json, const std::string& key)
 {
-    if (!LOOLProtocol::matchPrefix(".uno:", command))
+    const std::string quotedKey = '"' + key + '"';
+    auto pos = json.find(quotedKey);
+    if (pos == std::string::npos)
+        return std::string();
+
+    pos = json.find_first_not_of(" \t\r\n", pos + quotedKey.size());
+    if (pos == std::string::npos || json[pos] != ':')
+        return std::string();
+
+    pos = json.find_first_not_of(" \t\r\n", pos + 1);
+    if (pos == std::string::npos)
         return std::string();
 
-    size_t equalPos = command.find('=');
-    if (equalPos != std::string::npos)
-        return command.substr(0, equalPos);
+    if (json[pos] == '"')
+    {
+        const auto end = json.find('"', pos + 1);
+        return end == std::string::npos ? std::string() : json.substr(pos + 1, end - pos - 1);
+    }
 
-    return command;
+    const auto end = json.find_first_of(",} \t\r\n", pos);
+    return json.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
 }
 
-/// Extract rectangle from the invalidation callback
-bool extractRectangle(const std::vector<std::string>& tokens, int& x, int& y, int& w, int& h, int& part)
+bool isSameTarget(const TileQueue::Callback& a, const TileQueue::Callback& b)
 {
-    x = 0;
-    y = 0;
-    w = INT_MAX;
-    h = INT_MAX;
-    part = 0;
+    return a.Type == b.Type && a.ViewId == b.ViewId && a.ExceptViewId == b.ExceptViewId;
+}
 
-    if (tokens.size() < 5)
-        return false;
+}
 
-    if (tokens[3] == "EMPTY,")
+TileQueue::Callback TileQueue::parseCallback(const int type, const std::string& payload)
+{
+    Callback callback;
+    callback.Type = type;
+    callback.ViewId = Callback::AllViews;
+    callback.ExceptViewId = -1;
+    callback.HasRectangle = false;
+    callback.Part = 0;
+    callback.X = 0;
+    callback.Y = 0;
+    callback.Width = 0;
+    callback.Height = 0;
+    callback.PayloadViewId = -1;
+    callback.UnoCommandLength = 0;
+    callback.IsMerged = false;
+
+    int values[5];
+    if (type == 0)                  // invalidation: "x, y, width, height, part" or "EMPTY, part"
     {
-        part = std::atoi(tokens[4].c_str());
-        return true;
+        if (payload.compare(0, 6, "EMPTY,") == 0)
+        {
+            if (parseIntegers(payload.c_str() + 6, values, 1) == 1)
+            {
+                callback.HasRectangle = true;
+                callback.Width = INT_MAX;
+                callback.Height = INT_MAX;
+                callback.Part = values[0];
+            }
+        }
+        else if (parseIntegers(payload.c_str(), values, 5) == 5)
+        {
+            callback.HasRectangle = true;
+            callback.X = values[0];
+            callback.Y = values[1];
+            callback.Width = values[2];
+            callback.Height = values[3];
+            callback.Part = values[4];
+        }
+    }
+    else if (type == 1 ||           // the cursor has moved
+             type == 17)            // the cell cursor has moved
+    {
+        // Payload may be 'EMPTY'.
+        if (parseIntegers(payload.c_str(), values, 4) == 4)
+        {
+            callback.HasRectangle = true;
+            callback.X = values[0];
+            callback.Y = values[1];
+            callback.Width = values[2];
+            callback.Height = values[3];
+        }
     }
+    else if (type == 24 ||          // the view cursor has moved
+             type == 26 ||          // the view cell cursor has moved
+             type == 28)            // the view cursor visibility has changed
+    {
+        const std::string viewId = getJsonValue(payload, "viewId");
+        if (!viewId.empty())
+            callback.PayloadViewId = std::atoi(viewId.c_str());
 
-    if (tokens.size() < 8)
-        return false;
+        if (type != 28)
+        {
+            callback.Part = std::atoi(getJsonValue(payload, "part").c_str());
 
-    x = std::atoi(tokens[3].c_str());
-    y = std::atoi(tokens[4].c_str());
-    w = std::atoi(tokens[5].c_str());
-    h = std::atoi(tokens[6].c_str());
-    part = std::atoi(tokens[7].c_str());
+            // Rectangle may be 'EMPTY'.
+            if (parseIntegers(getJsonValue(payload, "rectangle").c_str(), values, 4) == 4)
+            {
+                callback.HasRectangle = true;
+                callback.X = values[0];
+                callback.Y = values[1];
+                callback.Width = values[2];
+                callback.Height = values[3];
+            }
+        }
+    }
+    else if (type == 8)             // state changed: ".uno:Command=value"
+    {
+        if (LOOLProtocol::matchPrefix(".uno:", payload))
+        {
+            callback.UnoCommandLength = std::min(payload.find_first_of("= "), payload.size());
+        }
+    }
 
-    return true;
+    return callback;
 }
 
+TileQueue::Payload TileQueue::makeCallbackRecord(const Callback& callback, const std::string& payload)
+{
+    Payload record(CallbackHeaderSize + payload.size());
+    record[0] = CallbackMarker;
+    std::memcpy(record.data() + 1, &callback, sizeof(Callback));
+    std::memcpy(record.data() + CallbackHeaderSize, payload.data(), payload.size());
+    return record;
 }
 
-std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
+TileQueue::Callback TileQueue::getCallback(const Payload& value)
 {
-    assert(LOOLProtocol::matchPrefix("callback", callbackMsg, /*ignoreWhitespace*/ true));
+    assert(isCallback(value));
 
-    std::vector<std::string> tokens = LOOLProtocol::tokenize(callbackMsg);
+    Callback callback;
+    std::memcpy(&callback, value.data() + 1, sizeof(Callback));
+    return callback;
+}
 
-    if (tokens.size() < 3)
-        return std::string();
+std::string TileQueue::getCallbackPayload(const Payload& value)
+{
+    const Callback callback = getCallback(value);
+    if (callback.IsMerged)
+    {
+        return std::to_string(callback.X) + ", " +
+               std::to_string(callback.Y) + ", " +
+               std::to_string(callback.Width) + ", " +
+               std::to_string(callback.Height) + ", " +
+               std::to_string(callback.Part);
+    }
+
+    return std::string(value.data() + CallbackHeaderSize, value.size() - CallbackHeaderSize);
+}
+
+std::string TileQueue::callbackToString(const Payload& value)
+{
+    const Callback callback = getCallback(value);
 
-    // the message is "callback <view> <id> ..."
-    const std::string& callbackType = tokens[2];
+    std::string target;
+    if (callback.ViewId != Callback::AllViews)
+        target = std::to_string(callback.ViewId);
+    else if (callback.ExceptViewId >= 0)
+        target = "except-" + std::to_string(callback.ExceptViewId);
+    else
+        target = "all";
 
-    if (callbackType == "0")        // invalidation
+    return "callback " + target + ' ' + std::to_string(callback.Type) + ' ' + getCallbackPayload(value);
+}
+
+void TileQueue::putCallback_impl(const Payload& record)
+{
+    Callback callback = getCallback(record);
+    if (removeCallbackDuplicate(callback, record))
     {
-        int msgX, msgY, msgW, msgH, msgPart;
+        // The payload is made from the merged rectangle when the callback is sent.
+        callback.IsMerged = true;
+        MessageQueue::put_impl(makeCallbackRecord(callback, std::string()));
+    }
+    else
+    {
+        MessageQueue::put_impl(record);
+    }
+}
+
+bool TileQueue::removeCallbackDuplicate(Callback& callback, const Payload& record)
+{
+    const int callbackType = callback.Type;
 
-        if (!extractRectangle(tokens, msgX, msgY, msgW, msgH, msgPart))
-            return std::string();
+    if (callbackType == 0)          // invalidation
+    {
+        if (!callback.HasRectangle)
+            return false;
 
         bool performedMerge = false;
 
@@ -212,29 +368,15 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
         {
             auto& it = _queue[i];
 
-            std::vector<std::string> queuedTokens = LOOLProtocol::tokenize(it.data(), it.size());
-            if (queuedTokens.size() < 3)
-            {
-                ++i;
-                continue;
-            }
-
-            // not a invalidation callback
-            if (queuedTokens[0] != tokens[0] || queuedTokens[1] != tokens[1] || queuedTokens[2] != tokens[2])
-            {
-                ++i;
-                continue;
-            }
-
-            int queuedX, queuedY, queuedW, queuedH, queuedPart;
-
-            if (!extractRectangle(queuedTokens, queuedX, queuedY, queuedW, queuedH, queuedPart))
+            // not an invalidation callback
+            if (!isCallback(it))
             {
                 ++i;
                 continue;
             }
 
-            if (msgPart != queuedPart)
+            const Callback queued = getCallback(it);
+            if (!isSameTarget(queued, callback) || !queued.HasRectangle || queued.Part != callback.Part)
             {
                 ++i;
                 continue;
@@ -242,10 +384,12 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
 
             // the invalidation in the queue is fully covered by the message,
             // just remove it
-            if (msgX <= queuedX && queuedX + queuedW <= msgX + msgW && msgY <= queuedY && queuedY + queuedH <= msgY + msgH)
+            if (callback.X <= queued.X && queued.X + queued.Width <= callback.X + callback.Width &&
+                callback.Y <= queued.Y && queued.Y + queued.Height <= callback.Y + callback.Height)
             {
-                LOG_TRC("Removing smaller invalidation: " << std::string(it.data(), it.size()) << " -> " <<
-                        tokens[0] << " " << tokens[1] << " " << tokens[2] << " " << msgX << " " << msgY << " " << msgW << " " << msgH << " " << msgPart);
+                LOG_TRC("Removing smaller invalidation: " << callbackToString(it) << " -> " <<
+                        callback.X << ", " << callback.Y << ", " << callback.Width << ", " <<
+                        callback.Height << ", " << callback.Part);
 
                 // remove from the queue
                 _queue.erase(_queue.begin() + i);
@@ -254,12 +398,13 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
 
             // the invalidation just intersects, join those (if the result is
             // small)
-            if (TileDesc::rectanglesIntersect(msgX, msgY, msgW, msgH, queuedX, queuedY, queuedW, queuedH))
+            if (TileDesc::rectanglesIntersect(callback.X, callback.Y, callback.Width, callback.Height,
+                                              queued.X, queued.Y, queued.Width, queued.Height))
             {
-                int joinX = std::min(msgX, queuedX);
-                int joinY = std::min(msgY, queuedY);
-                int joinW = std::max(msgX + msgW, queuedX + queuedW) - joinX;
-                int joinH = std::max(msgY + msgH, queuedY + queuedH) - joinY;
+                const int joinX = std::min(callback.X, queued.X);
+                const int joinY = std::min(callback.Y, queued.Y);
+                const int joinW = std::max(callback.X + callback.Width, queued.X + queued.Width) - joinX;
+                const int joinH = std::max(callback.Y + callback.Height, queued.Y + queued.Height) - joinY;
 
                 const int reasonableSizeX = 4*3840; // 4x tile at 100% zoom
                 const int reasonableSizeY = 2*3840; // 2x tile at 100% zoom
@@ -269,14 +414,15 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                     continue;
                 }
 
-                LOG_TRC("Merging invalidations: " << std::string(it.data(), it.size()) << " and " <<
-                        tokens[0] << " " << tokens[1] << " " << tokens[2] << " " << msgX << " " << msgY << " " << msgW << " " << msgH << " " << msgPart << " -> " <<
-                        tokens[0] << " " << tokens[1] << " " << tokens[2] << " " << joinX << " " << joinY << " " << joinW << " " << joinH << " " << msgPart);
+                LOG_TRC("Merging invalidations: " << callbackToString(it) << " and " <<
+                        callback.X << ", " << callback.Y << ", " << callback.Width << ", " <<
+                        callback.Height << " -> " << joinX << ", " << joinY << ", " << joinW << ", " <<
+                        joinH << ", " << callback.Part);
 
-                msgX = joinX;
-                msgY = joinY;
-                msgW = joinW;
-                msgH = joinH;
+                callback.X = joinX;
+                callback.Y = joinY;
+                callback.Width = joinW;
+                callback.Height = joinH;
                 performedMerge = true;
 
                 // remove from the queue
@@ -287,110 +433,72 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
             ++i;
         }
 
-        if (performedMerge)
-        {
-            size_t pre = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3;
-            size_t post = pre + tokens[3].size() + tokens[4].size() + tokens[5].size() + tokens[6].size() + 4;
-
-            std::string result = callbackMsg.substr(0, pre) +
-                std::to_string(msgX) + ", " +
-                std::to_string(msgY) + ", " +
-                std::to_string(msgW) + ", " +
-                std::to_string(msgH) + ", " + callbackMsg.substr(post);
-
-            LOG_TRC("Merge result: " << result);
-
-            return result;
-        }
+        return performedMerge;
     }
-    else if (callbackType == "8")        // state changed
+    else if (callbackType == 8)     // state changed
     {
-        if (tokens.size() < 4)
-            return std::string();
+        if (callback.UnoCommandLength == 0)
+            return false;
 
-        std::string unoCommand = extractUnoCommand(tokens[3]);
-        if (unoCommand.empty())
-            return std::string();
+        const char* unoCommand = record.data() + CallbackHeaderSize;
 
         // remove obsolete states of the same .uno: command
         for (size_t i = 0; i < _queue.size(); ++i)
         {
             auto& it = _queue[i];
-
-            std::vector<std::string> queuedTokens = LOOLProtocol::tokenize(it.data(), it.size());
-            if (queuedTokens.size() < 4)
-                continue;
-
-            if (queuedTokens[0] != tokens[0] || queuedTokens[1] != tokens[1] || queuedTokens[2] != tokens[2])
+            if (!isCallback(it))
                 continue;
 
             // callback, the same target, state changed; now check it's
             // the same .uno: command
-            std::string queuedUnoCommand = extractUnoCommand(queuedTokens[3]);
-            if (queuedUnoCommand.empty())
-                continue;
-
-            if (unoCommand == queuedUnoCommand)
+            const Callback queued = getCallback(it);
+            if (isSameTarget(queued, callback) &&
+                queued.UnoCommandLength == callback.UnoCommandLength &&
+                std::memcmp(it.data() + CallbackHeaderSize, unoCommand, callback.UnoCommandLength) == 0)
             {
-                LOG_TRC("Remove obsolete uno command: " << std::string(it.data(), it.size()) << " -> " << callbackMsg);
+                LOG_TRC("Remove obsolete uno command: " << callbackToString(it) << " -> " <<
+                        std::string(unoCommand, record.size() - CallbackHeaderSize));
                 _queue.erase(_queue.begin() + i);
                 break;
             }
         }
     }
-    else if (callbackType == "1" || // the cursor has moved
-            callbackType == "5" ||  // the cursor visibility has changed
-            callbackType == "10" || // setting the indicator value
-            callbackType == "13" || // setting the document size
-            callbackType == "17" || // the cell cursor has moved
-            callbackType == "24" || // the view cursor has moved
-            callbackType == "26" || // the view cell cursor has moved
-            callbackType == "28")   // the view cursor visibility has changed
+    else if (callbackType == 1 ||   // the cursor has moved
+            callbackType == 5 ||    // the cursor visibility has changed
+            callbackType == 10 ||   // setting the indicator value
+            callbackType == 13 ||   // setting the document size
+            callbackType == 17 ||   // the cell cursor has moved
+            callbackType == 24 ||   // the view cursor has moved
+            callbackType == 26 ||   // the view cell cursor has moved
+            callbackType == 28)     // the view cursor visibility has changed
     {
-        const bool isViewCallback = (callbackType == "24" || callbackType == "26" || callbackType == "28");
-
-        std::string viewId;
-        if (isViewCallback)
-        {
-            viewId = extractViewId(callbackMsg, tokens);
-        }
+        const bool isViewCallback = (callbackType == 24 || callbackType == 26 || callbackType == 28);
 
         for (size_t i = 0; i < _queue.size(); ++i)
         {
             auto& it = _queue[i];
 
             // skip non-callbacks quickly
-            if (!LOOLProtocol::matchPrefix("callback", it))
+            if (!isCallback(it))
                 continue;
 
-            std::vector<std::string> queuedTokens = LOOLProtocol::tokenize(it.data(), it.size());
-            if (queuedTokens.size() < 3)
+            const Callback queued = getCallback(it);
+            if (!isSameTarget(queued, callback))
                 continue;
 
-            if (!isViewCallback && (queuedTokens[1] == tokens[1] && queuedTokens[2] == tokens[2]))
+            // we additionally need to ensure that the payload is about
+            // the same viewid (otherwise we'd merge them all views into
+            // one)
+            if (!isViewCallback || queued.PayloadViewId == callback.PayloadViewId)
             {
-                LOG_TRC("Remove obsolete callback: " << std::string(it.data(), it.size()) << " -> " << callbackMsg);
+                LOG_TRC("Remove obsolete callback: " << callbackToString(it));
                 _queue.erase(_queue.begin() + i);
                 break;
             }
-            else if (isViewCallback && (queuedTokens[1] == tokens[1] && queuedTokens[2] == tokens[2]))
-            {
-                // we additionally need to ensure that the payload is about
-                // the same viewid (otherwise we'd merge them all views into
-                // one)
-                const std::string queuedViewId = extractViewId(std::string(it.data(), it.size()), queuedTokens);
-
-                if (viewId == queuedViewId)
-                {
-                    LOG_TRC("Remove obsolete view callback: " << std::string(it.data(), it.size()) << " -> " << callbackMsg);
-                    _queue.erase(_queue.begin() + i);
-                    break;
-                }
-            }
         }
     }
 
-    return std::string();
+    return false;
 }
 
 int TileQueue::priority(const std::string& tileMsg)
@@ -432,6 +540,12 @@ TileQueue::Payload TileQueue::get_impl()
     LOG_TRC("MessageQueue depth: " << _queue.size());
 
     const auto front = _queue.front();
+    if (isCallback(front))
+    {
+        LOG_TRC("MessageQueue res: " << callbackToString(front));
+        _queue.erase(_queue.begin());
+        return front;
+    }
 
     auto msg = std::string(front.data(), front.size());
 
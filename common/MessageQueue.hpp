@@ -15,6 +15,7 @@
 #include <functional>
 #include <map>
 #include <mutex>
+#include <string>
 #include <vector>
 
 /// Thread-safe message queue (FIFO).
@@ -147,6 +148,62 @@ private:
     };
 
 public:
+    /// A LOK callback, queued as a typed binary record rather than as text:
+    /// a marker byte that no text message starts with, this header, and the
+    /// payload as LOK gave it. Merging and deduplicating callbacks compares
+    /// the header only, and the text is only made when the callback leaves
+    /// the kit.
+    struct Callback
+    {
+        /// The ViewId of callbacks for all views.
+        static constexpr int AllViews = -1;
+
+        int Type;
+        /// The view to send the callback to, or AllViews.
+        int ViewId;
+        /// With AllViews, the view not to send the callback to, if not -1.
+        int ExceptViewId;
+        /// The rectangle of invalidations and cursors, in twips.
+        bool HasRectangle;
+        int Part;
+        int X;
+        int Y;
+        int Width;
+        int Height;
+        /// The view the payload is about, for view cursors, or -1.
+        int PayloadViewId;
+        /// The length of the .uno: command the state change payloads start with.
+        unsigned UnoCommandLength;
+        /// The invalidation was merged with others, the payload is the
+        /// rectangle and the part, and is made from them.
+        bool IsMerged;
+    };
+
+    /// Parses the type-specific fields of a callback from its payload.
+    /// The callback is for all views.
+    static Callback parseCallback(int type, const std::string& payload);
+
+    /// Thread safe insert of a callback record.
+    void putCallback(const Callback& callback, const std::string& payload)
+    {
+        put(makeCallbackRecord(callback, payload));
+    }
+
+    static bool isCallback(const Payload& value)
+    {
+        return value.size() >= CallbackHeaderSize && value[0] == CallbackMarker;
+    }
+
+    /// The header of a callback record.
+    static Callback getCallback(const Payload& value);
+
+    /// The payload of a callback record, as LOK would have given it.
+    static std::string getCallbackPayload(const Payload& value);
+
+    /// The callback record as "callback <target> <type> <payload>", as
+    /// callbacks used to be queued, e.g. for logging.
+    static std::string callbackToString(const Payload& value);
+
     void updateCursorPosition(int viewId, int part, int x, int y, int width, int height)
     {
         const auto cursorPosition = CursorPosition({ part, x, y, width, height });
@@ -193,16 +250,25 @@ protected:
     virtual Payload get_impl() override;
 
 private:
+    static constexpr char CallbackMarker = '\x01';
+    static constexpr size_t CallbackHeaderSize = 1 + sizeof(Callback);
+
+    static Payload makeCallbackRecord(const Callback& callback, const std::string& payload);
+
     /// Search the queue for a duplicate tile and remove it (if present).
     void removeTileDuplicate(const std::string& tileMsg);
 
+    /// Queue the callback record, removing or merging the callbacks it makes obsolete.
+    void putCallback_impl(const Payload& record);
+
     /// Search the queue for a duplicate callback and remove it (if present).
     ///
     /// This removes also callbacks that are made invalid by the current
-    /// message, like the new cursor position invalidates the old one etc.
+    /// one, like the new cursor position invalidates the old one etc.
     ///
-    /// @return New message to put into the queue.  If empty, use what was in callbackMsg.
-    std::string removeCallbackDuplicate(const std::string& callbackMsg);
+    /// @return true if the callback was merged with queued invalidations,
+    /// whose union its rectangle now is.
+    bool removeCallbackDuplicate(Callback& callback, const Payload& record);
 
     /// De-prioritize the previews (tiles with 'id') - move them to the end of
     /// the queue.
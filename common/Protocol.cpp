@@ -12,6 +12,8 @@
 #include "Protocol.hpp"
 
 #include <cassert>
+#include <climits>
+#include <cstdint>
 #include <cstring>
 #include <map>
 #include <string>
@@ -73,61 +75,99 @@ namespace LOOLProtocol
         return true;
     }
 
-    bool getTokenInteger(const std::string& token, const std::string& name, int& value)
+    namespace
     {
-        if (token.size() > (name.size() + 1) &&
-            token.compare(0, name.size(), name) == 0 &&
-            token[name.size()] == '=')
+        /// The value of a name=value token, if it has that name.
+        bool getValue(const StringView token, const StringView name, StringView& value)
         {
-            const char* str = token.data() + name.size() + 1;
-            char* endptr = nullptr;
-            value = strtol(str, &endptr, 10);
-            return (endptr > str);
+            if (token.size() > (name.size() + 1) &&
+                token.startsWith(name) &&
+                token[name.size()] == '=')
+            {
+                value = token.substr(name.size() + 1);
+                return true;
+            }
+
+            return false;
         }
 
-        return false;
+        /// Parses the leading digits of str, as strtoull() would, but within
+        /// the view, which need not be null-terminated. Returns the digits parsed.
+        size_t parseDigits(const StringView str, size_t pos, uint64_t& value)
+        {
+            const size_t start = pos;
+            value = 0;
+            for (; pos < str.size() && str[pos] >= '0' && str[pos] <= '9'; ++pos)
+            {
+                // Saturate on overflow.
+                const uint64_t digit = str[pos] - '0';
+                value = (value > (UINT64_MAX - digit) / 10) ? UINT64_MAX : value * 10 + digit;
+            }
+
+            return pos - start;
+        }
+    }
+
+    bool stringToInteger(const StringView input, int& value)
+    {
+        if (input.empty())
+            return false;
+
+        const bool negative = (input[0] == '-');
+        const size_t sign = (negative || input[0] == '+') ? 1 : 0;
+        uint64_t digits = 0;
+        const size_t count = parseDigits(input, sign, digits);
+        if (count == 0 || digits > static_cast<uint64_t>(INT_MAX) + (negative ? 1 : 0))
+        {
+            return false;
+        }
+
+        value = negative ? -static_cast<int64_t>(digits) : static_cast<int64_t>(digits);
+        return true;
+    }
+
+    bool getTokenInteger(const StringView token, const StringView name, int& value)
+    {
+        StringView str;
+        return getValue(token, name, str) && stringToInteger(str, value);
     }
 
-    bool getTokenUInt64(const std::string& token, const std::string& name, uint64_t& value)
+    bool getTokenUInt64(const StringView token, const StringView name, uint64_t& value)
     {
-        if (token.size() > (name.size() + 1) &&
-            token.compare(0, name.size(), name) == 0 &&
-            token[name.size()] == '=')
+        StringView str;
+        if (getValue(token, name, str))
         {
-            const char* str = token.data() + name.size() + 1;
-            char* endptr = nullptr;
-            value = strtoull(str, &endptr, 10);
-            return (endptr > str);
+            const size_t sign = (str[0] == '+') ? 1 : 0;
+            return parseDigits(str, sign, value) > 0;
         }
 
         return false;
     }
 
-    bool getTokenString(const std::string& token, const std::string& name, std::string& value)
+    bool getTokenString(const StringView token, const StringView name, std::string& value)
     {
-        if (token.size() > (name.size() + 1) &&
-            token.compare(0, name.size(), name) == 0 &&
-            token[name.size()] == '=')
+        StringView str;
+        if (getValue(token, name, str))
         {
-            value = token.substr(name.size() + 1);
+            value.assign(str.data(), str.size());
             return true;
         }
 
         return false;
     }
 
-    bool getTokenKeyword(const std::string& token, const std::string& name,
+    bool getTokenKeyword(const StringView token, const StringView name,
                          const std::map<std::string, int>& map, int& value)
     {
-        std::string t;
-        if (getTokenString(token, name, t))
+        StringView str;
+        if (getValue(token, name, str))
         {
-            if (t[0] == '\'' && t[t.size() - 1] == '\'')
+            if (str.size() >= 2 && str[0] == '\'' && str[str.size() - 1] == '\'')
             {
-                t = t.substr(1, t.size() - 2);
+                str = str.substr(1, str.size() - 2);
             }
 
-            const auto p = map.find(t);
+            const auto p = map.find(str.toString());
             if (p != map.cend())
             {
                 value = p->second;
@@ -138,6 +178,53 @@ namespace LOOLProtocol
         return false;
     }
 
+    bool getTokenInteger(const Tokens& tokens, const StringView name, int& value)
+    {
+        for (const StringView& token : tokens)
+        {
+            if (getTokenInteger(token, name, value))
+                return true;
+        }
+
+        return false;
+    }
+
+    bool getTokenString(const Tokens& tokens, const StringView name, std::string& value)
+    {
+        for (const StringView& token : tokens)
+        {
+            if (getTokenString(token, name, value))
+                return true;
+        }
+
+        return false;
+    }
+
+    Tokens::Tokens(const char* data, const size_t size, const char delimiter) :
+        _size(0)
+    {
+        // Split as tokenize() does: up to the first newline, skipping empty tokens.
+        const char* start = data;
+        const char* end = data;
+        for (size_t i = 0; i < size && data[i] != '\n'; ++i, ++end)
+        {
+            if (data[i] == delimiter)
+            {
+                if (start != end && *start != delimiter)
+                    push_back(StringView(start, end - start));
+
+                start = end;
+            }
+            else if (*start == delimiter)
+            {
+                ++start;
+            }
+        }
+
+        if (start != end && *start != delimiter && *start != '\n')
+            push_back(StringView(start, end - start));
+    }
+
     bool getTokenInteger(const Poco::StringTokenizer& tokens, const std::string& name, int& value)
     {
         for (size_t i = 0; i < tokens.count(); i++)
@@ -10,11 +10,17 @@
 #ifndef INCLUDED_LOOLPROTOCOL_HPP
 #define INCLUDED_LOOLPROTOCOL_HPP
 
+#include <algorithm>
+#include <cassert>
 #include <cstdint>
 #include <cstring>
+#include <initializer_list>
 #include <map>
+#include <ostream>
 #include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <Poco/Format.h>
 #include <Poco/StringTokenizer.h>
@@ -41,7 +47,277 @@ namespace LOOLProtocol
     // Negative numbers for error.
     std::tuple<int, int, std::string> ParseVersion(const std::string& version);
 
+    /// A view of a part of a message, as std::string_view is in C++17, to
+    /// look at the tokens of a message without copying them.
+    /// The message must outlive the view.
+    class StringView
+    {
+    public:
+        StringView() :
+            _data(""),
+            _size(0)
+        {
+        }
+
+        StringView(const char* data, const size_t size) :
+            _data(data),
+            _size(size)
+        {
+        }
+
+        StringView(const char* str) :
+            _data(str),
+            _size(std::strlen(str))
+        {
+        }
+
+        StringView(const std::string& str) :
+            _data(str.data()),
+            _size(str.size())
+        {
+        }
+
+        const char* data() const { return _data; }
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        char operator[](const size_t index) const { return _data[index]; }
+        const char* begin() const { return _data; }
+        const char* end() const { return _data + _size; }
+
+        StringView substr(const size_t pos, const size_t count = std::string::npos) const
+        {
+            const size_t start = std::min(pos, _size);
+            return StringView(_data + start, std::min(count, _size - start));
+        }
+
+        bool startsWith(const StringView prefix) const
+        {
+            return _size >= prefix._size && std::memcmp(_data, prefix._data, prefix._size) == 0;
+        }
+
+        size_t find(const char c, const size_t pos = 0) const
+        {
+            if (pos >= _size)
+                return std::string::npos;
+
+            const void* found = std::memchr(_data + pos, c, _size - pos);
+            return found ? static_cast<const char*>(found) - _data : std::string::npos;
+        }
+
+        size_t find(const StringView str, const size_t pos = 0) const
+        {
+            if (pos > _size)
+                return std::string::npos;
+
+            const char* found = std::search(_data + pos, end(), str.begin(), str.end());
+            return (found != end() || str.empty()) ? found - _data : std::string::npos;
+        }
+
+        std::string toString() const { return std::string(_data, _size); }
+        operator std::string() const { return toString(); }
+
+    private:
+        const char* _data;
+        size_t _size;
+    };
+
+    inline bool operator==(const StringView lhs, const StringView rhs)
+    {
+        return lhs.size() == rhs.size() && std::memcmp(lhs.data(), rhs.data(), lhs.size()) == 0;
+    }
+
+    inline bool operator!=(const StringView lhs, const StringView rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+    inline std::string operator+(const std::string& lhs, const StringView rhs)
+    {
+        return std::string(lhs).append(rhs.data(), rhs.size());
+    }
+
+    inline std::string operator+(const char* lhs, const StringView rhs)
+    {
+        return std::string(lhs).append(rhs.data(), rhs.size());
+    }
+
+    inline std::string operator+(const StringView lhs, const std::string& rhs)
+    {
+        return lhs.toString() + rhs;
+    }
+
+    inline std::string operator+(const StringView lhs, const char* rhs)
+    {
+        return lhs.toString() + rhs;
+    }
+
+    inline std::string operator+(const StringView lhs, const StringView rhs)
+    {
+        return lhs.toString().append(rhs.data(), rhs.size());
+    }
+
+    inline std::ostream& operator<<(std::ostream& os, const StringView str)
+    {
+        return os.write(str.data(), str.size());
+    }
+
+    /// The tokens of the first line of a message, split as tokenize() does,
+    /// but as views of the message rather than copies. Up to InlineTokens
+    /// views are kept in the object itself, so that tokenizing most
+    /// messages allocates nothing. The message must outlive the tokens.
+    class Tokens
+    {
+    public:
+        Tokens(const char* data, const size_t size, const char delimiter = ' ');
+
+        explicit Tokens(const std::string& message, const char delimiter = ' ') :
+            Tokens(message.data(), message.size(), delimiter)
+        {
+        }
+
+        /// The tokens would outlive the message.
+        explicit Tokens(std::string&& message, char delimiter = ' ') = delete;
+
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+
+        /// The token at the given index, empty past the last one.
+        StringView operator[](const size_t index) const
+        {
+            return index < _size ? getTokens()[index] : StringView();
+        }
+
+        const StringView* begin() const { return getTokens(); }
+        const StringView* end() const { return getTokens() + _size; }
+
+        /// The tokens from the given index on, joined with the delimiter.
+        std::string cat(const std::string& delimiter, const size_t begin) const
+        {
+            std::string result;
+            for (size_t i = begin; i < _size; ++i)
+            {
+                if (i > begin)
+                    result += delimiter;
+                result.append(getTokens()[i].data(), getTokens()[i].size());
+            }
+
+            return result;
+        }
+
+    private:
+        static constexpr size_t InlineTokens = 16;
+
+        const StringView* getTokens() const
+        {
+            return _size <= InlineTokens ? _inline : _overflow.data();
+        }
+
+        void push_back(const StringView token)
+        {
+            if (_size < InlineTokens)
+            {
+                _inline[_size] = token;
+            }
+            else
+            {
+                if (_size == InlineTokens)
+                    _overflow.assign(_inline, _inline + InlineTokens);
+                _overflow.push_back(token);
+            }
+
+            ++_size;
+        }
+
+    private:
+        StringView _inline[InlineTokens];
+        std::vector<StringView> _overflow;
+        size_t _size;
+    };
+
+    /// The FNV-1a hash of a token.
+    inline uint32_t hashToken(const StringView token)
+    {
+        uint32_t hash = 2166136261u;
+        for (const char c : token)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 16777619u;
+        }
+
+        return hash;
+    }
+
+    /// Maps the commands of a protocol to ids, e.g. of an enum, to switch on
+    /// them rather than comparing the command token to every command in turn.
+    /// An open-addressed hash table, filled once and at most half full, so a
+    /// lookup hashes the token and compares it to the commands of that hash only.
+    template <typename T>
+    class CommandTable
+    {
+    public:
+        CommandTable(std::initializer_list<std::pair<const char*, T>> commands, const T unknown) :
+            _unknown(unknown)
+        {
+            size_t capacity = 4;
+            while (capacity < 2 * commands.size())
+                capacity *= 2;
+
+            _entries.resize(capacity);
+            _mask = capacity - 1;
+            for (const auto& command : commands)
+            {
+                const StringView name(command.first);
+                const uint32_t hash = hashToken(name);
+                size_t index = hash & _mask;
+                while (_entries[index].Used)
+                {
+                    assert(_entries[index].Name != name && "Duplicate command.");
+                    index = (index + 1) & _mask;
+                }
+
+                _entries[index].Used = true;
+                _entries[index].Hash = hash;
+                _entries[index].Name = name;
+                _entries[index].Id = command.second;
+            }
+        }
+
+        /// The id of the command, or the unknown id.
+        T lookup(const StringView token) const
+        {
+            const uint32_t hash = hashToken(token);
+            for (size_t index = hash & _mask; _entries[index].Used; index = (index + 1) & _mask)
+            {
+                if (_entries[index].Hash == hash && _entries[index].Name == token)
+                    return _entries[index].Id;
+            }
+
+            return _unknown;
+        }
+
+    private:
+        struct Entry
+        {
+            Entry() :
+                Used(false),
+                Hash(0),
+                Id()
+            {
+            }
+
+            bool Used;
+            uint32_t Hash;
+            StringView Name;
+            T Id;
+        };
+
+        std::vector<Entry> _entries;
+        size_t _mask;
+        const T _unknown;
+    };
+
     bool stringToInteger(const std::string& input, int& value);
+    bool stringToInteger(StringView input, int& value);
     bool stringToUInt64(const std::string& input, uint64_t& value);
 
     inline
@@ -65,10 +341,35 @@ namespace LOOLProtocol
         return parseNameValuePair(token, name, strValue, '=') && stringToInteger(strValue, value);
     }
 
-    bool getTokenInteger(const std::string& token, const std::string& name, int& value);
-    bool getTokenUInt64(const std::string& token, const std::string& name, uint64_t& value);
-    bool getTokenString(const std::string& token, const std::string& name, std::string& value);
-    bool getTokenKeyword(const std::string& token, const std::string& name, const std::map<std::string, int>& map, int& value);
+    /// Splits a name=value token as the above do, but into views of the token.
+    inline
+    bool parseNameValuePair(const StringView token, StringView& name, StringView& value, const char delim = '=')
+    {
+        const size_t mid = token.find(delim);
+        if (mid != std::string::npos)
+        {
+            name = token.substr(0, mid);
+            value = token.substr(mid + 1);
+            return true;
+        }
+
+        return false;
+    }
+
+    inline
+    bool parseNameIntegerPair(const StringView token, StringView& name, int& value)
+    {
+        StringView strValue;
+        return parseNameValuePair(token, name, strValue, '=') && stringToInteger(strValue, value);
+    }
+
+    bool getTokenInteger(StringView token, StringView name, int& value);
+    bool getTokenUInt64(StringView token, StringView name, uint64_t& value);
+    bool getTokenString(StringView token, StringView name, std::string& value);
+    bool getTokenKeyword(StringView token, StringView name, const std::map<std::string, int>& map, int& value);
+
+    bool getTokenInteger(const Tokens& tokens, StringView name, int& value);
+    bool getTokenString(const Tokens& tokens, StringView name, std::string& value);
 
     bool getTokenInteger(const Poco::StringTokenizer& tokens, const std::string& name, int& value);
     bool getTokenString(const Poco::StringTokenizer& tokens, const std::string& name, std::string& value);
@@ -210,7 +511,7 @@ namespace LOOLProtocol
     /// Notice that this doesn't guarantee editing activity,
     /// rather just user interaction with the UI.
     inline
-    bool tokenIndicatesUserInteraction(const std::string& token)
+    bool tokenIndicatesUserInteraction(const StringView token)
     {
         // Exclude tokens that include these keywords, such as canceltiles statusindicator.
 
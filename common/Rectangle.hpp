@@ -49,27 +49,27 @@ struct Rectangle
             _y2 = rectangle._y2;
     }
 
-    int getLeft()
+    int getLeft() const
     {
         return _x1;
     }
 
-    int getTop()
+    int getTop() const
     {
         return _y1;
     }
 
-    int getWidth()
+    int getWidth() const
     {
         return _x2 - _x1;
     }
 
-    int getHeight()
+    int getHeight() const
     {
         return _y2 - _y1;
     }
 
-    bool isValid()
+    bool isValid() const
     {
         return _x1 <= _x2 && _y1 <= _y2;
     }
@@ -74,11 +74,11 @@ bool Session::sendBinaryFrame(const char *buffer, int length)
     return sendMessage(buffer, length, WSOpCode::Binary) >= length;
 }
 
-void Session::parseDocOptions(const std::vector<std::string>& tokens, int& part, std::string& timestamp)
+void Session::parseDocOptions(const LOOLProtocol::Tokens& tokens, int& part, std::string& timestamp)
 {
     // First token is the "load" command itself.
     size_t offset = 1;
-    if (tokens.size() > 2 && tokens[1].find("part=") == 0)
+    if (tokens.size() > 2 && tokens[1].startsWith("part="))
     {
         getTokenInteger(tokens[1], "part", part);
         ++offset;
@@ -86,48 +86,46 @@ void Session::parseDocOptions(const std::vector<std::string>& tokens, int& part,
 
     for (size_t i = offset; i < tokens.size(); ++i)
     {
-        // FIXME use any kind of startsWith() instead of find(...) == 0
-        if (tokens[i].find("url=") == 0)
+        const LOOLProtocol::StringView token = tokens[i];
+        if (token.startsWith("url="))
         {
-            _docURL = tokens[i].substr(strlen("url="));
+            _docURL = token.substr(strlen("url="));
             ++offset;
         }
-        else if (tokens[i].find("jail=") == 0)
+        else if (token.startsWith("jail="))
         {
-            _jailedFilePath = tokens[i].substr(strlen("jail="));
+            _jailedFilePath = token.substr(strlen("jail="));
             ++offset;
         }
-        else if (tokens[i].find("authorid=") == 0)
+        else if (token.startsWith("authorid="))
         {
-            std::string userId = tokens[i].substr(strlen("authorid="));
-            Poco::URI::decode(userId, _userId);
+            Poco::URI::decode(token.substr(strlen("authorid=")), _userId);
             ++offset;
         }
-        else if (tokens[i].find("author=") == 0)
+        else if (token.startsWith("author="))
         {
-            std::string userName = tokens[i].substr(strlen("author="));
-            Poco::URI::decode(userName, _userName);
+            Poco::URI::decode(token.substr(strlen("author=")), _userName);
             ++offset;
         }
-        else if (tokens[i].find("readonly=") == 0)
+        else if (token.startsWith("readonly="))
         {
-            _isReadOnly = tokens[i].substr(strlen("readonly=")) != "0";
+            _isReadOnly = token.substr(strlen("readonly=")) != "0";
             ++offset;
         }
-        else if (tokens[i].find("timestamp=") == 0)
+        else if (token.startsWith("timestamp="))
         {
-            timestamp = tokens[i].substr(strlen("timestamp="));
+            timestamp = token.substr(strlen("timestamp="));
             ++offset;
         }
-        else if (tokens[i].find("password=") == 0)
+        else if (token.startsWith("password="))
         {
-            _docPassword = tokens[i].substr(strlen("password="));
+            _docPassword = token.substr(strlen("password="));
             _haveDocPassword = true;
             ++offset;
         }
-        else if (tokens[i].find("lang=") == 0)
+        else if (token.startsWith("lang="))
         {
-            _lang = tokens[i].substr(strlen("lang="));
+            _lang = token.substr(strlen("lang="));
             ++offset;
         }
     }
@@ -137,7 +135,7 @@ void Session::parseDocOptions(const std::vector<std::string>& tokens, int& part,
         if (getTokenString(tokens[offset], "options", _docOptions))
         {
             if (tokens.size() > offset + 1)
-                _docOptions += Poco::cat(std::string(" "), tokens.begin() + offset + 1, tokens.end());
+                _docOptions += tokens.cat(" ", offset + 1);
         }
     }
 }
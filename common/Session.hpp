@@ -87,7 +87,7 @@ protected:
     virtual ~Session();
 
     /// Parses the options of the "load" command, shared between MasterProcessSession::loadDocument() and ChildProcessSession::loadDocument().
-    void parseDocOptions(const std::vector<std::string>& tokens, int& part, std::string& timestamp);
+    void parseDocOptions(const LOOLProtocol::Tokens& tokens, int& part, std::string& timestamp);
 
     void updateLastActivityTime()
     {
@@ -0,0 +1,272 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include "ShmRing.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "Log.hpp"
+
+#ifndef MFD_CLOEXEC
+#  define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#  define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#  define F_ADD_SEALS (1024 + 9)
+#  define F_GET_SEALS (1024 + 10)
+#  define F_SEAL_SEAL 0x0001
+#  define F_SEAL_SHRINK 0x0002
+#  define F_SEAL_GROW 0x0004
+#endif
+
+namespace
+{
+    const char PositionPrefix[] = "shmdata: pos=";
+}
+
+ShmRing::ShmRing(int fd, void* mapping, size_t size) :
+    _fd(fd),
+    _mapping(mapping),
+    _header(static_cast<Header*>(mapping)),
+    _data(static_cast<char*>(mapping) + sizeof(Header)),
+    _size(size)
+{
+}
+
+ShmRing::~ShmRing()
+{
+    munmap(_mapping, sizeof(Header) + _size);
+    close(_fd);
+}
+
+std::unique_ptr<ShmRing> ShmRing::create(size_t size)
+{
+#ifdef SYS_memfd_create
+    const int fd = syscall(SYS_memfd_create, "loolkit-tiles", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        LOG_SYS("Failed to create the tile ring memfd.");
+        return nullptr;
+    }
+
+    const size_t total = sizeof(Header) + size;
+    // Sealed so wsd can rely on the size of its mapping.
+    if (ftruncate(fd, total) != 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+    {
+        LOG_SYS("Failed to size and seal the tile ring memfd.");
+        close(fd);
+        return nullptr;
+    }
+
+    void* mapping = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        LOG_SYS("Failed to map the tile ring of " << total << " bytes.");
+        close(fd);
+        return nullptr;
+    }
+
+    Header* header = new (mapping) Header;
+    header->Magic = Magic;
+    header->Reserved = 0;
+    header->Head = 0;
+    header->Tail = 0;
+
+    LOG_INF("Created tile ring of " << size << " bytes.");
+    return std::unique_ptr<ShmRing>(new ShmRing(fd, mapping, size));
+#else
+    (void)size;
+    LOG_WRN("memfd is not supported, no tile ring.");
+    return nullptr;
+#endif
+}
+
+std::unique_ptr<ShmRing> ShmRing::attach(int fd)
+{
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) <= sizeof(Header))
+    {
+        LOG_ERR("Invalid tile ring fd #" << fd << ".");
+        if (fd >= 0)
+            close(fd);
+        return nullptr;
+    }
+
+    // Otherwise the peer could shrink it under our feet, and we'd get SIGBUS.
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK))
+    {
+        LOG_ERR("Tile ring fd #" << fd << " is not sealed.");
+        close(fd);
+        return nullptr;
+    }
+
+    const size_t total = st.st_size;
+    void* mapping = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        LOG_SYS("Failed to map the tile ring of " << total << " bytes.");
+        close(fd);
+        return nullptr;
+    }
+
+    if (static_cast<Header*>(mapping)->Magic != Magic)
+    {
+        LOG_ERR("Invalid tile ring header.");
+        munmap(mapping, total);
+        close(fd);
+        return nullptr;
+    }
+
+    LOG_INF("Attached tile ring of " << total - sizeof(Header) << " bytes.");
+    return std::unique_ptr<ShmRing>(new ShmRing(fd, mapping, total - sizeof(Header)));
+}
+
+bool ShmRing::write(const char* data, size_t len, uint64_t& pos)
+{
+    if (len == 0 || len > _size)
+        return false;
+
+    const uint64_t head = _header->Head.load(std::memory_order_relaxed);
+    const uint64_t tail = _header->Tail.load(std::memory_order_acquire);
+
+    // The data is always contiguous, skip the end of the ring if necessary.
+    uint64_t start = head;
+    const size_t offset = head % _size;
+    if (offset + len > _size)
+        start += _size - offset;
+
+    if (start + len - tail > _size)
+        return false;
+
+    std::memcpy(_data + start % _size, data, len);
+    _header->Head.store(start + len, std::memory_order_release);
+
+    pos = start;
+    return true;
+}
+
+const char* ShmRing::get(uint64_t pos, size_t len) const
+{
+    const uint64_t head = _header->Head.load(std::memory_order_acquire);
+    const uint64_t tail = _header->Tail.load(std::memory_order_relaxed);
+
+    const size_t offset = pos % _size;
+    if (len == 0 || len > _size || offset + len > _size ||
+        pos < tail || pos + len > head)
+    {
+        LOG_ERR("Invalid tile ring position " << pos << " of " << len << " bytes (tail: " <<
+                tail << ", head: " << head << ").");
+        return nullptr;
+    }
+
+    return _data + offset;
+}
+
+void ShmRing::release(uint64_t pos, size_t len)
+{
+    _header->Tail.store(pos + len, std::memory_order_release);
+}
+
+bool ShmRing::sendFD(int socketFd, const std::vector<char>& message) const
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(message.data());
+    iov.iov_len = message.size();
+
+    char control[CMSG_SPACE(sizeof(int))];
+    std::memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &_fd, sizeof(int));
+
+    ssize_t sent;
+    while ((sent = sendmsg(socketFd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+
+    if (sent < 0)
+    {
+        LOG_SYS("Failed to send the tile ring fd.");
+        return false;
+    }
+
+    // The fd went with the first byte, write any remainder as usual.
+    size_t done = sent;
+    while (done < message.size())
+    {
+        const ssize_t rc = ::send(socketFd, message.data() + done, message.size() - done, MSG_NOSIGNAL);
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc <= 0)
+        {
+            LOG_SYS("Failed to send the tile ring message.");
+            return false;
+        }
+
+        done += rc;
+    }
+
+    return true;
+}
+
+std::string ShmRing::getPositionMessage(uint64_t pos, size_t len)
+{
+    return PositionPrefix + std::to_string(pos) + " size=" + std::to_string(len) + ' ';
+}
+
+bool ShmRing::parsePositionMessage(const char* data, size_t len,
+                                   uint64_t& pos, size_t& size, size_t& offset)
+{
+    static const size_t prefixLen = sizeof(PositionPrefix) - 1;
+    if (len <= prefixLen || std::memcmp(data, PositionPrefix, prefixLen) != 0)
+        return false;
+
+    // Parse from a bounded copy, the data isn't null-terminated.
+    const std::string line(data, std::min<size_t>(len, prefixLen + 64));
+    char* end = nullptr;
+    pos = std::strtoull(line.c_str() + prefixLen, &end, 10);
+    if (end == nullptr || std::strncmp(end, " size=", 6) != 0)
+        return false;
+
+    size = std::strtoull(end + 6, &end, 10);
+    if (*end != ' ')
+        return false;
+
+    offset = end + 1 - line.c_str();
+    return true;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
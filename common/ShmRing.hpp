@@ -0,0 +1,93 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_SHMRING_HPP
+#define INCLUDED_SHMRING_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// A single-producer, single-consumer byte ring in shared memory.
+/// The kit writes the rendered tiles into it once and only sends
+/// their position to wsd, which hands them to the tile cache and the
+/// clients straight from the ring, in order, and releases the space.
+/// The ring lives in a sealed memfd that is passed to wsd over the
+/// Unix socket.
+class ShmRing
+{
+public:
+    ~ShmRing();
+
+    /// Creates a ring of the given data size, for the producer.
+    /// Returns nullptr if memfd isn't supported.
+    static std::unique_ptr<ShmRing> create(size_t size);
+
+    /// Maps the ring in the given memfd, for the consumer.
+    /// Takes ownership of the fd. Returns nullptr if it's invalid.
+    static std::unique_ptr<ShmRing> attach(int fd);
+
+    int getFD() const { return _fd; }
+    size_t getSize() const { return _size; }
+
+    /// Copies the data into the ring.
+    /// @param pos is set to the position of the data.
+    /// @return false if there isn't enough room.
+    bool write(const char* data, size_t len, uint64_t& pos);
+
+    /// Returns the data written at pos, in place, or nullptr if pos
+    /// is invalid. It stays valid until released.
+    const char* get(uint64_t pos, size_t len) const;
+
+    /// Releases the data written at pos, and everything before it.
+    void release(uint64_t pos, size_t len);
+
+    /// Sends the fd of the ring over the Unix socket, along with
+    /// the given message, which is what the peer receives as data.
+    bool sendFD(int socketFd, const std::vector<char>& message) const;
+
+    /// Builds the control message that announces the data at pos.
+    static std::string getPositionMessage(uint64_t pos, size_t len);
+
+    /// Parses a message built by getPositionMessage().
+    /// @param offset is set to the length of the control prefix.
+    static bool parsePositionMessage(const char* data, size_t len,
+                                     uint64_t& pos, size_t& size, size_t& offset);
+
+private:
+    /// At the start of the mapping.
+    struct Header
+    {
+        uint32_t Magic;
+        uint32_t Reserved;
+        /// Where the producer writes next.
+        std::atomic<uint64_t> Head;
+        /// Up to where the consumer has released.
+        std::atomic<uint64_t> Tail;
+    };
+
+    ShmRing(int fd, void* mapping, size_t size);
+
+private:
+    const int _fd;
+    void* const _mapping;
+    Header* const _header;
+    char* const _data;
+    /// The data size, which the consumer gets from the mapping,
+    /// never from the (peer writable) header.
+    const size_t _size;
+
+    static constexpr uint32_t Magic = 0x52696e67;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
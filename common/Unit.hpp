@@ -247,7 +247,7 @@ public:
     virtual void postFork() {}
 
     /// Kit got a message
-    virtual bool filterKitMessage(const std::shared_ptr<LOOLWebSocket>& /* ws */,
+    virtual bool filterKitMessage(const std::shared_ptr<WebSocketHandler>& /* ws */,
                                   std::string& /* message */)
     {
         return false;
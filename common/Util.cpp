@@ -173,6 +173,39 @@ namespace Util
         return std::make_pair(numPSSKb, numDirtyKb);
     }
 
+    size_t getCpuUsage(FILE* file)
+    {
+        size_t ticks = 0;
+        if (file)
+        {
+            rewind(file);
+            char line[4096] = { 0 };
+            if (fgets(line, sizeof (line), file))
+            {
+                // The command name (field 2) may contain spaces,
+                // so start counting fields after its closing paren.
+                const char* pos = strrchr(line, ')');
+                if (pos != nullptr)
+                {
+                    // Fields 14 and 15 are utime and stime,
+                    // i.e. the 12th and 13th after the paren.
+                    int index = 2;
+                    for (++pos; *pos != '\0' && index < 15; ++pos)
+                    {
+                        if (*pos == ' ')
+                        {
+                            ++index;
+                            if (index == 14 || index == 15)
+                                ticks += strtoul(pos + 1, nullptr, 10);
+                        }
+                    }
+                }
+            }
+        }
+
+        return ticks;
+    }
+
     std::string getMemoryStats(FILE* file)
     {
         const auto pssAndDirtyKb = getPssAndDirtyFromSMaps(file);
@@ -203,43 +236,53 @@ namespace Util
 
     size_t getMemoryUsageRSS(const Poco::Process::PID pid)
     {
-        static const auto pageSizeBytes = getpagesize();
-
         if (pid > 0)
         {
             const auto cmd = "/proc/" + std::to_string(pid) + "/stat";
             FILE* fp = fopen(cmd.c_str(), "r");
             if (fp != nullptr)
             {
-                size_t rss = 0;
-                char line[4096] = { 0 };
-                if (fgets(line, sizeof (line), fp))
+                const size_t rss = getMemoryUsageRSS(fp);
+                fclose(fp);
+                return rss;
+            }
+        }
+
+        return 0;
+    }
+
+    size_t getMemoryUsageRSS(FILE* file)
+    {
+        static const auto pageSizeBytes = getpagesize();
+
+        size_t rss = 0;
+        if (file)
+        {
+            rewind(file);
+            char line[4096] = { 0 };
+            if (fgets(line, sizeof (line), file))
+            {
+                // Count the fields after the command name, as getCpuUsage.
+                const char* pos = strrchr(line, ')');
+                if (pos != nullptr)
                 {
-                    const std::string s(line);
-                    int index = 1;
-                    auto pos = s.find(' ');
-                    while (pos != std::string::npos)
+                    int index = 2;
+                    for (++pos; *pos != '\0'; ++pos)
                     {
-                        if (index == 23)
+                        if (*pos == ' ' && ++index == 24)
                         {
                             // Convert from memory pages to KB.
-                            rss = strtol(&s[pos], nullptr, 10);
+                            rss = strtoul(pos + 1, nullptr, 10);
                             rss *= pageSizeBytes;
                             rss /= 1024;
                             break;
                         }
-
-                        ++index;
-                        pos = s.find(' ', pos + 1);
                     }
                 }
-
-                fclose(fp);
-                return rss;
             }
         }
 
-        return 0;
+        return rss;
     }
 
     std::string replace(std::string result, const std::string& a, const std::string& b)
@@ -102,10 +102,21 @@ namespace Util
     /// Returns the process RSS in KB.
     size_t getMemoryUsageRSS(const Poco::Process::PID pid);
 
+    /// Returns the RSS in KB from an open /proc/<pid>/stat file.
+    size_t getMemoryUsageRSS(FILE* file);
+
     /// Returns the RSS and PSS of the current process in KB.
     /// Example: "procmemstats: pid=123 rss=12400 pss=566"
     std::string getMemoryStats(FILE* file);
 
+    /// Returns the PSS and Private_Dirty in KB from an open
+    /// /proc/<pid>/smaps or /proc/<pid>/smaps_rollup file.
+    std::pair<size_t, size_t> getPssAndDirtyFromSMaps(FILE* file);
+
+    /// Returns the user + system CPU time, in clock ticks,
+    /// from an open /proc/<pid>/stat file.
+    size_t getCpuUsage(FILE* file);
+
     std::string replace(std::string s, const std::string& a, const std::string& b);
 
     std::string formatLinesForLog(const std::string& s);
@@ -33,6 +33,67 @@ using Poco::URI;
 
 using namespace LOOLProtocol;
 
+namespace
+{
+    enum class Command
+    {
+        Unknown,
+        ClientVisibleArea,
+        ClientZoom,
+        CommandValues,
+        DownloadAs,
+        DummyMsg,
+        GetChildId,
+        GetTextSelection,
+        InsertFile,
+        Key,
+        Load,
+        Mouse,
+        Paste,
+        RenderFont,
+        ResetSelection,
+        SaveAs,
+        SelectGraphic,
+        SelectText,
+        SetClientPart,
+        SetPage,
+        Status,
+        Tile,
+        TileCombine,
+        Uno,
+        UserActive,
+        UserInactive
+    };
+
+    const CommandTable<Command> Commands({
+            { "clientvisiblearea", Command::ClientVisibleArea },
+            { "clientzoom", Command::ClientZoom },
+            { "commandvalues", Command::CommandValues },
+            { "downloadas", Command::DownloadAs },
+            { "dummymsg", Command::DummyMsg },
+            { "getchildid", Command::GetChildId },
+            { "gettextselection", Command::GetTextSelection },
+            { "insertfile", Command::InsertFile },
+            { "key", Command::Key },
+            { "load", Command::Load },
+            { "mouse", Command::Mouse },
+            { "paste", Command::Paste },
+            { "renderfont", Command::RenderFont },
+            { "resetselection", Command::ResetSelection },
+            { "saveas", Command::SaveAs },
+            { "selectgraphic", Command::SelectGraphic },
+            { "selecttext", Command::SelectText },
+            { "setclientpart", Command::SetClientPart },
+            { "setpage", Command::SetPage },
+            { "status", Command::Status },
+            { "tile", Command::Tile },
+            { "tilecombine", Command::TileCombine },
+            { "uno", Command::Uno },
+            { "useractive", Command::UserActive },
+            { "userinactive", Command::UserInactive } },
+        Command::Unknown);
+}
+
 std::recursive_mutex ChildSession::Mutex;
 
 ChildSession::ChildSession(const std::string& id,
@@ -76,8 +137,8 @@ void ChildSession::disconnect()
 bool ChildSession::_handleInput(const char *buffer, int length)
 {
     LOG_TRC(getName() + ": handling [" << getAbbreviatedMessage(buffer, length) << "].");
-    const std::string firstLine = getFirstLine(buffer, length);
-    const auto tokens = LOOLProtocol::tokenize(firstLine.data(), firstLine.size());
+    const Tokens tokens(buffer, length);
+    const Command command = Commands.lookup(tokens[0]);
 
     if (LOOLProtocol::tokenIndicatesUserInteraction(tokens[0]))
     {
@@ -85,7 +146,7 @@ bool ChildSession::_handleInput(const char *buffer, int length)
         updateLastActivityTime();
     }
 
-    if (tokens.size() > 0 && tokens[0] == "useractive" && getLOKitDocument() != nullptr)
+    if (command == Command::UserActive && getLOKitDocument() != nullptr)
     {
         LOG_DBG("Handling message after inactivity of " << getInactivityMS() << "ms.");
         setIsActive(true);
@@ -156,36 +217,36 @@ bool ChildSession::_handleInput(const char *buffer, int length)
         LOG_TRC("Finished replaying messages.");
     }
 
-    if (tokens[0] == "dummymsg")
-    {
-        // Just to update the activity of a view-only client.
-        return true;
-    }
-    else if (tokens[0] == "commandvalues")
-    {
-        return getCommandValues(buffer, length, tokens);
-    }
-    else if (tokens[0] == "load")
+    switch (command)
     {
-        if (_isDocLoaded)
-        {
-            sendTextFrame("error: cmd=load kind=docalreadyloaded");
-            return false;
-        }
+        case Command::DummyMsg:
+            // Just to update the activity of a view-only client.
+            return true;
+        case Command::CommandValues:
+            return getCommandValues(buffer, length, tokens);
+        case Command::Load:
+            if (_isDocLoaded)
+            {
+                sendTextFrame("error: cmd=load kind=docalreadyloaded");
+                return false;
+            }
 
-        _isDocLoaded = loadDocument(buffer, length, tokens);
-        if (!_isDocLoaded)
-        {
-            sendTextFrame("error: cmd=load kind=faileddocloading");
-        }
+            _isDocLoaded = loadDocument(buffer, length, tokens);
+            if (!_isDocLoaded)
+            {
+                sendTextFrame("error: cmd=load kind=faileddocloading");
+            }
 
-        return _isDocLoaded;
+            return _isDocLoaded;
+        default:
+            break;
     }
-    else if (!_isDocLoaded)
+
+    if (!_isDocLoaded)
     {
         // Be forgiving to these messages while we load.
-        if (tokens[0] == "useractive" ||
-            tokens[0] == "userinactive")
+        if (command == Command::UserActive ||
+            command == Command::UserInactive)
         {
             return true;
         }
@@ -193,122 +254,68 @@ bool ChildSession::_handleInput(const char *buffer, int length)
         sendTextFrame("error: cmd=" + tokens[0] + " kind=nodocloaded");
         return false;
     }
-    else if (tokens[0] == "renderfont")
-    {
-        sendFontRendering(buffer, length, tokens);
-    }
-    else if (tokens[0] == "setclientpart")
-    {
-        return setClientPart(buffer, length, tokens);
-    }
-    else if (tokens[0] == "setpage")
-    {
-        return setPage(buffer, length, tokens);
-    }
-    else if (tokens[0] == "status")
-    {
-        return getStatus(buffer, length);
-    }
-    else if (tokens[0] == "tile" || tokens[0] == "tilecombine")
-    {
-        assert(false && "Tile traffic should go through the DocumentBroker-LoKit WS.");
-    }
-    else
+
+    switch (command)
     {
+        case Command::RenderFont:
+            sendFontRendering(buffer, length, tokens);
+            break;
+        case Command::SetClientPart:
+            return setClientPart(buffer, length, tokens);
+        case Command::SetPage:
+            return setPage(buffer, length, tokens);
+        case Command::Status:
+            return getStatus(buffer, length);
+        case Command::Tile:
+        case Command::TileCombine:
+            assert(false && "Tile traffic should go through the DocumentBroker-LoKit WS.");
+            break;
+
         // All other commands are such that they always require a LibreOfficeKitDocument session,
         // i.e. need to be handled in a child process.
-
-        assert(tokens[0] == "clientzoom" ||
-               tokens[0] == "clientvisiblearea" ||
-               tokens[0] == "downloadas" ||
-               tokens[0] == "getchildid" ||
-               tokens[0] == "gettextselection" ||
-               tokens[0] == "paste" ||
-               tokens[0] == "insertfile" ||
-               tokens[0] == "key" ||
-               tokens[0] == "mouse" ||
-               tokens[0] == "uno" ||
-               tokens[0] == "selecttext" ||
-               tokens[0] == "selectgraphic" ||
-               tokens[0] == "resetselection" ||
-               tokens[0] == "saveas" ||
-               tokens[0] == "useractive" ||
-               tokens[0] == "userinactive");
-
-        if (tokens[0] == "clientzoom")
-        {
+        case Command::ClientZoom:
             return clientZoom(buffer, length, tokens);
-        }
-        else if (tokens[0] == "clientvisiblearea")
-        {
+        case Command::ClientVisibleArea:
             return clientVisibleArea(buffer, length, tokens);
-        }
-        else if (tokens[0] == "downloadas")
-        {
+        case Command::DownloadAs:
             return downloadAs(buffer, length, tokens);
-        }
-        else if (tokens[0] == "getchildid")
-        {
+        case Command::GetChildId:
             return getChildId();
-        }
-        else if (tokens[0] == "gettextselection")
-        {
+        case Command::GetTextSelection:
             return getTextSelection(buffer, length, tokens);
-        }
-        else if (tokens[0] == "paste")
-        {
+        case Command::Paste:
             return paste(buffer, length, tokens);
-        }
-        else if (tokens[0] == "insertfile")
-        {
+        case Command::InsertFile:
             return insertFile(buffer, length, tokens);
-        }
-        else if (tokens[0] == "key")
-        {
+        case Command::Key:
             return keyEvent(buffer, length, tokens);
-        }
-        else if (tokens[0] == "mouse")
-        {
+        case Command::Mouse:
             return mouseEvent(buffer, length, tokens);
-        }
-        else if (tokens[0] == "uno")
-        {
+        case Command::Uno:
             return unoCommand(buffer, length, tokens);
-        }
-        else if (tokens[0] == "selecttext")
-        {
+        case Command::SelectText:
             return selectText(buffer, length, tokens);
-        }
-        else if (tokens[0] == "selectgraphic")
-        {
+        case Command::SelectGraphic:
             return selectGraphic(buffer, length, tokens);
-        }
-        else if (tokens[0] == "resetselection")
-        {
+        case Command::ResetSelection:
             return resetSelection(buffer, length, tokens);
-        }
-        else if (tokens[0] == "saveas")
-        {
+        case Command::SaveAs:
             return saveAs(buffer, length, tokens);
-        }
-        else if (tokens[0] == "useractive")
-        {
+        case Command::UserActive:
             setIsActive(true);
-        }
-        else if (tokens[0] == "userinactive")
-        {
+            break;
+        case Command::UserInactive:
             setIsActive(false);
-        }
-        else
-        {
+            break;
+        default:
             assert(false && "Unknown command token.");
-        }
+            break;
     }
 
     return true;
 }
 
-bool ChildSession::loadDocument(const char * /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::loadDocument(const char * /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     int part = -1;
     if (tokens.size() < 2)
@@ -373,7 +380,7 @@ bool ChildSession::loadDocument(const char * /*buffer*/, int /*length*/, const s
     return true;
 }
 
-bool ChildSession::sendFontRendering(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::sendFontRendering(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     std::string font, text, decodedFont, decodedChar;
     bool bSuccess;
@@ -399,7 +406,7 @@ bool ChildSession::sendFontRendering(const char* /*buffer*/, int /*length*/, con
         return false;
     }
 
-    const std::string response = "renderfont: " + Poco::cat(std::string(" "), tokens.begin() + 1, tokens.end()) + "\n";
+    const std::string response = "renderfont: " + tokens.cat(" ", 1) + "\n";
 
     std::vector<char> output;
     output.resize(response.size());
@@ -489,7 +496,7 @@ void insertUserNames(const std::map<int, UserInfo>& viewInfo, std::string& json)
 
 }
 
-bool ChildSession::getCommandValues(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::getCommandValues(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     bool success;
     char* values;
@@ -530,7 +537,7 @@ bool ChildSession::getCommandValues(const char* /*buffer*/, int /*length*/, cons
     return success;
 }
 
-bool ChildSession::clientZoom(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::clientZoom(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     int tilePixelWidth, tilePixelHeight, tileTwipWidth, tileTwipHeight;
 
@@ -552,7 +559,7 @@ bool ChildSession::clientZoom(const char* /*buffer*/, int /*length*/, const std:
     return true;
 }
 
-bool ChildSession::clientVisibleArea(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::clientVisibleArea(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     int x;
     int y;
@@ -577,7 +584,7 @@ bool ChildSession::clientVisibleArea(const char* /*buffer*/, int /*length*/, con
     return true;
 }
 
-bool ChildSession::downloadAs(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::downloadAs(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     std::string name, id, format, filterOptions;
 
@@ -595,7 +602,7 @@ bool ChildSession::downloadAs(const char* /*buffer*/, int /*length*/, const std:
     {
         if (tokens.size() > 5)
         {
-            filterOptions += Poco::cat(std::string(" "), tokens.begin() + 5, tokens.end());
+            filterOptions += tokens.cat(" ", 5);
         }
     }
 
@@ -625,7 +632,7 @@ bool ChildSession::getChildId()
     return true;
 }
 
-bool ChildSession::getTextSelection(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::getTextSelection(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     std::string mimeType;
 
@@ -650,7 +657,7 @@ bool ChildSession::getTextSelection(const char* /*buffer*/, int /*length*/, cons
     return true;
 }
 
-bool ChildSession::paste(const char* buffer, int length, const std::vector<std::string>& tokens)
+bool ChildSession::paste(const char* buffer, int length, const Tokens& tokens)
 {
     std::string mimeType;
     if (tokens.size() < 2 || !getTokenString(tokens[1], "mimetype", mimeType) ||
@@ -675,7 +682,7 @@ bool ChildSession::paste(const char* buffer, int length, const std::vector<std::
     return true;
 }
 
-bool ChildSession::insertFile(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::insertFile(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     std::string name, type;
     if (tokens.size() != 3 ||
@@ -706,7 +713,7 @@ bool ChildSession::insertFile(const char* /*buffer*/, int /*length*/, const std:
     return true;
 }
 
-bool ChildSession::keyEvent(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::keyEvent(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     int type, charcode, keycode;
     if (tokens.size() != 4 ||
@@ -745,7 +752,7 @@ bool ChildSession::keyEvent(const char* /*buffer*/, int /*length*/, const std::v
     return true;
 }
 
-bool ChildSession::mouseEvent(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::mouseEvent(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     int type, x, y, count;
     bool success = true;
@@ -790,7 +797,7 @@ bool ChildSession::mouseEvent(const char* /*buffer*/, int /*length*/, const std:
     return true;
 }
 
-bool ChildSession::unoCommand(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::unoCommand(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     if (tokens.size() <= 1)
     {
@@ -811,19 +818,19 @@ bool ChildSession::unoCommand(const char* /*buffer*/, int /*length*/, const std:
     }
     else if (tokens.size() == 2)
     {
-        getLOKitDocument()->postUnoCommand(tokens[1].c_str(), nullptr, bNotify);
+        getLOKitDocument()->postUnoCommand(tokens[1].toString().c_str(), nullptr, bNotify);
     }
     else
     {
-        getLOKitDocument()->postUnoCommand(tokens[1].c_str(),
-                                       Poco::cat(std::string(" "), tokens.begin() + 2, tokens.end()).c_str(),
+        getLOKitDocument()->postUnoCommand(tokens[1].toString().c_str(),
+                                       tokens.cat(" ", 2).c_str(),
                                        bNotify);
     }
 
     return true;
 }
 
-bool ChildSession::selectText(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::selectText(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     int type, x, y;
     if (tokens.size() != 4 ||
@@ -848,7 +855,7 @@ bool ChildSession::selectText(const char* /*buffer*/, int /*length*/, const std:
     return true;
 }
 
-bool ChildSession::selectGraphic(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::selectGraphic(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     int type, x, y;
     if (tokens.size() != 4 ||
@@ -872,7 +879,7 @@ bool ChildSession::selectGraphic(const char* /*buffer*/, int /*length*/, const s
     return true;
 }
 
-bool ChildSession::resetSelection(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::resetSelection(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     if (tokens.size() != 1)
     {
@@ -889,7 +896,7 @@ bool ChildSession::resetSelection(const char* /*buffer*/, int /*length*/, const
     return true;
 }
 
-bool ChildSession::saveAs(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::saveAs(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     std::string url, format, filterOptions;
 
@@ -906,7 +913,7 @@ bool ChildSession::saveAs(const char* /*buffer*/, int /*length*/, const std::vec
     {
         if (tokens.size() > 4)
         {
-            filterOptions += Poco::cat(std::string(" "), tokens.begin() + 4, tokens.end());
+            filterOptions += tokens.cat(" ", 4);
         }
     }
 
@@ -930,7 +937,7 @@ bool ChildSession::saveAs(const char* /*buffer*/, int /*length*/, const std::vec
     return true;
 }
 
-bool ChildSession::setClientPart(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::setClientPart(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     int part;
     if (tokens.size() < 2 ||
@@ -952,7 +959,7 @@ bool ChildSession::setClientPart(const char* /*buffer*/, int /*length*/, const s
     return true;
 }
 
-bool ChildSession::setPage(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens)
+bool ChildSession::setPage(const char* /*buffer*/, int /*length*/, const Tokens& tokens)
 {
     int page;
     if (tokens.size() < 2 ||
@@ -58,6 +58,8 @@ static std::map<Process::PID, std::string> childJails;
 #ifndef KIT_IN_PROCESS
 int ClientPortNumber = DEFAULT_CLIENT_PORT_NUMBER;
 int MasterPortNumber = DEFAULT_MASTER_PORT_NUMBER;
+bool UseLocalSocket = false;
+int TileRingSizeKb = 0;
 #endif
 
 /// Dispatcher class to demultiplex requests from
@@ -412,6 +414,15 @@ int main(int argc, char** argv)
             eq = std::strchr(cmd, '=');
             MasterPortNumber = std::stoll(std::string(eq+1));
         }
+        else if (std::strstr(cmd, "--localsocket") == cmd)
+        {
+            UseLocalSocket = true;
+        }
+        else if (std::strstr(cmd, "--tileringkb=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            TileRingSizeKb = std::stoi(std::string(eq+1));
+        }
         else if (std::strstr(cmd, "--version") == cmd)
         {
             std::string version, hash;
@@ -14,19 +14,29 @@
 #include "config.h"
 
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <ftw.h>
 #include <malloc.h>
+#include <netinet/in.h>
 #include <sys/capability.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <climits>
 #include <condition_variable>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <thread>
 
@@ -37,9 +47,6 @@
 #include <Poco/Exception.h>
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
-#include <Poco/Net/HTTPClientSession.h>
-#include <Poco/Net/HTTPRequest.h>
-#include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/NetException.h>
 #include <Poco/Net/Socket.h>
 #include <Poco/Process.h>
@@ -51,18 +58,19 @@
 
 #include "ChildSession.hpp"
 #include "Common.hpp"
-#include "IoUtil.hpp"
+#include "Histogram.hpp"
 #include "KitHelper.hpp"
 #include "Kit.hpp"
 #include "Protocol.hpp"
-#include "LOOLWebSocket.hpp"
 #include "Log.hpp"
 #include "Png.hpp"
 #include "Rectangle.hpp"
+#include "ShmRing.hpp"
 #include "TileDesc.hpp"
 #include "Unit.hpp"
 #include "UserMessages.hpp"
 #include "Util.hpp"
+#include "WebSocketHandler.hpp"
 
 #include "common/SigUtil.hpp"
 #include "common/Seccomp.hpp"
@@ -80,7 +88,6 @@ using Poco::File;
 using Poco::JSON::Array;
 using Poco::JSON::Object;
 using Poco::JSON::Parser;
-using Poco::Net::WebSocket;
 using Poco::Runnable;
 using Poco::StringTokenizer;
 using Poco::Thread;
@@ -89,9 +96,6 @@ using Poco::URI;
 using Poco::Util::Application;
 
 #ifndef BUILDING_TESTS
-using Poco::Net::HTTPClientSession;
-using Poco::Net::HTTPRequest;
-using Poco::Net::HTTPResponse;
 using Poco::Path;
 using Poco::Process;
 #endif
@@ -428,6 +432,203 @@ public:
 
 static FILE* ProcSMapsFile = nullptr;
 
+/// The websocket to wsd, polled by the main thread of the kit.
+/// Messages may be sent from any thread: they are queued and written
+/// out by the poll, so rendering never blocks on the socket.
+class KitWebSocketHandler final : public WebSocketHandler
+{
+public:
+    typedef std::function<void(const std::vector<char>&)> MessageHandler;
+
+    KitWebSocketHandler(SocketPoll& poll, MessageHandler handler) :
+        _poll(poll),
+        _handler(std::move(handler)),
+        _closed(false)
+    {
+    }
+
+    /// Queues a message to be sent by the poll, from any thread.
+    void enqueueMessage(std::vector<char> data, const WSOpCode code)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queue.emplace_back(code, std::move(data));
+        }
+
+        _poll.wakeup();
+    }
+
+    void enqueueMessage(const char* data, const size_t len, const WSOpCode code)
+    {
+        enqueueMessage(std::vector<char>(data, data + len), code);
+    }
+
+    bool isClosed() const { return _closed; }
+
+private:
+    void handleMessage(bool /*fin*/, WSOpCode /*code*/, std::vector<char>& data) override
+    {
+        _handler(data);
+    }
+
+    int getPollEvents(std::chrono::steady_clock::time_point /* now */,
+                      int & /* timeoutMaxMs */) override
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _queue.empty() ? POLLIN : POLLIN | POLLOUT;
+    }
+
+    /// wsd pings us, not the other way around.
+    void checkTimeout(std::chrono::steady_clock::time_point /* now */) override
+    {
+    }
+
+    /// Moves all the queued messages to the socket buffer at once.
+    void performWrites() override
+    {
+        std::deque<std::pair<WSOpCode, std::vector<char>>> queue;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            queue.swap(_queue);
+        }
+
+        for (const auto& item : queue)
+            sendMessage(item.second.data(), item.second.size(), item.first, false);
+    }
+
+    void onDisconnect() override
+    {
+        LOG_WRN("Kit connection to wsd closed.");
+        _closed = true;
+    }
+
+private:
+    SocketPoll& _poll;
+    MessageHandler _handler;
+    std::mutex _mutex;
+    std::deque<std::pair<WSOpCode, std::vector<char>>> _queue;
+    std::atomic<bool> _closed;
+};
+
+/// Converts documents for the convert pool of wsd, when the kit
+/// hosts no Document: loads each, saves it in the requested format
+/// and unloads it, then replies with convertresult:. Conversions run
+/// one at a time in a thread of their own, so the kit keeps polling.
+class Converter
+{
+public:
+    Converter(const std::shared_ptr<lok::Office>& loKit,
+              const std::shared_ptr<KitWebSocketHandler>& ws) :
+        _loKit(loKit),
+        _ws(ws),
+        _stop(false),
+        _thread(&Converter::run, this)
+    {
+    }
+
+    ~Converter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+
+        _cv.notify_one();
+        _thread.join();
+    }
+
+    /// Queues a convert request, from the main thread.
+    void enqueue(const std::string& request)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _requests.push_back(request);
+        }
+
+        _cv.notify_one();
+    }
+
+private:
+    void run()
+    {
+        Util::setThreadName("kit_convert");
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _cv.wait(lock, [this]() { return _stop || !_requests.empty(); });
+            if (_stop)
+                break;
+
+            const std::string request = _requests.front();
+            _requests.pop_front();
+            lock.unlock();
+
+            convert(request);
+
+            lock.lock();
+        }
+    }
+
+    void convert(const std::string& request)
+    {
+        const LOOLProtocol::Tokens tokens(request);
+        int id = 0;
+        std::string url;
+        std::string to;
+        std::string format;
+        if (!getTokenInteger(tokens, "id", id) ||
+            !getTokenString(tokens, "url", url) ||
+            !getTokenString(tokens, "to", to) ||
+            !getTokenString(tokens, "format", format))
+        {
+            LOG_ERR("Bad convert request [" << request << "].");
+            if (id <= 0)
+                return;
+        }
+
+        std::string decodedUrl;
+        URI::decode(url, decodedUrl);
+        std::string decodedTo;
+        URI::decode(to, decodedTo);
+
+        bool success = false;
+        if (!decodedUrl.empty() && !decodedTo.empty() && !format.empty())
+        {
+            LOG_DBG("Converting [" << decodedUrl << "] to [" << decodedTo << "] as " << format << ".");
+            Timestamp timestamp;
+            std::unique_ptr<lok::Document> loKitDocument(_loKit->documentLoad(decodedUrl.c_str()));
+            if (!loKitDocument || !loKitDocument->get())
+            {
+                LOG_ERR("Failed to load: " << decodedUrl << ", error: " << _loKit->getError());
+            }
+            else
+            {
+                success = loKitDocument->saveAs(decodedTo.c_str(), format.c_str());
+                if (!success)
+                    LOG_ERR("Failed to save as [" << decodedTo << "], error: " << _loKit->getError());
+            }
+
+            // Unload before replying, wsd removes the files.
+            loKitDocument.reset();
+            LOG_DBG("Converted [" << decodedUrl << "] in " << (timestamp.elapsed() / 1000.) << "ms.");
+        }
+
+        const std::string result = "convertresult: id=" + std::to_string(id) +
+                                   " ok=" + (success ? "true" : "false");
+        _ws->enqueueMessage(result.data(), result.size(), WebSocketHandler::WSOpCode::Text);
+    }
+
+private:
+    std::shared_ptr<lok::Office> _loKit;
+    std::shared_ptr<KitWebSocketHandler> _ws;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::string> _requests;
+    bool _stop;
+    std::thread _thread;
+};
+
 /// A document container.
 /// Owns LOKitDocument instance and connections.
 /// Manages the lifetime of a document.
@@ -450,7 +651,8 @@ public:
              const std::string& docId,
              const std::string& url,
              std::shared_ptr<TileQueue> tileQueue,
-             const std::shared_ptr<LOOLWebSocket>& ws)
+             const std::shared_ptr<KitWebSocketHandler>& ws,
+             std::shared_ptr<ShmRing> tileRing = nullptr)
       : _loKit(loKit),
         _jailId(jailId),
         _docKey(docKey),
@@ -458,6 +660,9 @@ public:
         _url(url),
         _tileQueue(std::move(tileQueue)),
         _ws(ws),
+        _tileRing(std::move(tileRing)),
+        _paintTimes("us"),
+        _renderTimes("us"),
         _docPassword(""),
         _haveDocPassword(false),
         _isDocPasswordProtected(false),
@@ -555,6 +760,7 @@ public:
             if (num_sessions == 0)
             {
                 LOG_INF("Document [" << _url << "] has no more views, exiting bluntly.");
+                Log::shutdown();
                 std::_Exit(Application::EXIT_OK);
             }
         }
@@ -599,7 +805,7 @@ public:
         LOG_INF("setDocumentPassword returned");
     }
 
-    void renderTile(const std::vector<std::string>& tokens, const std::shared_ptr<LOOLWebSocket>& ws)
+    void renderTile(const std::vector<std::string>& tokens, const std::shared_ptr<KitWebSocketHandler>& ws)
     {
         assert(ws && "Expected a non-null websocket.");
         auto tile = TileDesc::parse(tokens);
@@ -640,6 +846,7 @@ public:
                                       tile.getTilePosX(), tile.getTilePosY(),
                                       tile.getTileWidth(), tile.getTileHeight());
         const auto elapsed = timestamp.elapsed();
+        _paintTimes.add(elapsed);
         LOG_TRC("paintTile at (" << tile.getPart() << ',' << tile.getTilePosX() << ',' << tile.getTilePosY() <<
                 ") " << "ver: " << tile.getVersion() << " rendered in " << (elapsed/1000.) <<
                 " ms (" << area / elapsed << " MP/s).");
@@ -661,11 +868,14 @@ public:
             return;
         }
 
+        _renderTimes.add(timestamp.elapsed());
+
         LOG_TRC("Sending render-tile response (" << output.size() << " bytes) for: " << response);
-        ws->sendFrame(output.data(), output.size(), WebSocket::FRAME_BINARY);
+        if (!sendTilesToRing(ws, response, output.data() + response.size(), output.size() - response.size()))
+            ws->enqueueMessage(std::move(output), WebSocketHandler::WSOpCode::Binary);
     }
 
-    void renderCombinedTiles(const std::vector<std::string>& tokens, const std::shared_ptr<LOOLWebSocket>& ws)
+    void renderCombinedTiles(const std::vector<std::string>& tokens, const std::shared_ptr<KitWebSocketHandler>& ws)
     {
         assert(ws && "Expected a non-null websocket.");
         auto tileCombined = TileCombined::parse(tokens);
@@ -719,13 +929,22 @@ public:
                                       renderArea.getLeft(), renderArea.getTop(),
                                       renderArea.getWidth(), renderArea.getHeight());
         Timestamp::TimeDiff elapsed = timestamp.elapsed();
+        _paintTimes.add(elapsed);
         LOG_DBG("paintTile (combined) at (" << renderArea.getLeft() << ", " << renderArea.getTop() << "), (" <<
                 renderArea.getWidth() << ", " << renderArea.getHeight() << ") " <<
                 " rendered in " << (elapsed/1000.) << " ms (" << area / elapsed << " MP/s).");
         const auto mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->getTileMode());
 
+#if ENABLE_DEBUG
+        const std::string renderId = " renderid=" + Util::UniqueId();
+#else
+        const std::string renderId;
+#endif
+
+        // Each tile is sent as soon as it's encoded, rather than all
+        // of them at the end, so that the first ones show up sooner.
         std::vector<char> output;
-        output.reserve(pixmapWidth * pixmapHeight * 4);
+        output.reserve(4 * tileCombined.getWidth() * tileCombined.getHeight());
 
         size_t tileIndex = 0;
         for (Util::Rectangle& tileRect : tileRecs)
@@ -733,7 +952,7 @@ public:
             const size_t positionX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
             const size_t positionY = (tileRect.getTop() - renderArea.getTop()) / tileCombined.getTileHeight();
 
-            const auto oldSize = output.size();
+            output.clear();
             const auto pixelWidth = tileCombined.getWidth();
             const auto pixelHeight = tileCombined.getHeight();
 
@@ -758,45 +977,75 @@ public:
                 return;
             }
 
-            const auto imgSize = output.size() - oldSize;
+            const auto imgSize = output.size();
             LOG_TRC("Encoded tile #" << tileIndex << " at (" << positionX << "," << positionY << ") with oldhash=" <<
                     tiles[tileIndex].getOldHash() << ", hash=" << hash << " in " << imgSize << " bytes.");
             tiles[tileIndex].setHash(hash);
             tiles[tileIndex].setImgSize(imgSize);
+
+            const std::string tileMsg = tiles[tileIndex].serialize("tile:") + renderId + "\n";
+            LOG_TRC("Sending back painted tile: " << tileMsg);
+            if (!sendTilesToRing(ws, tileMsg, output.data(), output.size()))
+            {
+                std::vector<char> response;
+                response.reserve(tileMsg.size() + output.size());
+                response.insert(response.end(), tileMsg.begin(), tileMsg.end());
+                response.insert(response.end(), output.begin(), output.end());
+                ws->enqueueMessage(std::move(response), WebSocketHandler::WSOpCode::Binary);
+            }
+
             tileIndex++;
         }
 
         elapsed = timestamp.elapsed();
+        _renderTimes.add(elapsed);
         LOG_DBG("renderCombinedTiles at (" << renderArea.getLeft() << ", " << renderArea.getTop() << "), (" <<
                 renderArea.getWidth() << ", " << renderArea.getHeight() << ") " <<
                 " took " << (elapsed/1000.) << " ms (including the paintTile).");
+    }
 
-#if ENABLE_DEBUG
-        const auto tileMsg = tileCombined.serialize("tilecombine:") + " renderid=" + Util::UniqueId() + "\n";
-#else
-        const auto tileMsg = tileCombined.serialize("tilecombine:") + "\n";
-#endif
-        LOG_TRC("Sending back painted tiles for " << tileMsg);
+    /// Sends the paint and render times since the last call to wsd, for its metrics.
+    void sendRenderMetrics()
+    {
+        if (_paintTimes.getCount() > 0)
+        {
+            sendTextFrame("kitmetrics: name=paint " + _paintTimes.serialize());
+            _paintTimes.reset();
+        }
+
+        if (_renderTimes.getCount() > 0)
+        {
+            sendTextFrame("kitmetrics: name=render " + _renderTimes.serialize());
+            _renderTimes.reset();
+        }
+    }
 
-        std::vector<char> response;
-        response.resize(tileMsg.size() + output.size());
-        std::copy(tileMsg.begin(), tileMsg.end(), response.begin());
-        std::copy(output.begin(), output.end(), response.begin() + tileMsg.size());
+    /// Writes the PNGs to the tile ring, and only sends their position
+    /// followed by the header line. Only called from the render thread.
+    /// @return false if there is no ring or no room, to send them as usual.
+    bool sendTilesToRing(const std::shared_ptr<KitWebSocketHandler>& ws, const std::string& header,
+                         const char* data, const size_t len)
+    {
+        uint64_t pos;
+        if (!_tileRing || len == 0 || !_tileRing->write(data, len, pos))
+            return false;
 
-        ws->sendFrame(response.data(), response.size(), WebSocket::FRAME_BINARY);
+        const std::string message = ShmRing::getPositionMessage(pos, len) + header;
+        ws->enqueueMessage(message.data(), message.size(), WebSocketHandler::WSOpCode::Binary);
+        return true;
     }
 
     bool sendTextFrame(const std::string& message) override
     {
         try
         {
-            if (!_ws || _ws->poll(Poco::Timespan(0), Poco::Net::Socket::SelectMode::SELECT_ERROR))
+            if (!_ws || _ws->isClosed())
             {
                 LOG_ERR("Child Doc: Bad socket while sending [" << getAbbreviatedMessage(message) << "].");
                 return false;
             }
 
-            _ws->sendFrame(message.data(), message.size());
+            _ws->enqueueMessage(message.data(), message.size(), WebSocketHandler::WSOpCode::Text);
             return true;
         }
         catch (const Exception& exc)
@@ -850,43 +1099,26 @@ public:
                 "] [" << LOKitHelper::kitCallbackTypeToString(type) <<
                 "] [" << payload << "].");
 
-        // when we examine the content of the JSON
-        std::string targetViewId;
+        // Parsed once here, the queue merges and deduplicates the callbacks by these fields.
+        TileQueue::Callback callback = TileQueue::parseCallback(type, payload);
 
         if (type == LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR ||
             type == LOK_CALLBACK_CELL_CURSOR)
         {
-            Poco::StringTokenizer tokens(payload, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
             // Payload may be 'EMPTY'.
-            if (tokens.count() == 4)
+            if (callback.HasRectangle)
             {
-                auto cursorX = std::stoi(tokens[0]);
-                auto cursorY = std::stoi(tokens[1]);
-                auto cursorWidth = std::stoi(tokens[2]);
-                auto cursorHeight = std::stoi(tokens[3]);
-
-                tileQueue->updateCursorPosition(0, 0, cursorX, cursorY, cursorWidth, cursorHeight);
+                tileQueue->updateCursorPosition(0, 0, callback.X, callback.Y, callback.Width, callback.Height);
             }
         }
         else if (type == LOK_CALLBACK_INVALIDATE_VIEW_CURSOR ||
                  type == LOK_CALLBACK_CELL_VIEW_CURSOR)
         {
-            Poco::JSON::Parser parser;
-            const auto result = parser.parse(payload);
-            const auto& command = result.extract<Poco::JSON::Object::Ptr>();
-            targetViewId = command->get("viewId").toString();
-            auto part = command->get("part").toString();
-            auto text = command->get("rectangle").toString();
-            Poco::StringTokenizer tokens(text, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
             // Payload may be 'EMPTY'.
-            if (tokens.count() == 4)
+            if (callback.HasRectangle)
             {
-                auto cursorX = std::stoi(tokens[0]);
-                auto cursorY = std::stoi(tokens[1]);
-                auto cursorWidth = std::stoi(tokens[2]);
-                auto cursorHeight = std::stoi(tokens[3]);
-
-                tileQueue->updateCursorPosition(std::stoi(targetViewId), std::stoi(part), cursorX, cursorY, cursorWidth, cursorHeight);
+                tileQueue->updateCursorPosition(callback.PayloadViewId, callback.Part,
+                                                callback.X, callback.Y, callback.Width, callback.Height);
             }
         }
 
@@ -896,16 +1128,19 @@ public:
         {
             // no point in handling invalidations or page resizes per-view,
             // all views have to be in sync
-            tileQueue->put("callback all " + std::to_string(type) + ' ' + payload);
+            callback.ViewId = TileQueue::Callback::AllViews;
         }
         else if (type == LOK_CALLBACK_INVALIDATE_VIEW_CURSOR ||
                  type == LOK_CALLBACK_CELL_VIEW_CURSOR)
         {
             // these should go to all views but the one that that triggered it
-            tileQueue->put("callback except-" + targetViewId + ' ' + std::to_string(type) + ' ' + payload);
+            callback.ViewId = TileQueue::Callback::AllViews;
+            callback.ExceptViewId = callback.PayloadViewId;
         }
         else
-            tileQueue->put("callback " + std::to_string(descriptor->ViewId) + ' ' + std::to_string(type) + ' ' + payload);
+            callback.ViewId = descriptor->ViewId;
+
+        tileQueue->putCallback(callback, payload);
     }
 
 private:
@@ -913,8 +1148,8 @@ private:
     /// Helper method to broadcast callback and its payload to all clients
     void broadcastCallbackToClients(const int type, const std::string& payload)
     {
-        // "-1" means broadcast
-        _tileQueue->put("callback all " + std::to_string(type) + ' ' + payload);
+        // The callback is for all views by default.
+        _tileQueue->putCallback(TileQueue::parseCallback(type, payload), payload);
     }
 
     /// Load a document (or view) and register callbacks.
@@ -996,6 +1231,7 @@ private:
             if (_sessions.empty())
             {
                 LOG_INF("Document [" << _url << "] has no more views, exiting bluntly.");
+                Log::shutdown();
                 std::_Exit(Application::EXIT_OK);
             }
 
@@ -1262,6 +1498,48 @@ private:
         return _loKitDocument;
     }
 
+    /// Forward a queued callback record to its views, making its text payload only now.
+    void forwardCallback(const TileQueue::Payload& record)
+    {
+        const TileQueue::Callback callback = TileQueue::getCallback(record);
+        const bool broadcast = (callback.ViewId == TileQueue::Callback::AllViews);
+        const std::string payload = TileQueue::getCallbackPayload(record);
+
+        // Forward the callback to the same view, demultiplexing is done by the LibreOffice core.
+        // TODO: replace with a map to be faster.
+        bool isFound = false;
+        for (auto& it : _sessions)
+        {
+            auto session = it.second;
+            if (session && ((broadcast && (session->getViewId() != callback.ExceptViewId)) || (!broadcast && (session->getViewId() == callback.ViewId))))
+            {
+                if (!it.second->isCloseFrame())
+                {
+                    isFound = true;
+                    session->loKitCallback(callback.Type, payload);
+                }
+                else
+                {
+                    LOG_ERR("Session-thread of session [" << session->getId() << "] for view [" <<
+                            callback.ViewId << "] is not running. Dropping [" << LOKitHelper::kitCallbackTypeToString(callback.Type) <<
+                            "] payload [" << payload << "].");
+                }
+
+                if (!broadcast)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (!isFound)
+        {
+            LOG_WRN("Document::ViewCallback. Session [" << callback.ViewId <<
+                    "] is no longer active to process [" << LOKitHelper::kitCallbackTypeToString(callback.Type) <<
+                    "] [" << payload << "] message to Master Session.");
+        }
+    }
+
     bool forwardToChild(const std::string& prefix, const std::vector<char>& payload)
     {
         assert(payload.size() > prefix.size());
@@ -1379,10 +1657,20 @@ private:
         auto lastMemStatsTime = std::chrono::steady_clock::now();
         sendTextFrame(Util::getMemoryStats(ProcSMapsFile));
 
+        // Report the render times as often, busy or not.
+        auto lastMetricsTime = lastMemStatsTime;
+
         try
         {
             while (!_stop && !TerminationFlag)
             {
+                const auto now = std::chrono::steady_clock::now();
+                if (std::chrono::duration_cast<std::chrono::milliseconds>(now - lastMetricsTime).count() > memStatsPeriodMs)
+                {
+                    sendRenderMetrics();
+                    lastMetricsTime = now;
+                }
+
                 const TileQueue::Payload input = _tileQueue->get(POLL_TIMEOUT_MS * 2);
                 if (input.empty())
                 {
@@ -1397,7 +1685,14 @@ private:
                     continue;
                 }
 
-                LOG_TRC("Kit Recv " << LOOLProtocol::getAbbreviatedMessage(input));
+                if (TileQueue::isCallback(input))
+                {
+                    LOG_TRC("Kit Recv " << TileQueue::callbackToString(input));
+                }
+                else
+                {
+                    LOG_TRC("Kit Recv " << LOOLProtocol::getAbbreviatedMessage(input));
+                }
 
                 if (_stop || TerminationFlag)
                 {
@@ -1405,6 +1700,12 @@ private:
                     break;
                 }
 
+                if (TileQueue::isCallback(input))
+                {
+                    forwardCallback(input);
+                    continue;
+                }
+
                 const auto tokens = LOOLProtocol::tokenize(input.data(), input.size());
 
                 if (tokens[0] == "eof")
@@ -1425,74 +1726,6 @@ private:
                 {
                     forwardToChild(tokens[0], input);
                 }
-                else if (tokens[0] == "callback")
-                {
-                    if (tokens.size() >= 3)
-                    {
-                        bool broadcast = false;
-                        int viewId = -1;
-                        int exceptViewId = -1;
-
-                        const std::string& target = tokens[1];
-                        if (target == "all")
-                        {
-                            broadcast = true;
-                        }
-                        else if (LOOLProtocol::matchPrefix("except-", target))
-                        {
-                            exceptViewId = std::stoi(target.substr(7));
-                            broadcast = true;
-                        }
-                        else
-                        {
-                            viewId = std::stoi(target);
-                        }
-
-                        const int type = std::stoi(tokens[2]);
-
-                        // payload is the rest of the message
-                        const auto offset = tokens[0].length() + tokens[1].length() + tokens[2].length() + 3; // + delims
-                        const std::string payload(input.data() + offset, input.size() - offset);
-
-                        // Forward the callback to the same view, demultiplexing is done by the LibreOffice core.
-                        // TODO: replace with a map to be faster.
-                        bool isFound = false;
-                        for (auto& it : _sessions)
-                        {
-                            auto session = it.second;
-                            if (session && ((broadcast && (session->getViewId() != exceptViewId)) || (!broadcast && (session->getViewId() == viewId))))
-                            {
-                                if (!it.second->isCloseFrame())
-                                {
-                                    isFound = true;
-                                    session->loKitCallback(type, payload);
-                                }
-                                else
-                                {
-                                    LOG_ERR("Session-thread of session [" << session->getId() << "] for view [" <<
-                                            viewId << "] is not running. Dropping [" << LOKitHelper::kitCallbackTypeToString(type) <<
-                                            "] payload [" << payload << "].");
-                                }
-
-                                if (!broadcast)
-                                {
-                                    break;
-                                }
-                            }
-                        }
-
-                        if (!isFound)
-                        {
-                            LOG_WRN("Document::ViewCallback. Session [" << viewId <<
-                                    "] is no longer active to process [" << LOKitHelper::kitCallbackTypeToString(type) <<
-                                    "] [" << payload << "] message to Master Session.");
-                        }
-                    }
-                    else
-                    {
-                        LOG_ERR("Invalid callback message: [" << LOOLProtocol::getAbbreviatedMessage(input) << "].");
-                    }
-                }
                 else
                 {
                     LOG_ERR("Unexpected request: [" << LOOLProtocol::getAbbreviatedMessage(input) << "].");
@@ -1538,8 +1771,14 @@ private:
 
     std::shared_ptr<lok::Document> _loKitDocument;
     std::shared_ptr<TileQueue> _tileQueue;
-    std::shared_ptr<LOOLWebSocket> _ws;
+    std::shared_ptr<KitWebSocketHandler> _ws;
+    /// The shared memory the tiles are sent through, if any.
+    std::shared_ptr<ShmRing> _tileRing;
     PngCache _pngCache;
+    /// The time spent painting tiles, and painting and encoding
+    /// them, since last reported to wsd. Only used by the render thread.
+    Histogram _paintTimes;
+    Histogram _renderTimes;
 
     // Document password provided
     std::string _docPassword;
@@ -1573,6 +1812,77 @@ void documentViewCallback(const int type, const char* payload, void* data)
 }
 
 #ifndef BUILDING_TESTS
+/// Connects to the abstract Unix socket loolwsd listens on for the kits.
+/// Returns the blocking socket fd, or -1 to use the master port instead.
+static int connectLocalSocket()
+{
+    const std::string name = PRISONER_SOCKET_NAME + std::to_string(MasterPortNumber);
+
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path + 1, name.data(), name.size());
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        LOG_SYS("Failed to create local socket.");
+        return -1;
+    }
+
+    const socklen_t len = offsetof(struct sockaddr_un, sun_path) + 1 + name.size();
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), len) != 0)
+    {
+        LOG_SYS("Failed to connect to local socket [" << name << "], using port " << MasterPortNumber << ".");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/// Connects to the master port of loolwsd, on the loopback.
+/// Returns the blocking socket fd, or -1 on failure.
+static int connectMasterPort()
+{
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MasterPortNumber);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        LOG_SYS("Failed to create socket.");
+        return -1;
+    }
+
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0)
+    {
+        LOG_SYS("Failed to connect to Master port " << MasterPortNumber << ".");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/// Passes the tile ring to loolwsd in a tileshm: message.
+/// Must be sent before anything else can write to the websocket.
+static bool sendTileRing(const ShmRing& ring, const int socketFd)
+{
+    const std::string message = "tileshm: size=" + std::to_string(ring.getSize());
+
+    // A text frame, as WebSocketHandler would write it.
+    std::vector<char> frame;
+    frame.push_back(static_cast<char>(0x80 | WebSocketHandler::WSOpCode::Text));
+    frame.push_back(static_cast<char>(message.size()));
+    frame.insert(frame.end(), message.begin(), message.end());
+
+    return ring.sendFD(socketFd, frame);
+}
+
 void lokit_main(const std::string& childRoot,
                 const std::string& jailId,
                 const std::string& sysTemplate,
@@ -1601,6 +1911,9 @@ void lokit_main(const std::string& childRoot,
     }
 
     Log::initialize("kit", logLevel ? logLevel : "", logColor != nullptr, logToFile, logProperties);
+    const char* logAsync = std::getenv("LOOL_LOGASYNC");
+    if (logAsync)
+        Log::enableAsync(std::max(std::atoi(logAsync), 1), std::getenv("LOOL_LOGASYNCBLOCK") == nullptr);
     Util::rng::reseed();
 
     assert(!childRoot.empty());
@@ -1697,7 +2010,10 @@ void lokit_main(const std::string& childRoot,
                 LOG_SYS("mknod(" << jailPath.toString() << "/dev/urandom) failed.");
             }
 
-            ProcSMapsFile = fopen("/proc/self/smaps", "r");
+            // smaps_rollup is much cheaper to read, where available.
+            ProcSMapsFile = fopen("/proc/self/smaps_rollup", "r");
+            if (ProcSMapsFile == nullptr)
+                ProcSMapsFile = fopen("/proc/self/smaps", "r");
             if (ProcSMapsFile == nullptr)
             {
                 LOG_SYS("Failed to symlink /proc/self/smaps. Memory stats will be missing.");
@@ -1780,27 +2096,49 @@ void lokit_main(const std::string& childRoot,
             free(versionInfo);
         }
 
-        // Open websocket connection between the child process and WSD.
-        HTTPClientSession cs("127.0.0.1", MasterPortNumber);
-        cs.setTimeout(Poco::Timespan(10, 0)); // 10 second
-        LOG_DBG("Connecting to Master " << cs.getHost() << ':' << cs.getPort());
-        HTTPRequest request(HTTPRequest::HTTP_GET, requestUrl);
-        HTTPResponse response;
-        auto ws = std::make_shared<LOOLWebSocket>(cs, request, response);
-        ws->setReceiveTimeout(0);
+        // Open websocket connection between the child process and WSD,
+        // over the Unix socket if we can, else over the loopback.
+        const int localFd = (UseLocalSocket ? connectLocalSocket() : -1);
+        const int fd = (localFd >= 0 ? localFd : connectMasterPort());
+        LOG_DBG("Connecting to Master over " << (localFd >= 0 ? "local socket" : "port") << " #" << fd);
+        if (fd < 0)
+            throw std::runtime_error("Failed to connect to Master.");
+
+        if (!WebSocketHandler::upgradeClientSocket(fd, requestUrl))
+        {
+            close(fd);
+            throw std::runtime_error("Failed to upgrade the connection to Master.");
+        }
+
+        // Only the Unix socket can pass the ring's fd.
+        std::shared_ptr<ShmRing> tileRing;
+        if (localFd >= 0 && TileRingSizeKb > 0)
+        {
+            tileRing = ShmRing::create(static_cast<size_t>(TileRingSizeKb) * 1024);
+            if (tileRing && !sendTileRing(*tileRing, fd))
+                tileRing.reset();
+        }
+
+        // From now on, we only ever poll the socket.
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        SocketPoll mainKit("kit_main");
+        mainKit.runOnClientThread();
 
         auto queue = std::make_shared<TileQueue>();
 
         const std::string socketName = "child_ws_" + pid;
-        IoUtil::SocketProcessor(ws, socketName,
-                [&socketName, &ws, &loKit, &jailId, &queue](const std::vector<char>& data)
+        std::shared_ptr<KitWebSocketHandler> ws;
+        std::unique_ptr<Converter> converter;
+        ws = std::make_shared<KitWebSocketHandler>(mainKit,
+                [&socketName, &ws, &loKit, &jailId, &queue, &tileRing, &converter](const std::vector<char>& data)
                 {
                     std::string message(data.data(), data.size());
 
 #ifndef KIT_IN_PROCESS
                     if (UnitKit::get().filterKitMessage(ws, message))
                     {
-                        return true;
+                        return;
                     }
 #endif
 
@@ -1824,7 +2162,7 @@ void lokit_main(const std::string& childRoot,
 
                         if (!document)
                         {
-                            document = std::make_shared<Document>(loKit, jailId, docKey, docId, url, queue, ws);
+                            document = std::make_shared<Document>(loKit, jailId, docKey, docId, url, queue, ws, tileRing);
                         }
 
                         // Validate and create session.
@@ -1839,6 +2177,20 @@ void lokit_main(const std::string& childRoot,
                         LOG_TRC("Setting TerminationFlag due to 'exit' command from parent.");
                         TerminationFlag = true;
                     }
+                    else if (tokens[0] == "convert")
+                    {
+                        if (document)
+                        {
+                            LOG_ERR("Cannot convert while hosting document [" << document->getUrl() << "].");
+                        }
+                        else
+                        {
+                            if (!converter)
+                                converter.reset(new Converter(loKit, ws));
+
+                            converter->enqueue(message);
+                        }
+                    }
                     else if (tokens[0] == "tile" || tokens[0] == "tilecombine" || tokens[0] == "canceltiles" ||
                              LOOLProtocol::getFirstToken(tokens[0], '-') == "child")
                     {
@@ -1855,20 +2207,23 @@ void lokit_main(const std::string& childRoot,
                     {
                         LOG_ERR("Bad or unknown token [" << tokens[0] << "]");
                     }
+                });
 
-                    return true;
-                },
-                []() {},
-                []()
-                {
-                    if (document && document->purgeSessions() == 0)
-                    {
-                        LOG_INF("Last session discarded. Terminating.");
-                        TerminationFlag = true;
-                    }
+        mainKit.insertNewSocket(StreamSocket::create<StreamSocket>(fd, ws));
 
-                    return TerminationFlag.load();
-                });
+        LOG_INF("Kit poll [" << socketName << "] starting.");
+        while (!TerminationFlag && !ws->isClosed())
+        {
+            mainKit.poll(POLL_TIMEOUT_MS);
+
+            if (document && document->purgeSessions() == 0)
+            {
+                LOG_INF("Last session discarded. Terminating.");
+                TerminationFlag = true;
+            }
+        }
+
+        LOG_INF("Kit poll [" << socketName << "] finished.");
 
 #if 0
         std::string uri = "file://$HOME/docs/basic-presentation.pptx";
@@ -1905,6 +2260,7 @@ void lokit_main(const std::string& childRoot,
     // Trap the signal handler, if invoked,
     // to prevent exiting.
     LOG_INF("Process finished.");
+    Log::shutdown();
     std::unique_lock<std::mutex> lock(SigHandlerTrap);
     std::_Exit(Application::EXIT_OK);
 }
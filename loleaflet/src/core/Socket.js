@@ -180,6 +180,11 @@ L.Socket = L.Class.extend({
 			console.log2(+new Date() + ' %cINCOMING%c: ' + textMsg.concat(' ').replace(' ', '%c '), 'background:#ddf;color:black', 'color:blue', 'color:black');
 		}
 
+		if (textMsg.startsWith('tilecombine:')) {
+			this._onTileCombinedMsg(textMsg, imgBytes.subarray(index + 1));
+			return;
+		}
+
 		var command = this.parseServerCmd(textMsg);
 		if (textMsg.startsWith('loolserver ')) {
 			// This must be the first message, unless we reconnect.
@@ -649,6 +654,43 @@ L.Socket = L.Class.extend({
 		}
 	},
 
+	// The cached tiles of a tilecombine come in one frame, split them in 'tile:' messages.
+	_onTileCombinedMsg: function (textMsg, data) {
+		var tokens = textMsg.split(' ');
+		var params = [];
+		var lists = {};
+		for (var i = 1; i < tokens.length; i++) {
+			var pos = tokens[i].indexOf('=');
+			var name = tokens[i].substring(0, pos);
+			if (name === 'tileposx' || name === 'tileposy' || name === 'imgsize' || name === 'ver' || name === 'hash') {
+				lists[name] = tokens[i].substring(pos + 1).split(',');
+			}
+			else if (name !== 'oldhash') {
+				params.push(tokens[i]);
+			}
+		}
+
+		if (!this._map._docLayer || !lists.tileposx || !lists.tileposy || !lists.imgsize) {
+			return;
+		}
+
+		var offset = 0;
+		for (i = 0; i < lists.tileposx.length; i++) {
+			var size = parseInt(lists.imgsize[i]);
+			var tileMsg = 'tile: tileposx=' + lists.tileposx[i] + ' tileposy=' + lists.tileposy[i] + ' ' + params.join(' ');
+			if (lists.ver) {
+				tileMsg += ' ver=' + lists.ver[i];
+			}
+			if (lists.hash) {
+				tileMsg += ' hash=' + lists.hash[i];
+			}
+
+			var img = 'data:image/png;base64,' + window.btoa(this._utf8ToString(data.subarray(offset, offset + size)));
+			offset += size;
+			this._map._docLayer._onMessage(tileMsg, img);
+		}
+	},
+
 	_onSocketError: function () {
 		console.debug('_onSocketError:');
 		this._map.hideBusy();
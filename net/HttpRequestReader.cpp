@@ -0,0 +1,244 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include "HttpRequestReader.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+
+#include <Poco/String.h>
+#include <Poco/TemporaryFile.h>
+
+#include "Log.hpp"
+
+using Poco::Net::HTTPResponse;
+
+HttpRequestReader::HttpRequestReader(const uint64_t maxBodySize) :
+    _maxBodySize(maxBodySize),
+    _spoolFd(-1),
+    _spoolMap(nullptr)
+{
+    reset();
+}
+
+HttpRequestReader::~HttpRequestReader()
+{
+    reset();
+}
+
+void HttpRequestReader::reset()
+{
+    _bodyStream.reset();
+
+    if (_spoolMap != nullptr)
+    {
+        munmap(_spoolMap, _bodySize);
+        _spoolMap = nullptr;
+    }
+
+    if (_spoolFd >= 0)
+    {
+        close(_spoolFd);
+        _spoolFd = -1;
+    }
+
+    _state = State::Header;
+    _started = false;
+    _headerScanned = 0;
+    _request.reset(new Poco::Net::HTTPRequest());
+    _expectContinue = false;
+    _bodySize = 0;
+    _bodyReceived = 0;
+    std::vector<char>().swap(_body);
+    _errorStatus = HTTPResponse::HTTP_OK;
+    _errorReason.clear();
+}
+
+HttpRequestReader::State HttpRequestReader::fail(const HTTPResponse::HTTPStatus status,
+                                                 const std::string& reason)
+{
+    LOG_WRN("Rejecting HTTP request with " << static_cast<int>(status) << ' ' << reason << '.');
+    _errorStatus = status;
+    _errorReason = reason;
+    _state = State::Error;
+    return _state;
+}
+
+HttpRequestReader::State HttpRequestReader::consume(std::vector<char>& in)
+{
+    if (_state == State::Complete || _state == State::Error)
+        return _state;
+
+    if (!in.empty())
+    {
+        _started = true;
+        _lastReadTime = std::chrono::steady_clock::now();
+    }
+
+    if (_state == State::Header)
+    {
+        // Don't search again what we searched already, but
+        // for the start of a marker split between two reads.
+        static const std::string marker("\r\n\r\n");
+        const size_t from = (_headerScanned > marker.size() ? _headerScanned - marker.size() + 1 : 0);
+        const auto itEnd = std::search(in.begin() + std::min(from, in.size()), in.end(),
+                                       marker.begin(), marker.end());
+        if (itEnd == in.end())
+        {
+            _headerScanned = in.size();
+            if (in.size() > MaxHeaderSize)
+                return fail(HTTPResponse::HTTP_BAD_REQUEST, "Request Header Too Large");
+
+            return _state;
+        }
+
+        const size_t headerSize = itEnd - in.begin() + marker.size();
+        if (headerSize > MaxHeaderSize)
+            return fail(HTTPResponse::HTTP_BAD_REQUEST, "Request Header Too Large");
+
+        if (parseHeader(in, headerSize) != State::Body)
+            return _state;
+    }
+
+    if (_state == State::Body)
+    {
+        const size_t size = std::min<uint64_t>(in.size(), _bodySize - _bodyReceived);
+        if (size > 0)
+        {
+            if (_spoolFd >= 0)
+            {
+                if (!spool(in.data(), size))
+                    return fail(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
+            }
+            else
+            {
+                _body.insert(_body.end(), in.begin(), in.begin() + size);
+            }
+
+            in.erase(in.begin(), in.begin() + size);
+            _bodyReceived += size;
+        }
+
+        if (_bodyReceived < _bodySize)
+            return _state;
+
+        if (_spoolFd >= 0)
+        {
+            _spoolMap = mmap(nullptr, _bodySize, PROT_READ, MAP_PRIVATE, _spoolFd, 0);
+            if (_spoolMap == MAP_FAILED)
+            {
+                LOG_SYS("Failed to map the spooled body of " << _bodySize << " bytes.");
+                _spoolMap = nullptr;
+                return fail(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
+            }
+
+            _bodyStream.reset(new Poco::MemoryInputStream(static_cast<const char*>(_spoolMap), _bodySize));
+        }
+        else
+        {
+            _bodyStream.reset(new Poco::MemoryInputStream(_body.empty() ? "" : _body.data(), _body.size()));
+        }
+
+        _state = State::Complete;
+    }
+
+    return _state;
+}
+
+HttpRequestReader::State HttpRequestReader::parseHeader(std::vector<char>& in, const size_t headerSize)
+{
+    try
+    {
+        Poco::MemoryInputStream header(in.data(), headerSize);
+        _request->read(header);
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_WRN("Failed to parse the HTTP request header: " << exc.what());
+        return fail(HTTPResponse::HTTP_BAD_REQUEST, "Bad Request");
+    }
+
+    in.erase(in.begin(), in.begin() + headerSize);
+
+    if (_request->getChunkedTransferEncoding())
+        return fail(HTTPResponse::HTTP_LENGTH_REQUIRED, "Length Required");
+
+    // Without a length, there is no body: anything else is the next request.
+    const Poco::Int64 length = _request->getContentLength64();
+    _bodySize = (length > 0 ? length : 0);
+    if (_maxBodySize > 0 && _bodySize > _maxBodySize)
+        return fail(HTTPResponse::HTTP_REQUESTENTITYTOOLARGE, "Request Entity Too Large");
+
+    _expectContinue = (_bodySize > 0 && Poco::icompare(_request->get("Expect", ""), "100-continue") == 0);
+
+    if (_bodySize > SpoolThreshold)
+    {
+        const std::string path = Poco::TemporaryFile::tempName();
+        _spoolFd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (_spoolFd < 0)
+        {
+            LOG_SYS("Failed to create spool file [" << path << "].");
+            return fail(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error");
+        }
+
+        // Nothing to cleanup, whatever happens to us.
+        unlink(path.c_str());
+        LOG_TRC("Spooling body of " << _bodySize << " bytes to [" << path << "].");
+    }
+    else
+    {
+        _body.reserve(_bodySize);
+    }
+
+    _state = State::Body;
+    return _state;
+}
+
+bool HttpRequestReader::spool(const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t len = write(_spoolFd, data, size);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            LOG_SYS("Failed to spool " << size << " bytes of the request body.");
+            return false;
+        }
+
+        data += len;
+        size -= len;
+    }
+
+    return true;
+}
+
+bool HttpRequestReader::takeExpectContinue()
+{
+    const bool expectContinue = _expectContinue;
+    _expectContinue = false;
+    return expectContinue;
+}
+
+Poco::MemoryInputStream& HttpRequestReader::getBody()
+{
+    assert(_state == State::Complete && _bodyStream);
+    return *_bodyStream;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,129 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_HTTPREQUESTREADER_HPP
+#define INCLUDED_HTTPREQUESTREADER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Poco/MemoryStream.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPResponse.h>
+
+/// Reads an HTTP request from a socket input buffer as it arrives.
+///
+/// The header is scanned once, then parsed once it's complete. The
+/// body is moved out of the input buffer as it arrives: small ones
+/// are kept in memory, larger ones are spooled to an unlinked file,
+/// which is mapped once complete. Either way the handlers read the
+/// body from a MemoryInputStream, without it ever being on the heap
+/// whole, and the multipart parts they extract go straight to files.
+/// Whatever follows the request is left in the input buffer.
+class HttpRequestReader
+{
+public:
+    enum class State
+    {
+        /// Waiting for the end of the header.
+        Header,
+        /// Waiting for the rest of the body.
+        Body,
+        /// The request and its body are ready.
+        Complete,
+        /// The request is invalid or over a limit, see getErrorStatus().
+        Error
+    };
+
+    /// The request line and the headers may not be larger than this.
+    static constexpr size_t MaxHeaderSize = 64 * 1024;
+
+    /// Bodies larger than this are spooled to a file.
+    static constexpr size_t SpoolThreshold = 256 * 1024;
+
+    /// @param maxBodySize the largest accepted body, in bytes, 0 for no limit.
+    explicit HttpRequestReader(uint64_t maxBodySize = 0);
+    ~HttpRequestReader();
+
+    HttpRequestReader(const HttpRequestReader&) = delete;
+    HttpRequestReader& operator=(const HttpRequestReader&) = delete;
+
+    /// Moves the bytes of the current request out of the buffer.
+    /// @return the state once done, Complete or Error being final until reset().
+    State consume(std::vector<char>& in);
+
+    State getState() const { return _state; }
+
+    /// True once some bytes of the current request arrived.
+    bool hasStarted() const { return _started; }
+
+    /// When the last bytes of the current request arrived.
+    std::chrono::steady_clock::time_point getLastReadTime() const { return _lastReadTime; }
+
+    /// The request, once past the Header state.
+    const Poco::Net::HTTPRequest& getRequest() const { return *_request; }
+
+    /// True once, when the client waits for "100 Continue" to send the body.
+    bool takeExpectContinue();
+
+    /// The body, once Complete.
+    Poco::MemoryInputStream& getBody();
+
+    uint64_t getBodySize() const { return _bodySize; }
+    bool isSpooled() const { return _spoolFd >= 0; }
+
+    /// The status to reply with, in the Error state.
+    Poco::Net::HTTPResponse::HTTPStatus getErrorStatus() const { return _errorStatus; }
+    const std::string& getErrorReason() const { return _errorReason; }
+
+    /// Forgets the current request, to read the next one.
+    void reset();
+
+private:
+    State fail(Poco::Net::HTTPResponse::HTTPStatus status, const std::string& reason);
+
+    /// Parses the header, the first headerSize bytes of the buffer.
+    State parseHeader(std::vector<char>& in, size_t headerSize);
+
+    /// Appends to the spool file.
+    bool spool(const char* data, size_t size);
+
+private:
+    const uint64_t _maxBodySize;
+
+    State _state;
+    bool _started;
+    std::chrono::steady_clock::time_point _lastReadTime;
+
+    /// The bytes of the header already searched for its end.
+    size_t _headerScanned;
+
+    /// Not assignable, hence recreated for each request.
+    std::unique_ptr<Poco::Net::HTTPRequest> _request;
+    bool _expectContinue;
+
+    uint64_t _bodySize;
+    uint64_t _bodyReceived;
+    std::vector<char> _body;
+
+    int _spoolFd;
+    void* _spoolMap;
+
+    std::unique_ptr<Poco::MemoryInputStream> _bodyStream;
+
+    Poco::Net::HTTPResponse::HTTPStatus _errorStatus;
+    std::string _errorReason;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -12,6 +12,10 @@
 
 #include "memory"
 
+#include <sys/un.h>
+
+#include <cstddef>
+
 #include "Socket.hpp"
 #include "Log.hpp"
 
@@ -61,7 +65,7 @@ public:
     /// Accepts an incoming connection (Servers only).
     /// Does not retry on error.
     /// Returns a valid Socket shared_ptr on success only.
-    std::shared_ptr<Socket> accept()
+    virtual std::shared_ptr<Socket> accept()
     {
         // Accept a connection (if any) and set it to non-blocking.
         struct sockaddr_in clientInfo;
@@ -115,11 +119,96 @@ public:
         }
     }
 
-private:
+protected:
+    /// Construct based on an existing listening socket fd.
+    ServerSocket(const int fd, SocketPoll& clientPoller, std::shared_ptr<SocketFactory> sockFactory) :
+        Socket(fd),
+        _clientPoller(clientPoller),
+        _sockFactory(std::move(sockFactory))
+    {
+    }
+
     SocketPoll& _clientPoller;
     std::shared_ptr<SocketFactory> _sockFactory;
 };
 
+/// A server socket in the abstract Unix socket namespace,
+/// which only accepts connections from our own user.
+class LocalServerSocket : public ServerSocket
+{
+public:
+    LocalServerSocket(SocketPoll& clientPoller, std::shared_ptr<SocketFactory> sockFactory) :
+        ServerSocket(::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+                     clientPoller, std::move(sockFactory))
+    {
+    }
+
+    /// Binds to the given name in the abstract namespace.
+    /// Returns true on success only.
+    bool bind(const std::string& name)
+    {
+        struct sockaddr_un addr;
+        if (name.empty() || name.size() >= sizeof(addr.sun_path))
+            return false;
+
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        // The leading null byte selects the abstract namespace, nothing on disk.
+        std::memcpy(addr.sun_path + 1, name.data(), name.size());
+
+        const socklen_t len = offsetof(struct sockaddr_un, sun_path) + 1 + name.size();
+        const int rc = ::bind(getFD(), reinterpret_cast<struct sockaddr*>(&addr), len);
+        return rc == 0;
+    }
+
+    /// Accepts an incoming connection, if its peer runs as our user.
+    std::shared_ptr<Socket> accept() override
+    {
+        const int rc = ::accept4(getFD(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (rc == -1)
+            return nullptr;
+
+        // Anyone on the host can connect to an abstract socket.
+        struct ucred creds;
+        socklen_t credsLen = sizeof(creds);
+        if (::getsockopt(rc, SOL_SOCKET, SO_PEERCRED, &creds, &credsLen) != 0 ||
+            creds.uid != ::getuid())
+        {
+            LOG_ERR("Rejecting local connection #" << rc << " from pid " <<
+                    (credsLen == sizeof(creds) ? creds.pid : -1) << ", not our user.");
+            ::close(rc);
+            return nullptr;
+        }
+
+        LOG_DBG("Accepted local socket #" << rc << " from pid " << creds.pid << ".");
+        try
+        {
+            std::shared_ptr<Socket> socket = _sockFactory->create(rc);
+            socket->_clientAddress = "local";
+            return socket;
+        }
+        catch (const std::exception& ex)
+        {
+            LOG_SYS("Failed to create local socket #" << rc << ". Error: " << ex.what());
+        }
+
+        return nullptr;
+    }
+
+    void handlePoll(SocketDisposition &,
+                    std::chrono::steady_clock::time_point /* now */,
+                    int events) override
+    {
+        // Unlike the base, a rejected peer mustn't stop us listening.
+        if (events & POLLIN)
+        {
+            std::shared_ptr<Socket> clientSocket = accept();
+            if (clientSocket)
+                _clientPoller.insertNewSocket(clientSocket);
+        }
+    }
+};
+
 #endif
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
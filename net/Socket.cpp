@@ -179,6 +179,8 @@ void WebSocketHandler::dumpState(std::ostream& os)
 {
     os << (_shuttingDown ? "shutd " : "alive ")
        << std::setw(5) << 1.0*_pingTimeUs/1000 << "ms ";
+    if (_deflate)
+        os << (_deflate->hasContextTakeover() ? "deflate " : "deflate-nct ");
     if (_wsPayload.size() > 0)
         dump_hex(os, "\t\tws queued payload:\n", "\t\t", _wsPayload);
 }
@@ -201,6 +203,10 @@ void StreamSocket::send(Poco::Net::HTTPResponse& response)
     response.set("User-Agent", HTTP_AGENT_STRING);
     response.set("Date", Poco::DateTimeFormatter::format(Poco::Timestamp(), Poco::DateTimeFormat::HTTP_FORMAT));
 
+    // Clients close after an HTTP/1.0 response, Poco's default.
+    if (_keepAlive)
+        response.setVersion(Poco::Net::HTTPMessage::HTTP_1_1);
+
     std::ostringstream oss;
     response.write(oss);
 
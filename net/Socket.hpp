@@ -565,6 +565,17 @@ public:
     /// Start the polling thread (if desired)
     void startThread();
 
+    /// Poll from the calling thread, by invoking poll(), instead of
+    /// starting a thread of our own (as the kit does).
+    void runOnClientThread()
+    {
+        assert(!_threadStarted);
+        _threadStarted = true;
+        _owner = std::this_thread::get_id();
+        LOG_DBG("Thread affinity of " << _name << " set to 0x" <<
+                std::hex << _owner << "." << std::dec);
+    }
+
     /// Stop and join the polling thread before returning (if active)
     void joinThread();
 
@@ -691,7 +702,9 @@ public:
         Socket(fd),
         _socketHandler(std::move(socketHandler)),
         _closed(false),
-        _shutdownSignalled(false)
+        _shutdownSignalled(false),
+        _keepAlive(false),
+        _responseEnded(false)
     {
         LOG_DBG("StreamSocket ctor #" << fd);
 
@@ -730,6 +743,29 @@ public:
         Socket::shutdown();
     }
 
+    /// Set for each HTTP request: whether the connection
+    /// may be kept for the next one, see endResponse().
+    void setKeepAlive(const bool keepAlive)
+    {
+        _keepAlive = keepAlive;
+        _responseEnded = false;
+    }
+
+    bool isKeepAlive() const { return _keepAlive; }
+
+    /// Ends the HTTP response just sent: shuts down, unless
+    /// the connection is kept for the next request.
+    void endResponse()
+    {
+        if (_keepAlive)
+            _responseEnded = true;
+        else
+            shutdown();
+    }
+
+    /// True once endResponse() kept the connection.
+    bool isResponseEnded() const { return _responseEnded; }
+
     int getPollEvents(std::chrono::steady_clock::time_point now,
                       int &timeoutMaxMs) override
     {
@@ -760,9 +796,16 @@ public:
     }
 
     /// Sends HTTP response.
-    /// Adds Date and User-Agent.
+    /// Adds Date and User-Agent, and makes it HTTP/1.1 when kept alive.
     void send(Poco::Net::HTTPResponse& response);
 
+    /// The number of bytes waiting to be written out.
+    size_t getOutBufferSize() const
+    {
+        assertCorrectThread();
+        return _outBuffer.size();
+    }
+
     /// Reads data by invoking readData() and buffering.
     /// Return false iff the socket is closed.
     virtual bool readIncomingData()
@@ -957,6 +1000,12 @@ protected:
     /// True when shutdown was requested via shutdown().
     bool _shutdownSignalled;
 
+    /// The HTTP connection is kept after the current response.
+    bool _keepAlive;
+
+    /// True when the handler ended its response with endResponse().
+    bool _responseEnded;
+
     std::vector< char > _inBuffer;
     std::vector< char > _outBuffer;
 
@@ -969,6 +1018,78 @@ protected:
     friend class SimpleResponseClient;
 };
 
+/// A StreamSocket over a Unix socket, which also
+/// receives the file descriptors the peer passes.
+class UnixStreamSocket : public StreamSocket
+{
+public:
+    UnixStreamSocket(const int fd, std::shared_ptr<SocketHandlerInterface> socketHandler) :
+        StreamSocket(fd, std::move(socketHandler))
+    {
+    }
+
+    ~UnixStreamSocket()
+    {
+        for (const int fd : _receivedFDs)
+            close(fd);
+    }
+
+    /// Returns the oldest received fd, which the caller then owns, or -1.
+    int takeReceivedFD()
+    {
+        if (_receivedFDs.empty())
+            return -1;
+
+        const int fd = _receivedFDs.front();
+        _receivedFDs.erase(_receivedFDs.begin());
+        return fd;
+    }
+
+    int readData(char* buf, int len) override
+    {
+        assertCorrectThread();
+
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = len;
+
+        char control[CMSG_SPACE(sizeof(int) * MaxFDs)];
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        const int rc = ::recvmsg(getFD(), &msg, MSG_CMSG_CLOEXEC);
+        if (rc > 0)
+        {
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                    continue;
+
+                const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (size_t i = 0; i < count; ++i)
+                {
+                    int fd;
+                    std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                    LOG_TRC("#" << getFD() << ": Received fd #" << fd << ".");
+                    _receivedFDs.push_back(fd);
+                }
+            }
+        }
+
+        return rc;
+    }
+
+private:
+    /// The most fds we accept in one read, extra ones are closed by the kernel.
+    static const int MaxFDs = 4;
+
+    std::vector<int> _receivedFDs;
+};
+
 namespace HttpHelper
 {
     /// Sends file as HTTP response.
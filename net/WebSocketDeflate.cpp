@@ -0,0 +1,350 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include "WebSocketDeflate.hpp"
+
+#include <time.h>
+
+#include <cstring>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+#include <Poco/StringTokenizer.h>
+
+#include "Log.hpp"
+#include "Util.hpp"
+
+bool WebSocketDeflate::Enabled = false;
+bool WebSocketDeflate::ContextTakeover = true;
+size_t WebSocketDeflate::MinSize = 256;
+int WebSocketDeflate::Level = 3;
+
+std::atomic<uint64_t> WebSocketDeflate::CompressedMessages(0);
+std::atomic<uint64_t> WebSocketDeflate::UncompressedMessages(0);
+std::atomic<uint64_t> WebSocketDeflate::DeflateInBytes(0);
+std::atomic<uint64_t> WebSocketDeflate::DeflateOutBytes(0);
+std::atomic<uint64_t> WebSocketDeflate::DeflateCpuUs(0);
+std::atomic<uint64_t> WebSocketDeflate::InflateInBytes(0);
+std::atomic<uint64_t> WebSocketDeflate::InflateOutBytes(0);
+std::atomic<uint64_t> WebSocketDeflate::InflateCpuUs(0);
+
+namespace
+{
+    /// The CPU time consumed by the calling thread, in microseconds.
+    uint64_t getThreadCpuUs()
+    {
+        timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+            return 0;
+
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    /// The empty stored block every compressed message ends with.
+    const unsigned char DeflateTail[] = { 0x00, 0x00, 0xff, 0xff };
+}
+
+WebSocketDeflate::WebSocketDeflate(int serverWindowBits, bool serverNoContextTakeover,
+                                   bool clientNoContextTakeover) :
+    _serverNoContextTakeover(serverNoContextTakeover),
+    _clientNoContextTakeover(clientNoContextTakeover)
+{
+    std::memset(&_deflate, 0, sizeof(_deflate));
+    std::memset(&_inflate, 0, sizeof(_inflate));
+
+    // Negative window bits for raw deflate, without the zlib header.
+    if (deflateInit2(&_deflate, Level, Z_DEFLATED, -serverWindowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("Failed to initialize deflate.");
+
+    // The client window is at most 15 bits, which we can always inflate.
+    if (inflateInit2(&_inflate, -15) != Z_OK)
+    {
+        deflateEnd(&_deflate);
+        throw std::runtime_error("Failed to initialize inflate.");
+    }
+}
+
+WebSocketDeflate::~WebSocketDeflate()
+{
+    deflateEnd(&_deflate);
+    inflateEnd(&_inflate);
+}
+
+void WebSocketDeflate::configure(bool enable, bool contextTakeover, size_t minSize, int level)
+{
+    Enabled = enable;
+    ContextTakeover = contextTakeover;
+    MinSize = minSize;
+    Level = std::min(std::max(level, 1), 9);
+
+    LOG_INF("WebSocket compression is " << (Enabled ? "enabled" : "disabled") <<
+            ", context takeover: " << ContextTakeover << ", min size: " << MinSize <<
+            " bytes, level: " << Level << ".");
+}
+
+std::unique_ptr<WebSocketDeflate> WebSocketDeflate::negotiate(const std::string& offers,
+                                                              std::string& response)
+{
+    response.clear();
+    if (!Enabled || offers.empty())
+        return nullptr;
+
+    Poco::StringTokenizer tokens(offers, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+    for (const auto& offer : tokens)
+    {
+        Poco::StringTokenizer params(offer, ";", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+        if (params.count() == 0 || params[0] != "permessage-deflate")
+            continue;
+
+        bool valid = true;
+        bool serverNoContextTakeover = !ContextTakeover;
+        bool clientNoContextTakeover = false;
+        int serverWindowBits = 15;
+        std::set<std::string> seen;
+        for (size_t i = 1; i < params.count() && valid; ++i)
+        {
+            std::string name = params[i];
+            std::string value;
+            const size_t eq = name.find('=');
+            if (eq != std::string::npos)
+            {
+                value = Util::trimmed(name.substr(eq + 1));
+                name = Util::trimmed(name.substr(0, eq));
+                if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+                    value = value.substr(1, value.size() - 2);
+            }
+
+            if (!seen.insert(name).second)
+            {
+                valid = false;
+            }
+            else if (name == "server_no_context_takeover" || name == "client_no_context_takeover")
+            {
+                valid = value.empty();
+                if (name[0] == 's')
+                    serverNoContextTakeover = true;
+                else
+                    clientNoContextTakeover = true;
+            }
+            else if (name == "server_max_window_bits" || name == "client_max_window_bits")
+            {
+                // The client may send client_max_window_bits without a value.
+                int bits = 15;
+                if (!value.empty() || name[0] == 's')
+                {
+                    try
+                    {
+                        bits = std::stoi(value);
+                    }
+                    catch (const std::exception&)
+                    {
+                        bits = 0;
+                    }
+                }
+
+                // zlib can't do a raw deflate with a window of 8 bits.
+                const int minBits = (name[0] == 's' ? 9 : 8);
+                valid = (bits >= minBits && bits <= 15);
+                if (name[0] == 's')
+                    serverWindowBits = bits;
+            }
+            else
+            {
+                valid = false;
+            }
+        }
+
+        if (!valid)
+        {
+            LOG_DBG("Declining WebSocket extension offer [" << offer << "].");
+            continue;
+        }
+
+        try
+        {
+            std::unique_ptr<WebSocketDeflate> deflate(new WebSocketDeflate(serverWindowBits,
+                                                                           serverNoContextTakeover,
+                                                                           clientNoContextTakeover));
+            response = "permessage-deflate";
+            if (serverNoContextTakeover)
+                response += "; server_no_context_takeover";
+            if (clientNoContextTakeover)
+                response += "; client_no_context_takeover";
+            if (serverWindowBits < 15)
+                response += "; server_max_window_bits=" + std::to_string(serverWindowBits);
+
+            LOG_DBG("Accepted WebSocket extension [" << response << "] for offer [" << offer << "].");
+            return deflate;
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_ERR("Failed to setup WebSocket compression: " << exc.what());
+            return nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+bool WebSocketDeflate::compress(const char* data, size_t len, std::vector<char>& out)
+{
+    const uint64_t startUs = getThreadCpuUs();
+
+    _deflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    _deflate.avail_in = len;
+
+    out.resize(deflateBound(&_deflate, len) + sizeof(DeflateTail));
+    size_t written = 0;
+    do
+    {
+        if (written == out.size())
+            out.resize(out.size() * 2);
+
+        _deflate.next_out = reinterpret_cast<Bytef*>(out.data() + written);
+        _deflate.avail_out = out.size() - written;
+
+        const int ret = deflate(&_deflate, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            LOG_ERR("Failed to deflate WebSocket message of " << len << " bytes: " << ret);
+            deflateReset(&_deflate);
+            ++UncompressedMessages;
+            return false;
+        }
+
+        written = out.size() - _deflate.avail_out;
+    }
+    while (_deflate.avail_out == 0);
+
+    // The tail is implied, the peer appends it back.
+    if (written >= sizeof(DeflateTail) &&
+        std::memcmp(out.data() + written - sizeof(DeflateTail), DeflateTail, sizeof(DeflateTail)) == 0)
+    {
+        written -= sizeof(DeflateTail);
+    }
+
+    out.resize(written);
+
+    DeflateCpuUs += getThreadCpuUs() - startUs;
+
+    if (_serverNoContextTakeover)
+    {
+        deflateReset(&_deflate);
+
+        // Nothing refers to this message later, so we may as well send it as-is.
+        if (written >= len)
+        {
+            ++UncompressedMessages;
+            return false;
+        }
+    }
+
+    ++CompressedMessages;
+    DeflateInBytes += len;
+    DeflateOutBytes += written;
+    return true;
+}
+
+bool WebSocketDeflate::decompress(const char* data, size_t len, bool fin, std::vector<char>& out,
+                                  const size_t maxSize)
+{
+    const uint64_t startUs = getThreadCpuUs();
+
+    out.clear();
+    if (!inflateChunk(reinterpret_cast<const unsigned char*>(data), len, out, maxSize))
+        return false;
+
+    if (fin)
+    {
+        if (!inflateChunk(DeflateTail, sizeof(DeflateTail), out, maxSize))
+            return false;
+
+        if (_clientNoContextTakeover)
+            inflateReset(&_inflate);
+    }
+
+    InflateCpuUs += getThreadCpuUs() - startUs;
+    InflateInBytes += len;
+    InflateOutBytes += out.size();
+    return true;
+}
+
+bool WebSocketDeflate::inflateChunk(const unsigned char* data, size_t len, std::vector<char>& out,
+                                    const size_t maxSize)
+{
+    _inflate.next_in = const_cast<Bytef*>(data);
+    _inflate.avail_in = len;
+
+    do
+    {
+        // A few compressed bytes may inflate to a lot: grow up to one byte over the limit only.
+        const size_t written = out.size();
+        if (written > maxSize)
+        {
+            LOG_WRN("WebSocket message inflates to more than " << maxSize << " bytes.");
+            return false;
+        }
+
+        out.resize(written + std::min<size_t>(std::max<size_t>(len * 4, 1024), maxSize + 1 - written));
+        _inflate.next_out = reinterpret_cast<Bytef*>(out.data() + written);
+        _inflate.avail_out = out.size() - written;
+
+        const int ret = inflate(&_inflate, Z_SYNC_FLUSH);
+        out.resize(out.size() - _inflate.avail_out);
+
+        if (ret == Z_STREAM_END)
+        {
+            // The peer finished the stream with a final block, start afresh.
+            inflateReset(&_inflate);
+        }
+        else if (ret == Z_BUF_ERROR)
+        {
+            if (_inflate.avail_out > 0)
+                break;
+        }
+        else if (ret != Z_OK)
+        {
+            LOG_ERR("Failed to inflate WebSocket message: " << ret);
+            return false;
+        }
+    }
+    while (_inflate.avail_in > 0 || _inflate.avail_out == 0);
+
+    return true;
+}
+
+std::string WebSocketDeflate::getStats()
+{
+    const uint64_t in = DeflateInBytes;
+    const uint64_t out = DeflateOutBytes;
+
+    std::ostringstream oss;
+    oss << "compressed=" << CompressedMessages
+        << " uncompressed=" << UncompressedMessages
+        << " in=" << in
+        << " out=" << out
+        << " ratio=" << std::fixed << std::setprecision(3) << (in ? static_cast<double>(out) / in : 1.0)
+        << " cpu_us=" << DeflateCpuUs
+        << " inflate_in=" << InflateInBytes
+        << " inflate_out=" << InflateOutBytes
+        << " inflate_cpu_us=" << InflateCpuUs;
+    return oss.str();
+}
+
+void WebSocketDeflate::dumpStats(std::ostream& os)
+{
+    os << "WebSocket compression: " << (Enabled ? "enabled" : "disabled")
+       << "\n\t" << getStats() << "\n";
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
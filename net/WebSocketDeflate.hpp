@@ -0,0 +1,97 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_WEBSOCKETDEFLATE_HPP
+#define INCLUDED_WEBSOCKETDEFLATE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+/// The RFC7692 permessage-deflate extension of one websocket.
+/// Only text messages of at least the configured size are compressed,
+/// tiles and other binary payloads are already compressed.
+/// Not thread-safe, owned by the WebSocketHandler of the connection.
+class WebSocketDeflate
+{
+public:
+    ~WebSocketDeflate();
+
+    /// Set the server-wide settings.
+    /// @param contextTakeover keep the compression context between
+    /// messages, which compresses much better, at the cost of ~300 KB
+    /// of zlib state per connection.
+    /// @param minSize smaller messages are sent uncompressed.
+    static void configure(bool enable, bool contextTakeover, size_t minSize, int level);
+
+    static bool isEnabled() { return Enabled; }
+
+    /// Parses the Sec-WebSocket-Extensions offers of the client
+    /// and accepts the first permessage-deflate one we support.
+    /// @param response is set to the Sec-WebSocket-Extensions of the reply.
+    /// @return nullptr if nothing was accepted.
+    static std::unique_ptr<WebSocketDeflate> negotiate(const std::string& offers,
+                                                       std::string& response);
+
+    /// True if a text message of the given size is worth compressing.
+    bool shouldCompress(size_t len) const { return len >= MinSize; }
+
+    /// Compresses a whole message, without the trailing 0x00 0x00 0xff 0xff.
+    /// @return false if the message should be sent uncompressed instead.
+    bool compress(const char* data, size_t len, std::vector<char>& out);
+
+    /// Decompresses a frame of a compressed message.
+    /// @param fin true for the last frame of the message.
+    /// @param maxSize stop inflating once out is larger than this.
+    /// @return false on corrupt data, or with out larger than maxSize.
+    bool decompress(const char* data, size_t len, bool fin, std::vector<char>& out, size_t maxSize);
+
+    bool hasContextTakeover() const { return !_serverNoContextTakeover; }
+
+    /// Compression ratio and CPU cost of all the connections.
+    static std::string getStats();
+    static void dumpStats(std::ostream& os);
+
+private:
+    WebSocketDeflate(int serverWindowBits, bool serverNoContextTakeover,
+                     bool clientNoContextTakeover);
+
+    bool inflateChunk(const unsigned char* data, size_t len, std::vector<char>& out, size_t maxSize);
+
+private:
+    z_stream _deflate;
+    z_stream _inflate;
+    const bool _serverNoContextTakeover;
+    const bool _clientNoContextTakeover;
+
+    static bool Enabled;
+    static bool ContextTakeover;
+    static size_t MinSize;
+    static int Level;
+
+    /// Sent messages.
+    static std::atomic<uint64_t> CompressedMessages;
+    static std::atomic<uint64_t> UncompressedMessages;
+    static std::atomic<uint64_t> DeflateInBytes;
+    static std::atomic<uint64_t> DeflateOutBytes;
+    static std::atomic<uint64_t> DeflateCpuUs;
+    /// Received messages.
+    static std::atomic<uint64_t> InflateInBytes;
+    static std::atomic<uint64_t> InflateOutBytes;
+    static std::atomic<uint64_t> InflateCpuUs;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
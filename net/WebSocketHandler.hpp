@@ -10,11 +10,19 @@
 #ifndef INCLUDED_WEBSOCKETHANDLER_HPP
 #define INCLUDED_WEBSOCKETHANDLER_HPP
 
+#include <cstring>
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 #include "Common.hpp"
 #include "Log.hpp"
 #include "Socket.hpp"
+#include "WebSocketDeflate.hpp"
 
 #include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/WebSocket.h>
 
 class WebSocketHandler : public SocketHandlerInterface
@@ -24,6 +32,9 @@ protected:
     std::weak_ptr<StreamSocket> _socket;
 
     const int InitialPingDelayMs = 25;
+
+    /// The largest message accepted from the peer, once inflated.
+    static constexpr size_t MaxMessageSize = 100 * 1024 * 1024;
     const int PingFrequencyMs = 18 * 1000;
     std::chrono::steady_clock::time_point _pingSent;
     int _pingTimeUs;
@@ -32,9 +43,13 @@ protected:
     bool _shuttingDown;
     enum class WSState { HTTP, WS } _wsState;
 
+    /// The permessage-deflate extension, if negotiated.
+    std::unique_ptr<WebSocketDeflate> _deflate;
+
     enum class WSFrameMask : unsigned char
     {
         Fin = 0x80,
+        Rsv1 = 0x40,
         Mask = 0x80
     };
 
@@ -43,22 +58,37 @@ public:
         _pingSent(std::chrono::steady_clock::now()),
         _pingTimeUs(0),
         _shuttingDown(false),
-        _wsState(WSState::HTTP)
+        _wsState(WSState::HTTP),
+        _wsMessageCode(WSOpCode::Text),
+        _wsFragmented(false),
+        _wsCompressed(false)
     {
     }
 
     /// Upgrades itself to a websocket directly.
+    /// @param allowCompression negotiate permessage-deflate, if enabled and offered.
     WebSocketHandler(const std::weak_ptr<StreamSocket>& socket,
-                     const Poco::Net::HTTPRequest& request) :
+                     const Poco::Net::HTTPRequest& request,
+                     const bool allowCompression = false) :
         _socket(socket),
         _pingSent(std::chrono::steady_clock::now() -
                   std::chrono::milliseconds(PingFrequencyMs) -
                   std::chrono::milliseconds(InitialPingDelayMs)),
         _pingTimeUs(0),
         _shuttingDown(false),
-        _wsState(WSState::HTTP)
+        _wsState(WSState::HTTP),
+        _wsMessageCode(WSOpCode::Text),
+        _wsFragmented(false),
+        _wsCompressed(false)
     {
-        upgradeToWebSocket(request);
+        upgradeToWebSocket(request, allowCompression);
+    }
+
+    /// Takes over the negotiated extensions, along with their
+    /// compression context, of the handler that did the upgrade.
+    void takeExtensions(WebSocketHandler& other)
+    {
+        _deflate = std::move(other._deflate);
     }
 
     /// Implementation of the SocketHandlerInterface.
@@ -126,6 +156,38 @@ public:
         sendFrame(socket, buf.data(), buf.size(), flags);
     }
 
+    /// Unmasks len bytes of payload from src into dst, a word at a time.
+    /// dst may be src itself, or before it in the same buffer, to decode in place.
+    static void unmask(char* dst, const char* src, const size_t len, const unsigned char mask[4])
+    {
+        size_t i = 0;
+
+#ifdef __SSE2__
+        uint32_t mask32;
+        std::memcpy(&mask32, mask, 4);
+        const __m128i mask128 = _mm_set1_epi32(mask32);
+        for (; i + 16 <= len; i += 16)
+        {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(chunk, mask128));
+        }
+#endif
+
+        uint64_t mask64;
+        std::memcpy(&mask64, mask, 4);
+        std::memcpy(reinterpret_cast<char*>(&mask64) + 4, mask, 4);
+        for (; i + 8 <= len; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, src + i, 8);
+            word ^= mask64;
+            std::memcpy(dst + i, &word, 8);
+        }
+
+        for (; i < len; ++i)
+            dst[i] = src[i] ^ mask[i % 4];
+    }
+
     bool handleOneIncomingMessage(const std::shared_ptr<StreamSocket>& socket)
     {
         assert(socket && "Expected a valid socket instance.");
@@ -143,6 +205,7 @@ public:
 
         unsigned char *p = reinterpret_cast<unsigned char*>(&socket->_inBuffer[0]);
         const bool fin = p[0] & 0x80;
+        const bool rsv1 = p[0] & 0x40;
         const WSOpCode code = static_cast<WSOpCode>(p[0] & 0x0f);
         const bool hasMask = p[1] & 0x80;
         size_t payloadLen = p[1] & 0x7f;
@@ -170,80 +233,131 @@ public:
             headerLen += 8;
         }
 
-        unsigned char *data, *mask;
+        // Control frames are small and never fragmented (RFC 6455 5.5),
+        // reject the others before trusting their length.
+        if (code >= WSOpCode::Close && (payloadLen > 125 || !fin))
+        {
+            LOG_ERR("#" << socket->getFD() << ": Invalid WebSocket control frame code " << code <<
+                    ", fin? " << fin << ", payload length: " << payloadLen << ".");
+            return protocolError(socket, StatusCodes::PROTOCOL_ERROR);
+        }
 
+        // Copy the mask, in-place decoding overwrites the header.
+        unsigned char mask[4] = { 0, 0, 0, 0 };
         if (hasMask)
         {
-            mask = p + headerLen;
+            if (len < headerLen + 4)
+                return false;
+
+            std::memcpy(mask, p + headerLen, 4);
             headerLen += 4;
         }
 
-        if (payloadLen + headerLen > len)
+        if (code < WSOpCode::Close && payloadLen > MaxMessageSize - _wsPayload.size())
+        {
+            LOG_ERR("#" << socket->getFD() << ": WebSocket message larger than " << MaxMessageSize << " bytes.");
+            return protocolError(socket, StatusCodes::PAYLOAD_TOO_BIG);
+        }
+
+        if (payloadLen > len - headerLen)
         { // partial read wait for more data.
             return false;
         }
 
-        data = p + headerLen;
+        const size_t frameLen = headerLen + payloadLen;
+        const char* data = &socket->_inBuffer[headerLen];
 
-        if (hasMask)
+        LOG_TRC("#" << socket->getFD() << ": Incoming WebSocket frame code " << code <<
+                ", fin? " << fin << ", mask? " << hasMask << ", payload length: " << payloadLen <<
+                ", residual socket data: " << len - frameLen << " bytes.");
+
+        if (code >= WSOpCode::Close)
         {
-            const size_t end = _wsPayload.size();
-            _wsPayload.resize(end + payloadLen);
-            char* wsData = &_wsPayload[end];
-            for (size_t i = 0; i < payloadLen; ++i)
-                *wsData++ = data[i] ^ mask[i % 4];
-        } else
-            _wsPayload.insert(_wsPayload.end(), data, data + payloadLen);
+            // Control frames are never fragmented, but may come in between
+            // the frames of a data message, so don't touch _wsPayload.
+            std::vector<char> control(payloadLen);
+            if (hasMask)
+                unmask(control.data(), data, payloadLen, mask);
+            else
+                std::copy(data, data + payloadLen, control.begin());
 
-        assert(_wsPayload.size() >= payloadLen);
+            socket->_inBuffer.erase(socket->_inBuffer.begin(), socket->_inBuffer.begin() + frameLen);
 
-        socket->_inBuffer.erase(socket->_inBuffer.begin(), socket->_inBuffer.begin() + headerLen + payloadLen);
+            if (rsv1)
+            {
+                LOG_ERR("#" << socket->getFD() << ": Invalid WebSocket control frame code " << code << ".");
+                return protocolError(socket, StatusCodes::PROTOCOL_ERROR);
+            }
 
-        // FIXME: fin, aggregating payloads into _wsPayload etc.
-        LOG_TRC("#" << socket->getFD() << ": Incoming WebSocket message code " << code <<
-                ", fin? " << fin << ", mask? " << hasMask << ", payload length: " << _wsPayload.size() <<
-                ", residual socket data: " << socket->_inBuffer.size() << " bytes.");
+            handleControlMessage(socket, code, control);
+            return true;
+        }
 
-        switch (code)
+        // Only the first frame of a data message may be flagged as compressed.
+        const bool isContinuation = (code == WSOpCode::Continuation);
+        if ((rsv1 && (!_deflate || isContinuation)) || isContinuation != _wsFragmented)
         {
-        case WSOpCode::Pong:
-            _pingTimeUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _pingSent).count();
-            LOG_TRC("#" << socket->getFD() << ": Pong received: " << _pingTimeUs << " microseconds");
-            break;
-        case WSOpCode::Ping:
-            LOG_ERR("#" << socket->getFD() << ": Clients should not send pings, only servers");
-            // drop through
-        case WSOpCode::Close:
-            if (!_shuttingDown)
-            {
-                // Peer-initiated shutdown must be echoed.
-                // Otherwise, this is the echo to _our_ shutdown message, which we should ignore.
-                const StatusCodes statusCode = static_cast<StatusCodes>((((uint64_t)(unsigned char)_wsPayload[0]) << 8) +
-                                                                        (((uint64_t)(unsigned char)_wsPayload[1]) << 0));
-                LOG_TRC("#" << socket->getFD() << ": Client initiated socket shutdown. Code: " << static_cast<int>(statusCode));
-                if (_wsPayload.size() > 2)
-                {
-                    const std::string message(&_wsPayload[2], &_wsPayload[2] + _wsPayload.size() - 2);
-                    shutdown(statusCode, message);
-                }
-                else
-                {
-                    shutdown(statusCode);
-                }
-            }
+            LOG_ERR("#" << socket->getFD() << ": Unexpected WebSocket frame code " << code <<
+                    ", rsv1? " << rsv1 << ", while " << (_wsFragmented ? "" : "not ") << "fragmented.");
+            return protocolError(socket, StatusCodes::PROTOCOL_ERROR);
+        }
+
+        if (!isContinuation)
+        {
+            _wsMessageCode = code;
+            _wsCompressed = rsv1;
+        }
+
+        if (fin && _wsPayload.empty() && frameLen == len)
+        {
+            // The common case: a complete message alone in the buffer.
+            // Decode it in place, over the header, and hand the buffer over.
+            char* payload = &socket->_inBuffer[0];
+            if (hasMask)
+                unmask(payload, data, payloadLen, mask);
             else
+                std::memmove(payload, data, payloadLen);
+
+            socket->_inBuffer.resize(payloadLen);
+            _wsPayload.swap(socket->_inBuffer);
+        }
+        else
+        {
+            // Append the fragment, the only copy it takes.
+            const size_t end = _wsPayload.size();
+            _wsPayload.resize(end + payloadLen);
+            if (hasMask)
+                unmask(&_wsPayload[end], data, payloadLen, mask);
+            else
+                std::copy(data, data + payloadLen, _wsPayload.begin() + end);
+
+            socket->_inBuffer.erase(socket->_inBuffer.begin(), socket->_inBuffer.begin() + frameLen);
+        }
+
+        _wsFragmented = !fin;
+        if (!fin)
+        {
+            // Wait for the continuation frames.
+            return true;
+        }
+
+        if (_wsCompressed)
+        {
+            std::vector<char> inflated;
+            if (!_deflate->decompress(_wsPayload.data(), _wsPayload.size(), true, inflated, MaxMessageSize))
             {
-                LOG_TRC("#" << socket->getFD() << ": Client responded to our shutdown.");
+                return protocolError(socket, inflated.size() > MaxMessageSize ? StatusCodes::PAYLOAD_TOO_BIG
+                                                                              : StatusCodes::MALFORMED_PAYLOAD);
             }
 
-            // TCP Close.
-            socket->closeConnection();
-            break;
-        default:
-            handleMessage(fin, code, _wsPayload);
-            break;
+            _wsPayload.swap(inflated);
         }
 
+        LOG_TRC("#" << socket->getFD() << ": Incoming WebSocket message code " << _wsMessageCode <<
+                ", payload length: " << _wsPayload.size() << ".");
+
+        handleMessage(true, _wsMessageCode, _wsPayload);
+
         _wsPayload.clear();
 
         return true;
@@ -316,19 +430,89 @@ public:
     }
 
     /// Sends a WebSocket message of WPOpCode type.
+    /// Text messages are compressed if permessage-deflate was negotiated.
     /// Returns the number of bytes written (including frame overhead) on success,
-    /// 0 for closed/invalid socket, and -1 for other errors.
+    /// counting the uncompressed length of the payload, 0 for closed/invalid socket,
+    /// and -1 for other errors.
     int sendMessage(const char* data, const size_t len, const WSOpCode code, const bool flush = true) const
     {
         //TODO: Support fragmented messages.
         static const unsigned char Fin = static_cast<unsigned char>(WSFrameMask::Fin);
+        static const unsigned char Rsv1 = static_cast<unsigned char>(WSFrameMask::Rsv1);
 
         auto socket = _socket.lock();
+        if (_deflate && code == WSOpCode::Text && data != nullptr && _deflate->shouldCompress(len))
+        {
+            std::vector<char> compressed;
+            if (_deflate->compress(data, len, compressed) && !compressed.empty())
+            {
+                const int size = sendFrame(socket, compressed.data(), compressed.size(),
+                                           static_cast<unsigned char>(Fin | Rsv1 | code), flush);
+                return (size > 0 ? size - compressed.size() + len : size);
+            }
+        }
+
         return sendFrame(socket, data, len, static_cast<unsigned char>(Fin | code), flush);
     }
 
 protected:
 
+    /// Handles a Close, Ping or Pong frame.
+    void handleControlMessage(const std::shared_ptr<StreamSocket>& socket, const WSOpCode code,
+                              const std::vector<char>& payload)
+    {
+        switch (code)
+        {
+        case WSOpCode::Pong:
+            _pingTimeUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _pingSent).count();
+            LOG_TRC("#" << socket->getFD() << ": Pong received: " << _pingTimeUs << " microseconds");
+            break;
+        case WSOpCode::Ping:
+            LOG_ERR("#" << socket->getFD() << ": Clients should not send pings, only servers");
+            // drop through
+        case WSOpCode::Close:
+            if (!_shuttingDown)
+            {
+                // Peer-initiated shutdown must be echoed.
+                // Otherwise, this is the echo to _our_ shutdown message, which we should ignore.
+                StatusCodes statusCode = StatusCodes::RESERVED_NO_STATUS_CODE;
+                if (payload.size() >= 2)
+                    statusCode = static_cast<StatusCodes>((((uint64_t)(unsigned char)payload[0]) << 8) +
+                                                          (((uint64_t)(unsigned char)payload[1]) << 0));
+                LOG_TRC("#" << socket->getFD() << ": Client initiated socket shutdown. Code: " << static_cast<int>(statusCode));
+                if (payload.size() > 2)
+                {
+                    const std::string message(&payload[2], &payload[2] + payload.size() - 2);
+                    shutdown(statusCode, message);
+                }
+                else
+                {
+                    shutdown(statusCode);
+                }
+            }
+            else
+            {
+                LOG_TRC("#" << socket->getFD() << ": Client responded to our shutdown.");
+            }
+
+            // TCP Close.
+            socket->closeConnection();
+            break;
+        default:
+            break;
+        }
+    }
+
+    /// Drops the message in progress and closes the connection.
+    bool protocolError(const std::shared_ptr<StreamSocket>& socket, const StatusCodes statusCode)
+    {
+        _wsPayload.clear();
+        _wsFragmented = false;
+        shutdown(statusCode);
+        socket->closeConnection();
+        return false;
+    }
+
     /// Sends a WebSocket frame given the data, length, and flags.
     /// Returns the number of bytes written (including frame overhead) on success,
     /// 0 for closed/invalid socket, and -1 for other errors.
@@ -394,11 +578,92 @@ private:
         {
             return computeAccept(key);
         }
+
+        static std::string doCreateKey()
+        {
+            return createKey();
+        }
     };
 
+public:
+    /// Upgrades a connected, blocking, socket to a websocket, as a client.
+    /// Only for the kits connecting back to us, before they start polling.
+    /// The response is read a byte at a time, so that nothing past it,
+    /// which the poll will read, is consumed. Returns true on success only.
+    static bool upgradeClientSocket(const int fd, const std::string& uri)
+    {
+        const std::string key = PublicComputeAccept::doCreateKey();
+
+        std::ostringstream oss;
+        oss << "GET " << uri << " HTTP/1.1\r\n"
+            << "Connection: Upgrade\r\n"
+            << "Upgrade: websocket\r\n"
+            << "Sec-WebSocket-Version: 13\r\n"
+            << "Sec-WebSocket-Key: " << key << "\r\n"
+            << "\r\n";
+        const std::string request = oss.str();
+
+        // Don't wait forever for the response.
+        struct timeval timeout = { 10, 0 };
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        size_t written = 0;
+        while (written < request.size())
+        {
+            const ssize_t rc = ::write(fd, request.data() + written, request.size() - written);
+            if (rc < 0 && errno == EINTR)
+                continue;
+
+            if (rc <= 0)
+            {
+                LOG_SYS("#" << fd << ": Failed to send WS Upgrade request.");
+                return false;
+            }
+
+            written += rc;
+        }
+
+        std::string response;
+        while (response.size() < 4 || response.compare(response.size() - 4, 4, "\r\n\r\n") != 0)
+        {
+            char c;
+            const ssize_t rc = ::read(fd, &c, 1);
+            if (rc < 0 && errno == EINTR)
+                continue;
+
+            if (rc <= 0 || response.size() >= static_cast<size_t>(READ_BUFFER_SIZE))
+            {
+                LOG_SYS("#" << fd << ": Failed to read WS Upgrade response.");
+                return false;
+            }
+
+            response += c;
+        }
+
+        try
+        {
+            std::istringstream iss(response);
+            Poco::Net::HTTPResponse res;
+            res.read(iss);
+            if (res.getStatus() == Poco::Net::HTTPResponse::HTTP_SWITCHING_PROTOCOLS &&
+                res.get("Sec-WebSocket-Accept", "") == PublicComputeAccept::doComputeAccept(key))
+            {
+                LOG_TRC("#" << fd << ": Upgraded to WebSocket.");
+                return true;
+            }
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_ERR("#" << fd << ": Invalid WS Upgrade response: " << exc.what());
+        }
+
+        LOG_ERR("#" << fd << ": WS Upgrade refused: " << response);
+        return false;
+    }
+
 protected:
     /// Upgrade the http(s) connection to a websocket.
-    void upgradeToWebSocket(const Poco::Net::HTTPRequest& req)
+    void upgradeToWebSocket(const Poco::Net::HTTPRequest& req, const bool allowCompression = false)
     {
         auto socket = _socket.lock();
         if (socket == nullptr)
@@ -420,12 +685,18 @@ protected:
             socket->setSocketBufferSize(0);
 #endif
 
+        std::string wsExtensions;
+        if (allowCompression)
+            _deflate = WebSocketDeflate::negotiate(req.get("Sec-WebSocket-Extensions", ""), wsExtensions);
+
         std::ostringstream oss;
         oss << "HTTP/1.1 101 Switching Protocols\r\n"
             << "Upgrade: websocket\r\n"
             << "Connection: Upgrade\r\n"
-            << "Sec-WebSocket-Accept: " << PublicComputeAccept::doComputeAccept(wsKey) << "\r\n"
-            << "\r\n";
+            << "Sec-WebSocket-Accept: " << PublicComputeAccept::doComputeAccept(wsKey) << "\r\n";
+        if (!wsExtensions.empty())
+            oss << "Sec-WebSocket-Extensions: " << wsExtensions << "\r\n";
+        oss << "\r\n";
 
         const std::string res = oss.str();
         LOG_TRC("#" << socket->getFD() << ": Sending WS Upgrade response: " << res);
@@ -437,6 +708,12 @@ protected:
         // but do reset the time to avoid pinging immediately after.
         _pingSent = std::chrono::steady_clock::now();
     }
+
+private:
+    /// The message being reassembled from its frames.
+    WSOpCode _wsMessageCode;
+    bool _wsFragmented;
+    bool _wsCompressed;
 };
 
 #endif
@@ -0,0 +1,141 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+// Microbenchmark of the Message construction on the kit-to-client
+// path: the allocations and time per message when the tokens, first
+// line and abbreviation are all built, as they used to be upfront,
+// against only forwarding the copied or adopted payload.
+
+#include "config.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "Log.hpp"
+#include "Message.hpp"
+
+namespace
+{
+    std::atomic<size_t> Allocations(0);
+}
+
+void* operator new(std::size_t size)
+{
+    ++Allocations;
+    void* p = std::malloc(size ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace
+{
+
+enum class Mode { Eager, Copy, Adopt };
+
+const char* toString(const Mode mode)
+{
+    switch (mode)
+    {
+        case Mode::Eager: return "eager";
+        case Mode::Copy: return "lazy copy";
+        case Mode::Adopt: return "lazy adopt";
+    }
+
+    return "";
+}
+
+void bench(const std::string& name, const std::vector<char>& payload, const Mode mode, const size_t iterations)
+{
+    size_t allocations = 0;
+    std::chrono::steady_clock::duration elapsed(0);
+    size_t check = 0;
+    for (size_t n = 0; n < iterations; ++n)
+    {
+        // The socket hands over a buffer of its own, don't count it.
+        std::vector<char> buffer(payload);
+
+        const size_t before = Allocations;
+        const auto start = std::chrono::steady_clock::now();
+
+        const auto message = (mode == Mode::Adopt
+                              ? std::make_shared<Message>(std::move(buffer), Message::Dir::Out)
+                              : std::make_shared<Message>(buffer.data(), buffer.size(), Message::Dir::Out));
+        if (mode == Mode::Eager)
+        {
+            check += message->tokens().size();
+            check += message->firstLine().size();
+            check += message->abbr().size();
+        }
+
+        check += message->forwardToken().size() + message->size();
+
+        elapsed += std::chrono::steady_clock::now() - start;
+        allocations += Allocations - before;
+    }
+
+    const double usecs = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    std::cout << std::setw(10) << name << " " << std::setw(10) << toString(mode) << ": "
+              << std::fixed << std::setprecision(2) << static_cast<double>(allocations) / iterations
+              << " allocs/msg, " << std::setprecision(3) << usecs / iterations << " us/msg"
+              << (check == 0 ? " (empty)" : "") << "\n";
+}
+
+std::vector<char> makePayload(const std::string& firstLine, const size_t binarySize)
+{
+    std::vector<char> payload(firstLine.begin(), firstLine.end());
+    for (size_t i = 0; i < binarySize; ++i)
+        payload.push_back(static_cast<char>(std::rand()));
+    return payload;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    const bool verbose = (argc > 1 && std::string("--verbose") == argv[1]);
+    Log::initialize("bench", verbose ? "trace" : "error", false, false, {});
+
+    const std::vector<char> tile = makePayload(
+        "tile: part=0 width=256 height=256 tileposx=0 tileposy=3840 "
+        "tilewidth=3840 tileheight=3840 ver=42 imgsize=32768\n", 32 * 1024);
+    const std::vector<char> invalidate = makePayload(
+        "client-0042 invalidatecursor: 1418, 1418, 0, 275", 0);
+    const std::vector<char> status = makePayload(
+        "client-all statechanged: .uno:Bold=false", 0);
+
+    const size_t iterations = 100000;
+    for (const Mode mode : { Mode::Eager, Mode::Copy, Mode::Adopt })
+    {
+        bench("tile", tile, mode, iterations);
+        bench("cursor", invalidate, mode, iterations);
+        bench("status", status, mode, iterations);
+    }
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,164 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+// Microbenchmark of the dispatch of incoming client messages: the
+// allocations and time per message to tokenize the first line, find
+// the command and parse a key=value argument, with copied tokens and
+// a chain of string comparisons, as the sessions used to, against
+// token views and a CommandTable lookup.
+
+#include "config.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "Protocol.hpp"
+
+namespace
+{
+    std::atomic<size_t> Allocations(0);
+}
+
+void* operator new(std::size_t size)
+{
+    ++Allocations;
+    void* p = std::malloc(size ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace
+{
+
+enum class Mode { Chain, Table };
+
+const char* toString(const Mode mode)
+{
+    switch (mode)
+    {
+        case Mode::Chain: return "if-chain";
+        case Mode::Table: return "table";
+    }
+
+    return "";
+}
+
+/// The commands of ClientSession, in the order it used to compare them.
+const std::vector<std::string> CommandNames = {
+    "canceltiles", "clientzoom", "clientvisiblearea", "commandvalues", "closedocument",
+    "downloadas", "getchildid", "gettextselection", "paste", "insertfile", "key", "mouse",
+    "partpagerectangles", "ping", "renderfont", "requestloksession", "resetselection",
+    "save", "saveas", "selectgraphic", "selecttext", "setclientpart", "setpage", "status",
+    "tile", "tilecombine", "uno", "useractive", "userinactive"
+};
+
+const LOOLProtocol::CommandTable<int> Commands({
+        { "canceltiles", 0 }, { "clientzoom", 1 }, { "clientvisiblearea", 2 },
+        { "commandvalues", 3 }, { "closedocument", 4 }, { "downloadas", 5 },
+        { "getchildid", 6 }, { "gettextselection", 7 }, { "paste", 8 }, { "insertfile", 9 },
+        { "key", 10 }, { "mouse", 11 }, { "partpagerectangles", 12 }, { "ping", 13 },
+        { "renderfont", 14 }, { "requestloksession", 15 }, { "resetselection", 16 },
+        { "save", 17 }, { "saveas", 18 }, { "selectgraphic", 19 }, { "selecttext", 20 },
+        { "setclientpart", 21 }, { "setpage", 22 }, { "status", 23 }, { "tile", 24 },
+        { "tilecombine", 25 }, { "uno", 26 }, { "useractive", 27 }, { "userinactive", 28 } },
+    -1);
+
+size_t dispatchChain(const std::string& message)
+{
+    const std::string firstLine = LOOLProtocol::getFirstLine(message.data(), message.size());
+    const std::vector<std::string> tokens = LOOLProtocol::tokenize(firstLine.data(), firstLine.size());
+
+    size_t command = 0;
+    while (command < CommandNames.size() && tokens[0] != CommandNames[command])
+        ++command;
+
+    std::string value;
+    if (tokens.size() > 1)
+        LOOLProtocol::getTokenString(tokens[1], "type", value);
+
+    return command + value.size();
+}
+
+size_t dispatchTable(const std::string& message)
+{
+    const LOOLProtocol::Tokens tokens(message);
+    const int command = Commands.lookup(tokens[0]);
+
+    LOOLProtocol::StringView name;
+    LOOLProtocol::StringView value;
+    if (LOOLProtocol::parseNameValuePair(tokens[1], name, value) && name != "type")
+        value = LOOLProtocol::StringView();
+
+    return command + value.size();
+}
+
+void bench(const std::string& message, const Mode mode, const size_t iterations)
+{
+    size_t allocations = 0;
+    std::chrono::steady_clock::duration elapsed(0);
+    size_t check = 0;
+    for (size_t n = 0; n < iterations; ++n)
+    {
+        const size_t before = Allocations;
+        const auto start = std::chrono::steady_clock::now();
+
+        check += (mode == Mode::Chain ? dispatchChain(message) : dispatchTable(message));
+
+        elapsed += std::chrono::steady_clock::now() - start;
+        allocations += Allocations - before;
+    }
+
+    const double usecs = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1000.;
+    std::cout << std::setw(18) << LOOLProtocol::Tokens(message)[0].toString() << " " << std::setw(8) << toString(mode) << ": "
+              << std::fixed << std::setprecision(2) << static_cast<double>(allocations) / iterations
+              << " allocs/msg, " << std::setprecision(3) << usecs / iterations << " us/msg"
+              << (check == 0 ? " (empty)" : "") << "\n";
+}
+
+}
+
+int main(int, char**)
+{
+    const std::vector<std::string> messages = {
+        "tile part=0 width=256 height=256 tileposx=0 tileposy=3840 tilewidth=3840 tileheight=3840 ver=42",
+        "key type=input char=97 key=0",
+        "mouse type=buttondown x=5000 y=7000 count=1 buttons=1 modifier=0",
+        "uno .uno:Bold",
+        "userinactive",
+        "clientvisiblearea x=0 y=0 width=20000 height=11000"
+    };
+
+    const size_t iterations = 200000;
+    for (const Mode mode : { Mode::Chain, Mode::Table })
+    {
+        for (const std::string& message : messages)
+            bench(message, mode, iterations);
+    }
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
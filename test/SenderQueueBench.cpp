@@ -0,0 +1,169 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+// Microbenchmark of the SenderQueue of a slow client: enqueueing
+// tiles and cursor invalidations over a deep queue, with and without
+// duplicates, then draining it; compared to the linear scan that
+// used to deduplicate them.
+
+#include "config.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Log.hpp"
+#include "Message.hpp"
+#include "SenderQueue.hpp"
+#include "TileDesc.hpp"
+
+namespace
+{
+
+typedef std::shared_ptr<Message> Item;
+
+/// The deduplication SenderQueue used to do, by scanning.
+class LinearQueue
+{
+public:
+    size_t enqueue(const Item& item)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (item->firstToken() == "tile:")
+        {
+            const TileDesc newTile = TileDesc::parse(item->firstLine());
+            const auto pos = std::find_if(_queue.begin(), _queue.end(),
+                [&newTile](const Item& cur)
+                {
+                    return cur->firstToken() == "tile:" &&
+                           newTile == TileDesc::parse(cur->firstLine());
+                });
+
+            if (pos != _queue.end())
+                _queue.erase(pos);
+        }
+        else if (item->firstToken() == "invalidatecursor:")
+        {
+            const auto pos = std::find_if(_queue.begin(), _queue.end(),
+                [](const Item& cur)
+                {
+                    return cur->firstToken() == "invalidatecursor:";
+                });
+
+            if (pos != _queue.end())
+                _queue.erase(pos);
+        }
+
+        _queue.push_back(item);
+        return _queue.size();
+    }
+
+    bool dequeue(Item& item)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_queue.empty())
+            return false;
+
+        item = _queue.front();
+        _queue.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex _mutex;
+    std::deque<Item> _queue;
+};
+
+std::vector<Item> makeTiles(const size_t count, const int ver)
+{
+    std::vector<Item> tiles;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const std::string tile = "tile: part=0 width=256 height=256 tileposx=" + std::to_string((i % 64) * 3840) +
+                                 " tileposy=" + std::to_string((i / 64) * 3840) +
+                                 " tilewidth=3840 tileheight=3840 ver=" + std::to_string(ver);
+        tiles.push_back(std::make_shared<Message>(tile, Message::Dir::Out));
+    }
+
+    return tiles;
+}
+
+template <typename Queue>
+void bench(const std::string& name, const size_t depth, const size_t iterations)
+{
+    // The same tiles, rendered again, supersede the queued ones.
+    const std::vector<Item> queued = makeTiles(depth, 1);
+    const std::vector<Item> updated = makeTiles(depth, 2);
+    const Item cursor = std::make_shared<Message>("invalidatecursor: 1418, 1418, 0, 275", Message::Dir::Out);
+
+    std::chrono::steady_clock::duration enqueue(0);
+    std::chrono::steady_clock::duration dedup(0);
+    std::chrono::steady_clock::duration dequeue(0);
+    size_t sent = 0;
+    for (size_t n = 0; n < iterations; ++n)
+    {
+        Queue queue;
+
+        auto start = std::chrono::steady_clock::now();
+        for (const Item& item : queued)
+        {
+            queue.enqueue(item);
+            queue.enqueue(cursor);
+        }
+        enqueue += std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for (const Item& item : updated)
+            queue.enqueue(item);
+        dedup += std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        Item item;
+        while (queue.dequeue(item))
+            ++sent;
+        dequeue += std::chrono::steady_clock::now() - start;
+    }
+
+    const auto perOp = [iterations, depth](const std::chrono::steady_clock::duration elapsed, const size_t ops)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / double(iterations * ops);
+    };
+
+    std::cout << std::setw(8) << name << " depth " << std::setw(5) << depth << ": "
+              << std::fixed << std::setprecision(0)
+              << "enqueue " << std::setw(8) << perOp(enqueue, 2 * depth) << " ns, "
+              << "dedup " << std::setw(8) << perOp(dedup, depth) << " ns, "
+              << "dequeue " << std::setw(6) << perOp(dequeue, sent / iterations) << " ns/msg ("
+              << sent / iterations << " sent)\n";
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    const bool verbose = (argc > 1 && std::string("--verbose") == argv[1]);
+    Log::initialize("bench", verbose ? "trace" : "error", false, false, {});
+
+    for (const size_t depth : { 16, 256, 2048 })
+    {
+        const size_t iterations = std::max<size_t>(1, 16384 / depth);
+        bench<SenderQueue<Item>>("indexed", depth, iterations);
+        bench<LinearQueue>("linear", depth, depth > 256 ? 1 : iterations);
+    }
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
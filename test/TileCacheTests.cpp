@@ -56,6 +56,7 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST_SUITE(TileCacheTests);
 
     CPPUNIT_TEST(testSimple);
+    CPPUNIT_TEST(testPrefetch);
     CPPUNIT_TEST(testSimpleCombine);
     CPPUNIT_TEST(testPerformance);
     CPPUNIT_TEST(testCancelTiles);
@@ -81,6 +82,7 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST_SUITE_END();
 
     void testSimple();
+    void testPrefetch();
     void testSimpleCombine();
     void testPerformance();
     void testCancelTiles();
@@ -194,6 +196,51 @@ void TileCacheTests::testSimple()
     CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !file);
 }
 
+void TileCacheTests::testPrefetch()
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::Wsd, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    TileCache tc("doc.ods", Poco::Timestamp(), "/tmp/tile_cache_tests_prefetch");
+
+    TileDesc cached(0, 256, 256, 0, 0, 3840, 3840, -1, 0, -1, false);
+    TileDesc first(0, 256, 256, 0, 3840, 3840, 3840, -1, 0, -1, false);
+    first.setVersion(1);
+    TileDesc second(0, 256, 256, 3840, 3840, 3840, 3840, -1, 0, -1, false);
+    second.setVersion(2);
+
+    // Cached tiles are not prefetched.
+    const auto size = 1024;
+    const auto data = genRandomData(size);
+    tc.saveTileAndNotify(cached, data.data(), size);
+    CPPUNIT_ASSERT_MESSAGE("prefetched a cached tile", !tc.prefetchTile(cached));
+
+    // The others are requested from the kit once.
+    CPPUNIT_ASSERT_MESSAGE("tile not prefetched", tc.prefetchTile(first));
+    CPPUNIT_ASSERT_MESSAGE("tile not prefetched", tc.prefetchTile(second));
+    CPPUNIT_ASSERT_MESSAGE("tile prefetched twice", !tc.prefetchTile(first));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), tc.getPrefetchCount());
+    CPPUNIT_ASSERT(tc.hasTilesBeingRendered());
+
+    // Once rendered, the prefetched tile is served to the client from the cache.
+    tc.saveTileAndNotify(first, data.data(), size);
+    auto file = tc.lookupTile(first);
+    CPPUNIT_ASSERT_MESSAGE("prefetched tile not found", file && file->is_open());
+    CPPUNIT_ASSERT_MESSAGE("prefetched tile corrupted", data == readDataFromFile(file));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), tc.getPrefetchHitCount());
+
+    // A client request cancels the rest, so that it doesn't wait behind them.
+    CPPUNIT_ASSERT_EQUAL(std::string("canceltiles 2,"), tc.cancelPrefetch());
+    CPPUNIT_ASSERT(!tc.hasTilesBeingRendered());
+    CPPUNIT_ASSERT_EQUAL(std::string(), tc.cancelPrefetch());
+
+    // Until it is prefetched again.
+    CPPUNIT_ASSERT_MESSAGE("cancelled tile not prefetched", tc.prefetchTile(second));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), tc.getPrefetchHitCount());
+}
+
 void TileCacheTests::testSimpleCombine()
 {
     const auto testname = "simpleCombine ";
@@ -205,16 +252,13 @@ void TileCacheTests::testSimpleCombine()
 
     sendTextFrame(socket1, "tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 tilewidth=3840 tileheight=3840");
 
-    auto tile1a = getResponseMessage(socket1, "tile:");
-    CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile1a.empty());
-    auto tile1b = getResponseMessage(socket1, "tile:");
-    CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile1b.empty());
+    auto tiles1 = getTileMessages(socket1, 2);
+    CPPUNIT_ASSERT_EQUAL_MESSAGE("did not receive the tiles as expected", static_cast<size_t>(2), tiles1.size());
     sendTextFrame(socket1, "tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 tilewidth=3840 tileheight=3840");
 
-    tile1a = getResponseMessage(socket1, "tile:");
-    CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile1a.empty());
-    tile1b = getResponseMessage(socket1, "tile:");
-    CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile1b.empty());
+    // Both cached now.
+    tiles1 = getTileMessages(socket1, 2);
+    CPPUNIT_ASSERT_EQUAL_MESSAGE("did not receive the tiles as expected", static_cast<size_t>(2), tiles1.size());
 
     // Second.
     std::cerr << "Connecting second client." << std::endl;
@@ -222,10 +266,8 @@ void TileCacheTests::testSimpleCombine()
 
     sendTextFrame(socket2, "tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 tilewidth=3840 tileheight=3840");
 
-    auto tile2a = getResponseMessage(socket2, "tile:");
-    CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile2a.empty());
-    auto tile2b = getResponseMessage(socket2, "tile:");
-    CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile2b.empty());
+    const auto tiles2 = getTileMessages(socket2, 2);
+    CPPUNIT_ASSERT_EQUAL_MESSAGE("did not receive the tiles as expected", static_cast<size_t>(2), tiles2.size());
 }
 
 void TileCacheTests::testPerformance()
@@ -236,11 +278,8 @@ void TileCacheTests::testPerformance()
     for (auto x = 0; x < 5; ++x)
     {
         sendTextFrame(socket, "tilecombine part=0 width=256 height=256 tileposx=0,3840,7680,11520,0,3840,7680,11520 tileposy=0,0,0,0,3840,3840,3840,3840 tilewidth=3840 tileheight=3840");
-        for (auto i = 0; i < 8; ++i)
-        {
-            auto tile = getResponseMessage(socket, "tile:", "tile-performance ");
-            CPPUNIT_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile.empty());
-        }
+        const auto tiles = getTileMessages(socket, 8, "tile-performance ");
+        CPPUNIT_ASSERT_EQUAL_MESSAGE("did not receive the tiles as expected", static_cast<size_t>(8), tiles.size());
     }
 
     std::cerr << "Tile rendering roundtrip for 5 x 8 tiles combined: " << timestamp.elapsed() / 1000.
@@ -323,10 +362,7 @@ void TileCacheTests::testCancelTilesMultiView()
             continue;
         }
 
-        for (auto i = 0; i < 4; ++i)
-        {
-            getTileMessage(*socket2, "cancelTilesMultiView-2 ");
-        }
+        getTileMessages(socket2, 4, "cancelTilesMultiView-2 ");
 
         // Should never get more than 4 tiles on socket2.
         // Though in practice we get the rendering result from socket1's request and ours.
@@ -419,11 +455,8 @@ void TileCacheTests::testUnresponsiveClient()
 
         // Verify that we get all 8 tiles.
         sendTextFrame(socket2, "tilecombine part=0 width=256 height=256 tileposx=0,3840,7680,11520,0,3840,7680,11520 tileposy=0,0,0,0,3840,3840,3840,3840 tilewidth=3840 tileheight=3840");
-        for (auto i = 0; i < 8; ++i)
-        {
-            auto tile = getResponseMessage(socket2, "tile:", "client2 ");
-            CPPUNIT_ASSERT_MESSAGE("Did not receive tile #" + std::to_string(i+1) + " of 8: message as expected", !tile.empty());
-        }
+        const auto tiles = getTileMessages(socket2, 8, "client2 ");
+        CPPUNIT_ASSERT_EQUAL_MESSAGE("Did not receive all 8 tiles as expected", static_cast<size_t>(8), tiles.size());
     }
 }
 
@@ -513,20 +546,14 @@ void TileCacheTests::testTilesRenderedJustOnce()
 
         // Get same 3 tiles.
         sendTextFrame(socket, "tilecombine part=0 width=256 height=256 tileposx=0,3840,7680 tileposy=0,0,0 tilewidth=3840 tileheight=3840", testname);
-        const auto tile1 = assertResponseString(socket, "tile:", testname);
-        std::string renderId1;
-        LOOLProtocol::getTokenStringFromMessage(tile1, "renderid", renderId1);
-        CPPUNIT_ASSERT_EQUAL(std::string("cached"), renderId1);
-
-        const auto tile2 = assertResponseString(socket, "tile:", testname);
-        std::string renderId2;
-        LOOLProtocol::getTokenStringFromMessage(tile2, "renderid", renderId2);
-        CPPUNIT_ASSERT_EQUAL(std::string("cached"), renderId2);
-
-        const auto tile3 = assertResponseString(socket, "tile:", testname);
-        std::string renderId3;
-        LOOLProtocol::getTokenStringFromMessage(tile3, "renderid", renderId3);
-        CPPUNIT_ASSERT_EQUAL(std::string("cached"), renderId3);
+        const auto tiles = getTileMessages(socket, 3, testname);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), tiles.size());
+        for (const auto& tile : tiles)
+        {
+            std::string renderId;
+            LOOLProtocol::getTokenStringFromMessage(tile, "renderid", renderId);
+            CPPUNIT_ASSERT_EQUAL(std::string("cached"), renderId);
+        }
 
         // Get new rendercount.
         sendTextFrame(socket, "ping", testname);
@@ -584,21 +611,15 @@ void TileCacheTests::testTilesRenderedJustOnceMultiClient()
 
         assertResponseString(socket2, "invalidatetiles:", testname2);
         sendTextFrame(socket2, "tilecombine part=0 width=256 height=256 tileposx=0,3840,7680 tileposy=0,0,0 tilewidth=3840 tileheight=3840", testname2);
-        assertResponseString(socket2, "tile:", testname2);
-        assertResponseString(socket2, "tile:", testname2);
-        assertResponseString(socket2, "tile:", testname2);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), getTileMessages(socket2, 3, testname2).size());
 
         assertResponseString(socket3, "invalidatetiles:", testname3);
         sendTextFrame(socket3, "tilecombine part=0 width=256 height=256 tileposx=0,3840,7680 tileposy=0,0,0 tilewidth=3840 tileheight=3840", testname3);
-        assertResponseString(socket3, "tile:", testname3);
-        assertResponseString(socket3, "tile:", testname3);
-        assertResponseString(socket3, "tile:", testname3);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), getTileMessages(socket3, 3, testname3).size());
 
         assertResponseString(socket4, "invalidatetiles:", testname4);
         sendTextFrame(socket4, "tilecombine part=0 width=256 height=256 tileposx=0,3840,7680 tileposy=0,0,0 tilewidth=3840 tileheight=3840", testname4);
-        assertResponseString(socket4, "tile:", testname4);
-        assertResponseString(socket4, "tile:", testname4);
-        assertResponseString(socket4, "tile:", testname4);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), getTileMessages(socket4, 3, testname4).size());
 
         // Get new rendercount.
         sendTextFrame(socket, "ping", testname1);
@@ -609,20 +630,14 @@ void TileCacheTests::testTilesRenderedJustOnceMultiClient()
 
         // Get same 3 tiles.
         sendTextFrame(socket, "tilecombine part=0 width=256 height=256 tileposx=0,3840,7680 tileposy=0,0,0 tilewidth=3840 tileheight=3840", testname1);
-        const auto tile1 = assertResponseString(socket, "tile:", testname1);
-        std::string renderId1;
-        LOOLProtocol::getTokenStringFromMessage(tile1, "renderid", renderId1);
-        CPPUNIT_ASSERT_EQUAL(std::string("cached"), renderId1);
-
-        const auto tile2 = assertResponseString(socket, "tile:", testname1);
-        std::string renderId2;
-        LOOLProtocol::getTokenStringFromMessage(tile2, "renderid", renderId2);
-        CPPUNIT_ASSERT_EQUAL(std::string("cached"), renderId2);
-
-        const auto tile3 = assertResponseString(socket, "tile:", testname1);
-        std::string renderId3;
-        LOOLProtocol::getTokenStringFromMessage(tile3, "renderid", renderId3);
-        CPPUNIT_ASSERT_EQUAL(std::string("cached"), renderId3);
+        const auto tiles = getTileMessages(socket, 3, testname1);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), tiles.size());
+        for (const auto& tile : tiles)
+        {
+            std::string renderId;
+            LOOLProtocol::getTokenStringFromMessage(tile, "renderid", renderId);
+            CPPUNIT_ASSERT_EQUAL(std::string("cached"), renderId);
+        }
 
         // Get new rendercount.
         sendTextFrame(socket, "ping", testname1);
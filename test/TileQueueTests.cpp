@@ -46,12 +46,15 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testTileRecombining);
     CPPUNIT_TEST(testViewOrder);
     CPPUNIT_TEST(testPreviewsDeprioritization);
+    CPPUNIT_TEST(testMessage);
     CPPUNIT_TEST(testSenderQueue);
     CPPUNIT_TEST(testSenderQueueTileDeduplication);
     CPPUNIT_TEST(testInvalidateViewCursorDeduplication);
     CPPUNIT_TEST(testCallbackInvalidation);
     CPPUNIT_TEST(testCallbackIndicatorValue);
     CPPUNIT_TEST(testCallbackPageSize);
+    CPPUNIT_TEST(testCallbackViewCursor);
+    CPPUNIT_TEST(testCallbackStateChanged);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -60,12 +63,15 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     void testTileRecombining();
     void testViewOrder();
     void testPreviewsDeprioritization();
+    void testMessage();
     void testSenderQueue();
     void testSenderQueueTileDeduplication();
     void testInvalidateViewCursorDeduplication();
     void testCallbackInvalidation();
     void testCallbackIndicatorValue();
     void testCallbackPageSize();
+    void testCallbackViewCursor();
+    void testCallbackStateChanged();
 };
 
 void TileQueueTests::testTileQueuePriority()
@@ -151,6 +157,9 @@ namespace {
 
 std::string payloadAsString(const MessageQueue::Payload& payload)
 {
+    if (TileQueue::isCallback(payload))
+        return TileQueue::callbackToString(payload);
+
     return std::string(payload.data(), payload.size());
 }
 
@@ -273,6 +282,33 @@ void TileQueueTests::testPreviewsDeprioritization()
     CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(queue._queue.size()));
 }
 
+void TileQueueTests::testMessage()
+{
+    const std::string text = "client-0002  invalidatecursor: 1418, 1418, 0, 275";
+    const Message copied(text, Message::Dir::Out);
+    CPPUNIT_ASSERT_EQUAL(std::string("client-0002"), copied.forwardToken());
+    CPPUNIT_ASSERT_EQUAL(std::string("invalidatecursor: 1418, 1418, 0, 275"), copied.firstLine());
+    CPPUNIT_ASSERT_EQUAL(std::string("invalidatecursor:"), copied.firstToken());
+    CPPUNIT_ASSERT_EQUAL(5UL, copied.tokens().size());
+    CPPUNIT_ASSERT(!copied.isBinary());
+
+    // The adopted buffer is the one the message keeps.
+    const std::string header = "tile: part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840\n";
+    std::vector<char> buffer(header.begin(), header.end());
+    buffer.insert(buffer.end(), 64, '\xff');
+    const std::vector<char> expected(buffer);
+    const char* const storage = buffer.data();
+    const Message adopted(std::move(buffer), Message::Dir::Out);
+    CPPUNIT_ASSERT(storage == adopted.data().data());
+    CPPUNIT_ASSERT_EQUAL(expected, adopted.data());
+    CPPUNIT_ASSERT_EQUAL(std::string(), adopted.forwardToken());
+    CPPUNIT_ASSERT_EQUAL(std::string("tile:"), adopted.firstToken());
+    CPPUNIT_ASSERT_EQUAL(8UL, adopted.tokens().size());
+    CPPUNIT_ASSERT_EQUAL(header.substr(0, header.size() - 1), adopted.firstLine());
+    CPPUNIT_ASSERT(adopted.isBinary());
+    CPPUNIT_ASSERT(adopted.abbr().find("tile: part=0") != std::string::npos);
+}
+
 void TileQueueTests::testSenderQueue()
 {
     SenderQueue<std::shared_ptr<Message>> queue;
@@ -472,6 +508,52 @@ void TileQueueTests::testCallbackPageSize()
     CPPUNIT_ASSERT_EQUAL(std::string("callback all 13 12474, 205748"), payloadAsString(queue.get()));
 }
 
+void TileQueueTests::testCallbackViewCursor()
+{
+    TileQueue queue;
+
+    const std::string view1 = "{    \"viewId\": \"1\",     \"rectangle\": \"3999, 1418, 0, 298\",     \"part\": \"0\" }";
+    const std::string view2 = "{    \"viewId\": \"2\",     \"rectangle\": \"1000, 1418, 0, 298\",     \"part\": \"3\" }";
+
+    TileQueue::Callback callback1 = TileQueue::parseCallback(24, view1);
+    CPPUNIT_ASSERT_EQUAL(1, callback1.PayloadViewId);
+    CPPUNIT_ASSERT_EQUAL(true, callback1.HasRectangle);
+    CPPUNIT_ASSERT_EQUAL(3999, callback1.X);
+    CPPUNIT_ASSERT_EQUAL(298, callback1.Height);
+    callback1.ExceptViewId = callback1.PayloadViewId;
+
+    TileQueue::Callback callback2 = TileQueue::parseCallback(24, view2);
+    CPPUNIT_ASSERT_EQUAL(3, callback2.Part);
+    callback2.ExceptViewId = callback2.PayloadViewId;
+
+    // the cursor of the same view is replaced, the other one kept
+    queue.putCallback(callback1, view1);
+    queue.putCallback(callback2, view2);
+    queue.putCallback(callback1, view1);
+
+    CPPUNIT_ASSERT_EQUAL(2, static_cast<int>(queue._queue.size()));
+    CPPUNIT_ASSERT_EQUAL("callback except-2 24 " + view2, payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL("callback except-1 24 " + view1, payloadAsString(queue.get()));
+
+    CPPUNIT_ASSERT_EQUAL(false, TileQueue::parseCallback(24, "{ \"viewId\": \"1\", \"rectangle\": \"EMPTY\", \"part\": \"0\" }").HasRectangle);
+}
+
+void TileQueueTests::testCallbackStateChanged()
+{
+    TileQueue queue;
+
+    // only the last state of a command for the same view is kept
+    queue.put("callback 2 8 .uno:Bold=true");
+    queue.put("callback 2 8 .uno:Italic=true");
+    queue.put("callback 3 8 .uno:Bold=true");
+    queue.put("callback 2 8 .uno:Bold=false");
+
+    CPPUNIT_ASSERT_EQUAL(3, static_cast<int>(queue._queue.size()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback 2 8 .uno:Italic=true"), payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback 3 8 .uno:Bold=true"), payloadAsString(queue.get()));
+    CPPUNIT_ASSERT_EQUAL(std::string("callback 2 8 .uno:Bold=false"), payloadAsString(queue.get()));
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(TileQueueTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
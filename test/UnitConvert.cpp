@@ -0,0 +1,166 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Checks that the convert pool times out the conversions waiting
+ * for a kit, not only the running ones.
+ */
+
+#include "config.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+
+#include <Poco/Net/FilePartSource.h>
+#include <Poco/Net/HTMLForm.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPResponse.h>
+#include <Poco/NullStream.h>
+#include <Poco/StreamCopier.h>
+#include <Poco/Util/LayeredConfiguration.h>
+
+#include "Log.hpp"
+#include "Unit.hpp"
+#include "UnitHTTP.hpp"
+#include "helpers.hpp"
+
+namespace
+{
+    /// Posts a conversion and waits for the reply.
+    void convert(Poco::Net::HTTPResponse& response)
+    {
+        const std::string srcPath = FileUtil::getTempFilePath(TDOC, "hello.odt", "unitConvert_");
+        std::unique_ptr<Poco::Net::HTTPClientSession> session(UnitHTTP::createSession());
+        session->setTimeout(Poco::Timespan(30, 0));
+
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, "/lool/convert-to");
+        Poco::Net::HTMLForm form;
+        form.setEncoding(Poco::Net::HTMLForm::ENCODING_MULTIPART);
+        form.set("format", "txt");
+        form.addPart("data", new Poco::Net::FilePartSource(srcPath));
+        form.prepareSubmit(request);
+        form.write(session->sendRequest(request));
+
+        std::istream& responseStream = session->receiveResponse(response);
+        Poco::NullOutputStream nullStream;
+        Poco::StreamCopier::copyStream(responseStream, nullStream);
+
+        FileUtil::removeFile(srcPath);
+    }
+}
+
+// Inside the WSD process
+class UnitConvert : public UnitWSD
+{
+    std::atomic<bool> _started;
+    std::thread _thread;
+
+public:
+    UnitConvert() :
+        _started(false)
+    {
+        setHasKitHooks();
+        setTimeout(60 * 1000);
+    }
+
+    ~UnitConvert()
+    {
+        if (_thread.joinable())
+            _thread.join();
+    }
+
+    virtual void configure(Poco::Util::LayeredConfiguration& config) override
+    {
+        UnitWSD::configure(config);
+        config.setInt("num_prespawn_children", 1);
+        config.setInt("convert_pool.size", 1);
+        config.setInt("convert_pool.timeout_secs", 2);
+    }
+
+    virtual void invokeTest() override
+    {
+        if (_started)
+            return;
+
+        _started = true;
+        _thread = std::thread([this]()
+            {
+                // The first conversion takes the only kit, which never replies,
+                // and the second one waits for a kit that never comes.
+                Poco::Net::HTTPResponse running;
+                std::thread first([&running]() { convert(running); });
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+                Poco::Net::HTTPResponse waiting;
+                convert(waiting);
+                first.join();
+
+                LOG_INF("UnitConvert: running got " << running.getStatus() <<
+                        ", waiting got " << waiting.getStatus() << ".");
+                if (running.getStatus() != Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR)
+                    exitTest(TestResult::Failed);
+                else if (waiting.getStatus() != Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE ||
+                         waiting.get("Retry-After", "") != "1")
+                    exitTest(TestResult::Failed);
+                else
+                    exitTest(TestResult::Ok);
+            });
+    }
+};
+
+// Inside the forkit & kit processes
+class UnitKitConvert : public UnitKit
+{
+    int _launched;
+
+public:
+    UnitKitConvert() :
+        _launched(0)
+    {
+        setTimeout(60 * 1000);
+    }
+
+    virtual void launchedKit(int /* pid */) override
+    {
+        ++_launched;
+    }
+
+    virtual void postFork() override
+    {
+        // Only the first kit comes up, the later ones don't connect
+        // until the test is over.
+        if (_launched > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(60));
+            _exit(0);
+        }
+    }
+
+    virtual bool filterKitMessage(const std::shared_ptr<WebSocketHandler>& /* ws */,
+                                  std::string& message) override
+    {
+        // Swallow the conversions, they never finish.
+        return message.compare(0, 8, "convert ") == 0;
+    }
+};
+
+UnitBase *unit_create_wsd(void)
+{
+    return new UnitConvert();
+}
+
+UnitBase *unit_create_kit(void)
+{
+    return new UnitKitConvert();
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
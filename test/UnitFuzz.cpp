@@ -144,7 +144,7 @@ public:
         std::cerr << "\n\nYour KIT process has fuzzing hooks\n\n\n";
         setTimeout(3600 * 1000); /* one hour */
     }
-    virtual bool filterKitMessage(const std::shared_ptr<LOOLWebSocket> & /* ws */,
+    virtual bool filterKitMessage(const std::shared_ptr<WebSocketHandler> & /* ws */,
                                   std::string & /* message */) override
     {
         return false;
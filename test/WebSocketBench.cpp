@@ -0,0 +1,211 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+// Microbenchmark of the incoming websocket frame decoding:
+// the unmasking alone, then whole and fragmented messages
+// pushed through WebSocketHandler::handleOneIncomingMessage.
+
+#include "config.h"
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Log.hpp"
+#include "Socket.hpp"
+#include "WebSocketHandler.hpp"
+
+namespace
+{
+
+/// Gives access to the input buffer of the socket.
+class BenchSocket : public StreamSocket
+{
+public:
+    BenchSocket(const int fd, std::shared_ptr<SocketHandlerInterface> handler) :
+        StreamSocket(fd, std::move(handler))
+    {
+    }
+
+    std::vector<char>& getInBuffer() { return _inBuffer; }
+};
+
+/// Counts the decoded messages.
+class BenchHandler : public WebSocketHandler
+{
+public:
+    BenchHandler() :
+        _messages(0),
+        _bytes(0)
+    {
+    }
+
+    size_t getMessages() const { return _messages; }
+    size_t getBytes() const { return _bytes; }
+
+protected:
+    void handleMessage(bool /*fin*/, WSOpCode /*code*/, std::vector<char>& data) override
+    {
+        ++_messages;
+        _bytes += data.size();
+    }
+
+private:
+    size_t _messages;
+    size_t _bytes;
+};
+
+const unsigned char Mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+
+/// Appends a masked frame, as browsers send them.
+void appendFrame(std::vector<char>& out, const unsigned char flags, const char* data, const size_t len)
+{
+    out.push_back(flags);
+    if (len < 126)
+    {
+        out.push_back(static_cast<char>(0x80 | len));
+    }
+    else if (len <= 0xffff)
+    {
+        out.push_back(static_cast<char>(0x80 | 126));
+        out.push_back(static_cast<char>((len >> 8) & 0xff));
+        out.push_back(static_cast<char>((len >> 0) & 0xff));
+    }
+    else
+    {
+        out.push_back(static_cast<char>(0x80 | 127));
+        for (int shift = 56; shift >= 0; shift -= 8)
+            out.push_back(static_cast<char>((len >> shift) & 0xff));
+    }
+
+    out.insert(out.end(), Mask, Mask + 4);
+    for (size_t i = 0; i < len; ++i)
+        out.push_back(data[i] ^ Mask[i % 4]);
+}
+
+/// Encodes a message as the given number of frames.
+std::vector<char> encode(const std::string& message, const size_t frames)
+{
+    std::vector<char> out;
+    const size_t chunk = message.size() / frames;
+    for (size_t i = 0; i < frames; ++i)
+    {
+        const bool last = (i == frames - 1);
+        const size_t offset = i * chunk;
+        const size_t len = (last ? message.size() - offset : chunk);
+        const unsigned char opcode = (i == 0 ? WebSocketHandler::WSOpCode::Text : WebSocketHandler::WSOpCode::Continuation);
+        appendFrame(out, (last ? 0x80 : 0) | opcode, message.data() + offset, len);
+    }
+
+    return out;
+}
+
+double toMBps(const size_t bytes, const std::chrono::steady_clock::duration elapsed)
+{
+    const double secs = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1e6;
+    return secs > 0 ? bytes / secs / (1024 * 1024) : 0;
+}
+
+void benchUnmask(const size_t size, const size_t iterations)
+{
+    std::vector<char> src(size);
+    for (size_t i = 0; i < size; ++i)
+        src[i] = static_cast<char>(std::rand());
+    std::vector<char> dst(size);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t n = 0; n < iterations; ++n)
+    {
+        // The byte-wise loop this replaced.
+        for (size_t i = 0; i < size; ++i)
+            dst[i] = src[i] ^ Mask[i % 4];
+        src[n % size] = dst[0];
+    }
+    const auto byteWise = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (size_t n = 0; n < iterations; ++n)
+    {
+        WebSocketHandler::unmask(dst.data(), src.data(), size, Mask);
+        src[n % size] = dst[0];
+    }
+    const auto wordWise = std::chrono::steady_clock::now() - start;
+
+    std::cout << "unmask " << std::setw(8) << size << " bytes: byte-wise "
+              << std::setw(8) << std::fixed << std::setprecision(1) << toMBps(size * iterations, byteWise)
+              << " MB/s, word-wise " << std::setw(8) << toMBps(size * iterations, wordWise) << " MB/s\n";
+}
+
+void benchDecode(const size_t size, const size_t frames, const size_t iterations)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+        std::cerr << "Failed to create socketpair.\n";
+        std::exit(1);
+    }
+
+    auto handler = std::make_shared<BenchHandler>();
+    auto socket = StreamSocket::create<BenchSocket>(fds[0], handler);
+
+    const std::string message(size, 'x');
+    const std::vector<char> encoded = encode(message, frames);
+
+    std::vector<char>& in = socket->getInBuffer();
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t n = 0; n < iterations; ++n)
+    {
+        in.insert(in.end(), encoded.begin(), encoded.end());
+        while (handler->handleOneIncomingMessage(socket))
+            ;
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    if (handler->getMessages() != iterations || handler->getBytes() != size * iterations)
+    {
+        std::cerr << "Decoded " << handler->getMessages() << " messages of " << handler->getBytes()
+                  << " bytes, expected " << iterations << " of " << size * iterations << ".\n";
+        std::exit(1);
+    }
+
+    std::cout << "decode " << std::setw(8) << size << " bytes in " << frames << " frame(s): "
+              << std::setw(8) << std::fixed << std::setprecision(1) << toMBps(size * iterations, elapsed)
+              << " MB/s, " << std::setprecision(0)
+              << iterations / (std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1e6 + 1e-9)
+              << " msgs/s\n";
+
+    close(fds[1]);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    const bool verbose = (argc > 1 && std::string("--verbose") == argv[1]);
+    Log::initialize("bench", verbose ? "trace" : "error", false, false, {});
+
+    const size_t totalBytes = 256 * 1024 * 1024;
+    for (const size_t size : { 64, 1024, 16 * 1024, 1024 * 1024 })
+        benchUnmask(size, totalBytes / size);
+
+    for (const size_t size : { 64, 1024, 16 * 1024, 1024 * 1024 })
+    {
+        benchDecode(size, 1, totalBytes / 4 / size);
+        benchDecode(size, 4, totalBytes / 4 / size);
+    }
+
+    return 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
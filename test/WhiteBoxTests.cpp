@@ -9,15 +9,32 @@
 
 #include "config.h"
 
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <Poco/InflatingStream.h>
+#include <Poco/StreamCopier.h>
+
 #include <cppunit/extensions/HelperMacros.h>
 
+#include <AutoSaveScheduler.hpp>
 #include <ChildSession.hpp>
 #include <Common.hpp>
+#include <Histogram.hpp>
+#include <HttpRequestReader.hpp>
 #include <Kit.hpp>
 #include <MessageQueue.hpp>
+#include <Metrics.hpp>
+#include <PreprocessedFile.hpp>
 #include <Protocol.hpp>
 #include <TileDesc.hpp>
+#include <TraceFile.hpp>
 #include <Util.hpp>
+#include <WebSocketHandler.hpp>
 
 /// WhiteBox unit-tests.
 class WhiteBoxTests : public CPPUNIT_NS::TestFixture
@@ -27,22 +44,40 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testLOOLProtocolFunctions);
     CPPUNIT_TEST(testMessageAbbreviation);
     CPPUNIT_TEST(testTokenizer);
+    CPPUNIT_TEST(testTokens);
     CPPUNIT_TEST(testReplace);
     CPPUNIT_TEST(testRegexListMatcher);
     CPPUNIT_TEST(testRegexListMatcher_Init);
     CPPUNIT_TEST(testEmptyCellCursor);
     CPPUNIT_TEST(testRectanglesIntersect);
+    CPPUNIT_TEST(testProcStats);
+    CPPUNIT_TEST(testAutoSaveScheduler);
+    CPPUNIT_TEST(testWebSocketUnmask);
+    CPPUNIT_TEST(testWebSocketControlFrames);
+    CPPUNIT_TEST(testTraceFile);
+    CPPUNIT_TEST(testMetrics);
+    CPPUNIT_TEST(testHttpRequestReader);
+    CPPUNIT_TEST(testPreprocessedFile);
 
     CPPUNIT_TEST_SUITE_END();
 
     void testLOOLProtocolFunctions();
     void testMessageAbbreviation();
     void testTokenizer();
+    void testTokens();
     void testReplace();
     void testRegexListMatcher();
     void testRegexListMatcher_Init();
     void testEmptyCellCursor();
     void testRectanglesIntersect();
+    void testProcStats();
+    void testAutoSaveScheduler();
+    void testWebSocketUnmask();
+    void testWebSocketControlFrames();
+    void testTraceFile();
+    void testMetrics();
+    void testHttpRequestReader();
+    void testPreprocessedFile();
 };
 
 void WhiteBoxTests::testLOOLProtocolFunctions()
@@ -230,6 +265,72 @@ void WhiteBoxTests::testTokenizer()
     CPPUNIT_ASSERT_EQUAL(std::string("XYZ"), tokens[2]);
 }
 
+void WhiteBoxTests::testTokens()
+{
+    // Split as tokenize() does.
+    for (const std::string message : { "", "  ", " A  Z ", " A  \nZ ", " A  Z  \n ",
+                                       "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 ver=-1" })
+    {
+        const std::vector<std::string> expected = LOOLProtocol::tokenize(message);
+        const LOOLProtocol::Tokens tokens(message);
+        CPPUNIT_ASSERT_EQUAL(expected.size(), tokens.size());
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            CPPUNIT_ASSERT_EQUAL(expected[i], tokens[i].toString());
+        }
+
+        CPPUNIT_ASSERT(tokens[expected.size()].empty());
+    }
+
+    // More tokens than fit inline.
+    std::string message;
+    for (int i = 0; i < 20; ++i)
+    {
+        message += "token" + std::to_string(i) + ' ';
+    }
+
+    const LOOLProtocol::Tokens tokens(message);
+    CPPUNIT_ASSERT_EQUAL(20UL, tokens.size());
+    CPPUNIT_ASSERT(tokens[17] == "token17");
+    CPPUNIT_ASSERT_EQUAL(std::string("token18 token19"), tokens.cat(" ", 18));
+
+    // The values are parsed within the token, not up to the null terminator.
+    const std::string values = "x=12 y=-3 big=4294967296 hash=18446744073709551615 type='buttondown'";
+    const LOOLProtocol::Tokens parts(values.data(), 3);
+    int value = 0;
+    CPPUNIT_ASSERT(LOOLProtocol::getTokenInteger(parts[0], "x", value));
+    CPPUNIT_ASSERT_EQUAL(1, value);
+
+    const LOOLProtocol::Tokens pairs(values);
+    CPPUNIT_ASSERT(LOOLProtocol::getTokenInteger(pairs, "y", value));
+    CPPUNIT_ASSERT_EQUAL(-3, value);
+    CPPUNIT_ASSERT(!LOOLProtocol::getTokenInteger(pairs, "big", value));
+
+    uint64_t hash = 0;
+    CPPUNIT_ASSERT(LOOLProtocol::getTokenUInt64(pairs[3], "hash", hash));
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(18446744073709551615ULL), hash);
+
+    const std::map<std::string, int> types = { { "buttondown", 1 } };
+    CPPUNIT_ASSERT(LOOLProtocol::getTokenKeyword(pairs[4], "type", types, value));
+    CPPUNIT_ASSERT_EQUAL(1, value);
+
+    // The command table.
+    enum class Command { Unknown, Key, Mouse, Tile, TileCombine };
+    const LOOLProtocol::CommandTable<Command> commands({
+            { "key", Command::Key },
+            { "mouse", Command::Mouse },
+            { "tile", Command::Tile },
+            { "tilecombine", Command::TileCombine } },
+        Command::Unknown);
+    CPPUNIT_ASSERT(commands.lookup("key") == Command::Key);
+    CPPUNIT_ASSERT(commands.lookup("mouse") == Command::Mouse);
+    CPPUNIT_ASSERT(commands.lookup(LOOLProtocol::Tokens(message)[0]) == Command::Unknown);
+    CPPUNIT_ASSERT(commands.lookup("tile") == Command::Tile);
+    CPPUNIT_ASSERT(commands.lookup("tilecombine") == Command::TileCombine);
+    CPPUNIT_ASSERT(commands.lookup("til") == Command::Unknown);
+    CPPUNIT_ASSERT(commands.lookup("") == Command::Unknown);
+}
+
 void WhiteBoxTests::testReplace()
 {
     CPPUNIT_ASSERT_EQUAL(std::string("zesz one zwo flee"), Util::replace("test one two flee", "t", "z"));
@@ -410,6 +511,533 @@ void WhiteBoxTests::testRectanglesIntersect()
                                                   1000, 1000, 2000, 1000));
 }
 
+void WhiteBoxTests::testProcStats()
+{
+    // Trimmed /proc/<pid>/smaps_rollup.
+    FILE* smaps = tmpfile();
+    CPPUNIT_ASSERT(smaps != nullptr);
+    fputs("55d7c0a2b000-7ffc3b3f5000 ---p 00000000 00:00 0                          [rollup]\n"
+          "Rss:              231284 kB\n"
+          "Pss:              102400 kB\n"
+          "Pss_Anon:          61440 kB\n"
+          "Pss_File:          40960 kB\n"
+          "Shared_Dirty:       1024 kB\n"
+          "Private_Clean:      2048 kB\n"
+          "Private_Dirty:     65536 kB\n", smaps);
+
+    // Read twice, as the sampler does with the same open file.
+    for (int i = 0; i < 2; ++i)
+    {
+        const auto pssAndDirtyKb = Util::getPssAndDirtyFromSMaps(smaps);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(102400), pssAndDirtyKb.first);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(65536), pssAndDirtyKb.second);
+    }
+
+    fclose(smaps);
+
+    // The command name may contain spaces and parens.
+    FILE* stat = tmpfile();
+    CPPUNIT_ASSERT(stat != nullptr);
+    fputs("4242 (lokit (a) b) S 1 4242 4242 0 -1 4194560 1031 0 0 0 150 25 0 0 20 0 8 0 "
+          "12345 1234567890 5678 18446744073709551615\n", stat);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(175), Util::getCpuUsage(stat));
+    fclose(stat);
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), Util::getCpuUsage(nullptr));
+}
+
+void WhiteBoxTests::testAutoSaveScheduler()
+{
+    // 2 concurrent uploads, 60 per minute, ie. one per second after the burst.
+    AutoSaveScheduler scheduler(2, 60);
+    auto now = std::chrono::steady_clock::now();
+    const auto second = std::chrono::seconds(1);
+    const auto minute = std::chrono::seconds(60);
+
+    CPPUNIT_ASSERT(scheduler.tryAcquire("a", now - minute, 0, now));
+    CPPUNIT_ASSERT(!scheduler.tryAcquire("a", now - minute, 0, now));
+    CPPUNIT_ASSERT(scheduler.tryAcquire("b", now, 0, now));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), scheduler.getInFlightCount());
+
+    // Capped at 2 concurrent uploads.
+    CPPUNIT_ASSERT(!scheduler.tryAcquire("c", now, 0, now));
+    CPPUNIT_ASSERT(!scheduler.tryAcquire("d", now - minute, 0, now));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), scheduler.getWaitingCount());
+
+    // A slot is free, but the rate limit needs a second.
+    scheduler.release("a");
+    CPPUNIT_ASSERT(!scheduler.tryAcquire("d", now - minute, 0, now));
+    now += second;
+
+    // The oldest modification goes first.
+    CPPUNIT_ASSERT(!scheduler.tryAcquire("c", now - second, 0, now));
+    CPPUNIT_ASSERT(scheduler.tryAcquire("d", now - minute, 0, now));
+
+    // Each MB counts as much as a second since modified.
+    CPPUNIT_ASSERT(!scheduler.tryAcquire("e", now, 10 * 1024 * 1024, now));
+    scheduler.release("b");
+    now += second;
+    CPPUNIT_ASSERT(!scheduler.tryAcquire("c", now - 2 * second, 0, now));
+    CPPUNIT_ASSERT(scheduler.tryAcquire("e", now - second, 10 * 1024 * 1024, now));
+
+    scheduler.cancel("c");
+    scheduler.cancel("d");
+    scheduler.cancel("e");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), scheduler.getInFlightCount());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), scheduler.getWaitingCount());
+
+    // Saving before unloading goes first, but within the limits.
+    now += 2 * second;
+    CPPUNIT_ASSERT(scheduler.tryAcquire("a", now - minute, 0, now));
+    CPPUNIT_ASSERT(scheduler.tryAcquire("b", now - minute, 0, now));
+    CPPUNIT_ASSERT(!scheduler.tryAcquire("c", now - 2 * minute, 0, now));
+    CPPUNIT_ASSERT(!scheduler.tryAcquireUrgent("u", now, 0, now));
+    scheduler.release("a");
+    now += second;
+    CPPUNIT_ASSERT(!scheduler.tryAcquire("c", now - 2 * minute, 0, now));
+    CPPUNIT_ASSERT(scheduler.tryAcquireUrgent("u", now, 0, now));
+
+    scheduler.cancel("b");
+    scheduler.cancel("c");
+    scheduler.cancel("u");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), scheduler.getInFlightCount());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), scheduler.getWaitingCount());
+
+    // Jitter is within +/- 10%.
+    for (int i = 0; i < 100; ++i)
+    {
+        const auto interval = AutoSaveScheduler::jitter(std::chrono::milliseconds(30000)).count();
+        CPPUNIT_ASSERT(interval >= 27000 && interval <= 33000);
+    }
+}
+
+void WhiteBoxTests::testWebSocketUnmask()
+{
+    const unsigned char mask[4] = { 0x01, 0x80, 0x7f, 0xff };
+
+    // All the word / tail splits, both into another buffer and in place over a header.
+    for (size_t len = 0; len < 70; ++len)
+    {
+        for (size_t shift = 0; shift <= 14; shift += 7)
+        {
+            std::vector<char> buffer(shift + len);
+            for (size_t i = 0; i < buffer.size(); ++i)
+                buffer[i] = static_cast<char>(i * 13);
+
+            std::vector<char> expected(len);
+            for (size_t i = 0; i < len; ++i)
+                expected[i] = buffer[shift + i] ^ mask[i % 4];
+
+            std::vector<char> copy(len);
+            WebSocketHandler::unmask(copy.data(), buffer.data() + shift, len, mask);
+            CPPUNIT_ASSERT(copy == expected);
+
+            WebSocketHandler::unmask(buffer.data(), buffer.data() + shift, len, mask);
+            CPPUNIT_ASSERT(std::equal(expected.begin(), expected.end(), buffer.begin()));
+        }
+    }
+}
+
+namespace
+{
+    /// Gives access to the input buffer of the socket.
+    class TestSocket : public StreamSocket
+    {
+    public:
+        TestSocket(const int fd, std::shared_ptr<SocketHandlerInterface> handler) :
+            StreamSocket(fd, std::move(handler))
+        {
+        }
+
+        std::vector<char>& getInBuffer() { return _inBuffer; }
+    };
+}
+
+void WhiteBoxTests::testWebSocketControlFrames()
+{
+    // Decodes the frame, returns what was sent back.
+    const auto decode = [](const std::vector<unsigned char>& frame, bool& result)
+    {
+        int fds[2];
+        CPPUNIT_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+        auto handler = std::make_shared<WebSocketHandler>();
+        auto socket = StreamSocket::create<TestSocket>(fds[0], handler);
+        socket->getInBuffer().assign(frame.begin(), frame.end());
+        result = handler->handleOneIncomingMessage(socket);
+
+        char reply[64];
+        const ssize_t len = recv(fds[1], reply, sizeof(reply), MSG_DONTWAIT);
+        close(fds[1]);
+        return std::string(reply, std::max<ssize_t>(len, 0));
+    };
+
+    // Closed with 1002, protocol error.
+    const std::string protocolError("\x88\x02\x03\xea", 4);
+    bool result = true;
+
+    // A pong is fine.
+    CPPUNIT_ASSERT_EQUAL(std::string(), decode({ 0x8a, 0x82, 1, 2, 3, 4, 'o' ^ 1, 'k' ^ 2 }, result));
+    CPPUNIT_ASSERT(result);
+
+    // Without waiting for the payload of an oversized ping.
+    CPPUNIT_ASSERT_EQUAL(protocolError, decode({ 0x89, 0x80 | 126, 0, 126, 1, 2, 3, 4 }, result));
+    CPPUNIT_ASSERT(!result);
+
+    // Nor letting its length wrap around.
+    CPPUNIT_ASSERT_EQUAL(protocolError, decode({ 0x89, 0x80 | 127, 0x80, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4 }, result));
+    CPPUNIT_ASSERT(!result);
+
+    // Control frames are never fragmented.
+    CPPUNIT_ASSERT_EQUAL(protocolError, decode({ 0x0a, 0x80, 1, 2, 3, 4 }, result));
+    CPPUNIT_ASSERT(!result);
+}
+
+void WhiteBoxTests::testTraceFile()
+{
+    for (const bool compress : { false, true })
+    {
+        const std::string path = Poco::Path::temp() + "looltrace-test-" + std::to_string(getpid()) +
+                                 (compress ? ".gz" : "");
+        {
+            TraceFileWriter writer(path, true, compress, false, { "^tile:" });
+            writer.newSession("1234", "0001", "file:///doc.odt", "");
+            writer.writeIncoming("1234", "0001", "load url=file:///doc.odt");
+            writer.writeOutgoing("1234", "0001", "tile: part=0");
+            writer.newSession("1234", "0002", "file:///doc.odt", "");
+            writer.writeIncoming("1234", "0002", std::string("key\0binary", 10));
+            writer.writeOutgoing("1234", "0001", "status: type=text");
+            writer.endSession("1234", "0001", "file:///doc.odt");
+        }
+
+        TraceFileReader reader(path);
+        std::vector<TraceFileRecord> records;
+        for (;;)
+        {
+            TraceFileRecord rec = reader.getNextRecord();
+            if (rec.Dir == TraceFileRecord::Direction::Invalid)
+                break;
+            records.push_back(rec);
+        }
+
+        std::remove(path.c_str());
+
+        // The filtered tile is dropped, the binary payload kept intact.
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(6), records.size());
+        CPPUNIT_ASSERT_EQUAL(reader.getEpochStart(), records[0].TimestampNs);
+        CPPUNIT_ASSERT(records[0].Dir == TraceFileRecord::Direction::Event);
+        CPPUNIT_ASSERT_EQUAL(std::string("NewSession: file:///doc.odt"), records[0].Payload);
+        CPPUNIT_ASSERT_EQUAL(1234U, records[0].Pid);
+        CPPUNIT_ASSERT_EQUAL(std::string("0001"), records[0].SessionId);
+        CPPUNIT_ASSERT(records[1].Dir == TraceFileRecord::Direction::Incoming);
+        CPPUNIT_ASSERT_EQUAL(std::string("load url=file:///doc.odt"), records[1].Payload);
+        CPPUNIT_ASSERT_EQUAL(records[0].SessionIndex, records[1].SessionIndex);
+        CPPUNIT_ASSERT_EQUAL(std::string("0002"), records[3].SessionId);
+        CPPUNIT_ASSERT(records[3].SessionIndex != records[0].SessionIndex);
+        CPPUNIT_ASSERT_EQUAL(std::string("key\0binary", 10), records[3].Payload);
+        CPPUNIT_ASSERT(records[4].Dir == TraceFileRecord::Direction::Outgoing);
+        CPPUNIT_ASSERT_EQUAL(records[0].SessionIndex, records[4].SessionIndex);
+        CPPUNIT_ASSERT_EQUAL(std::string("EndSession: file:///doc.odt"), records[5].Payload);
+        for (size_t i = 1; i < records.size(); ++i)
+            CPPUNIT_ASSERT(records[i].TimestampNs >= records[i - 1].TimestampNs);
+    }
+
+    // Oversized records and sessions not announced yet end the trace.
+    const std::string path = Poco::Path::temp() + "looltrace-invalid-" + std::to_string(getpid());
+    const auto countRecords = [&path](const std::string& trace)
+    {
+        {
+            std::ofstream out(path, std::ios::binary);
+            out.write(TraceFileRecord::magic(), TraceFileRecord::MagicSize);
+            out << trace;
+        }
+
+        size_t count = 0;
+        TraceFileReader reader(path);
+        while (reader.getNextRecord().Dir != TraceFileRecord::Direction::Invalid)
+            ++count;
+
+        std::remove(path.c_str());
+        return count;
+    };
+
+    const auto record = [](const TraceFileRecord::Direction dir, const uint32_t sessionIndex,
+                           const std::string& payload, const size_t payloadSize)
+    {
+        char header[TraceFileRecord::HeaderSize];
+        TraceFileRecord::encodeHeader(header, dir, 0, sessionIndex, payloadSize);
+        return std::string(header, sizeof(header)) + payload;
+    };
+
+    const std::string session0 = std::string("1234\0" "0001", 9);
+    const std::string session1 = std::string("1234\0" "0002", 9);
+    const std::string newSession = "NewSession: file:///doc.odt";
+    const std::string start = record(TraceFileRecord::Direction::Session, 0, session0, session0.size()) +
+                              record(TraceFileRecord::Direction::Event, 0, newSession, newSession.size());
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2),
+                         countRecords(start + record(TraceFileRecord::Direction::Incoming, 0, "load", 4)));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1),
+                         countRecords(start + record(TraceFileRecord::Direction::Incoming, 1, "load", 4)));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1),
+                         countRecords(start + record(TraceFileRecord::Direction::Session, 2, session1, session1.size()) +
+                                      record(TraceFileRecord::Direction::Incoming, 2, "load", 4)));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1),
+                         countRecords(start + record(TraceFileRecord::Direction::Incoming, 0, "load",
+                                                     TraceFileRecord::MaxPayloadSize + 1)));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1),
+                         countRecords(start + record(TraceFileRecord::Direction::Incoming, 0, "load",
+                                                     UINT32_MAX - (TraceFileRecord::HeaderSize - 4))));
+    CPPUNIT_ASSERT_THROW(countRecords(record(TraceFileRecord::Direction::Session, 1, session0, session0.size()) +
+                                      record(TraceFileRecord::Direction::Event, 1, newSession, newSession.size())),
+                         std::runtime_error);
+    std::remove(path.c_str());
+}
+
+void WhiteBoxTests::testMetrics()
+{
+    // Each value is below the upper bound of its bucket, and within a quarter of it.
+    for (const uint64_t value : { 0UL, 1UL, 7UL, 8UL, 9UL, 1000UL, 123456UL, 8589934591UL })
+    {
+        const int index = Histogram::getIndex(value);
+        CPPUNIT_ASSERT(value < Histogram::getUpperBound(index));
+        CPPUNIT_ASSERT(index == 0 || value >= Histogram::getUpperBound(index - 1));
+        CPPUNIT_ASSERT(Histogram::getUpperBound(index) - 1 <= value + value / 4);
+    }
+
+    CPPUNIT_ASSERT_EQUAL(Histogram::Buckets - 1, Histogram::getIndex(UINT64_MAX));
+
+    Histogram kit("us");
+    for (uint64_t value = 1; value <= 100; ++value)
+        kit.add(value);
+
+    Histogram wsd("us");
+    wsd.add(1000);
+    wsd.merge(kit.serialize());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(101), wsd.getCount());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(6050), wsd.getSum());
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1000), wsd.getMax());
+    CPPUNIT_ASSERT(wsd.getPercentile(50) >= 50 && wsd.getPercentile(50) < 64);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(1000), wsd.getPercentile(100));
+
+    kit.reset();
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), kit.getCount());
+    CPPUNIT_ASSERT_EQUAL(std::string("sum=0 max=0 buckets="), kit.serialize());
+
+    Metrics::counter("test_requests_total{endpoint=\"a\"}", "Requests.").inc(2);
+    Metrics::counter("test_requests_total{endpoint=\"b\"}", "Requests.").inc();
+    Metrics::histogram("test_duration_us", "Durations.", "us").add(3);
+
+    std::ostringstream oss;
+    Metrics::dumpPrometheus(oss);
+    const std::string prometheus = oss.str();
+    CPPUNIT_ASSERT(prometheus.find("# TYPE test_requests_total counter\n"
+                                   "test_requests_total{endpoint=\"a\"} 2\n"
+                                   "test_requests_total{endpoint=\"b\"} 1\n") != std::string::npos);
+    CPPUNIT_ASSERT(prometheus.find("test_duration_us_bucket{le=\"3\"} 1\n") != std::string::npos);
+    CPPUNIT_ASSERT(prometheus.find("test_duration_us_bucket{le=\"+Inf\"} 1\n"
+                                   "test_duration_us_sum 3\n"
+                                   "test_duration_us_count 1\n") != std::string::npos);
+
+    // The same buckets on every scrape, cumulative, whichever are used.
+    Histogram& octave = Metrics::histogram("test_octave_us", "Octaves.", "us");
+    const auto getBuckets = []()
+    {
+        std::ostringstream dump;
+        Metrics::dumpPrometheus(dump);
+        std::istringstream lines(dump.str());
+        std::vector<std::pair<std::string, uint64_t>> buckets;
+        const std::string prefix = "test_octave_us_bucket{le=\"";
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            if (line.compare(0, prefix.size(), prefix) != 0)
+                continue;
+
+            const size_t end = line.find("\"} ", prefix.size());
+            CPPUNIT_ASSERT(end != std::string::npos);
+            buckets.emplace_back(line.substr(prefix.size(), end - prefix.size()),
+                                 std::stoull(line.substr(end + 3)));
+        }
+
+        return buckets;
+    };
+
+    octave.add(5);
+    const auto first = getBuckets();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(Histogram::Buckets / Histogram::SubBuckets), first.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("+Inf"), first.back().first);
+    for (size_t i = 0; i < first.size(); ++i)
+    {
+        const uint64_t le = (i + 1 < first.size() ? std::stoull(first[i].first) : UINT64_MAX);
+        CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(le >= 5 ? 1 : 0), first[i].second);
+        CPPUNIT_ASSERT(i == 0 || le > std::stoull(first[i - 1].first));
+    }
+
+    octave.add(1000000);
+    const auto second = getBuckets();
+    CPPUNIT_ASSERT_EQUAL(first.size(), second.size());
+    for (size_t i = 0; i < second.size(); ++i)
+    {
+        CPPUNIT_ASSERT_EQUAL(first[i].first, second[i].first);
+        CPPUNIT_ASSERT(second[i].second >= first[i].second && (i == 0 || second[i].second >= second[i - 1].second));
+    }
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(2), second.back().second);
+
+    const std::string stats = Metrics::getStats();
+    CPPUNIT_ASSERT(stats.find("test_requests_total{endpoint=a}=2") != std::string::npos);
+    CPPUNIT_ASSERT(stats.find("test_duration_us_p99=3") != std::string::npos);
+}
+
+namespace
+{
+std::string readBody(HttpRequestReader& reader)
+{
+    Poco::MemoryInputStream& body = reader.getBody();
+    return std::string(std::istreambuf_iterator<char>(body), std::istreambuf_iterator<char>());
+}
+
+HttpRequestReader::State consumeString(HttpRequestReader& reader, const std::string& data)
+{
+    std::vector<char> in(data.begin(), data.end());
+    return reader.consume(in);
+}
+}
+
+void WhiteBoxTests::testHttpRequestReader()
+{
+    using State = HttpRequestReader::State;
+
+    // Byte by byte, the pipelined request is left in the buffer.
+    {
+        const std::string data = "POST /lool/convert-to HTTP/1.1\r\nHost: x\r\nContent-Length: 5\r\n\r\n"
+                                 "helloGET / HTTP/1.1\r\n\r\n";
+        HttpRequestReader reader;
+        std::vector<char> in;
+        State state = State::Header;
+        size_t pos = 0;
+        for (; pos < data.size() && state != State::Complete; ++pos)
+        {
+            in.push_back(data[pos]);
+            state = reader.consume(in);
+        }
+
+        CPPUNIT_ASSERT(state == State::Complete);
+        CPPUNIT_ASSERT_EQUAL(std::string("/lool/convert-to"), reader.getRequest().getURI());
+        CPPUNIT_ASSERT_EQUAL(std::string("hello"), readBody(reader));
+        CPPUNIT_ASSERT(in.empty());
+
+        in.insert(in.end(), data.begin() + pos, data.end());
+        reader.reset();
+        CPPUNIT_ASSERT(!reader.hasStarted());
+        CPPUNIT_ASSERT(reader.consume(in) == State::Complete);
+        CPPUNIT_ASSERT_EQUAL(std::string("GET"), reader.getRequest().getMethod());
+        CPPUNIT_ASSERT(in.empty());
+    }
+
+    // Large bodies are spooled, "100 Continue" is asked for once.
+    {
+        std::string body(HttpRequestReader::SpoolThreshold * 3 + 7, 'x');
+        for (size_t i = 0; i < body.size(); ++i)
+            body[i] = 'a' + i % 26;
+
+        const std::string data = "POST /x HTTP/1.1\r\nContent-Length: " + std::to_string(body.size()) +
+                                 "\r\nExpect: 100-continue\r\n\r\n" + body + "tail";
+        HttpRequestReader reader(10 * 1024 * 1024);
+        std::vector<char> in;
+        State state = State::Header;
+        size_t pos = 0;
+        int continues = 0;
+        while (state == State::Header || state == State::Body)
+        {
+            const size_t size = std::min<size_t>(16384, data.size() - pos);
+            in.insert(in.end(), data.begin() + pos, data.begin() + pos + size);
+            pos += size;
+            state = reader.consume(in);
+            continues += reader.takeExpectContinue();
+        }
+
+        CPPUNIT_ASSERT(state == State::Complete);
+        CPPUNIT_ASSERT_EQUAL(1, continues);
+        CPPUNIT_ASSERT(reader.isSpooled());
+        CPPUNIT_ASSERT(readBody(reader) == body);
+        CPPUNIT_ASSERT_EQUAL(std::string("tail"), std::string(in.begin(), in.end()) + data.substr(pos));
+    }
+
+    // Rejected requests.
+    {
+        HttpRequestReader reader(100);
+        CPPUNIT_ASSERT(consumeString(reader, "POST /x HTTP/1.1\r\nContent-Length: 101\r\n\r\n") == State::Error);
+        CPPUNIT_ASSERT_EQUAL(Poco::Net::HTTPResponse::HTTP_REQUESTENTITYTOOLARGE, reader.getErrorStatus());
+    }
+    {
+        HttpRequestReader reader;
+        CPPUNIT_ASSERT(consumeString(reader, "garbage\r\n\r\n") == State::Error);
+        CPPUNIT_ASSERT_EQUAL(Poco::Net::HTTPResponse::HTTP_BAD_REQUEST, reader.getErrorStatus());
+    }
+    {
+        HttpRequestReader reader;
+        CPPUNIT_ASSERT(consumeString(reader, std::string(HttpRequestReader::MaxHeaderSize + 1, 'a')) == State::Error);
+        CPPUNIT_ASSERT_EQUAL(Poco::Net::HTTPResponse::HTTP_BAD_REQUEST, reader.getErrorStatus());
+    }
+    {
+        HttpRequestReader reader;
+        CPPUNIT_ASSERT(consumeString(reader, "POST /x HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n") == State::Error);
+        CPPUNIT_ASSERT_EQUAL(Poco::Net::HTTPResponse::HTTP_LENGTH_REQUIRED, reader.getErrorStatus());
+    }
+
+    // The end of the header split between two reads.
+    const std::string data = "GET /abc HTTP/1.1\r\nA: b\r\n\r\n";
+    for (size_t cut = 1; cut < data.size(); ++cut)
+    {
+        HttpRequestReader reader;
+        std::vector<char> in(data.begin(), data.begin() + cut);
+        CPPUNIT_ASSERT(reader.consume(in) == State::Header);
+        in.insert(in.end(), data.begin() + cut, data.end());
+        CPPUNIT_ASSERT(reader.consume(in) == State::Complete);
+        CPPUNIT_ASSERT_EQUAL(std::string("/abc"), reader.getRequest().getURI());
+    }
+}
+
+void WhiteBoxTests::testPreprocessedFile()
+{
+    using Slot = PreprocessedFile::Slot;
+
+    const auto gunzip = [](const std::string& data)
+    {
+        // Checks the CRC and the size in the trailer too.
+        std::istringstream compressed(data);
+        Poco::InflatingInputStream inflater(compressed, Poco::InflatingStreamBuf::STREAM_GZIP);
+        std::string out;
+        Poco::StreamCopier::copyToString(inflater, out);
+        return out;
+    };
+
+    const std::string data = "<html>%VERSION% 100% sure, %ACCESS_TOKEN%%HOST%%UNKNOWN%"
+                             "width: 50%; %ACCESS_TOKEN_TTL%</html>%";
+    const PreprocessedFile file(data, { { "VERSION", "1.0" } });
+
+    std::vector<std::string> values(static_cast<size_t>(Slot::Count));
+    CPPUNIT_ASSERT_EQUAL(std::string("<html>1.0 100% sure, %UNKNOWN%width: 50%; </html>%"),
+                         file.render(values));
+    CPPUNIT_ASSERT_EQUAL(file.render(values), gunzip(file.renderCompressed(values)));
+
+    values[static_cast<size_t>(Slot::AccessToken)] = "token";
+    values[static_cast<size_t>(Slot::AccessTokenTtl)] = "1234";
+    values[static_cast<size_t>(Slot::Host)] = "ws://localhost:9980";
+    CPPUNIT_ASSERT_EQUAL(std::string("<html>1.0 100% sure, tokenws://localhost:9980%UNKNOWN%"
+                                     "width: 50%; 1234</html>%"),
+                         file.render(values));
+    CPPUNIT_ASSERT_EQUAL(file.render(values), gunzip(file.renderCompressed(values)));
+
+    // Nothing but slots, and nothing at all.
+    const PreprocessedFile slots("%HOST%%ACCESS_TOKEN%", {});
+    CPPUNIT_ASSERT_EQUAL(slots.render(values), gunzip(slots.renderCompressed(values)));
+    const PreprocessedFile empty("", {});
+    CPPUNIT_ASSERT_EQUAL(std::string(), gunzip(empty.renderCompressed(values)));
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(WhiteBoxTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -31,6 +31,7 @@
 #include <Common.hpp>
 #include "common/FileUtil.hpp"
 #include <LOOLWebSocket.hpp>
+#include <TileDesc.hpp>
 #include <Util.hpp>
 
 #ifndef TDOC
@@ -458,6 +459,38 @@ std::vector<char> getTileMessage(LOOLWebSocket& ws, const std::string& name = ""
     return getResponseMessage(ws, "tile", name);
 }
 
+/// Returns the first line of each tile: message until count tiles are received,
+/// splitting the tilecombine: messages the cached tiles are sent in.
+inline
+std::vector<std::string> getTileMessages(const std::shared_ptr<LOOLWebSocket>& ws, const size_t count, const std::string& name = "")
+{
+    std::vector<std::string> tiles;
+    while (tiles.size() < count)
+    {
+        const std::string firstLine = LOOLProtocol::getFirstLine(getTileMessage(*ws, name));
+        if (firstLine.empty())
+        {
+            break;
+        }
+
+        if (LOOLProtocol::matchPrefix("tilecombine:", firstLine))
+        {
+            std::string renderId;
+            LOOLProtocol::getTokenStringFromMessage(firstLine, "renderid", renderId);
+            for (const auto& tile : TileCombined::parse(firstLine).getTiles())
+            {
+                tiles.push_back(tile.serialize("tile:") + (renderId.empty() ? "" : " renderid=" + renderId));
+            }
+        }
+        else
+        {
+            tiles.push_back(firstLine);
+        }
+    }
+
+    return tiles;
+}
+
 inline
 std::vector<char> assertTileMessage(LOOLWebSocket& ws, const std::string& name = "")
 {
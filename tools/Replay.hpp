@@ -10,6 +10,10 @@
 #ifndef INCLUDED_REPLAY_HPP
 #define INCLUDED_REPLAY_HPP
 
+#include <algorithm>
+#include <map>
+#include <vector>
+
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
 
@@ -104,10 +108,15 @@ class Replay : public Poco::Runnable
 {
 public:
 
-    Replay(const std::string& serverUri, const std::string& uri, bool ignoreTiming = true) :
+    /// Replays the trace @speed times faster than it was recorded, and
+    /// each traced session as @users synthetic users of its document.
+    Replay(const std::string& serverUri, const std::string& uri, bool ignoreTiming = true,
+           double speed = 1, unsigned users = 1) :
         _serverUri(serverUri),
         _uri(uri),
-        _ignoreTiming(ignoreTiming)
+        _ignoreTiming(ignoreTiming),
+        _speed(speed > 0 ? speed : 1),
+        _users(std::max(users, 1U))
     {
     }
 
@@ -135,10 +144,12 @@ protected:
 
         auto epochFile(traceFile.getEpochStart());
         auto epochCurrent(std::chrono::steady_clock::now());
+        const auto replayStart = epochCurrent;
 
-        const auto replayDuration = (traceFile.getEpochEnd() - epochFile);
-        std::cout << "Replaying file [" << _uri << "] of " << replayDuration / 1000000. << " second length." << std::endl;
+        std::cout << "Replaying file [" << _uri << "] at " << _speed << "x speed, with "
+                  << _users << " user(s) per session." << std::endl;
 
+        size_t count = 0;
         for (;;)
         {
             const auto rec = traceFile.getNextRecord();
@@ -148,8 +159,10 @@ protected:
                 break;
             }
 
+            ++count;
+
             const auto deltaCurrent = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epochCurrent).count();
-            const auto deltaFile = rec.TimestampNs - epochFile;
+            const auto deltaFile = static_cast<Poco::Int64>((rec.TimestampNs - epochFile) / _speed);
             const auto delay = (_ignoreTiming ? 0 : deltaFile - deltaCurrent);
             if (delay > 0)
             {
@@ -163,6 +176,21 @@ protected:
 
             std::cout << rec.toString() << std::endl;
 
+            if (rec.SessionIndex > _sessions.size())
+            {
+                // The sessions are numbered in order of appearance.
+                std::cout << "ERROR: invalid session index " << rec.SessionIndex << ", only " <<
+                             _sessions.size() << " sessions so far.\n";
+                continue;
+            }
+
+            if (rec.SessionIndex == _sessions.size())
+            {
+                _sessions.emplace_back();
+            }
+
+            SessionData& session = _sessions[rec.SessionIndex];
+
             if (rec.Dir == TraceFileRecord::Direction::Event)
             {
                 // Meta info about about an event.
@@ -174,89 +202,70 @@ protected:
                     const auto uriOrig = rec.Payload.substr(NewSession.size());
                     std::string uri;
                     Poco::URI::decode(uriOrig, uri);
-                    auto it = _sessions.find(uri);
-                    if (it != _sessions.end())
+                    if (!session.Users.empty())
+                    {
+                        std::cout << "ERROR: session [" << rec.SessionId << "] already exists on doc [" << uri << "]\n";
+                    }
+                    else
                     {
-                        // Add a new session.
-                        if (it->second.find(rec.SessionId) != it->second.end())
+                        if (++_documents[uri] == 1)
                         {
-                            std::cout << "ERROR: session [" << rec.SessionId << "] already exists on doc [" << uri << "]\n";
+                            std::cout << "New Document: " << uri << "\n";
                         }
-                        else
+
+                        session.Uri = uri;
+                        for (unsigned i = 0; i < _users; ++i)
                         {
-                            auto connection = Connection::create(_serverUri, uri, rec.SessionId);
+                            const auto sessionId = (_users > 1 ? rec.SessionId + '-' + std::to_string(i) : rec.SessionId);
+                            auto connection = Connection::create(_serverUri, uri, sessionId);
                             if (connection)
                             {
-                                it->second.emplace(rec.SessionId, connection);
+                                session.Users.push_back(connection);
                             }
                         }
                     }
-                    else
-                    {
-                        std::cout << "New Document: " << uri << "\n";
-                        _childToDoc.emplace(rec.Pid, uri);
-                        auto connection = Connection::create(_serverUri, uri, rec.SessionId);
-                        if (connection)
-                        {
-                            _sessions[uri].emplace(rec.SessionId, connection);
-                        }
-                    }
                 }
                 else if (rec.Payload.find(EndSession) == 0)
                 {
-                    const auto uriOrig = rec.Payload.substr(EndSession.size());
-                    std::string uri;
-                    Poco::URI::decode(uriOrig, uri);
-                    auto it = _sessions.find(uri);
-                    if (it != _sessions.end())
+                    if (!session.Uri.empty())
                     {
-                        std::cout << "EndSession [" << rec.SessionId << "]: " << uri << "\n";
+                        std::cout << "EndSession [" << rec.SessionId << "]: " << session.Uri << "\n";
 
-                        it->second.erase(rec.SessionId);
-                        if (it->second.empty())
+                        session.Users.clear();
+                        if (--_documents[session.Uri] == 0)
                         {
-                            std::cout << "End Doc [" << uri << "].\n";
-                            _sessions.erase(it);
-                            _childToDoc.erase(rec.Pid);
+                            std::cout << "End Doc [" << session.Uri << "].\n";
+                            _documents.erase(session.Uri);
                         }
+
+                        session.Uri.clear();
                     }
                     else
                     {
-                        std::cout << "ERROR: Doc [" << uri << "] does not exist.\n";
+                        std::cout << "ERROR: Session [" << rec.SessionId << "] does not exist.\n";
                     }
                 }
             }
             else if (rec.Dir == TraceFileRecord::Direction::Incoming)
             {
-                auto docIt = _childToDoc.find(rec.Pid);
-                if (docIt != _childToDoc.end())
+                if (!session.Users.empty())
                 {
-                    const auto& uri = docIt->second;
-                    auto it = _sessions.find(uri);
-                    if (it != _sessions.end())
+                    // Send the command to every user of the session.
+                    for (auto it = session.Users.begin(); it != session.Users.end(); )
                     {
-                        const auto sessionIt = it->second.find(rec.SessionId);
-                        if (sessionIt != it->second.end())
+                        if ((*it)->send(rec.Payload))
                         {
-                            // Send the command.
-                            if (!sessionIt->second->send(rec.Payload))
-                            {
-                                it->second.erase(sessionIt);
-                            }
+                            ++it;
                         }
                         else
                         {
-                            std::cout << "ERROR: Session [" << rec.SessionId << "] does not exist.\n";
+                            it = session.Users.erase(it);
                         }
                     }
-                    else
-                    {
-                        std::cout << "ERROR: Doc [" << uri << "] does not exist.\n";
-                    }
                 }
                 else
                 {
-                    std::cout << "ERROR: Unknown PID [" << rec.Pid << "] maps to no active document.\n";
+                    std::cout << "ERROR: Session [" << rec.SessionId << "] does not exist.\n";
                 }
             }
             else
@@ -267,6 +276,9 @@ protected:
             epochCurrent = std::chrono::steady_clock::now();
             epochFile = rec.TimestampNs;
         }
+
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - replayStart).count();
+        std::cout << "Replayed " << count << " records of [" << _uri << "] in " << elapsed / 1000. << " seconds." << std::endl;
     }
 
 protected:
@@ -276,11 +288,23 @@ protected:
     /// Should we ignore timing that is saved in the trace file?
     bool _ignoreTiming;
 
-    /// LOK child process PID to Doc URI map.
-    std::map<unsigned, std::string> _childToDoc;
+    /// How many times faster than recorded to replay.
+    const double _speed;
+
+    /// The number of synthetic users replaying each traced session.
+    const unsigned _users;
+
+    struct SessionData
+    {
+        std::string Uri;
+        std::vector<std::shared_ptr<Connection>> Users;
+    };
+
+    /// The traced sessions, by their index in the trace file.
+    std::vector<SessionData> _sessions;
 
-    /// Doc URI to _sessions map. _sessions are maps of SessionID to Connection.
-    std::map<std::string, std::map<std::string, std::shared_ptr<Connection>>> _sessions;
+    /// Doc URI to the number of its active traced sessions.
+    std::map<std::string, unsigned> _documents;
 };
 
 #endif
@@ -42,6 +42,8 @@ public:
     static bool Benchmark;
     static size_t Iterations;
     static bool NoDelay;
+    static double Speed;
+    static unsigned Users;
     unsigned _numClients;
     std::string _serverURI;
 
@@ -88,7 +90,7 @@ class Worker: public Replay
 {
 public:
 
-    Worker(const std::string& serverUri, const std::string& uri) : Replay(serverUri, uri, Stress::NoDelay)
+    Worker(const std::string& serverUri, const std::string& uri) : Replay(serverUri, uri, Stress::NoDelay, Stress::Speed, Stress::Users)
     {
     }
 
@@ -210,6 +212,8 @@ private:
 };
 
 bool Stress::NoDelay = false;
+double Stress::Speed = 1;
+unsigned Stress::Users = 1;
 bool Stress::Benchmark = false;
 size_t Stress::Iterations = 100;
 
@@ -236,6 +240,12 @@ void Stress::defineOptions(OptionSet& optionSet)
                         .argument("iter"));
     optionSet.addOption(Option("nodelay", "", "Replay at full speed disregarding original timing.")
                         .required(false).repeatable(false));
+    optionSet.addOption(Option("speed", "", "Replay this many times faster than the original timing.")
+                        .required(false).repeatable(false)
+                        .argument("factor"));
+    optionSet.addOption(Option("users", "", "Number of synthetic users replaying each traced session.")
+                        .required(false).repeatable(false)
+                        .argument("count"));
     optionSet.addOption(Option("clientsperdoc", "", "Number of simultaneous clients on each doc.")
                         .required(false).repeatable(false)
                         .argument("concurrency"));
@@ -265,6 +275,10 @@ void Stress::handleOption(const std::string& optionName,
         Stress::Iterations = std::max(std::stoi(value), 1);
     else if (optionName == "nodelay")
         Stress::NoDelay = true;
+    else if (optionName == "speed")
+        Stress::Speed = std::max(std::stod(value), 0.001);
+    else if (optionName == "users")
+        Stress::Users = std::max(std::stoi(value), 1);
     else if (optionName == "clientsperdoc")
         _numClients = std::max(std::stoi(value), 1);
     else if (optionName == "server")
@@ -283,7 +297,7 @@ int Stress::main(const std::vector<std::string>& args)
     if (args.size() == 0)
     {
         std::cerr << "Usage: loolstress [--bench] <tracefile | url> " << std::endl;
-        std::cerr << "       Trace files may be plain text or gzipped (with .gz extension)." << std::endl;
+        std::cerr << "       Trace files may be binary or plain text, and gzipped (with .gz extension)." << std::endl;
         std::cerr << "       --help for full arguments list." << std::endl;
         return Application::EXIT_NOINPUT;
     }
@@ -1,6 +1,20 @@
 #include "mergeodf.h"
 
+#include <sys/inotify.h>
 #include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
 
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKitEnums.h>
@@ -12,6 +26,8 @@
 #include <Poco/Delegate.h>
 #include <Poco/Zip/Compress.h>
 #include <Poco/Zip/Decompress.h>
+#include <Poco/Zip/ZipArchive.h>
+#include <Poco/Zip/ZipStream.h>
 #include <Poco/Glob.h>
 #include <Poco/TemporaryFile.h>
 #include <Poco/Format.h>
@@ -74,6 +90,93 @@ const std::string resturl = "/lool/merge-to/";
 const int tokenOpts = StringTokenizer::TOK_IGNORE_EMPTY |
 StringTokenizer::TOK_TRIM;
 
+namespace
+{
+    /// The help of a template, in each flavour: json, another json, yaml.
+    struct TemplateSpec
+    {
+        Poco::Timestamp Modified;
+        Poco::File::FileSize Size;
+        std::string Specs[3];
+        bool Built[3] = { false, false, false };
+    };
+
+    /// By template path. A MergeODF is created for each request, but
+    /// the library stays loaded, and so does the help of the templates.
+    std::mutex SpecCacheMutex;
+    std::map<std::string, TemplateSpec> SpecCache;
+
+    /// The entries of a template, unzipped once: each Parser writes them
+    /// out to its own directory, instead of inflating the template again.
+    /// Directories are named with a trailing slash, and have no data.
+    struct TemplateContents
+    {
+        Poco::Timestamp Modified;
+        Poco::File::FileSize Size;
+        std::vector<std::pair<std::string, std::string>> Entries;
+    };
+
+    /// By template path, as the SpecCache.
+    std::mutex ContentsCacheMutex;
+    std::map<std::string, std::shared_ptr<const TemplateContents>> ContentsCache;
+
+    std::shared_ptr<const TemplateContents> loadTemplateContents(const std::string& templfile)
+    {
+        Poco::File file(templfile);
+        const Poco::Timestamp modified = file.getLastModified();
+        const Poco::File::FileSize size = file.getSize();
+
+        {
+            std::lock_guard<std::mutex> lock(ContentsCacheMutex);
+            const auto it = ContentsCache.find(templfile);
+            if (it != ContentsCache.end() && it->second->Modified == modified && it->second->Size == size)
+                return it->second;
+        }
+
+        auto contents = std::make_shared<TemplateContents>();
+        contents->Modified = modified;
+        contents->Size = size;
+
+        std::ifstream inp(templfile, std::ios::binary);
+        Poco::Zip::ZipArchive archive(inp);
+        for (auto it = archive.fileBegin(); it != archive.fileEnd(); ++it)
+        {
+            if (it->first.find("..") != std::string::npos)
+                throw Poco::DataFormatException("Invalid entry in template " + templfile, it->first);
+
+            std::string data;
+            if (it->second.isFile())
+            {
+                Poco::Zip::ZipInputStream zipin(inp, it->second);
+                Poco::StreamCopier::copyToString(zipin, data);
+            }
+            contents->Entries.emplace_back(it->first, std::move(data));
+        }
+
+        if (contents->Entries.empty())
+            throw Poco::DataFormatException("Empty template", templfile);
+
+        std::lock_guard<std::mutex> lock(ContentsCacheMutex);
+        ContentsCache[templfile] = contents;
+        return contents;
+    }
+
+    /// Drops from the caches the templates no longer listed.
+    void forgetRemovedTemplates(const std::list<std::string>& templsts)
+    {
+        const std::set<std::string> current(templsts.begin(), templsts.end());
+        {
+            std::lock_guard<std::mutex> lock(SpecCacheMutex);
+            for (auto it = SpecCache.begin(); it != SpecCache.end(); )
+                it = (current.count(it->first) ? std::next(it) : SpecCache.erase(it));
+        }
+
+        std::lock_guard<std::mutex> lock(ContentsCacheMutex);
+        for (auto it = ContentsCache.begin(); it != ContentsCache.end(); )
+            it = (current.count(it->first) ? std::next(it) : ContentsCache.erase(it));
+    }
+}
+
 extern "C" MergeODF* create_object()
 {
     return new MergeODF;
@@ -279,36 +382,212 @@ std::string parseVar(std::string roughVar)
     return "";
 }
 
-/// 列目錄內的樣板檔
-std::list<std::string> templLists(bool isBasename)
+namespace
 {
-    std::set<std::string> files;
-    std::list<std::string> rets;
-    Poco::Glob::glob("/usr/share/NDCODFAPI/ODFReport/templates/*.ot[ts]", files);
-
-    for (auto it = files.begin() ; it != files.end(); ++ it)
+    /// The templates by endpoint, kept current by an inotify watch on
+    /// their directories, instead of globbing them for each lookup.
+    /// Templates written there, by templaterepo or anyone else, are
+    /// found on the next lookup.
+    class TemplateRegistry
     {
-        auto afile = *it;
-        auto basename = Poco::Path(afile).getBaseName();
-        if (isBasename)
-            rets.push_back(basename);
-        else
-            rets.push_back(Poco::Path(afile).toString());
-    }
+    public:
+        static TemplateRegistry& instance()
+        {
+            static TemplateRegistry registry;
+            return registry;
+        }
+
+        /// The path of the template of the endpoint, empty if none.
+        std::string find(const std::string& endpoint)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            update();
+            const auto it = _templates.find(endpoint);
+            return (it != _templates.end() ? it->second : std::string());
+        }
+
+        /// The template paths, or their endpoints, in path order.
+        std::list<std::string> list(bool isBasename)
+        {
+            std::vector<std::pair<std::string, std::string>> templates;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                update();
+                templates.assign(_templates.begin(), _templates.end());
+            }
+
+            std::sort(templates.begin(), templates.end(),
+                      [](const std::pair<std::string, std::string>& a,
+                         const std::pair<std::string, std::string>& b)
+                      { return a.second < b.second; });
+
+            std::list<std::string> rets;
+            for (const auto& it : templates)
+                rets.push_back(isBasename ? it.first : it.second);
+            return rets;
+        }
+
+    private:
+        TemplateRegistry() :
+            _inotifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+            _pid(getpid())
+        {
+            _dirs.push_back("/usr/share/NDCODFAPI/ODFReport/templates/");
 #ifdef ENABLE_DEBUG
-    // 可以在 runTimeData/templates 放範例檔案來針對 API 進行測試
-    Poco::Glob::glob("./runTimeData/templates/*.ot[ts]", files);
-    for (auto it = files.begin() ; it != files.end(); ++ it)
-    {
-        auto afile = *it;
-        auto basename = Poco::Path(afile).getBaseName();
-        if (isBasename)
-            rets.push_back(basename);
-        else
-            rets.push_back(Poco::Path(afile).toString());
-    }
+            // 可以在 runTimeData/templates 放範例檔案來針對 API 進行測試
+            _dirs.push_back(Poco::Path("./runTimeData/templates/").absolute().toString());
 #endif
-    return rets;
+            if (_inotifyFd < 0)
+                std::cerr << "mergeodf: inotify_init1 failed: " << strerror(errno) << std::endl;
+
+            rewatch();
+        }
+
+        /// Applies the changes since the last lookup. The forked children
+        /// keep their snapshot, the events are for the parent to read.
+        void update()
+        {
+            if (getpid() != _pid)
+                return;
+
+            // Without a watch, a directory is globbed as before.
+            if (!_unwatched.empty())
+            {
+                rescan();
+                return;
+            }
+
+            alignas(struct inotify_event) char buf[4096];
+            ssize_t len;
+            while ((len = read(_inotifyFd, buf, sizeof(buf))) > 0)
+            {
+                for (char* ptr = buf; ptr < buf + len; )
+                {
+                    const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(ptr);
+                    ptr += sizeof(struct inotify_event) + event->len;
+
+                    if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                    {
+                        // Lost events, or a directory replaced: start over.
+                        rewatch();
+                        return;
+                    }
+
+                    if (event->len > 0)
+                    {
+                        const Poco::Path path(event->name);
+                        const std::string ext = path.getExtension();
+                        if (ext == "ott" || ext == "ots")
+                            resolve(path.getBaseName());
+                    }
+                }
+            }
+        }
+
+        /// The template of an endpoint is the first found, in the order of the directories.
+        void resolve(const std::string& endpoint)
+        {
+            for (const std::string& dir : _dirs)
+            {
+                for (const char* ext : { ".ots", ".ott" })
+                {
+                    const std::string templfile = dir + endpoint + ext;
+                    if (Poco::File(templfile).exists())
+                    {
+                        _templates[endpoint] = templfile;
+                        return;
+                    }
+                }
+            }
+
+            _templates.erase(endpoint);
+        }
+
+        void rescan()
+        {
+            _templates.clear();
+            for (auto dir = _dirs.rbegin(); dir != _dirs.rend(); ++dir)
+            {
+                std::set<std::string> files;
+                Poco::Glob::glob(*dir + "*.ot[ts]", files);
+
+                // In reverse, so that the first ones win.
+                for (auto it = files.rbegin(); it != files.rend(); ++it)
+                    _templates[Poco::Path(*it).getBaseName()] = Poco::Path(*it).toString();
+            }
+        }
+
+        /// (Re)watches the directories, then rescans them.
+        void rewatch()
+        {
+            for (const auto& it : _watches)
+                inotify_rm_watch(_inotifyFd, it.first);
+            _watches.clear();
+            _unwatched.clear();
+
+            for (size_t i = 0; i < _dirs.size(); ++i)
+            {
+                const int wd = inotify_add_watch(_inotifyFd, _dirs[i].c_str(),
+                                                 IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                                 IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF);
+                if (wd >= 0)
+                    _watches[wd] = i;
+                else
+                    _unwatched.push_back(i);
+            }
+
+            // Drop what was queued for the old watches.
+            char buf[4096];
+            while (read(_inotifyFd, buf, sizeof(buf)) > 0)
+                ;
+
+            rescan();
+        }
+
+    private:
+        std::mutex _mutex;
+        const int _inotifyFd;
+        const pid_t _pid;
+        std::vector<std::string> _dirs;
+        std::map<int, size_t> _watches;
+        std::vector<size_t> _unwatched;
+        std::unordered_map<std::string, std::string> _templates;
+    };
+
+    /// Splits /lool/merge-to/<endpoint>[/<action>][?<query>], the endpoint
+    /// being that of a template.
+    bool parseMergeToUri(const std::string& uri, std::string& endpoint, std::string& action,
+                         Poco::URI::QueryParameters& params)
+    {
+        try
+        {
+            const Poco::URI requestUri(uri);
+            const std::string& path = requestUri.getPath();
+            if (path.compare(0, resturl.size(), resturl) != 0)
+                return false;
+
+            const size_t slash = path.find('/', resturl.size());
+            if (slash != std::string::npos && path.find('/', slash + 1) != std::string::npos)
+                return false;
+
+            endpoint = path.substr(resturl.size(), slash == std::string::npos ? std::string::npos
+                                                                              : slash - resturl.size());
+            action = (slash == std::string::npos ? std::string() : path.substr(slash + 1));
+            params = requestUri.getQueryParameters();
+        }
+        catch (const Poco::SyntaxException&)
+        {
+            return false;
+        }
+
+        return !endpoint.empty() && !TemplateRegistry::instance().find(endpoint).empty();
+    }
+}
+
+/// 列目錄內的樣板檔
+std::list<std::string> templLists(bool isBasename)
+{
+    return TemplateRegistry::instance().list(isBasename);
 }
 
 /// 將 xml 內容存回 .xml 檔
@@ -333,7 +612,8 @@ void saveXmlBack(AutoPtr<Poco::XML::Document> docXML,
 
 /// 以檔名開啟
 Parser::Parser(std::string templfile)
-    :success(true),
+    :doctype(DocType::OTHER),
+    success(true),
     picserial(0),
     outAnotherJson(false),
     outYaml(false)
@@ -343,27 +623,19 @@ Parser::Parser(std::string templfile)
 
 /// 以 rest endpoint 開啟
 Parser::Parser(Poco::URI &uri)
-    :success(true),
+    :doctype(DocType::OTHER),
+    success(true),
     picserial(0),
     outAnotherJson(false),
     outYaml(false)
 {
-    //把存在的 .ot[ts] 檔案之路徑生成一個 list
-    auto lsts = templLists(false);
-    for (auto it = lsts.begin(); it != lsts.end(); ++ it)
-    {
-        const auto templfile = *it;
-        auto endpoint = Poco::Path(templfile).getBaseName();
-        if (uri.toString() == (resturl + endpoint) ||
-                uri.toString() == (resturl + endpoint + "?outputPDF") ||
-                uri.toString() == (resturl + endpoint + "?outputPDF=") ||
-                uri.toString() == (resturl + endpoint + "?outputPDF=true") ||
-                uri.toString() == (resturl + endpoint + "?outputPDF=false")
-           )  // 符合 endpoint
-        {
-            extract(templfile);
-            return;
-        }
+    std::string endpoint;
+    std::string action;
+    Poco::URI::QueryParameters params;
+    if (parseMergeToUri(uri.toString(), endpoint, action, params) && action.empty())
+    {
+        extract(TemplateRegistry::instance().find(endpoint));
+        return;
     }
     success = false;
 }
@@ -418,18 +690,27 @@ std::string Parser::getMimeType()
 /// 將樣板檔解開
 void Parser::extract(std::string templfile)
 {
+    const auto contents = loadTemplateContents(templfile);
     extra2 = TemporaryFile::tempName();
+    Poco::File(extra2).createDirectories();
 
-    std::ifstream inp(templfile, std::ios::binary);
-    assert (inp.good());
-    Decompress dec(inp, extra2);
-    dec.decompressAllFiles();
-    assert (!dec.mapping().empty());
-
-    zipfilepaths = dec.mapping();
-    for (auto it = zipfilepaths.begin(); it != zipfilepaths.end(); ++it)
+    zipfilepaths.clear();
+    for (const auto& entry : contents->Entries)
     {
-        const auto fileName = it->second.toString();
+        const auto& fileName = entry.first;
+        const Path path(extra2 + "/" + fileName, Path::PATH_UNIX);
+        if (path.isDirectory())
+        {
+            Poco::File(path).createDirectories();
+            continue;
+        }
+
+        Poco::File(path.parent()).createDirectories();
+        Poco::FileOutputStream fos(path.toString(), std::ios::binary);
+        fos.write(entry.second.data(), entry.second.size());
+        fos.close();
+        zipfilepaths.emplace(fileName, Path(fileName, Path::PATH_UNIX));
+
         if (fileName == "content.xml")
             contentXmlFileName = extra2 + "/" + fileName;
 
@@ -1086,6 +1367,8 @@ std::vector<std::list<Element*>> Parser::scanVarPtr()
             auto Parent_1 = static_cast<Element*>(currentNode->parentNode());
             auto Parent_2 = Parent_1->parentNode();
             while(true){
+                if (!Parent_2)
+                    throw Poco::DataFormatException("Variable out of the text", currentNode->innerText());
                 std::string nodeName = Parent_2->nodeName();
                 if(nodeName == "office:text" || nodeName == "table:table-cell")
                 {
@@ -1109,6 +1392,8 @@ std::vector<std::list<Element*>> Parser::scanVarPtr()
                 else
                 {
                     // If there are different office:annotation name, only take the first grpname as target
+                    if (!grpNodeList->item(0)->lastChild())
+                        throw Poco::DataFormatException("Group annotation without a name");
                     std::string grpname = grpNodeList->item(0)->lastChild()->innerText();
                     Parent_3->setAttribute("grpname", grpname);
                     auto checkDuplicate = std::find(groupVar.begin(), groupVar.end(), Parent_3);
@@ -1148,6 +1433,8 @@ std::vector<std::list<Element*>> Parser::scanVarPtr()
             auto Parent_1 = static_cast<Element*>(currentNode->parentNode());
             auto Parent_2 = static_cast<Element*>(Parent_1->parentNode());
             while(true){
+                if (!Parent_2)
+                    throw Poco::DataFormatException("Variable out of a table", currentNode->innerText());
                 std::string nodeName = Parent_2->nodeName();
                 if(nodeName == "table:table" || nodeName == "table:table-row-group")
                 {
@@ -1177,11 +1464,15 @@ std::vector<std::list<Element*>> Parser::scanVarPtr()
                 else
                 {
                     // If there are different office:annotation name, only take the first grpname as target
+                    if (!grpNodeList->item(0)->lastChild())
+                        throw Poco::DataFormatException("Group annotation without a name");
                     std::string grpname = grpNodeList->item(0)->lastChild()->innerText();
                     //Ensure put attr grpname in the table:table-row not in table:table-row-group!
                     Parent_2 = static_cast<Element*> (Parent_2->firstChild());
                     while(true)
                     {
+                        if (!Parent_2)
+                            throw Poco::DataFormatException("Group " + grpname + " without a row");
                         if (Parent_2->nodeName()=="table:table-row")
                             break;
                         Parent_2 = static_cast<Element*> (Parent_2->firstChild());
@@ -1756,6 +2047,138 @@ void MergeODF::initSQLDB()
     logdb->changeTable();
 }
 
+/// api help of one template, only unzipped and parsed again when it changes
+std::string MergeODF::getTemplateSpec(const std::string& templfile,
+        bool anotherJson,
+        bool yaml)
+{
+    const int flavour = anotherJson ? 1 : yaml ? 2 : 0;
+    Poco::File file(templfile);
+    const Poco::Timestamp modified = file.getLastModified();
+    const Poco::File::FileSize size = file.getSize();
+
+    {
+        std::lock_guard<std::mutex> lock(SpecCacheMutex);
+        TemplateSpec& spec = SpecCache[templfile];
+        if (spec.Modified == modified && spec.Size == size)
+        {
+            if (spec.Built[flavour])
+                return spec.Specs[flavour];
+        }
+        else
+        {
+            spec = TemplateSpec();
+            spec.Modified = modified;
+            spec.Size = size;
+        }
+    }
+
+    // Parsed unlocked, the help of the other templates is still served meanwhile.
+    std::unique_ptr<Parser> parser(new Parser(templfile));
+    parser->setOutputFlags(anotherJson, yaml);
+    const auto endpoint = Poco::Path(templfile).getBaseName();
+
+    std::string buf;
+    if (anotherJson)
+    {
+        buf = "* json 傳遞的 json 資料需以 urlencode(encodeURIComponent) 編碼<br />"
+            "* 圖檔需以 base64 編碼<br />"
+            "* 若以 json 傳參數，則 header 需指定 content-type='application/json'<br /><br />json 範例:<br /><br />";
+        buf += Poco::format("{<br />%s}", parser->jjsonVars());
+    }
+    else if (yaml)
+        buf = Poco::format(YAMLTEMPL, endpoint, endpoint, parser->yamlVars());
+    else
+        buf = Poco::format(APITEMPL, endpoint, endpoint, parser->jsonVars());
+
+    std::lock_guard<std::mutex> lock(SpecCacheMutex);
+    TemplateSpec& spec = SpecCache[templfile];
+    if (spec.Modified == modified && spec.Size == size)
+    {
+        spec.Specs[flavour] = buf;
+        spec.Built[flavour] = true;
+    }
+
+    return buf;
+}
+
+/// unzip and parse every template, so that their first requests find them ready
+void MergeODF::warmupTemplates(unsigned threads)
+{
+    const auto templsts = templLists(false);
+    const std::vector<std::string> templfiles(templsts.begin(), templsts.end());
+    forgetRemovedTemplates(templsts);
+    if (templfiles.empty())
+        return;
+
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    threads = std::min<size_t>(threads, templfiles.size());
+
+    LOG_INF("mergeodf: warming up " << templfiles.size() << " templates with " << threads << " threads.");
+
+    struct WarmupResult
+    {
+        double Ms;
+        std::string Error;
+    };
+    std::vector<WarmupResult> results(templfiles.size());
+    std::atomic<size_t> next(0);
+
+    const auto worker = [&]()
+    {
+        for (size_t i = next++; i < templfiles.size(); i = next++)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            try
+            {
+                // Each flavour of the help parses the variables of the template.
+                getTemplateSpec(templfiles[i], false, false);
+                getTemplateSpec(templfiles[i], true, false);
+                getTemplateSpec(templfiles[i], false, true);
+            }
+            catch (const Poco::Exception& exc)
+            {
+                results[i].Error = exc.displayText();
+            }
+            catch (const std::exception& exc)
+            {
+                results[i].Error = exc.what();
+            }
+            results[i].Ms = std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() - start).count();
+        }
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; ++i)
+        workers.emplace_back(worker);
+    worker();
+    for (auto& it : workers)
+        it.join();
+    const double totalMs = std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0;
+    for (size_t i = 0; i < templfiles.size(); ++i)
+    {
+        if (results[i].Error.empty())
+        {
+            LOG_INF("mergeodf: template [" << templfiles[i] << "] ready in " << results[i].Ms << " ms.");
+        }
+        else
+        {
+            ++failed;
+            LOG_ERR("mergeodf: template [" << templfiles[i] << "] is invalid, after " << results[i].Ms <<
+                    " ms: " << results[i].Error);
+        }
+    }
+
+    LOG_INF("mergeodf: warmed up " << templfiles.size() - failed << " templates in " << totalMs <<
+            " ms, " << failed << " invalid.");
+}
+
 /// api help. yaml&json&json sample(another json)
 std::string MergeODF::makeApiJson(std::string which="",
         bool anotherJson,
@@ -1765,38 +2188,21 @@ std::string MergeODF::makeApiJson(std::string which="",
     std::string jsonstr;
 
     auto templsts = templLists(false);
+
+    forgetRemovedTemplates(templsts);
+
     auto it = templsts.begin();
     for (size_t pos = 0; it != templsts.end(); ++it, pos++)
     {
         try
         {
             const auto templfile = *it;
-            Parser *parser = new Parser(templfile);
-            parser->setOutputFlags(anotherJson, yaml);
-
             auto endpoint = Poco::Path(templfile).getBaseName();
 
             if (!which.empty() && endpoint != which)
                 continue;
 
-
-            std::string buf;
-            std::string parserResult;
-            if (anotherJson)
-            {
-                buf = "* json 傳遞的 json 資料需以 urlencode(encodeURIComponent) 編碼<br />"
-                    "* 圖檔需以 base64 編碼<br />"
-                    "* 若以 json 傳參數，則 header 需指定 content-type='application/json'<br /><br />json 範例:<br /><br />";
-                buf += Poco::format("{<br />%s}", parser->jjsonVars());
-            }
-            else if (yaml)
-                buf = Poco::format(YAMLTEMPL, endpoint, endpoint, parser->yamlVars());
-            else
-                buf = Poco::format(APITEMPL, endpoint, endpoint, parser->jsonVars());
-
-            delete parser;
-
-            jsonstr += buf;
+            jsonstr += getTemplateSpec(templfile, anotherJson, yaml);
 
             if (!which.empty() && endpoint == which)
                 break;
@@ -1830,13 +2236,11 @@ std::string MergeODF::makeApiJson(std::string which="",
 /// validate if match rest uri: /accessTime
 std::string MergeODF::isMergeToQueryAccessTime(std::string uri)
 {
-    auto templsts = templLists(true);
-    for (auto it = templsts.begin(); it != templsts.end(); ++it)
-    {
-        const auto endpoint = *it;
-        if (uri == (resturl + endpoint + "/accessTime"))
-            return endpoint;
-    }
+    std::string endpoint;
+    std::string action;
+    Poco::URI::QueryParameters params;
+    if (parseMergeToUri(uri, endpoint, action, params) && action == "accessTime")
+        return endpoint;
     return "";
 }
 
@@ -1844,32 +2248,31 @@ std::string MergeODF::isMergeToQueryAccessTime(std::string uri)
 std::string MergeODF::isMergeToUri(std::string uri, bool forHelp,
         bool anotherJson, bool yaml)
 {
-    auto templsts = templLists(true);
-    for (auto it = templsts.begin(); it != templsts.end(); ++it)
+    std::string endpoint;
+    std::string action;
+    Poco::URI::QueryParameters params;
+    if (!parseMergeToUri(uri, endpoint, action, params))
+        return "";
+
+    if (forHelp)
     {
-        const auto endpoint = *it;
-        if (forHelp)
-        {
-            if (uri == (resturl + endpoint + "/api"))
-                return endpoint;
-            if (uri == (resturl + endpoint + "/yaml") && yaml)
-                return endpoint;
-            if (uri == (resturl + endpoint + "/json") && anotherJson)
-                return endpoint;
-        }
-        else
-        {
-            //std::cout<<uri<<std::endl;
-            if (uri == (resturl + endpoint) ||
-                    uri == (resturl + endpoint + "?outputPDF=false"))
-                return endpoint;
-            if (uri == (resturl + endpoint + "?outputPDF") ||
-                    uri == (resturl + endpoint + "?outputPDF=") ||
-                    uri == (resturl + endpoint + "?outputPDF=true"))
-                return "pdf";
-        }
+        if (action == "api" ||
+                (action == "yaml" && yaml) ||
+                (action == "json" && anotherJson))
+            return endpoint;
+        return "";
     }
-    return "";
+
+    if (!action.empty())
+        return "";
+
+    // ?outputPDF, ?outputPDF= and ?outputPDF=true, but not ?outputPDF=false
+    for (const auto& param : params)
+    {
+        if (param.first == "outputPDF" && param.second != "false")
+            return "pdf";
+    }
+    return endpoint;
 }
 
 /// validate if match rest uri for /mergeto/[doc]/api
@@ -2168,7 +2571,7 @@ void MergeODF::responseAccessTime(std::weak_ptr<StreamSocket> _socket, std::stri
 
     auto socket = _socket.lock();
     socket->send(oss.str());
-    socket->shutdown();
+    socket->endResponse();
 }
 
 /// http://server/lool/merge-to
@@ -2188,12 +2591,13 @@ void MergeODF::handleMergeTo(std::weak_ptr<StreamSocket> _socket,
             << "Access-Control-Allow-Origin: *" << "\r\n"
             << "Access-Control-Allow-Headers: Origin, X-Requested-With, Content-Type, Accept" << "\r\n"
             << "User-Agent: " << WOPI_AGENT_STRING << "\r\n"
+            << "Content-Length: 0\r\n"
             << "Content-Type: application/json; charset=utf-8\r\n"
             << "X-Content-Type-Options: nosniff\r\n"
             << "\r\n";
         auto socket = _socket.lock();
         socket->send(oss.str());
-        socket->shutdown();
+        socket->endResponse();
         return;
     }
     //Logger setting
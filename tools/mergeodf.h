@@ -208,6 +208,9 @@ public:
                                Poco::MemoryInputStream&);
     virtual int getApiCallTimes(std::string);
     virtual void responseAccessTime(std::weak_ptr<StreamSocket>, std::string);
+    /// Unzips and parses every template, and builds their help, on that
+    /// many threads, 0 for one per core. Logs how long each one took.
+    virtual void warmupTemplates(unsigned threads);
 
 private:
     LogDB *logdb;
@@ -232,6 +235,8 @@ private:
 
     std::string outputODF(std::string);
 
+    std::string getTemplateSpec(const std::string&, bool anotherJson, bool yaml);
+
     const std::string TEMPLH = R"MULTILINE(
 {
     "swagger": "2.0",
@@ -2,6 +2,13 @@
 
 #include <sys/wait.h>
 
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <vector>
+
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKitEnums.h>
 #include <LibreOfficeKit/LibreOfficeKit.hxx>
@@ -12,6 +19,10 @@
 #include <Poco/Delegate.h>
 #include <Poco/Zip/Compress.h>
 #include <Poco/Zip/Decompress.h>
+#include <Poco/Zip/ZipCommon.h>
+#include <Poco/DateTime.h>
+#include <Poco/DigestStream.h>
+#include <Poco/SHA1Engine.h>
 #include <Poco/Glob.h>
 #include <Poco/TemporaryFile.h>
 #include <Poco/Format.h>
@@ -70,6 +81,206 @@ using Poco::Data::SQLite::Utility;
 using Poco::FileChannel;
 using Poco::PatternFormatter;
 
+namespace
+{
+    const std::string RepoPath = "/usr/share/NDCODFAPI/ODFReport/templates/repo/";
+    const std::string InfoFilePath = RepoPath + "myfile.json";
+
+    /// A template of the repo, named as in the archives: <category>/<docname>.<extname>
+    struct RepoTemplate
+    {
+        std::string Name;
+        std::string Path;
+        Poco::Timestamp Modified;
+        std::string Digest;
+    };
+
+    struct FileDigest
+    {
+        Poco::Timestamp Modified;
+        Poco::File::FileSize Size;
+        std::string Digest;
+    };
+
+    /// The following are guarded by RepoMutex.
+    std::mutex RepoMutex;
+    std::map<std::string, FileDigest> DigestCache;
+    Poco::Timestamp InfoModified = 0;
+    Object::Ptr Info;
+    std::string AllTemplatesKey;
+    std::string AllTemplatesZip;
+
+    /// The SHA-1 of the file, hashed again only when its mtime or size changed.
+    std::string fileDigest(const std::string& path, Poco::Timestamp& modified)
+    {
+        Poco::File file(path);
+        modified = file.getLastModified();
+        const Poco::File::FileSize size = file.getSize();
+
+        FileDigest& cached = DigestCache[path];
+        if (cached.Digest.empty() || cached.Modified != modified || cached.Size != size)
+        {
+            std::ifstream istr(path, std::ios::binary);
+            Poco::SHA1Engine sha1;
+            Poco::DigestOutputStream dos(sha1);
+            Poco::StreamCopier::copyStream(istr, dos);
+            dos.close();
+
+            cached.Modified = modified;
+            cached.Size = size;
+            cached.Digest = Poco::DigestEngine::digestToHex(sha1.digest());
+        }
+
+        return cached.Digest;
+    }
+
+    /// myfile.json, parsed again only when it changed.
+    Object::Ptr loadInfo()
+    {
+        const Poco::Timestamp modified = Poco::File(InfoFilePath).getLastModified();
+        if (Info.isNull() || modified != InfoModified)
+        {
+            std::ifstream istr(InfoFilePath);
+            Poco::JSON::Parser parser;
+            Info = parser.parse(istr).extract<Object::Ptr>();
+            InfoModified = modified;
+        }
+
+        return Info;
+    }
+
+    /// The templates listed by category in the object, as in myfile.json.
+    std::vector<RepoTemplate> listTemplates(const Object::Ptr& object)
+    {
+        std::vector<RepoTemplate> templates;
+        for (auto it = object->begin(); it != object->end(); ++it)
+        {
+            Array::Ptr templArray = object->getArray(it->first);
+            if (templArray.isNull())
+                continue;
+
+            for (auto tp = templArray->begin(); tp != templArray->end(); ++tp)
+            {
+                Object::Ptr oData = tp->extract<Object::Ptr>();
+                const std::string endpt = oData->getValue<std::string>("endpt");
+                const std::string docname = oData->getValue<std::string>("docname");
+                const std::string extname = oData->getValue<std::string>("extname");
+
+                RepoTemplate templ;
+                templ.Name = it->first + "/" + docname + "." + extname;
+                templ.Path = RepoPath + endpt + "." + extname;
+                if (!Poco::File(templ.Path).exists())
+                {
+                    LOG_WRN("Template [" << templ.Path << "] of [" << templ.Name << "] is missing.");
+                    continue;
+                }
+
+                templ.Digest = fileDigest(templ.Path, templ.Modified);
+                templates.push_back(templ);
+            }
+        }
+
+        return templates;
+    }
+
+    /// The templates of the repo, and their digests.
+    std::vector<RepoTemplate> repoManifest()
+    {
+        std::vector<RepoTemplate> templates = listTemplates(loadInfo());
+
+        // Forget the templates no longer in the repo.
+        std::set<std::string> paths;
+        for (const RepoTemplate& templ : templates)
+            paths.insert(templ.Path);
+        for (auto it = DigestCache.begin(); it != DigestCache.end(); )
+            it = (paths.count(it->first) ? std::next(it) : DigestCache.erase(it));
+
+        return templates;
+    }
+
+    /// The templates of the repo the client asked for, by category as in
+    /// myfile.json, the client choosing neither the files nor their names.
+    /// @return false if any of them isn't in myfile.json.
+    bool selectTemplates(const Object::Ptr& object, std::vector<RepoTemplate>& templates)
+    {
+        std::map<std::string, RepoTemplate> listed;
+        for (const RepoTemplate& templ : repoManifest())
+            listed.emplace(templ.Name, templ);
+
+        for (auto it = object->begin(); it != object->end(); ++it)
+        {
+            Array::Ptr templArray = object->getArray(it->first);
+            if (templArray.isNull())
+                continue;
+
+            for (auto tp = templArray->begin(); tp != templArray->end(); ++tp)
+            {
+                Object::Ptr oData = tp->extract<Object::Ptr>();
+                const std::string endpt = oData->getValue<std::string>("endpt");
+                const std::string docname = oData->getValue<std::string>("docname");
+                const std::string extname = oData->getValue<std::string>("extname");
+
+                const auto found = listed.find(it->first + "/" + docname + "." + extname);
+                if (found == listed.end() || found->second.Path != RepoPath + endpt + "." + extname)
+                {
+                    LOG_WRN("Template [" << endpt << "." << extname << "] of [" << it->first << "/" <<
+                            docname << "] isn't in the repo.");
+                    return false;
+                }
+
+                templates.push_back(found->second);
+            }
+        }
+
+        return true;
+    }
+
+    /// The digests by name, which clients send back to sync.
+    std::string manifestJson(const std::vector<RepoTemplate>& templates)
+    {
+        Object::Ptr digests = new Object();
+        for (const RepoTemplate& templ : templates)
+            digests->set(templ.Name, templ.Digest);
+
+        std::ostringstream oss;
+        digests->stringify(oss);
+        return oss.str();
+    }
+
+    /// Zips the templates straight from the repo, with the manifest if any.
+    std::string zipTemplates(const std::vector<RepoTemplate>& templates, const std::string& manifest)
+    {
+        std::ostringstream out;
+        Compress c(out, true);
+        for (const RepoTemplate& templ : templates)
+        {
+            // Templates are zip files already.
+            Poco::FileInputStream istr(templ.Path);
+            c.addFile(istr, Poco::DateTime(templ.Modified), Poco::Path(templ.Name, Poco::Path::PATH_UNIX),
+                      Poco::Zip::ZipCommon::CM_STORE);
+        }
+
+        if (!manifest.empty())
+        {
+            std::istringstream istr(manifest);
+            c.addFile(istr, Poco::DateTime(), Poco::Path("manifest.json", Poco::Path::PATH_UNIX));
+        }
+
+        c.close();
+        return out.str();
+    }
+
+    void sendZip(const std::shared_ptr<StreamSocket>& socket, HTTPResponse& response,
+                 const std::string& mimeType, const std::string& zip)
+    {
+        response.setContentType(mimeType);
+        response.setContentLength(zip.size());
+        socket->send(response);
+        socket->send(zip);
+        socket->endResponse();
+    }
+}
+
 extern "C" TemplateRepo* create_object()
 {
     return new TemplateRepo;
@@ -116,7 +327,7 @@ void TemplateRepo::handleAPIHelp(const Poco::Net::HTTPRequest& request, std::wea
                 "config server_name not set");
         response.setContentLength(0);
         socket->send(response);
-        socket->shutdown();
+        socket->endResponse();
         return;
     }
 #endif
@@ -139,7 +350,7 @@ void TemplateRepo::handleAPIHelp(const Poco::Net::HTTPRequest& request, std::wea
     auto socket = _socket.lock();
     socket->send(oss.str());
     //socket->send(read);
-    socket->shutdown();
+    socket->endResponse();
     LOG_INF("Sent api json successfully.");
 
 }
@@ -164,22 +375,70 @@ void TemplateRepo::getInfoFile(std::weak_ptr<StreamSocket> _socket)
     response.set("Access-Control-Allow-Methods", "GET, OPTIONS");
     response.set("Access-Control-Allow-Headers", "Origin, X-Requested-With, Content-Type, Accept");
     HttpHelper::sendFile(socket, infoFilePath, mimeType, response);
-    socket->shutdown();
+    socket->endResponse();
 
 }
 
 void TemplateRepo::downloadAllTemplates(std::weak_ptr<StreamSocket> _socket)
 {
-    std::string zipFilePath = zip_ALL_FILE();
+    std::string zip;
+    {
+        // Zipped again only when a template changed.
+        std::lock_guard<std::mutex> lock(RepoMutex);
+        const std::vector<RepoTemplate> templates = repoManifest();
+        const std::string key = manifestJson(templates);
+        if (key != AllTemplatesKey)
+        {
+            AllTemplatesZip = zipTemplates(templates, std::string());
+            AllTemplatesKey = key;
+        }
+        zip = AllTemplatesZip;
+    }
+
+    HTTPResponse response;
+    auto socket = _socket.lock();
+
+    response.set("Access-Control-Allow-Origin", "*");
+    response.set("Access-Control-Allow-Methods", "GET, OPTIONS");
+    response.set("Access-Control-Allow-Headers", "Origin, X-Requested-With, Content-Type, Accept");
+    sendZip(socket, response, "application/zip", zip);
+}
+
+void TemplateRepo::getManifest(std::weak_ptr<StreamSocket> _socket, const Poco::Net::HTTPRequest& request)
+{
+    std::string manifest;
+    {
+        std::lock_guard<std::mutex> lock(RepoMutex);
+        manifest = manifestJson(repoManifest());
+    }
+
+    Poco::SHA1Engine sha1;
+    sha1.update(manifest);
+    const std::string etag = '"' + Poco::DigestEngine::digestToHex(sha1.digest()) + '"';
+
     HTTPResponse response;
     auto socket = _socket.lock();
-    std::string mimeType = "application/zip";
 
     response.set("Access-Control-Allow-Origin", "*");
     response.set("Access-Control-Allow-Methods", "GET, OPTIONS");
     response.set("Access-Control-Allow-Headers", "Origin, X-Requested-With, Content-Type, Accept");
-    HttpHelper::sendFile(socket, zipFilePath, mimeType, response);
-    socket->shutdown();
+    response.set("ETag", etag);
+    response.set("Cache-Control", "no-cache");
+
+    const auto itMatch = request.find("If-None-Match");
+    if (itMatch != request.end() && itMatch->second == etag)
+    {
+        response.setStatusAndReason(HTTPResponse::HTTP_NOT_MODIFIED);
+        socket->send(response);
+        socket->endResponse();
+        return;
+    }
+
+    response.setContentType("application/json; charset=utf-8");
+    response.setContentLength(manifest.size());
+    socket->send(response);
+    socket->send(manifest);
+    socket->endResponse();
 }
 
 void TemplateRepo::syncTemplates(std::weak_ptr<StreamSocket> _socket,
@@ -199,12 +458,13 @@ void TemplateRepo::syncTemplates(std::weak_ptr<StreamSocket> _socket,
             << "Access-Control-Allow-Origin: *" << "\r\n"
             << "Access-Control-Allow-Headers: Origin, X-Requested-With, Content-Type, Accept" << "\r\n"
             << "User-Agent: " << WOPI_AGENT_STRING << "\r\n"
+            << "Content-Length: 0\r\n"
             << "Content-Type: application/json; charset=utf-8\r\n"
             << "X-Content-Type-Options: nosniff\r\n"
             << "\r\n";
         auto socket = _socket.lock();
         socket->send(oss.str());
-        socket->shutdown();
+        socket->endResponse();
         return;
     }
     if (request.getContentType() == "application/json")
@@ -243,7 +503,7 @@ void TemplateRepo::syncTemplates(std::weak_ptr<StreamSocket> _socket,
                 << rrr;
             auto socket = _socket.lock();
             socket->send(oss.str());
-            socket->shutdown();
+            socket->endResponse();
             return;
         }
     }
@@ -263,133 +523,83 @@ void TemplateRepo::syncTemplates(std::weak_ptr<StreamSocket> _socket,
             << rrr;
         auto socket = _socket.lock();
         socket->send(oss.str());
-        socket->shutdown();
+        socket->endResponse();
         return;
     }
 
-    std::string zipFilePath = zip_DIFF_FILE(object);
-    std::cout << zipFilePath << std::endl;
     HTTPResponse response;
     auto socket = _socket.lock();
-    std::string mimeType = "application/octet-stream";
 
     response.set("Access-Control-Allow-Origin", "*");
     response.set("Access-Control-Allow-Methods", "POST, OPTIONS");
     response.set("Access-Control-Allow-Headers", "Origin, X-Requested-With, Content-Type, Accept");
-    response.set("Content-Disposition", "attachment; filename=\"sync.zip\"");
-    HttpHelper::sendFile(socket, zipFilePath, mimeType, response);
-    socket->shutdown();
-}
-
-void createDirectory(std::string filePath)
-{
-    Poco::File dir(Poco::Path(filePath, Poco::Path::PATH_UNIX));
-    dir.createDirectories();
-}
 
-Object::Ptr JSON_FROM_FILE(){
-    std::ifstream inFile;
-    std::string line;
-    inFile.open("/usr/share/NDCODFAPI/ODFReport/templates/repo/myfile.json");
-    while(std::getline(inFile, line))
+    std::string zip;
+    if (object->isObject("digests"))
     {
-        std::cout << line << "\n";
-    }
-    Poco::JSON::Parser parser;
-    Var result = parser.parse(line);
-    Object::Ptr object;
-    object = result.extract<Object::Ptr>();
-    return object;
-}
-std::string zip_ALL_FILE()
-{
-    //Create temp dir
-    //
-    //
-    std::string templatePath = "/usr/share/NDCODFAPI/ODFReport/templates/repo/";
-
-    std::string extra2;
-    extra2 = TemporaryFile::tempName();
-    createDirectory(extra2);
-    Object::Ptr object;
-    object = JSON_FROM_FILE();
-    for(auto it = object->begin();it!=object->end();it++){
-        createDirectory(extra2 + "/" + it->first);
-        Array::Ptr templArray = object->getArray(it->first);
-        std::string extraPath = extra2 + "/" + it->first + "/";
-        for(auto tp = templArray->begin();tp!=templArray->end();tp++)
+        // The client sent the digests of what it has, as in the manifest:
+        // it gets what changed, and the manifest to drop what was removed.
+        Object::Ptr digests = object->getObject("digests");
+        std::vector<RepoTemplate> changed;
+        std::string manifest;
+        bool removed = false;
         {
-            Object::Ptr oData = tp->extract<Object::Ptr>();
-            std::string endpt = oData->getValue<std::string>("endpt");
-            std::string docname = oData->getValue<std::string>("docname");
-            std::string extname = oData->getValue<std::string>("extname");
-            std::string oFilePath = templatePath + endpt + "." + extname;
-            std::string nFilePath = extra2 + "/" + it->first + "/" + docname + "." + extname;
-            std::string oFileName = endpt + "." + extname;
-            std::string nFileName = docname + "." + extname;
-            Poco::File oFile(templatePath+endpt + "." + extname);
-            oFile.copyTo(extraPath);
-            Poco::File nFile(extraPath + oFileName);
-            nFile.renameTo(extraPath + nFileName);
-        }
-
-    }
-
-    //zip the dir
-    const auto zip2 = extra2 + ".zip";
-
-    std::ofstream out(zip2, std::ios::binary);
-    Compress c(out, true);
+            std::lock_guard<std::mutex> lock(RepoMutex);
+            const std::vector<RepoTemplate> templates = repoManifest();
+            std::set<std::string> names;
+            for (const RepoTemplate& templ : templates)
+            {
+                names.insert(templ.Name);
+                if (!digests->has(templ.Name) || digests->getValue<std::string>(templ.Name) != templ.Digest)
+                    changed.push_back(templ);
+            }
 
-    c.addRecursive(extra2);
-    c.close();
-    return zip2;
-}
+            for (auto it = digests->begin(); it != digests->end() && !removed; ++it)
+                removed = (names.count(it->first) == 0);
 
+            manifest = manifestJson(templates);
+        }
 
-std::string zip_DIFF_FILE(Object::Ptr object)
-{
-    //Create temp dir
-    std::string templatePath = "/usr/share/NDCODFAPI/ODFReport/templates/repo/";
-
-    std::string extra2;
-    extra2 = TemporaryFile::tempName();
-    createDirectory(extra2);
-    for(auto it = object->begin();it!=object->end();it++){
-        createDirectory(extra2 + "/" + it->first);
-        Array::Ptr templArray = object->getArray(it->first);
-        std::string extraPath = extra2 + "/" + it->first + "/";
-        for(auto tp = templArray->begin();tp!=templArray->end();tp++)
+        if (changed.empty() && !removed)
         {
-            Object::Ptr oData = tp->extract<Object::Ptr>();
-            std::string endpt = oData->getValue<std::string>("endpt");
-            std::string docname = oData->getValue<std::string>("docname");
-            std::string extname = oData->getValue<std::string>("extname");
-            std::string oFilePath = templatePath + endpt + "." + extname;
-            std::string nFilePath = extra2 + "/" + it->first + "/" + docname + "." + extname;
-            std::string oFileName = endpt + "." + extname;
-            std::string nFileName = docname + "." + extname;
-            Poco::File oFile(templatePath+endpt + "." + extname);
-            oFile.copyTo(extraPath);
-            Poco::File nFile(extraPath + oFileName);
-            nFile.renameTo(extraPath + nFileName);
+            response.setStatusAndReason(HTTPResponse::HTTP_NO_CONTENT);
+            socket->send(response);
+            socket->endResponse();
+            return;
         }
 
+        zip = zipTemplates(changed, manifest);
     }
+    else
+    {
+        // The templates the client asked for, by category, as listed in myfile.json.
+        std::vector<RepoTemplate> templates;
+        bool listed = false;
+        {
+            std::lock_guard<std::mutex> lock(RepoMutex);
+            listed = selectTemplates(object, templates);
+        }
 
-    //zip the dir
-    const auto zip2 = extra2 + ".zip";
+        if (!listed)
+        {
+            response.setStatusAndReason(HTTPResponse::HTTP_UNAUTHORIZED, "Unknown template");
+            response.setContentLength(0);
+            socket->send(response);
+            socket->endResponse();
+            return;
+        }
 
-    std::ofstream out(zip2, std::ios::binary);
-    Compress c(out, true);
+        zip = zipTemplates(templates, std::string());
+    }
 
-    c.addRecursive(extra2);
-    c.close();
-    return zip2;
+    response.set("Content-Disposition", "attachment; filename=\"sync.zip\"");
+    sendZip(socket, response, "application/octet-stream", zip);
 }
+
 void TemplateRepo::doTemplateRepo(std::weak_ptr<StreamSocket> _socket, const Poco::Net::HTTPRequest& request, Poco::MemoryInputStream& message)
 {
-
+    // Answered here rather than from a forked process: wsd waited for
+    // it anyway, and it lost whatever the socket couldn't take at once.
     HTTPResponse response;
     auto socket = _socket.lock();
 
@@ -398,76 +608,52 @@ void TemplateRepo::doTemplateRepo(std::weak_ptr<StreamSocket> _socket, const Poc
     response.set("Access-Control-Allow-Headers",
             "Origin, X-Requested-With, Content-Type, Accept");
 
-    Process::PID pid = fork();
-    if (pid < 0)
-    {
-        response.setStatusAndReason
-            (HTTPResponse::HTTP_SERVICE_UNAVAILABLE,
-             "error loading mergeodf");
-        response.setContentLength(0);
-        socket->send(response);
-        socket->shutdown();
-        _exit(Application::EXIT_SOFTWARE);
-        return;
-    }
-    else if (pid == 0)
+    try
     {
-        if ((pid = fork()) < 0)
+        if (request.getMethod() == HTTPRequest::HTTP_GET &&
+                request.getURI()=="/lool/templaterepo/list")
         {
-            response.setStatusAndReason(
-                    HTTPResponse::HTTP_SERVICE_UNAVAILABLE,
-                    "error loading mergeodf");
-            response.setContentLength(0);
-            socket->send(response);
-            socket->shutdown();
-            _exit(Application::EXIT_SOFTWARE);
-            return;
+            getInfoFile(socket);
         }
-        else if (pid > 0)
+        else if (request.getMethod() == HTTPRequest::HTTP_GET &&
+                 request.getURI()=="/lool/templaterepo/download")
         {
-            if (request.getMethod() == HTTPRequest::HTTP_GET &&
-                    request.getURI()=="/lool/templaterepo/list")
-            {
-                getInfoFile(socket);
-            }
-            else if (request.getMethod() == HTTPRequest::HTTP_GET &&
-                     request.getURI()=="/lool/templaterepo/download")
-            {
-                downloadAllTemplates(socket);
-            }
-            else if ((request.getMethod() == HTTPRequest::HTTP_POST ||
-                      request.getMethod() == HTTPRequest::HTTP_OPTIONS) &&
-                     request.getURI()=="/lool/templaterepo/sync")
-            {
-                syncTemplates(socket, request, message);
-            }
-            else if (request.getMethod() == HTTPRequest::HTTP_GET &&
-                     isTemplateRepoHelpUri(request.getURI()))
-            {  // /lool/tempalterepo/api
-                handleAPIHelp(request, socket);
-            }
-            else
-            {
-                response.setStatusAndReason(
-                        HTTPResponse::HTTP_SERVICE_UNAVAILABLE,
-                        "No such Route");
-                response.setContentLength(0);
-                socket->send(response);
-                socket->shutdown();
-                _exit(Application::EXIT_SOFTWARE);
-                return;
-            }
-            _exit(Application::EXIT_SOFTWARE);
-            return;
+            downloadAllTemplates(socket);
+        }
+        else if (request.getMethod() == HTTPRequest::HTTP_GET &&
+                 request.getURI()=="/lool/templaterepo/manifest")
+        {
+            getManifest(socket, request);
+        }
+        else if ((request.getMethod() == HTTPRequest::HTTP_POST ||
+                  request.getMethod() == HTTPRequest::HTTP_OPTIONS) &&
+                 request.getURI()=="/lool/templaterepo/sync")
+        {
+            syncTemplates(socket, request, message);
+        }
+        else if (request.getMethod() == HTTPRequest::HTTP_GET &&
+                 isTemplateRepoHelpUri(request.getURI()))
+        {  // /lool/tempalterepo/api
+            handleAPIHelp(request, socket);
         }
         else
         {
-            _exit(Application::EXIT_SOFTWARE);
+            response.setStatusAndReason(
+                    HTTPResponse::HTTP_SERVICE_UNAVAILABLE,
+                    "No such Route");
+            response.setContentLength(0);
+            socket->send(response);
+            socket->endResponse();
         }
     }
-    else
+    catch (const std::exception& exc)
     {
-        std::cout << "call from parent" << std::endl;
-        waitpid(pid, NULL, 0); // 父程序呼叫waitpid(), 等待子程序終結,並捕獲返回狀態
+        LOG_ERR("Template repo request [" << request.getURI() << "] failed: " << exc.what());
+        response.setStatusAndReason(
+                HTTPResponse::HTTP_INTERNAL_SERVER_ERROR,
+                "template repo error");
+        response.setContentLength(0);
+        socket->send(response);
+        socket->shutdown();
     }
 }
@@ -38,10 +38,6 @@ using Poco::JSON::Object;
 typedef Poco::Tuple<std::string, std::string> VarData;
 
 std::list<std::string> templLists(bool);
-std::string zip_ALL_FILE();
-std::string zip_DIFF_FILE(Object::Ptr);
-Object::Ptr JSON_FROM_FILE();
-void createDirectroy(std::string);
 
 class TemplateRepo
 {
@@ -51,6 +47,7 @@ public:
     virtual void doTemplateRepo(std::weak_ptr<StreamSocket>, const Poco::Net::HTTPRequest& , Poco::MemoryInputStream&);
 
     virtual void getInfoFile(std::weak_ptr<StreamSocket>);
+    virtual void getManifest(std::weak_ptr<StreamSocket>, const Poco::Net::HTTPRequest&);
     virtual void syncTemplates(std::weak_ptr<StreamSocket>, const Poco::Net::HTTPRequest& , Poco::MemoryInputStream&);
     virtual void downloadAllTemplates(std::weak_ptr<StreamSocket>);
     virtual std::string makeApiJson(std::string,
@@ -80,6 +77,15 @@ paths:
                 type: array
                 items: 
                   $ref: '#/definitions/Category'
+  /lool/templaterepo/manifest:
+    get:
+      responses:
+        '200':
+          description: Success
+          schema:
+            $ref: '#/definitions/Digests'
+        '304':
+          description: Not modified
   /lool/templaterepo/sync:
     post:
       consumes:
@@ -89,6 +95,8 @@ paths:
       responses:
         '200':
           description: Success
+        '204':
+          description: Up to date
         '401':
           description: Json data error
 schemes:
@@ -118,7 +126,12 @@ definitions:
         type: string
       docname:
         type: string
-        
+  Digests:
+    type: object
+    description: SHA-1 of each template, by <category>/<docname>.<extname>
+    additionalProperties:
+      type: string
+
 parameters:
   Sync:
     in: body
@@ -132,6 +145,8 @@ parameters:
           type: array
           items: 
             $ref: '#/definitions/Category'
+        digests:
+          $ref: '#/definitions/Digests'
 
 )MULTILINE";
 };
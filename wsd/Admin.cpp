@@ -9,6 +9,7 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <cassert>
 #include <mutex>
 #include <sys/poll.h>
@@ -105,7 +106,11 @@ void AdminSocketHandler::handleMessage(bool /* fin */, WSOpCode /* code */,
              tokens[0] == "active_users_count" ||
              tokens[0] == "active_docs_count" ||
              tokens[0] == "mem_stats" ||
-             tokens[0] == "cpu_stats")
+             tokens[0] == "cpu_stats" ||
+             tokens[0] == "doc_stats" ||
+             tokens[0] == "evictions" ||
+             tokens[0] == "ws_compression" ||
+             tokens[0] == "metrics")
     {
         const std::string result = model.query(tokens[0]);
         if (!result.empty())
@@ -306,11 +311,19 @@ Admin::Admin() :
     _model(AdminModel()),
     _forKitPid(-1),
     _lastTotalMemory(0),
+    _totalMemKb(0),
+    _cpuUsage(0),
     _memStatsTaskIntervalMs(5000),
-    _cpuStatsTaskIntervalMs(5000)
+    _cpuStatsTaskIntervalMs(5000),
+    _sampler([this](const ProcSampler::Snapshot& snapshot)
+             {
+                 addCallback([this, snapshot]{ applySnapshot(snapshot); });
+             })
 {
     LOG_INF("Admin ctor.");
 
+    _sampler.setInterval(std::min<int>(_memStatsTaskIntervalMs, _cpuStatsTaskIntervalMs));
+
     const auto totalMem = getTotalMemoryUsage();
     LOG_TRC("Total memory used: " << totalMem);
     _model.addMemStats(totalMem);
@@ -319,6 +332,7 @@ Admin::Admin() :
 Admin::~Admin()
 {
     LOG_INF("~Admin dtor.");
+    _sampler.stop();
 }
 
 void Admin::pollingThread()
@@ -337,7 +351,7 @@ void Admin::pollingThread()
             std::chrono::duration_cast<std::chrono::milliseconds>(now - lastCPU).count();
         if (cpuWait <= 0)
         {
-            // TODO: implement me ...
+            _model.addCpuStats(_cpuUsage);
             lastCPU = now;
             cpuWait += _cpuStatsTaskIntervalMs;
         }
@@ -367,6 +381,7 @@ void Admin::pollingThread()
 
 void Admin::addDoc(const std::string& docKey, Poco::Process::PID pid, const std::string& filename, const std::string& sessionId, const std::string& userName, const std::string& fileId)
 {
+    _sampler.addDocument(docKey, pid);
     addCallback([this, docKey, pid, filename, sessionId, userName, fileId]
                  { _model.addDocument(docKey, pid, filename, sessionId, userName, fileId); });
 }
@@ -380,12 +395,18 @@ void Admin::rmDoc(const std::string& docKey, const std::string& sessionId)
 void Admin::rmDoc(const std::string& docKey)
 {
     LOG_INF("Removing complete doc [" << docKey << "] from Admin.");
-    addCallback([this, docKey]{ _model.removeDocument(docKey); });
+    _sampler.removeDocument(docKey);
+    addCallback([this, docKey]
+                 {
+                     _model.removeDocument(docKey);
+                     _pendingEvictions.erase(docKey);
+                 });
 }
 
 void Admin::rescheduleMemTimer(unsigned interval)
 {
     _memStatsTaskIntervalMs = interval;
+    _sampler.setInterval(std::min<int>(_memStatsTaskIntervalMs, _cpuStatsTaskIntervalMs));
     LOG_INF("Memory stats interval changed - New interval: " << interval);
     wakeup();
 }
@@ -393,12 +414,17 @@ void Admin::rescheduleMemTimer(unsigned interval)
 void Admin::rescheduleCpuTimer(unsigned interval)
 {
     _cpuStatsTaskIntervalMs = interval;
+    _sampler.setInterval(std::min<int>(_memStatsTaskIntervalMs, _cpuStatsTaskIntervalMs));
     LOG_INF("CPU stats interval changed - New interval: " << interval);
     wakeup();
 }
 
 unsigned Admin::getTotalMemoryUsage()
 {
+    // Once sampled, the ProcSampler keeps this up-to-date.
+    if (_totalMemKb > 0)
+        return _totalMemKb;
+
     // To simplify and clarify this; since load, link and pre-init all
     // inside the forkit - we should account all of our fixed cost of
     // memory to the forkit; and then count only dirty pages in the clients
@@ -411,6 +437,80 @@ unsigned Admin::getTotalMemoryUsage()
     return totalMem;
 }
 
+void Admin::applySnapshot(const ProcSampler::Snapshot& snapshot)
+{
+    size_t kitsDirtyKb = 0;
+    for (const auto& kit : snapshot.Kits)
+    {
+        const int dirty = _model.addDocumentSample(kit.DocKey, kit.DirtyKb, kit.CpuPercent);
+        kitsDirtyKb += std::max(dirty, 0);
+    }
+
+    _totalMemKb = snapshot.BaseMemKb + kitsDirtyKb;
+    _cpuUsage = snapshot.TotalCpuPercent;
+
+    triggerMemoryCleanup(_totalMemKb);
+}
+
+void Admin::triggerMemoryCleanup(size_t totalMem)
+{
+    static const size_t memLimitKb = LOOLWSD::getConfigValue<unsigned int>("memory.limit_kb", 0);
+    static const size_t lowWatermarkKb = memLimitKb *
+        std::min(LOOLWSD::getConfigValue<unsigned int>("memory.low_watermark_percent", 80), 100U) / 100;
+    static const std::time_t minIdleSecs = LOOLWSD::getConfigValue<unsigned int>("memory.min_idle_secs", 300);
+
+    // Forget evictions that never completed (i.e. the save failed),
+    // so the documents can be picked again.
+    const std::time_t now = std::time(nullptr);
+    size_t pendingKb = 0;
+    for (auto it = _pendingEvictions.begin(); it != _pendingEvictions.end(); )
+    {
+        if (now - it->second.first > EvictionTimeoutSecs)
+        {
+            LOG_WRN("Doc [" << it->first << "] was not unloaded in time.");
+            it = _pendingEvictions.erase(it);
+        }
+        else
+        {
+            pendingKb += it->second.second;
+            ++it;
+        }
+    }
+
+    if (memLimitKb == 0 || totalMem <= memLimitKb)
+        return;
+
+    // The memory of the documents being unloaded is about to be released.
+    if (totalMem <= lowWatermarkKb + pendingKb)
+        return;
+
+    size_t memToFreeKb = totalMem - lowWatermarkKb - pendingKb;
+    LOG_WRN("Total memory used (" << totalMem << " KB) exceeds the limit of " << memLimitKb <<
+            " KB. Unloading idle documents to free " << memToFreeKb << " KB.");
+
+    for (const auto& doc : _model.getEvictionCandidates(minIdleSecs))
+    {
+        if (memToFreeKb == 0)
+            break;
+
+        if (doc.Mem <= 0 || _pendingEvictions.find(doc.DocKey) != _pendingEvictions.end())
+            continue;
+
+        LOG_INF("Unloading doc [" << doc.DocKey << "] of kit [" << doc.Pid << "], idle for " <<
+                doc.IdleTime << " secs, using " << doc.Mem << " KB.");
+        _pendingEvictions.emplace(doc.DocKey, std::make_pair(now, static_cast<size_t>(doc.Mem)));
+        _model.addEviction(doc.DocKey, doc.Mem);
+
+        // Saves first, if modified.
+        LOOLWSD::unloadDocument(doc.DocKey, "memorypressure");
+
+        memToFreeKb -= std::min(static_cast<size_t>(doc.Mem), memToFreeKb);
+    }
+
+    if (memToFreeKb > 0)
+        LOG_WRN("Not enough idle documents to unload, still " << memToFreeKb << " KB over.");
+}
+
 unsigned Admin::getMemStatsInterval()
 {
     return _memStatsTaskIntervalMs;
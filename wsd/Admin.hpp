@@ -14,6 +14,7 @@
 
 #include "AdminModel.hpp"
 #include "Log.hpp"
+#include "ProcSampler.hpp"
 
 #include "net/WebSocketHandler.hpp"
 
@@ -64,6 +65,7 @@ public:
     {
         // FIXME: not if admin console is not enabled ?
         startThread();
+        _sampler.start();
     }
 
     /// Custom poll thread function
@@ -83,7 +85,11 @@ public:
     /// Remove the document with all views. Used on termination or catastrophic failure.
     void rmDoc(const std::string& docKey);
 
-    void setForKitPid(const int forKitPid) { _forKitPid = forKitPid; }
+    void setForKitPid(const int forKitPid)
+    {
+        _forKitPid = forKitPid;
+        _sampler.setForKitPid(forKitPid);
+    }
 
     /// Callers must ensure that modelMutex is acquired
     AdminModel& getModel();
@@ -101,6 +107,14 @@ public:
 
     void dumpState(std::ostream& os) override;
 
+private:
+    /// Update the model with the usage collected by the sampler.
+    void applySnapshot(const ProcSampler::Snapshot& snapshot);
+
+    /// When we use more memory than configured, unload the
+    /// coldest documents until we are under the low watermark.
+    void triggerMemoryCleanup(size_t totalMem);
+
 private:
     /// The model is accessed only during startup & in
     /// the Admin Poll thread.
@@ -108,8 +122,22 @@ private:
     int _forKitPid;
     long _lastTotalMemory;
 
+    /// The total memory and CPU usage of the last sample.
+    size_t _totalMemKb;
+    unsigned _cpuUsage;
+
+    /// Documents we asked to unload, but haven't gone yet,
+    /// with the time of the request and their dirty memory.
+    std::map<std::string, std::pair<std::time_t, size_t>> _pendingEvictions;
+
+    /// Seconds after which a pending eviction is considered failed.
+    static constexpr std::time_t EvictionTimeoutSecs = 60;
+
     std::atomic<int> _memStatsTaskIntervalMs;
     std::atomic<int> _cpuStatsTaskIntervalMs;
+
+    /// Samples /proc on its own thread; must be the last member.
+    ProcSampler _sampler;
 };
 
 #endif
@@ -11,6 +11,7 @@
 
 #include "AdminModel.hpp"
 
+#include <algorithm>
 #include <memory>
 #include <set>
 #include <sstream>
@@ -21,8 +22,10 @@
 #include <Poco/URI.h>
 
 #include "Protocol.hpp"
+#include "net/WebSocketDeflate.hpp"
 #include "net/WebSocketHandler.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "Unit.hpp"
 #include "Util.hpp"
 
@@ -126,6 +129,33 @@ std::string Document::to_string() const
     return oss.str();
 }
 
+void Document::addSample(int dirty, unsigned cpuPercent)
+{
+    _memHistory.push(dirty);
+    _cpuHistory.push(cpuPercent);
+}
+
+std::string Document::getStats() const
+{
+    std::ostringstream oss;
+    oss << "{"
+        << "\"pid\"" << ":" << this->getPid() << ","
+        << "\"mem\"" << ":[";
+    for (std::size_t i = 0; i < _memHistory.size(); ++i)
+    {
+        oss << (i ? "," : "") << _memHistory[i];
+    }
+
+    oss << "],\"cpu\"" << ":[";
+    for (std::size_t i = 0; i < _cpuHistory.size(); ++i)
+    {
+        oss << (i ? "," : "") << _cpuHistory[i];
+    }
+
+    oss << "]}";
+    return oss.str();
+}
+
 bool Subscriber::notify(const std::string& message)
 {
     // If there is no socket, then return false to
@@ -239,6 +269,22 @@ std::string AdminModel::query(const std::string& command)
     {
         return std::to_string(_cpuStatsSize);
     }
+    else if (token == "doc_stats")
+    {
+        return getDocumentsStats();
+    }
+    else if (token == "evictions")
+    {
+        return "count=" + std::to_string(_evictionCount) + " mem=" + std::to_string(_evictedMemKb);
+    }
+    else if (token == "ws_compression")
+    {
+        return WebSocketDeflate::getStats();
+    }
+    else if (token == "metrics")
+    {
+        return Metrics::getStats();
+    }
     else if (token == "mac_list")
     {
         return getMacList();
@@ -620,4 +666,79 @@ void AdminModel::updateMemoryDirty(const std::string& docKey, int dirty)
     }
 }
 
+int AdminModel::addDocumentSample(const std::string& docKey, int dirty, unsigned cpuPercent)
+{
+    assertCorrectThread();
+
+    auto docIt = _documents.find(docKey);
+    if (docIt == _documents.end())
+        return 0;
+
+    if (dirty >= 0)
+        updateMemoryDirty(docKey, dirty);
+
+    docIt->second.addSample(docIt->second.getMemoryDirty(), cpuPercent);
+    return docIt->second.getMemoryDirty();
+}
+
+std::vector<DocBasicInfo> AdminModel::getEvictionCandidates(std::time_t minIdleSecs) const
+{
+    assertCorrectThread();
+
+    std::vector<DocBasicInfo> docs;
+    docs.reserve(_documents.size());
+    for (const auto& it : _documents)
+    {
+        if (!it.second.isExpired() && it.second.getIdleTime() >= minIdleSecs)
+        {
+            docs.emplace_back(it.first, it.second.getPid(),
+                              it.second.getIdleTime(), it.second.getMemoryDirty());
+        }
+    }
+
+    std::sort(docs.begin(), docs.end(),
+              [](const DocBasicInfo& a, const DocBasicInfo& b)
+              {
+                  const double coldA = static_cast<double>(a.IdleTime) * std::max(a.Mem, 1);
+                  const double coldB = static_cast<double>(b.IdleTime) * std::max(b.Mem, 1);
+                  return coldA > coldB;
+              });
+
+    return docs;
+}
+
+void AdminModel::addEviction(const std::string& docKey, int dirty)
+{
+    assertCorrectThread();
+
+    ++_evictionCount;
+    _evictedMemKb += std::max(dirty, 0);
+
+    auto docIt = _documents.find(docKey);
+    if (docIt != _documents.end())
+    {
+        notify("evictdoc " + std::to_string(docIt->second.getPid()) + ' ' + std::to_string(dirty));
+    }
+}
+
+std::string AdminModel::getDocumentsStats() const
+{
+    assertCorrectThread();
+
+    std::ostringstream oss;
+    oss << "{\"documents\":[";
+    std::string separator;
+    for (const auto& it : _documents)
+    {
+        if (!it.second.isExpired())
+        {
+            oss << separator << it.second.getStats();
+            separator = ",";
+        }
+    }
+
+    oss << "]}";
+    return oss.str();
+}
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,9 +10,11 @@
 #ifndef INCLUDED_ADMINMODEL_HPP
 #define INCLUDED_ADMINMODEL_HPP
 
+#include <array>
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <Poco/Process.h>
 
@@ -46,6 +48,40 @@ private:
     std::time_t _end = 0;
 };
 
+/// A fixed-size ring buffer holding the last Size samples.
+template <typename T, std::size_t Size>
+class SampleRing
+{
+public:
+    SampleRing() :
+        _next(0),
+        _count(0)
+    {
+    }
+
+    void push(const T& value)
+    {
+        _data[_next] = value;
+        _next = (_next + 1) % Size;
+        if (_count < Size)
+            ++_count;
+    }
+
+    std::size_t size() const { return _count; }
+    bool empty() const { return _count == 0; }
+
+    /// Returns the i-th oldest sample.
+    const T& operator[](std::size_t i) const { return _data[(_next + Size - _count + i) % Size]; }
+
+    /// Returns the most recent sample.
+    const T& back() const { return (*this)[_count - 1]; }
+
+private:
+    std::array<T, Size> _data;
+    std::size_t _next;
+    std::size_t _count;
+};
+
 /// A document in Admin controller.
 class Document
 {
@@ -86,6 +122,13 @@ public:
     bool updateMemoryDirty(int dirty);
     int getMemoryDirty() const { return _memoryDirty; }
 
+    /// Record a sample of the Kit process usage.
+    void addSample(int dirty, unsigned cpuPercent);
+    unsigned getCpuUsage() const { return _cpuHistory.empty() ? 0 : _cpuHistory.back(); }
+
+    /// Returns the recent memory and CPU samples as JSON.
+    std::string getStats() const;
+
     std::pair<std::time_t, std::string> getSnapshot() const;
     const std::string getHistory() const;
     void takeSnapshot();
@@ -106,6 +149,10 @@ private:
     /// The dirty (ie. un-shared) memory of the document's Kit process.
     int _memoryDirty;
 
+    /// The last samples of the dirty memory and the CPU usage.
+    SampleRing<int, 60> _memHistory;
+    SampleRing<unsigned, 60> _cpuHistory;
+
     std::time_t _start;
     std::time_t _lastActivity;
     std::time_t _end = 0;
@@ -153,6 +200,24 @@ private:
     std::time_t _end = 0;
 };
 
+/// The basic info of a live document, used to
+/// pick the documents to unload under memory pressure.
+struct DocBasicInfo
+{
+    std::string DocKey;
+    Poco::Process::PID Pid;
+    std::time_t IdleTime;
+    int Mem;
+
+    DocBasicInfo(const std::string& docKey, Poco::Process::PID pid, std::time_t idleTime, int mem) :
+        DocKey(docKey),
+        Pid(pid),
+        IdleTime(idleTime),
+        Mem(mem)
+    {
+    }
+};
+
 /// The Admin controller implementation.
 class AdminModel
 {
@@ -205,6 +270,19 @@ public:
     void updateLastActivityTime(const std::string& docKey);
     void updateMemoryDirty(const std::string& docKey, int dirty);
 
+    /// Record a sample of the document's Kit process usage.
+    /// A negative dirty means it is unknown and the last reported
+    /// value is kept. Returns the document's dirty memory.
+    int addDocumentSample(const std::string& docKey, int dirty, unsigned cpuPercent);
+
+    /// Returns the live documents idle for at least minIdleSecs,
+    /// the coldest first: the ones that have been idle the longest
+    /// with the most dirty memory, ie. highest idle time * dirty.
+    std::vector<DocBasicInfo> getEvictionCandidates(std::time_t minIdleSecs) const;
+
+    /// Account for a document unloaded under memory pressure.
+    void addEviction(const std::string& docKey, int dirty);
+
     bool setMacIpData(std::string);
     bool removeMacIpData(std::string);
     bool appendMacIpData(std::string, std::string);
@@ -219,6 +297,8 @@ private:
 
     std::string getDocuments() const;
 
+    std::string getDocumentsStats() const;
+
     std::string getMacList();
 
     std::string getIPList();
@@ -235,6 +315,10 @@ private:
     std::list<unsigned> _cpuStats;
     unsigned _cpuStatsSize = 100;
 
+    /// Documents unloaded under memory pressure, and their dirty memory.
+    unsigned _evictionCount = 0;
+    size_t _evictedMemKb = 0;
+
     /// We check the owner even in the release builds, needs to be always correct.
     std::thread::id _owner;
 
@@ -0,0 +1,172 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include "AutoSaveScheduler.hpp"
+
+#include <algorithm>
+
+#include "Log.hpp"
+#include "Util.hpp"
+
+AutoSaveScheduler::AutoSaveScheduler(unsigned maxConcurrent, unsigned maxPerMinute) :
+    _maxConcurrent(std::max(maxConcurrent, 1U)),
+    _maxPerMinute(std::max(maxPerMinute, 1U)),
+    _tokens(_maxConcurrent),
+    _lastRefill(std::chrono::steady_clock::now())
+{
+}
+
+void AutoSaveScheduler::configure(unsigned maxConcurrent, unsigned maxPerMinute)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _maxConcurrent = std::max(maxConcurrent, 1U);
+    _maxPerMinute = std::max(maxPerMinute, 1U);
+    _tokens = std::min<double>(_tokens, _maxConcurrent);
+
+    LOG_INF("AutoSave scheduler: at most " << _maxConcurrent << " concurrent uploads, " <<
+            _maxPerMinute << " autosaves per minute.");
+}
+
+std::chrono::milliseconds AutoSaveScheduler::jitter(std::chrono::milliseconds interval)
+{
+    const long range = interval.count() / 5;
+    if (range <= 0)
+        return interval;
+
+    const long shift = static_cast<long>(Util::rng::getNext() % (range + 1)) - range / 2;
+    return std::chrono::milliseconds(interval.count() + shift);
+}
+
+void AutoSaveScheduler::expire(TimePoint now)
+{
+    Util::assertIsLocked(_mutex);
+
+    for (auto it = _waiting.begin(); it != _waiting.end(); )
+    {
+        if (std::chrono::duration_cast<std::chrono::milliseconds>(now - it->second.LastAsked).count() > RequestTimeoutMs)
+            it = _waiting.erase(it);
+        else
+            ++it;
+    }
+
+    for (auto it = _inFlight.begin(); it != _inFlight.end(); )
+    {
+        if (std::chrono::duration_cast<std::chrono::milliseconds>(now - it->second).count() > SaveTimeoutMs)
+        {
+            LOG_WRN("AutoSave of [" << it->first << "] didn't complete in time, releasing its slot.");
+            it = _inFlight.erase(it);
+        }
+        else
+            ++it;
+    }
+
+    // The bucket holds at most a burst of _maxConcurrent saves.
+    const double elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - _lastRefill).count();
+    if (elapsedMs > 0)
+    {
+        _tokens = std::min<double>(_tokens + elapsedMs * _maxPerMinute / 60000.0, _maxConcurrent);
+        _lastRefill = now;
+    }
+}
+
+double AutoSaveScheduler::getPriority(TimePoint modifiedSince, size_t size, TimePoint now)
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(now - modifiedSince).count() +
+           size / (1024. * 1024.);
+}
+
+bool AutoSaveScheduler::tryAcquire(const std::string& docKey, TimePoint modifiedSince,
+                                   size_t size, TimePoint now)
+{
+    return acquire(docKey, getPriority(modifiedSince, size, now), now);
+}
+
+bool AutoSaveScheduler::tryAcquireUrgent(const std::string& docKey, TimePoint modifiedSince,
+                                         size_t size, TimePoint now)
+{
+    return acquire(docKey, UrgentPriority + getPriority(modifiedSince, size, now), now);
+}
+
+bool AutoSaveScheduler::acquire(const std::string& docKey, const double priority, TimePoint now)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    expire(now);
+
+    if (_inFlight.find(docKey) != _inFlight.end())
+    {
+        // Still saving.
+        return false;
+    }
+
+    Request& request = _waiting[docKey];
+    request.Priority = priority;
+    request.LastAsked = now;
+
+    if (_inFlight.size() >= _maxConcurrent || _tokens < 1)
+    {
+        LOG_TRC("AutoSave of [" << docKey << "] deferred. In flight: " << _inFlight.size() <<
+                ", waiting: " << _waiting.size() << ".");
+        return false;
+    }
+
+    // Grant only if we are within the free slots, by priority.
+    const size_t freeSlots = _maxConcurrent - _inFlight.size();
+    size_t ahead = 0;
+    for (const auto& pair : _waiting)
+    {
+        if (pair.second.Priority > request.Priority && ++ahead >= freeSlots)
+        {
+            LOG_TRC("AutoSave of [" << docKey << "] deferred for more urgent documents.");
+            return false;
+        }
+    }
+
+    _waiting.erase(docKey);
+    _inFlight[docKey] = now;
+    _tokens -= 1;
+
+    LOG_TRC("AutoSave of [" << docKey << "] granted. In flight: " << _inFlight.size() <<
+            ", waiting: " << _waiting.size() << ".");
+    return true;
+}
+
+void AutoSaveScheduler::release(const std::string& docKey)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _inFlight.erase(docKey);
+}
+
+void AutoSaveScheduler::cancel(const std::string& docKey)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _inFlight.erase(docKey);
+    _waiting.erase(docKey);
+}
+
+void AutoSaveScheduler::dumpState(std::ostream& os) const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    os << "AutoSaveScheduler:\n"
+       << "\tmaxConcurrent: " << _maxConcurrent
+       << "\n\tmaxPerMinute: " << _maxPerMinute
+       << "\n\ttokens: " << _tokens
+       << "\n\tinFlight: " << _inFlight.size()
+       << "\n\twaiting: " << _waiting.size() << "\n";
+    for (const auto& pair : _waiting)
+    {
+        os << "\t\t[" << pair.first << "] priority: " << pair.second.Priority << "\n";
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,124 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_AUTOSAVESCHEDULER_HPP
+#define INCLUDED_AUTOSAVESCHEDULER_HPP
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+/// Schedules the autosaves of all the documents, so that they
+/// don't align and spike the storage I/O.
+/// Each DocumentBroker asks for a slot when its (jittered) autosave
+/// is due and the document is modified. Slots are granted by priority,
+/// as long as there are fewer than the configured uploads in flight
+/// and the global rate limit allows. Otherwise the broker retries on
+/// its next poll. Thread-safe.
+class AutoSaveScheduler
+{
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    AutoSaveScheduler(unsigned maxConcurrent = 4, unsigned maxPerMinute = 60);
+
+    static AutoSaveScheduler& instance()
+    {
+        static AutoSaveScheduler scheduler;
+        return scheduler;
+    }
+
+    /// Set the cap on concurrent uploads and
+    /// the max number of autosaves started per minute.
+    void configure(unsigned maxConcurrent, unsigned maxPerMinute);
+
+    /// Returns the given autosave interval randomly
+    /// shifted by up to +/- 10%, to spread the saves.
+    static std::chrono::milliseconds jitter(std::chrono::milliseconds interval);
+
+    /// Asks to autosave the document with the given key.
+    /// @param modifiedSince when the document got modified.
+    /// @param size of the document, in bytes.
+    /// @return true if the save may start now, in which
+    /// case release() must be called once it's done.
+    /// Otherwise the request waits, ranked by priority,
+    /// and the caller should ask again later.
+    bool tryAcquire(const std::string& docKey, TimePoint modifiedSince, size_t size,
+                    TimePoint now = std::chrono::steady_clock::now());
+
+    /// The same as tryAcquire(), for a save that blocks the unloading
+    /// of the document: it goes before all the autosaves, but still
+    /// waits for a free slot and the rate limit.
+    bool tryAcquireUrgent(const std::string& docKey, TimePoint modifiedSince, size_t size,
+                          TimePoint now = std::chrono::steady_clock::now());
+
+    /// The save of the document is done (or was never started).
+    void release(const std::string& docKey);
+
+    /// The document is gone, drop any waiting request or slot.
+    void cancel(const std::string& docKey);
+
+    size_t getInFlightCount() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _inFlight.size();
+    }
+
+    size_t getWaitingCount() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _waiting.size();
+    }
+
+    void dumpState(std::ostream& os) const;
+
+private:
+    /// A pending autosave request.
+    struct Request
+    {
+        /// Higher is more urgent: the seconds since the document
+        /// got modified plus one for every MB of its size.
+        double Priority;
+        /// When the broker last asked, to expire abandoned requests.
+        TimePoint LastAsked;
+    };
+
+    /// Drop the stale requests and slots, and refill the rate limit.
+    void expire(TimePoint now);
+
+    static double getPriority(TimePoint modifiedSince, size_t size, TimePoint now);
+
+    bool acquire(const std::string& docKey, double priority, TimePoint now);
+
+private:
+    mutable std::mutex _mutex;
+    std::map<std::string, Request> _waiting;
+    /// The documents being saved, with when they started.
+    std::map<std::string, TimePoint> _inFlight;
+
+    unsigned _maxConcurrent;
+    unsigned _maxPerMinute;
+
+    /// Token bucket for the rate limit.
+    double _tokens;
+    TimePoint _lastRefill;
+
+    /// A request not renewed in this time is abandoned.
+    static constexpr int RequestTimeoutMs = 30 * 1000;
+    /// A save not released in this time is considered failed.
+    static constexpr int SaveTimeoutMs = 120 * 1000;
+    /// Added to the priority of the urgent requests, more than any autosave can have.
+    static constexpr double UrgentPriority = 1e12;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -11,6 +11,7 @@
 
 #include "ClientSession.hpp"
 
+#include <algorithm>
 #include <fstream>
 
 #include <Poco/Net/HTTPResponse.h>
@@ -22,6 +23,7 @@
 #include "DocumentBroker.hpp"
 #include "LOOLWSD.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "Protocol.hpp"
 #include "Session.hpp"
 #include "Util.hpp"
@@ -32,6 +34,79 @@ using namespace LOOLProtocol;
 using Poco::Path;
 using Poco::StringTokenizer;
 
+namespace
+{
+    enum class Command
+    {
+        Unknown,
+        CancelTiles,
+        ClientVisibleArea,
+        ClientZoom,
+        CloseDocument,
+        CommandValues,
+        DownloadAs,
+        GetChildId,
+        GetTextSelection,
+        InsertFile,
+        Key,
+        Load,
+        LoolClient,
+        Mouse,
+        PartPageRectangles,
+        Paste,
+        Ping,
+        RenderFont,
+        RequestLokSession,
+        ResetSelection,
+        Save,
+        SaveAs,
+        SelectGraphic,
+        SelectText,
+        SetClientPart,
+        SetPage,
+        Status,
+        Tile,
+        TileCombine,
+        Uno,
+        UserActive,
+        UserInactive
+    };
+
+    const CommandTable<Command> Commands({
+            { "canceltiles", Command::CancelTiles },
+            { "clientvisiblearea", Command::ClientVisibleArea },
+            { "clientzoom", Command::ClientZoom },
+            { "closedocument", Command::CloseDocument },
+            { "commandvalues", Command::CommandValues },
+            { "downloadas", Command::DownloadAs },
+            { "getchildid", Command::GetChildId },
+            { "gettextselection", Command::GetTextSelection },
+            { "insertfile", Command::InsertFile },
+            { "key", Command::Key },
+            { "load", Command::Load },
+            { "loolclient", Command::LoolClient },
+            { "mouse", Command::Mouse },
+            { "partpagerectangles", Command::PartPageRectangles },
+            { "paste", Command::Paste },
+            { "ping", Command::Ping },
+            { "renderfont", Command::RenderFont },
+            { "requestloksession", Command::RequestLokSession },
+            { "resetselection", Command::ResetSelection },
+            { "save", Command::Save },
+            { "saveas", Command::SaveAs },
+            { "selectgraphic", Command::SelectGraphic },
+            { "selecttext", Command::SelectText },
+            { "setclientpart", Command::SetClientPart },
+            { "setpage", Command::SetPage },
+            { "status", Command::Status },
+            { "tile", Command::Tile },
+            { "tilecombine", Command::TileCombine },
+            { "uno", Command::Uno },
+            { "useractive", Command::UserActive },
+            { "userinactive", Command::UserInactive } },
+        Command::Unknown);
+}
+
 ClientSession::ClientSession(const std::string& id,
                              const std::shared_ptr<DocumentBroker>& docBroker,
                              const Poco::URI& uriPublic,
@@ -42,6 +117,8 @@ ClientSession::ClientSession(const std::string& id,
     _isDocumentOwner(false),
     _isAttached(false),
     _isViewLoaded(false),
+    _queueDepth("messages"),
+    _sendLatency("us"),
     _isQueue(false)
 {
     const size_t curConnections = ++LOOLWSD::NumConnections;
@@ -66,8 +143,8 @@ void ClientSession::handleIncomingMessage(SocketDisposition &disposition)
 bool ClientSession::_handleInput(const char *buffer, int length)
 {
     LOG_TRC(getName() << ": handling incoming [" << getAbbreviatedMessage(buffer, length) << "].");
-    const std::string firstLine = getFirstLine(buffer, length);
-    const auto tokens = LOOLProtocol::tokenize(firstLine.data(), firstLine.size());
+    const Tokens tokens(buffer, length);
+    const Command command = Commands.lookup(tokens[0]);
 
     auto docBroker = getDocumentBroker();
     if (!docBroker)
@@ -76,7 +153,8 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         return false;
     }
 
-    LOOLWSD::dumpIncomingTrace(docBroker->getJailId(), getId(), firstLine);
+    if (LOOLWSD::TraceDumper)
+        LOOLWSD::dumpIncomingTrace(docBroker->getJailId(), getId(), getFirstLine(buffer, length));
 
     if (LOOLProtocol::tokenIndicatesUserInteraction(tokens[0]))
     {
@@ -85,7 +163,7 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         docBroker->updateLastActivityTime();
     }
 
-    if (tokens[0] == "loolclient")
+    if (command == Command::LoolClient)
     {
         const auto versionTuple = ParseVersion(tokens[1]);
 
@@ -103,7 +181,7 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         return true;
     }
 
-    if (tokens[0] == "load")
+    if (command == Command::Load)
     {
         if (_docURL != "")
         {
@@ -113,35 +191,7 @@ bool ClientSession::_handleInput(const char *buffer, int length)
 
         return loadDocument(buffer, length, tokens, docBroker);
     }
-    else if (tokens[0] != "canceltiles" &&
-             tokens[0] != "clientzoom" &&
-             tokens[0] != "clientvisiblearea" &&
-             tokens[0] != "commandvalues" &&
-             tokens[0] != "closedocument" &&
-             tokens[0] != "downloadas" &&
-             tokens[0] != "getchildid" &&
-             tokens[0] != "gettextselection" &&
-             tokens[0] != "paste" &&
-             tokens[0] != "insertfile" &&
-             tokens[0] != "key" &&
-             tokens[0] != "mouse" &&
-             tokens[0] != "partpagerectangles" &&
-             tokens[0] != "ping" &&
-             tokens[0] != "renderfont" &&
-             tokens[0] != "requestloksession" &&
-             tokens[0] != "resetselection" &&
-             tokens[0] != "save" &&
-             tokens[0] != "saveas" &&
-             tokens[0] != "selectgraphic" &&
-             tokens[0] != "selecttext" &&
-             tokens[0] != "setclientpart" &&
-             tokens[0] != "setpage" &&
-             tokens[0] != "status" &&
-             tokens[0] != "tile" &&
-             tokens[0] != "tilecombine" &&
-             tokens[0] != "uno" &&
-             tokens[0] != "useractive" &&
-             tokens[0] != "userinactive")
+    else if (command == Command::Unknown)
     {
         sendTextFrame("error: cmd=" + tokens[0] + " kind=unknown");
         return false;
@@ -151,88 +201,90 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         sendTextFrame("error: cmd=" + tokens[0] + " kind=nodocloaded");
         return false;
     }
-    else if (tokens[0] == "canceltiles")
-    {
-        docBroker->cancelTileRequests(shared_from_this());
-        return true;
-    }
-    else if (tokens[0] == "commandvalues")
-    {
-        return getCommandValues(buffer, length, tokens, docBroker);
-    }
-    else if (tokens[0] == "closedocument")
+
+    switch (command)
     {
-        // If this session is the owner of the file & 'EnableOwnerTermination' feature
-        // is turned on by WOPI, let it close all sessions
-        if (_isDocumentOwner && _wopiFileInfo && _wopiFileInfo->_enableOwnerTermination)
+        case Command::CancelTiles:
+            docBroker->cancelTileRequests(shared_from_this());
+            return true;
+        case Command::CommandValues:
+            return getCommandValues(buffer, length, tokens, docBroker);
+        case Command::CloseDocument:
+            // If this session is the owner of the file & 'EnableOwnerTermination' feature
+            // is turned on by WOPI, let it close all sessions
+            if (_isDocumentOwner && _wopiFileInfo && _wopiFileInfo->_enableOwnerTermination)
+            {
+                LOG_DBG("Session [" << getId() << "] requested owner termination");
+                docBroker->closeDocument("ownertermination");
+            }
+
+            return true;
+        case Command::PartPageRectangles:
+            // We don't support partpagerectangles any more, will be removed in the
+            // next version
+            sendTextFrame("partpagerectangles: ");
+            return true;
+        case Command::Ping:
         {
-            LOG_DBG("Session [" << getId() << "] requested owner termination");
-            docBroker->closeDocument("ownertermination");
+            std::string count = std::to_string(docBroker->getRenderedTileCount());
+            sendTextFrame("pong rendercount=" + count);
+            return true;
         }
-
-        return true;
-    }
-    else if (tokens[0] == "partpagerectangles")
-    {
-        // We don't support partpagerectangles any more, will be removed in the
-        // next version
-        sendTextFrame("partpagerectangles: ");
-        return true;
-    }
-    else if (tokens[0] == "ping")
-    {
-        std::string count = std::to_string(docBroker->getRenderedTileCount());
-        sendTextFrame("pong rendercount=" + count);
-        return true;
-    }
-    else if (tokens[0] == "renderfont")
-    {
-        return sendFontRendering(buffer, length, tokens, docBroker);
-    }
-    else if (tokens[0] == "status")
-    {
-        assert(firstLine.size() == static_cast<size_t>(length));
-        return forwardToChild(firstLine, docBroker);
-    }
-    else if (tokens[0] == "tile")
-    {
-        return sendTile(buffer, length, tokens, docBroker);
-    }
-    else if (tokens[0] == "tilecombine")
-    {
-        return sendCombinedTiles(buffer, length, tokens, docBroker);
-    }
-    else if (tokens[0] == "save")
-    {
-        int dontTerminateEdit = 1;
-        int dontSaveIfUnmodified = 1;
-        getTokenInteger(tokens[1], "dontTerminateEdit", dontTerminateEdit);
-        getTokenInteger(tokens[2], "dontSaveIfUnmodified", dontSaveIfUnmodified);
-        docBroker->sendUnoSave(getId(), dontTerminateEdit != 0, dontSaveIfUnmodified != 0);
-    }
-    else
-    {
-        if (!filterMessage(firstLine))
+        case Command::RenderFont:
+            return sendFontRendering(buffer, length, tokens, docBroker);
+        case Command::Status:
         {
-            const std::string dummyFrame = "dummymsg";
-            return forwardToChild(dummyFrame, docBroker);
+            const std::string firstLine = getFirstLine(buffer, length);
+            assert(firstLine.size() == static_cast<size_t>(length));
+            return forwardToChild(firstLine, docBroker);
         }
-        else if (tokens[0] != "requestloksession")
+        case Command::ClientVisibleArea:
         {
+            int x, y, width, height;
+            if (tokens.size() == 5 &&
+                getTokenInteger(tokens[1], "x", x) &&
+                getTokenInteger(tokens[2], "y", y) &&
+                getTokenInteger(tokens[3], "width", width) &&
+                getTokenInteger(tokens[4], "height", height))
+            {
+                _clientVisibleArea = Util::Rectangle(x, y, width, height);
+                docBroker->schedulePrefetch();
+            }
+
             return forwardToChild(std::string(buffer, length), docBroker);
         }
-        else
-        {
-            assert(tokens[0] == "requestloksession");
+        case Command::Tile:
+            return sendTile(buffer, length, tokens, docBroker);
+        case Command::TileCombine:
+            return sendCombinedTiles(buffer, length, tokens, docBroker);
+        case Command::Save:
+        {
+            int dontTerminateEdit = 1;
+            int dontSaveIfUnmodified = 1;
+            getTokenInteger(tokens[1], "dontTerminateEdit", dontTerminateEdit);
+            getTokenInteger(tokens[2], "dontSaveIfUnmodified", dontSaveIfUnmodified);
+            docBroker->sendUnoSave(getId(), dontTerminateEdit != 0, dontSaveIfUnmodified != 0);
+            break;
+        }
+        default:
+            if (!filterMessage(getFirstLine(buffer, length)))
+            {
+                const std::string dummyFrame = "dummymsg";
+                return forwardToChild(dummyFrame, docBroker);
+            }
+            else if (command != Command::RequestLokSession)
+            {
+                return forwardToChild(std::string(buffer, length), docBroker);
+            }
+
             return true;
-        }
     }
 
     return false;
 }
 
 bool ClientSession::loadDocument(const char* /*buffer*/, int /*length*/,
-                                 const std::vector<std::string>& tokens,
+                                 const Tokens& tokens,
                                  const std::shared_ptr<DocumentBroker>& docBroker)
 {
     if (tokens.size() < 2)
@@ -296,7 +348,7 @@ bool ClientSession::loadDocument(const char* /*buffer*/, int /*length*/,
     return false;
 }
 
-bool ClientSession::getCommandValues(const char *buffer, int length, const std::vector<std::string>& tokens,
+bool ClientSession::getCommandValues(const char *buffer, int length, const Tokens& tokens,
                                      const std::shared_ptr<DocumentBroker>& docBroker)
 {
     std::string command;
@@ -314,7 +366,7 @@ bool ClientSession::getCommandValues(const char *buffer, int length, const std::
     return forwardToChild(std::string(buffer, length), docBroker);
 }
 
-bool ClientSession::sendFontRendering(const char *buffer, int length, const std::vector<std::string>& tokens,
+bool ClientSession::sendFontRendering(const char *buffer, int length, const Tokens& tokens,
                                       const std::shared_ptr<DocumentBroker>& docBroker)
 {
     std::string font, text;
@@ -325,7 +377,7 @@ bool ClientSession::sendFontRendering(const char *buffer, int length, const std:
     }
 
     getTokenString(tokens[2], "char", text);
-    const std::string response = "renderfont: " + Poco::cat(std::string(" "), tokens.begin() + 1, tokens.end()) + "\n";
+    const std::string response = "renderfont: " + tokens.cat(" ", 1) + "\n";
 
     std::vector<char> output;
     output.resize(response.size());
@@ -348,12 +400,15 @@ bool ClientSession::sendFontRendering(const char *buffer, int length, const std:
     return forwardToChild(std::string(buffer, length), docBroker);
 }
 
-bool ClientSession::sendTile(const char * /*buffer*/, int /*length*/, const std::vector<std::string>& tokens,
+bool ClientSession::sendTile(const char * /*buffer*/, int /*length*/, const Tokens& tokens,
                              const std::shared_ptr<DocumentBroker>& docBroker)
 {
     try
     {
         auto tileDesc = TileDesc::parse(tokens);
+        if (tileDesc.getId() < 0)
+            _lastTile.reset(new TileDesc(tileDesc));
+
         docBroker->handleTileRequest(tileDesc, shared_from_this());
     }
     catch (const std::exception& exc)
@@ -365,12 +420,15 @@ bool ClientSession::sendTile(const char * /*buffer*/, int /*length*/, const std:
     return true;
 }
 
-bool ClientSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, const std::vector<std::string>& tokens,
+bool ClientSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, const Tokens& tokens,
                                       const std::shared_ptr<DocumentBroker>& docBroker)
 {
     try
     {
         auto tileCombined = TileCombined::parse(tokens);
+        if (!tileCombined.getTiles().empty() && tileCombined.getTiles()[0].getId() < 0)
+            _lastTile.reset(new TileDesc(tileCombined.getTiles()[0]));
+
         docBroker->handleTileCombinedRequest(tileCombined, shared_from_this());
     }
     catch (const std::exception& exc)
@@ -382,6 +440,42 @@ bool ClientSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, co
     return true;
 }
 
+std::vector<TileDesc> ClientSession::getTilesAroundVisibleArea(const int rows) const
+{
+    std::vector<TileDesc> tiles;
+    if (rows <= 0 || !_lastTile || !_clientVisibleArea.isValid() ||
+        _clientVisibleArea.getWidth() <= 0 || _clientVisibleArea.getHeight() <= 0)
+    {
+        return tiles;
+    }
+
+    const int tileWidth = _lastTile->getTileWidth();
+    const int tileHeight = _lastTile->getTileHeight();
+    const int firstColumn = std::max(0, _clientVisibleArea.getLeft()) / tileWidth;
+    const int lastColumn = (_clientVisibleArea.getLeft() + _clientVisibleArea.getWidth() - 1) / tileWidth;
+    const int firstRow = std::max(0, _clientVisibleArea.getTop()) / tileHeight;
+    const int lastRow = (_clientVisibleArea.getTop() + _clientVisibleArea.getHeight() - 1) / tileHeight;
+
+    for (int i = 1; i <= rows; ++i)
+    {
+        // Below first, scrolling down is the most common.
+        for (const int row : { lastRow + i, firstRow - i })
+        {
+            if (row < 0)
+                continue;
+
+            for (int column = firstColumn; column <= lastColumn; ++column)
+            {
+                tiles.emplace_back(_lastTile->getPart(), _lastTile->getWidth(), _lastTile->getHeight(),
+                                   column * tileWidth, row * tileHeight, tileWidth, tileHeight,
+                                   -1, 0, -1, false);
+            }
+        }
+    }
+
+    return tiles;
+}
+
 bool ClientSession::forwardToChild(const std::string& message,
                                    const std::shared_ptr<DocumentBroker>& docBroker)
 {
@@ -465,20 +559,31 @@ void ClientSession::performWrites()
 {
     LOG_DBG(getName() << " ClientSession: performing writes");
 
+    const auto socket = _socket.lock();
+    if (!socket)
+        return;
+
+    // Frame as many messages as the kernel can take at once, they are
+    // then written out together rather than one per poll iteration.
+    const size_t budget = std::max(socket->getSendBufferSize(), 1);
+    size_t count = 0;
     std::shared_ptr<Message> item;
-    if (_senderQueue.dequeue(item))
+    while (socket->getOutBufferSize() < budget && _senderQueue.dequeue(item))
     {
         try
         {
-            const std::vector<char>& data = item->data();
-            if (item->isBinary())
-            {
-                Session::sendBinaryFrame(data.data(), data.size());
-            }
-            else
-            {
-                Session::sendTextFrame(data.data(), data.size());
-            }
+            LOG_TRC(getName() << ": Send: [" << item->abbr() << "].");
+            sendMessage(item->data().data(), item->size(),
+                        item->isBinary() ? WSOpCode::Binary : WSOpCode::Text, false);
+            ++count;
+
+            static Histogram& sendLatency =
+                Metrics::histogram("loolwsd_client_send_latency_us",
+                                   "Time from queuing a message to a client to sending it.", "us");
+            const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - item->created()).count();
+            _sendLatency.add(latency);
+            sendLatency.add(latency);
         }
         catch (const std::exception& ex)
         {
@@ -487,12 +592,14 @@ void ClientSession::performWrites()
         }
     }
 
-    LOG_DBG(getName() << " ClientSession: performed write");
+    LOG_DBG(getName() << " ClientSession: framed " << count << " message(s), " <<
+            socket->getOutBufferSize() << " bytes to write");
 }
 
-bool ClientSession::handleKitToClientMessage(const char* buffer, const int length)
+bool ClientSession::handleKitToClientMessage(const std::shared_ptr<Message>& payload)
 {
-    const auto payload = std::make_shared<Message>(buffer, length, Message::Dir::Out);
+    const char* buffer = payload->data().data();
+    const int length = payload->size();
 
     LOG_TRC(getName() + ": handling kit-to-client [" << payload->abbr() << "].");
     const std::string& firstLine = payload->firstLine();
@@ -835,7 +942,10 @@ void ClientSession::dumpState(std::ostream& os)
     os << "\t\tisReadOnly: " << isReadOnly()
        << "\n\t\tisDocumentOwner: " << _isDocumentOwner
        << "\n\t\tisAttached: " << _isAttached
-       << "\n";
+       << "\n\t\tqueueDepth: ";
+    _queueDepth.dumpState(os);
+    os << "\t\tsendLatency: ";
+    _sendLatency.dumpState(os);
     _senderQueue.dumpState(os);
 }
 
@@ -10,6 +10,8 @@
 #ifndef INCLUDED_CLIENTSSESSION_HPP
 #define INCLUDED_CLIENTSSESSION_HPP
 
+#include "Histogram.hpp"
+#include "Rectangle.hpp"
 #include "Session.hpp"
 #include "Storage.hpp"
 #include "MessageQueue.hpp"
@@ -49,8 +51,13 @@ public:
     void setDocumentOwner(const bool documentOwner) { _isDocumentOwner = documentOwner; }
     bool isDocumentOwner() const { return _isDocumentOwner; }
 
+    /// The tiles in the given number of rows above and below the visible
+    /// area of the client, nearest first, to render before it scrolls there.
+    std::vector<TileDesc> getTilesAroundVisibleArea(int rows) const;
+
     /// Handle kit-to-client message.
-    bool handleKitToClientMessage(const char* data, const int size);
+    /// The payload is shared with the other sessions it's broadcast to.
+    bool handleKitToClientMessage(const std::shared_ptr<Message>& payload);
 
     // sendTextFrame that takes std::string and string literal.
     using Session::sendTextFrame;
@@ -77,7 +84,7 @@ public:
             docBroker->assertCorrectThread();
 
         LOG_TRC(getName() << " enqueueing client message " << data->id());
-        _senderQueue.enqueue(data);
+        _queueDepth.add(_senderQueue.enqueue(data));
     }
 
     /// Set the save-as socket which is used to send convert-to results.
@@ -120,18 +127,18 @@ private:
 
     virtual bool _handleInput(const char* buffer, int length) override;
 
-    bool loadDocument(const char* buffer, int length, const std::vector<std::string>& tokens,
+    bool loadDocument(const char* buffer, int length, const LOOLProtocol::Tokens& tokens,
                       const std::shared_ptr<DocumentBroker>& docBroker);
     bool getStatus(const char* buffer, int length,
                    const std::shared_ptr<DocumentBroker>& docBroker);
-    bool getCommandValues(const char* buffer, int length, const std::vector<std::string>& tokens,
+    bool getCommandValues(const char* buffer, int length, const LOOLProtocol::Tokens& tokens,
                           const std::shared_ptr<DocumentBroker>& docBroker);
-    bool sendTile(const char* buffer, int length, const std::vector<std::string>& tokens,
+    bool sendTile(const char* buffer, int length, const LOOLProtocol::Tokens& tokens,
                   const std::shared_ptr<DocumentBroker>& docBroker);
-    bool sendCombinedTiles(const char* buffer, int length, const std::vector<std::string>& tokens,
+    bool sendCombinedTiles(const char* buffer, int length, const LOOLProtocol::Tokens& tokens,
                            const std::shared_ptr<DocumentBroker>& docBroker);
 
-    bool sendFontRendering(const char* buffer, int length, const std::vector<std::string>& tokens,
+    bool sendFontRendering(const char* buffer, int length, const LOOLProtocol::Tokens& tokens,
                            const std::shared_ptr<DocumentBroker>& docBroker);
 
     bool forwardToChild(const std::string& message,
@@ -168,6 +175,19 @@ private:
 
     SenderQueue<std::shared_ptr<Message>> _senderQueue;
 
+    /// The length of the sender queue after each enqueue.
+    Histogram _queueDepth;
+
+    /// The time from creating a message to writing it to the socket.
+    Histogram _sendLatency;
+
+    /// The visible area of the client, in twips.
+    Util::Rectangle _clientVisibleArea;
+
+    /// The last tile the client requested, whose size the tiles around
+    /// its visible area have.
+    std::unique_ptr<TileDesc> _lastTile;
+
     bool _isQueue;  // convert-to: queue parameter setted.
 
     std::string _queueFormat;  // convert-to: queue parameter setted.
@@ -0,0 +1,620 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include "ConvertPool.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <iomanip>
+#include <sstream>
+
+#include <Poco/File.h>
+#include <Poco/Net/HTTPResponse.h>
+#include <Poco/Path.h>
+#include <Poco/URI.h>
+#include <Poco/UUIDGenerator.h>
+
+#include "Common.hpp"
+#include "FileUtil.hpp"
+#include "Histogram.hpp"
+#include "LOOLWSD.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "Protocol.hpp"
+#include "Util.hpp"
+
+namespace
+{
+    void setCorsHeaders(Poco::Net::HTTPResponse& response)
+    {
+        response.set("Access-Control-Allow-Origin", "*");
+        response.set("Access-Control-Allow-Methods", "GET, POST, OPTIONS");
+        response.set("Access-Control-Allow-Headers", "Origin, X-Requested-With, Content-Type, Accept");
+    }
+
+    Metrics::Gauge& getQueuedGauge()
+    {
+        static Metrics::Gauge& gauge = Metrics::gauge("loolwsd_convert_queued",
+                                                      "Conversions waiting for a kit of the convert pool.");
+        return gauge;
+    }
+
+    Metrics::Gauge& getRunningGauge()
+    {
+        static Metrics::Gauge& gauge = Metrics::gauge("loolwsd_convert_running",
+                                                      "Conversions in progress in the convert pool.");
+        return gauge;
+    }
+}
+
+class ConvertPool::ConvertPoolPoll final : public TerminatingPoll
+{
+    /// The ConvertPool owning us.
+    ConvertPool& _pool;
+
+public:
+    ConvertPoolPoll(const std::string &threadName, ConvertPool& pool) :
+        TerminatingPoll(threadName),
+        _pool(pool)
+    {
+    }
+
+    virtual void pollingThread()
+    {
+        // Delegate to the pool.
+        _pool.pollThread();
+    }
+};
+
+ConvertPool::ConvertPool(const size_t size, const size_t maxQueue,
+                         const size_t maxConversionsPerKit, const size_t timeoutSecs) :
+    _size(size),
+    _maxQueue(maxQueue),
+    _maxConversionsPerKit(maxConversionsPerKit),
+    _timeout(timeoutSecs),
+    _poll(new ConvertPoolPoll("convert_pool", *this)),
+    _stop(false),
+    _pending(0),
+    _lastJobId(0),
+    _nextClaimTime(std::chrono::steady_clock::now()),
+    _claiming(false),
+    _kitCount(0),
+    _busyCount(0),
+    _queuedCount(0),
+    _rateCount(0),
+    _rateStart(std::chrono::steady_clock::now()),
+    _rate(0)
+{
+    assert(_size > 0);
+    LOG_INF("ConvertPool ctor with " << _size << " kits and up to " << _maxQueue << " queued conversions.");
+}
+
+ConvertPool::~ConvertPool()
+{
+    stop();
+}
+
+void ConvertPool::start()
+{
+    _poll->startThread();
+}
+
+void ConvertPool::stop()
+{
+    _stop = true;
+    _poll->joinThread();
+
+    // A child claimed now is dropped with the callback that never runs.
+    if (_claimThread.joinable())
+        _claimThread.join();
+}
+
+bool ConvertPool::reserve()
+{
+    if (_stop || ShutdownRequestFlag || TerminationFlag)
+        return false;
+
+    size_t pending = _pending;
+    do
+    {
+        if (pending >= _size + _maxQueue)
+            return false;
+    }
+    while (!_pending.compare_exchange_weak(pending, pending + 1));
+
+    return true;
+}
+
+void ConvertPool::cancel()
+{
+    --_pending;
+}
+
+void ConvertPool::enqueue(const std::shared_ptr<StreamSocket>& socket, const std::string& fromPath,
+                          const std::string& format, const bool queue)
+{
+    auto job = std::make_shared<Job>();
+    job->Id = 0;
+    job->Socket = socket;
+    job->FromPath = fromPath;
+    job->Format = format;
+    job->Queue = queue;
+    job->QueuedTime = std::chrono::steady_clock::now();
+
+    _poll->insertNewSocket(socket);
+
+    std::weak_ptr<ConvertPool> weakPool = shared_from_this();
+    _poll->addCallback([weakPool, job]()
+        {
+            std::shared_ptr<ConvertPool> pool = weakPool.lock();
+            if (!pool)
+                return;
+
+            job->Id = ++pool->_lastJobId;
+            LOG_DBG("Queued conversion #" << job->Id << " of [" << job->FromPath << "] to " << job->Format << ".");
+            pool->_jobs.push_back(job);
+            getQueuedGauge().add(1);
+            pool->dispatch();
+        });
+}
+
+void ConvertPool::addSocketToPoll(const std::shared_ptr<Socket>& socket)
+{
+    _poll->insertNewSocket(socket);
+}
+
+bool ConvertPool::isValidFormat(const std::string& format)
+{
+    if (format.empty() || format.size() > 32)
+        return false;
+
+    for (const char c : format)
+    {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+            return false;
+    }
+
+    return true;
+}
+
+// The inner heart of the ConvertPool - our poll loop.
+void ConvertPool::pollThread()
+{
+    LOG_INF("Starting convert pool polling thread.");
+
+    while (!_stop && _poll->continuePolling())
+    {
+        claimKits(std::chrono::steady_clock::now());
+        dispatch();
+
+        _poll->poll(SocketPoll::DefaultPollTimeoutMs);
+
+        const auto now = std::chrono::steady_clock::now();
+        checkTimeouts(now);
+        updateRate(now);
+        updateStats();
+    }
+
+    LOG_INF("Finished polling the convert pool. stop: " << _stop << ", continuePolling: " <<
+            _poll->continuePolling() << ", TerminationFlag: " << TerminationFlag << ".");
+
+    // Fail the conversions we won't do.
+    for (auto it = _kits.begin(); it != _kits.end(); )
+        it = removeKit(it, "stopping");
+
+    while (!_jobs.empty())
+    {
+        const std::shared_ptr<Job> job = _jobs.front();
+        _jobs.pop_front();
+        getQueuedGauge().sub(1);
+        finishJob(job, std::string());
+    }
+
+    // Flush socket data, as the DocumentBroker does.
+    const int flushTimeoutMs = POLL_TIMEOUT_MS * 2;
+    const auto flushStartTime = std::chrono::steady_clock::now();
+    while (_poll->getSocketCount())
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const int elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - flushStartTime).count();
+        if (elapsedMs > flushTimeoutMs)
+            break;
+
+        _poll->poll(std::min(flushTimeoutMs - elapsedMs, POLL_TIMEOUT_MS / 5));
+    }
+
+    _poll->stop();
+    _poll->removeSockets();
+    updateStats();
+
+    LOG_INF("Finished convert pool polling thread.");
+}
+
+void ConvertPool::claimKits(const std::chrono::steady_clock::time_point now)
+{
+    if (_claiming || _kits.size() >= _size || now < _nextClaimTime || ShutdownRequestFlag)
+        return;
+
+    // One at a time, as this may block waiting for forkit, and the poll
+    // thread has conversions to serve meanwhile. The last claim thread
+    // is done, or about to be, once its callback ran.
+    if (_claimThread.joinable())
+        _claimThread.join();
+
+    _claiming = true;
+    ConvertPoolPoll* poll = _poll.get();
+    std::weak_ptr<ConvertPool> weakPool = shared_from_this();
+    _claimThread = std::thread([poll, weakPool]()
+        {
+            Util::setThreadName("convert_claim");
+            const std::shared_ptr<ChildProcess> child = getNewChild_Blocks();
+            poll->addCallback([weakPool, child]()
+                {
+                    std::shared_ptr<ConvertPool> pool = weakPool.lock();
+                    if (pool)
+                        pool->addKit(child);
+                });
+        });
+}
+
+void ConvertPool::addKit(const std::shared_ptr<ChildProcess>& child)
+{
+    _claiming = false;
+
+    if (!child)
+    {
+        LOG_WRN("ConvertPool failed to get a new child, have " << _kits.size() << " of " << _size << " kits.");
+        _nextClaimTime = std::chrono::steady_clock::now() +
+                         std::chrono::milliseconds(CHILD_REBALANCE_INTERVAL_MS);
+        return;
+    }
+
+    if (_stop)
+    {
+        child->close(true);
+        return;
+    }
+
+    child->setConvertPool(shared_from_this());
+
+    Kit kit;
+    kit.Child = child;
+    kit.Conversions = 0;
+    _kits.push_back(kit);
+
+    LOG_INF("ConvertPool claimed child [" << child->getPid() << "], have " << _kits.size() <<
+            " of " << _size << " kits.");
+
+    dispatch();
+    updateStats();
+}
+
+void ConvertPool::updateStats()
+{
+    size_t busy = 0;
+    for (const Kit& kit : _kits)
+        busy += (kit.Current ? 1 : 0);
+
+    _kitCount = _kits.size();
+    _busyCount = busy;
+    _queuedCount = _jobs.size();
+}
+
+void ConvertPool::dispatch()
+{
+    for (Kit& kit : _kits)
+    {
+        if (_jobs.empty())
+            break;
+
+        if (kit.Current)
+            continue;
+
+        const std::shared_ptr<Job> job = _jobs.front();
+        _jobs.pop_front();
+        getQueuedGauge().sub(1);
+
+        if (!startJob(kit, job))
+            finishJob(job, std::string());
+    }
+}
+
+bool ConvertPool::startJob(Kit& kit, const std::shared_ptr<Job>& job)
+{
+    const Poco::Path fromPath(job->FromPath);
+    const std::string jailedDir = std::string(JAILED_DOCUMENT_ROOT) + "convert-" + std::to_string(job->Id) + '/';
+    job->JobDir = LOOLWSD::ChildRoot + kit.Child->getJailId() + jailedDir;
+
+    // Hard-link the upload into the jail if we can, like LocalStorage.
+    try
+    {
+        Poco::File(job->JobDir).createDirectories();
+        const std::string jailedFile = job->JobDir + fromPath.getFileName();
+        if (link(job->FromPath.c_str(), jailedFile.c_str()) == -1)
+        {
+            LOG_TRC("link(\"" << job->FromPath << "\", \"" << jailedFile << "\") failed. Will copy.");
+            Poco::File(job->FromPath).copyTo(jailedFile);
+        }
+    }
+    catch (const Poco::Exception& exc)
+    {
+        LOG_ERR("Failed to move [" << job->FromPath << "] into jail [" << job->JobDir << "]: " <<
+                exc.displayText());
+        return false;
+    }
+
+    std::string encodedFrom;
+    Poco::URI::encode("file://" + jailedDir + fromPath.getFileName(), "", encodedFrom);
+    std::string encodedTo;
+    Poco::URI::encode("file://" + jailedDir + fromPath.getBaseName() + '.' + job->Format, "", encodedTo);
+
+    try
+    {
+        if (!kit.Child->sendTextFrame("convert id=" + std::to_string(job->Id) + " url=" + encodedFrom +
+                                      " to=" + encodedTo + " format=" + job->Format))
+            return false;
+    }
+    catch (const std::exception&)
+    {
+        // Already logged in sendTextFrame.
+        return false;
+    }
+
+    job->StartTime = std::chrono::steady_clock::now();
+    kit.Current = job;
+    ++kit.Conversions;
+    getRunningGauge().add(1);
+
+    static Histogram& queueWait = Metrics::histogram("loolwsd_convert_queue_wait_us",
+                                                     "Time conversions wait for a kit of the convert pool.", "us");
+    queueWait.add(std::chrono::duration_cast<std::chrono::microseconds>(
+                      job->StartTime - job->QueuedTime).count());
+
+    LOG_DBG("Started conversion #" << job->Id << " on child [" << kit.Child->getPid() << "].");
+    return true;
+}
+
+void ConvertPool::handleInput(const std::shared_ptr<ChildProcess>& child, const std::vector<char>& data)
+{
+    auto it = std::find_if(_kits.begin(), _kits.end(),
+                           [&child](const Kit& kit) { return kit.Child == child; });
+    if (it == _kits.end())
+    {
+        LOG_WRN("ConvertPool got a message from unknown child [" << child->getPid() << "]: [" <<
+                LOOLProtocol::getAbbreviatedMessage(data) << "].");
+        return;
+    }
+
+    const LOOLProtocol::Tokens tokens(data.data(), data.size());
+    int id = 0;
+    std::string ok;
+    if (tokens[0] != "convertresult:" ||
+        !LOOLProtocol::getTokenInteger(tokens, "id", id) ||
+        !LOOLProtocol::getTokenString(tokens, "ok", ok))
+    {
+        // The kit may still send us some notifications, e.g. from LOK.
+        LOG_TRC("ConvertPool ignoring child message [" << LOOLProtocol::getAbbreviatedMessage(data) << "].");
+        return;
+    }
+
+    const std::shared_ptr<Job> job = it->Current;
+    if (!job || job->Id != static_cast<unsigned>(id))
+    {
+        LOG_WRN("ConvertPool got the result of conversion #" << id << " which isn't running on child [" <<
+                child->getPid() << "].");
+        return;
+    }
+
+    it->Current.reset();
+    getRunningGauge().sub(1);
+
+    const Poco::Path fromPath(job->FromPath);
+    finishJob(job, ok == "true" ? job->JobDir + fromPath.getBaseName() + '.' + job->Format : std::string());
+
+    ++_rateCount;
+
+    if (_maxConversionsPerKit > 0 && it->Conversions >= _maxConversionsPerKit)
+    {
+        LOG_INF("Recycling child [" << child->getPid() << "] after " << it->Conversions << " conversions.");
+        it->Child->close(false);
+        _kits.erase(it);
+    }
+
+    dispatch();
+}
+
+void ConvertPool::childDisconnected(const std::shared_ptr<ChildProcess>& child)
+{
+    auto it = std::find_if(_kits.begin(), _kits.end(),
+                           [&child](const Kit& kit) { return kit.Child == child; });
+    if (it != _kits.end())
+        removeKit(it, "disconnected");
+}
+
+void ConvertPool::finishJob(const std::shared_ptr<Job>& job, const std::string& resultPath,
+                            const bool expired)
+{
+    const auto now = std::chrono::steady_clock::now();
+    const std::shared_ptr<StreamSocket>& socket = job->Socket;
+
+    bool sent = false;
+    if (!resultPath.empty() && Poco::File(resultPath).exists())
+    {
+        try
+        {
+            Poco::Net::HTTPResponse response;
+            setCorsHeaders(response);
+            if (!job->Queue)
+            {
+                LOG_TRC("Sending file: " << resultPath);
+                HttpHelper::sendFile(socket, resultPath, "application/octet-stream", response, true);
+            }
+            else
+            {
+                // Set queue for file download.
+                Poco::UUIDGenerator& generator = Poco::UUIDGenerator::defaultGenerator();
+                const std::string copy2 = "/data/looldocs/" + generator.create().toString() + "." + job->Format;
+                Poco::File(resultPath).copyTo(copy2);
+                socket->send(response);
+                socket->send("\"file://" + copy2 + "\"");
+            }
+
+            sent = true;
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_ERR("Failed to send the result of conversion #" << job->Id << ": " << exc.what());
+        }
+    }
+
+    if (expired)
+    {
+        LOG_WRN("Conversion #" << job->Id << " of [" << job->FromPath << "] to " << job->Format <<
+                " waited too long for a kit.");
+        Poco::Net::HTTPResponse response;
+        setCorsHeaders(response);
+        response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE,
+                                    "Too many conversions in progress");
+        response.set("Retry-After", "1");
+        response.setContentLength(0);
+        socket->send(response);
+    }
+    else if (!sent)
+    {
+        LOG_WRN("Conversion #" << job->Id << " of [" << job->FromPath << "] to " << job->Format << " failed.");
+        Poco::Net::HTTPResponse response;
+        setCorsHeaders(response);
+        response.setStatusAndReason(Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR,
+                                    "Failed to convert and send file.");
+        response.setContentLength(0);
+        socket->send(response);
+    }
+
+    socket->shutdown();
+
+    if (job->StartTime.time_since_epoch().count() != 0)
+    {
+        getDurationHistogram(job->Format).add(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - job->StartTime).count());
+    }
+
+    static Metrics::Counter& succeeded = Metrics::counter("loolwsd_convert_total{result=\"ok\"}",
+                                                          "Conversions done by the convert pool.");
+    static Metrics::Counter& failed = Metrics::counter("loolwsd_convert_total{result=\"error\"}",
+                                                       "Conversions done by the convert pool.");
+    static Metrics::Counter& timedOut = Metrics::counter("loolwsd_convert_total{result=\"expired\"}",
+                                                         "Conversions done by the convert pool.");
+    (expired ? timedOut : sent ? succeeded : failed).inc();
+
+    // Cleanup the jailed copies and the upload.
+    if (!job->JobDir.empty())
+        FileUtil::removeFile(job->JobDir, true);
+    FileUtil::removeFile(Poco::Path(job->FromPath).parent(), true);
+
+    --_pending;
+}
+
+std::vector<ConvertPool::Kit>::iterator ConvertPool::removeKit(std::vector<Kit>::iterator it,
+                                                              const std::string& reason)
+{
+    LOG_WRN("ConvertPool removing child [" << it->Child->getPid() << "]: " << reason << ".");
+
+    const std::shared_ptr<Job> job = it->Current;
+    it->Child->close(true);
+    it = _kits.erase(it);
+
+    if (job)
+    {
+        getRunningGauge().sub(1);
+        finishJob(job, std::string());
+    }
+
+    return it;
+}
+
+void ConvertPool::checkTimeouts(const std::chrono::steady_clock::time_point now)
+{
+    for (auto it = _kits.begin(); it != _kits.end(); )
+    {
+        if (!it->Child->isAlive())
+            it = removeKit(it, "died");
+        else if (it->Current && now - it->Current->StartTime > _timeout)
+            it = removeKit(it, "conversion #" + std::to_string(it->Current->Id) + " timed out");
+        else
+            ++it;
+    }
+
+    // The queue is in arrival order, the oldest waiting jobs first.
+    while (!_jobs.empty() && now - _jobs.front()->QueuedTime > _timeout)
+    {
+        const std::shared_ptr<Job> job = _jobs.front();
+        _jobs.pop_front();
+        getQueuedGauge().sub(1);
+        finishJob(job, std::string(), true);
+    }
+}
+
+void ConvertPool::updateRate(const std::chrono::steady_clock::time_point now)
+{
+    const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - _rateStart).count();
+    if (elapsedMs >= RateIntervalMs)
+    {
+        _rate = _rateCount * 1000.0 / elapsedMs;
+        _rateCount = 0;
+        _rateStart = now;
+    }
+}
+
+Histogram& ConvertPool::getDurationHistogram(const std::string& format)
+{
+    std::unique_lock<std::mutex> lock(_durationsMutex);
+
+    auto it = _durations.find(format);
+    if (it == _durations.end())
+    {
+        Histogram& histogram = Metrics::histogram("loolwsd_convert_duration_us{format=\"" + format + "\"}",
+                                                  "Time to convert documents in the convert pool, by target format.",
+                                                  "us");
+        it = _durations.emplace(format, &histogram).first;
+    }
+
+    return *it->second;
+}
+
+void ConvertPool::dumpState(std::ostream& os)
+{
+    // As of the last poll, the poll thread owns the kits and the jobs.
+    std::ostringstream rate;
+    rate << std::fixed << std::setprecision(2) << getRate();
+
+    os << "ConvertPool:\n"
+       << "  Kits: " << _kitCount << " of " << _size << ", busy: " << _busyCount << "\n"
+       << "  Pending: " << _pending << ", queued: " << _queuedCount
+       <<          ", max queue: " << _maxQueue << "\n"
+       << "  Max conversions per kit: " << _maxConversionsPerKit << "\n"
+       << "  Conversions/sec: " << rate.str() << "\n";
+
+    std::unique_lock<std::mutex> lock(_durationsMutex);
+    for (const auto& it : _durations)
+    {
+        os << "  Duration [" << it.first << "]: ";
+        it.second->dumpState(os);
+    }
+
+    lock.unlock();
+
+    _poll->dumpState(os);
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,207 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_CONVERTPOOL_HPP
+#define INCLUDED_CONVERTPOOL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DocumentBroker.hpp"
+
+class Histogram;
+
+/// Serves /lool/convert-to with a pool of warm kits, without a
+/// DocumentBroker or a session per request.
+///
+/// The pool claims its kits from the spare children up front and
+/// keeps them: each kit loads, converts and unloads the documents
+/// sent to it one after the other, and is recycled after a number of
+/// conversions. At most one conversion runs per kit, the others wait
+/// in a bounded queue, and requests over the bound are refused.
+/// All the work is done in the pool's own poll thread.
+class ConvertPool : public std::enable_shared_from_this<ConvertPool>
+{
+    class ConvertPoolPoll;
+
+public:
+    /// @param size the number of kits, hence of concurrent conversions.
+    /// @param maxQueue the number of conversions that may wait for a kit.
+    /// @param maxConversionsPerKit after which a kit is replaced, 0 for never.
+    /// @param timeoutSecs after which a running conversion fails and its kit is killed,
+    /// and a waiting one is refused.
+    ConvertPool(size_t size, size_t maxQueue, size_t maxConversionsPerKit, size_t timeoutSecs);
+    ~ConvertPool();
+
+    void start();
+    void stop();
+
+    /// Reserves a place for a conversion, from any thread.
+    /// @return false when the pool is stopped or the queue is full,
+    /// otherwise enqueue() or cancel() must follow.
+    bool reserve();
+
+    /// Releases a place reserved but not enqueued.
+    void cancel();
+
+    /// Cancels a reservation when it goes out of scope, unless released
+    /// when the conversion is handed over to enqueue().
+    class Reservation
+    {
+    public:
+        /// @param pool the pool reserved from, null for no reservation.
+        explicit Reservation(const std::shared_ptr<ConvertPool>& pool) :
+            _pool(pool)
+        {
+        }
+
+        ~Reservation()
+        {
+            if (_pool)
+                _pool->cancel();
+        }
+
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+
+        void release() { _pool.reset(); }
+
+    private:
+        std::shared_ptr<ConvertPool> _pool;
+    };
+
+    /// Converts the uploaded file and sends the result on the socket,
+    /// which the caller no longer owns.
+    /// @param fromPath the uploaded file, removed with its directory when done.
+    /// @param format the target format, as in the request.
+    /// @param queue true to copy the result to the download directory
+    /// and reply with its URL, instead of sending the file.
+    void enqueue(const std::shared_ptr<StreamSocket>& socket, const std::string& fromPath,
+                 const std::string& format, bool queue);
+
+    /// Polls the socket of a kit of ours.
+    void addSocketToPoll(const std::shared_ptr<Socket>& socket);
+
+    /// A message from a kit of ours, in the poll thread.
+    void handleInput(const std::shared_ptr<ChildProcess>& child, const std::vector<char>& data);
+
+    /// A kit of ours disconnected, in the poll thread.
+    void childDisconnected(const std::shared_ptr<ChildProcess>& child);
+
+    /// The conversions per second over the last RateIntervalMs.
+    double getRate() const { return _rate; }
+
+    void dumpState(std::ostream& os);
+
+    /// True if the format may be sent to a kit and used as a metric label.
+    static bool isValidFormat(const std::string& format);
+
+private:
+    struct Job
+    {
+        unsigned Id;
+        std::shared_ptr<StreamSocket> Socket;
+        std::string FromPath;
+        std::string Format;
+        bool Queue;
+        std::chrono::steady_clock::time_point QueuedTime;
+        std::chrono::steady_clock::time_point StartTime;
+        /// The directory of the job in the jail of its kit, once started.
+        std::string JobDir;
+    };
+
+    struct Kit
+    {
+        std::shared_ptr<ChildProcess> Child;
+        size_t Conversions;
+        std::shared_ptr<Job> Current;
+    };
+
+    void pollThread();
+
+    /// Claims a spare child when we have fewer kits than we want, from
+    /// another thread, as getting one may block for seconds.
+    void claimKits(std::chrono::steady_clock::time_point now);
+
+    /// Takes the claimed child, if any, back in the poll thread.
+    void addKit(const std::shared_ptr<ChildProcess>& child);
+
+    /// Publishes the state of the poll thread for dumpState.
+    void updateStats();
+
+    /// Starts the waiting jobs on the idle kits.
+    void dispatch();
+    bool startJob(Kit& kit, const std::shared_ptr<Job>& job);
+
+    /// Replies to the client and cleans up, the job is over.
+    /// @param resultPath the converted file, empty if the conversion failed.
+    /// @param expired true if the job waited for a kit too long, the client may retry.
+    void finishJob(const std::shared_ptr<Job>& job, const std::string& resultPath,
+                   bool expired = false);
+
+    /// Kills the kit, failing its job if any.
+    /// @return the iterator following the removed kit.
+    std::vector<Kit>::iterator removeKit(std::vector<Kit>::iterator it, const std::string& reason);
+
+    /// Fails the conversions running or waiting for longer than the timeout.
+    void checkTimeouts(std::chrono::steady_clock::time_point now);
+    void updateRate(std::chrono::steady_clock::time_point now);
+
+    Histogram& getDurationHistogram(const std::string& format);
+
+private:
+    const size_t _size;
+    const size_t _maxQueue;
+    const size_t _maxConversionsPerKit;
+    const std::chrono::seconds _timeout;
+
+    std::unique_ptr<ConvertPoolPoll> _poll;
+    std::atomic<bool> _stop;
+
+    /// Queued and running conversions, including the reserved ones.
+    std::atomic<size_t> _pending;
+
+    /// The following are owned by the poll thread.
+    std::vector<Kit> _kits;
+    std::deque<std::shared_ptr<Job>> _jobs;
+    unsigned _lastJobId;
+    std::chrono::steady_clock::time_point _nextClaimTime;
+    bool _claiming;
+
+    /// Gets the spare children, one at a time, joined by stop().
+    std::thread _claimThread;
+
+    /// What dumpState reports of the above, from any thread.
+    std::atomic<size_t> _kitCount;
+    std::atomic<size_t> _busyCount;
+    std::atomic<size_t> _queuedCount;
+
+    /// For the rate: the conversions done since the start of the interval.
+    size_t _rateCount;
+    std::chrono::steady_clock::time_point _rateStart;
+    std::atomic<double> _rate;
+
+    /// The per-format durations, which dumpState reads.
+    std::mutex _durationsMutex;
+    std::map<std::string, Histogram*> _durations;
+
+    static constexpr int RateIntervalMs = 10 * 1000;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
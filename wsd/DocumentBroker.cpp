@@ -37,12 +37,15 @@
 #include "Poco/DOM/NamedNodeMap.h"
 
 #include "Admin.hpp"
+#include "AutoSaveScheduler.hpp"
 #include "ClientSession.hpp"
+#include "ConvertPool.hpp"
 #include "Exceptions.hpp"
 #include "Message.hpp"
 #include "Protocol.hpp"
 #include "LOOLWSD.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "Storage.hpp"
 #include "TileCache.hpp"
 #include "SenderQueue.hpp"
@@ -73,6 +76,15 @@ void ChildProcess::setDocumentBroker(const std::shared_ptr<DocumentBroker>& docB
     docBroker->addSocketToPoll(_socket);
 }
 
+void ChildProcess::setConvertPool(const std::shared_ptr<ConvertPool>& convertPool)
+{
+    assert(convertPool && "Invalid ConvertPool instance.");
+    _convertPool = convertPool;
+
+    // Add the prisoner socket to the pool poll.
+    convertPool->addSocketToPoll(_socket);
+}
+
 namespace
 {
 
@@ -86,6 +98,13 @@ std::string getCachePath(const std::string& uri)
     return LOOLWSD::Cache + '/' +
         Poco::DigestEngine::digestToHex(digestEngine.digest()).insert(3, "/").insert(2, "/").insert(1, "/");
 }
+
+Metrics::Counter& getRenderedTilesCounter()
+{
+    static Metrics::Counter& rendered = Metrics::counter("loolwsd_tiles_rendered_total",
+                                                         "Tiles rendered by the kits.");
+    return rendered;
+}
 }
 
 Poco::URI DocumentBroker::sanitizeURI(const std::string& uri)
@@ -187,6 +206,7 @@ DocumentBroker::DocumentBroker(const std::string& uri,
     _cacheRoot(getCachePath(uriPublic.toString())),
     _lastSaveTime(std::chrono::steady_clock::now()),
     _lastSaveRequestTime(std::chrono::steady_clock::now() - std::chrono::milliseconds(COMMAND_TIMEOUT_MS)),
+    _modifiedSince(std::chrono::steady_clock::now()),
     _markToDestroy(false),
     _lastEditableSession(false),
     _isLoaded(false),
@@ -198,7 +218,9 @@ DocumentBroker::DocumentBroker(const std::string& uri,
     _poll(new DocumentBrokerPoll("docbroker_" + _docId, *this)),
     _stop(false),
     _tileVersion(0),
-    _debugRenderedTileCount(0)
+    _prefetchPending(false),
+    _debugRenderedTileCount(0),
+    _unloadSaving(false)
 {
     assert(!_docKey.empty());
     assert(!_childRoot.empty());
@@ -261,14 +283,14 @@ void DocumentBroker::pollThread()
     _childProcess->setDocumentBroker(shared_from_this());
     LOG_INF("Doc [" << _docKey << "] attached to child [" << _childProcess->getPid() << "].");
 
-    auto last30SecCheckTime = std::chrono::steady_clock::now();
-
     static const bool AutoSaveEnabled = !std::getenv("LOOL_NO_AUTOSAVE");
     static const size_t IdleDocTimeoutSecs = LOOLWSD::getConfigValue<int>(
                                                       "per_document.idle_timeout_secs", 3600);
-    unsigned int savingtime = LOOLWSD::getConfigValue<unsigned int>(
-                                                      "autosave.autosaving", 30);
-    //fprintf(stderr, "%d\n", savingtime);
+    static const std::chrono::milliseconds AutoSaveInterval(1000 * LOOLWSD::getConfigValue<unsigned int>(
+                                                      "autosave.autosaving", 30));
+
+    // Jittered, so documents opened together don't save together.
+    auto nextAutoSaveTime = std::chrono::steady_clock::now() + AutoSaveScheduler::jitter(AutoSaveInterval);
     std::string closeReason = "stopped";
 
     // Main polling loop goodness.
@@ -290,14 +312,55 @@ void DocumentBroker::pollThread()
             closeReason = "recycling";
             _stop = true;
         }
-        else if (AutoSaveEnabled && !_stop &&
-                 std::chrono::duration_cast<std::chrono::seconds>(now - last30SecCheckTime).count() >= savingtime)
+        else if (!_unloadReason.empty())
+        {
+            if (!_isModified)
+            {
+                LOG_INF("Unloading DocumentBroker for docKey [" << getDocKey() << "]: " << _unloadReason);
+                closeReason = _unloadReason;
+                _stop = true;
+            }
+            else if (_unloadSaving)
+            {
+                // The save failed or timed out, don't lose the edits.
+                LOG_WRN("Not unloading modified DocumentBroker for docKey [" << getDocKey() << "].");
+                _unloadReason.clear();
+            }
+            else if (AutoSaveScheduler::instance().tryAcquireUrgent(_docKey, _modifiedSince,
+                                                                    _storage ? _storage->getFileInfo()._size : 0))
+            {
+                // Save first, the loop waits for the save before unloading.
+                LOG_TRC("Saving before unloading.");
+                _unloadSaving = true;
+                if (!autoSave(true))
+                    AutoSaveScheduler::instance().release(_docKey);
+            }
+
+            // Otherwise the scheduler deferred us, ahead of the autosaves.
+        }
+        else if (AutoSaveEnabled && !_stop && now >= nextAutoSaveTime)
         {
-            LOG_TRC("Triggering an autosave.");
-            autoSave(true);  
-            last30SecCheckTime = std::chrono::steady_clock::now();
+            if (!_isModified)
+            {
+                // Nothing to save, no need to bother the kit.
+                nextAutoSaveTime = now + AutoSaveScheduler::jitter(AutoSaveInterval);
+            }
+            else if (AutoSaveScheduler::instance().tryAcquire(_docKey, _modifiedSince,
+                                                              _storage ? _storage->getFileInfo()._size : 0))
+            {
+                LOG_TRC("Triggering an autosave.");
+                if (!autoSave(true))
+                    AutoSaveScheduler::instance().release(_docKey);
+
+                nextAutoSaveTime = now + AutoSaveScheduler::jitter(AutoSaveInterval);
+            }
+
+            // Otherwise the scheduler deferred us, retry on the next poll.
         }
 
+        if (isLoaded() && !_stop)
+            prefetchTiles();
+
         // Remove idle documents after 1 hour.
         const bool idle = (getIdleTimeSecs() >= IdleDocTimeoutSecs);
 
@@ -331,6 +394,8 @@ void DocumentBroker::pollThread()
     // Terminate properly while we can.
     terminateChild(closeReason, false);
 
+    AutoSaveScheduler::instance().cancel(_docKey);
+
     // Stop to mark it done and cleanup.
     _poll->stop();
     _poll->removeSockets();
@@ -718,6 +783,9 @@ bool DocumentBroker::saveToStorage(const std::string& sessionId,
 {
     assertCorrectThread();
 
+    // Let the next autosave go, whether this one was or not.
+    AutoSaveScheduler::instance().release(_docKey);
+
     const bool res = saveToStorageInternal(sessionId, success, result);
 
     // If marked to destroy, or session is disconnected, remove.
@@ -1135,13 +1203,13 @@ void DocumentBroker::alertAllUsers(const std::string& msg)
 
 
 /// Handles input from the prisoner / child kit process
-bool DocumentBroker::handleInput(const std::vector<char>& payload)
+bool DocumentBroker::handleInput(std::vector<char>&& payload)
 {
-    auto message = std::make_shared<Message>(payload.data(), payload.size(), Message::Dir::Out);
-    const auto& msg = message->abbr();
-    LOG_TRC("DocumentBroker handling child message: [" << msg << "].");
+    const auto message = std::make_shared<Message>(std::move(payload), Message::Dir::Out);
+    LOG_TRC("DocumentBroker handling child message: [" << message->abbr() << "].");
 
-    LOOLWSD::dumpOutgoingTrace(getJailId(), "0", msg);
+    if (LOOLWSD::TraceDumper)
+        LOOLWSD::dumpOutgoingTrace(getJailId(), "0", message->abbr());
 
     if (LOOLProtocol::getFirstToken(message->forwardToken(), '-') == "client")
     {
@@ -1152,11 +1220,11 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
         const auto& command = message->firstToken();
         if (command == "tile:")
         {
-            handleTileResponse(payload);
+            handleTileResponse(message);
         }
         else if (command == "tilecombine:")
         {
-            handleTileCombinedResponse(payload);
+            handleTileCombinedResponse(message);
         }
         else if (command == "errortoall:")
         {
@@ -1176,9 +1244,13 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
                 Admin::instance().updateMemoryDirty(_docKey, dirty);
             }
         }
+        else if (command == "kitmetrics:")
+        {
+            handleKitMetrics(message->firstLine());
+        }
         else
         {
-            LOG_ERR("Unexpected message: [" << msg << "].");
+            LOG_ERR("Unexpected message: [" << message->abbr() << "].");
             return false;
         }
     }
@@ -1186,22 +1258,106 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
     return true;
 }
 
+bool DocumentBroker::handleRingInput(std::vector<char>&& header, const char* tiles, const size_t size)
+{
+    const auto message = std::make_shared<Message>(std::move(header), Message::Dir::Out);
+    LOG_TRC("DocumentBroker handling child ring message: [" << message->abbr() << "], " <<
+            size << " bytes in the ring.");
+
+    if (LOOLWSD::TraceDumper)
+        LOOLWSD::dumpOutgoingTrace(getJailId(), "0", message->abbr());
+
+    const auto& command = message->firstToken();
+    if (command == "tile:")
+    {
+        handleTileResponse(message->firstLine(), tiles, size);
+    }
+    else if (command == "tilecombine:")
+    {
+        handleTileCombinedResponse(message->firstLine(), tiles, size);
+    }
+    else
+    {
+        LOG_ERR("Unexpected ring message: [" << message->abbr() << "].");
+        return false;
+    }
+
+    return true;
+}
+
+void DocumentBroker::handleKitMetrics(const std::string& metrics)
+{
+    // The kits report the samples since their last report.
+    static Histogram& paint = Metrics::histogram("loolkit_paint_duration_us",
+        "Time the kits spend painting tiles, per paint.", "us");
+    static Histogram& render = Metrics::histogram("loolkit_render_duration_us",
+        "Time the kits spend rendering tiles, including the PNG encoding, per request.", "us");
+
+    const auto tokens = LOOLProtocol::tokenize(metrics);
+    std::string name;
+    if (tokens.size() < 2 || !LOOLProtocol::getTokenString(tokens[1], "name", name))
+    {
+        LOG_WRN("Invalid kit metrics: [" << metrics << "].");
+        return;
+    }
+
+    const auto samples = metrics.substr(metrics.find(tokens[1]) + tokens[1].size());
+    if (name == "paint")
+    {
+        paint.merge(samples);
+    }
+    else if (name == "render")
+    {
+        render.merge(samples);
+    }
+    else
+    {
+        LOG_WRN("Unknown kit metric [" << name << "].");
+    }
+}
+
 void DocumentBroker::invalidateTiles(const std::string& tiles)
 {
     // Remove from cache.
     _tileCache->invalidateTiles(tiles);
+
+    // The prefetched tiles are outdated, the clients will request them again.
+    std::unique_lock<std::mutex> lock(_mutex);
+    cancelPrefetch();
+    _prefetchPending = true;
+}
+
+void DocumentBroker::cancelPrefetch()
+{
+    const auto canceltiles = tileCache().cancelPrefetch();
+    if (!canceltiles.empty())
+    {
+        LOG_DBG("Cancelling prefetched tiles: " << canceltiles);
+        _childProcess->sendTextFrame(canceltiles);
+    }
 }
 
 void DocumentBroker::handleTileRequest(TileDesc& tile,
                                        const std::shared_ptr<ClientSession>& session)
 {
     assertCorrectThread();
+
+    static Metrics::Counter& requests = Metrics::counter("loolwsd_tile_requests_total{kind=\"tile\"}",
+                                                         "Tile requests of the clients.");
+    static Histogram& duration = Metrics::histogram("loolwsd_tile_request_duration_us{kind=\"tile\"}",
+        "Time to serve tile requests from the cache, or forward them to the kit.", "us");
+    requests.inc();
+    Metrics::ScopedTimer timer(duration);
+
     std::unique_lock<std::mutex> lock(_mutex);
 
     tile.setVersion(++_tileVersion);
     const auto tileMsg = tile.serialize();
     LOG_TRC("Tile request for " << tileMsg);
 
+    // The client may have moved, look around it again.
+    _prefetchPending = true;
+
     std::unique_ptr<std::fstream> cachedTile = _tileCache->lookupTile(tile);
     if (cachedTile)
     {
@@ -1241,6 +1397,9 @@ void DocumentBroker::handleTileRequest(TileDesc& tile,
         tileCache().subscribeToTileRendering(tile, session);
     }
 
+    // Don't keep the client waiting behind the tiles it may never need.
+    cancelPrefetch();
+
     // Forward to child to render.
     LOG_DBG("Sending render request for tile (" << tile.getPart() << ',' <<
             tile.getTilePosX() << ',' << tile.getTilePosY() << ").");
@@ -1252,39 +1411,40 @@ void DocumentBroker::handleTileRequest(TileDesc& tile,
 void DocumentBroker::handleTileCombinedRequest(TileCombined& tileCombined,
                                                const std::shared_ptr<ClientSession>& session)
 {
+    static Metrics::Counter& requests = Metrics::counter("loolwsd_tile_requests_total{kind=\"tilecombine\"}",
+                                                         "Tile requests of the clients.");
+    static Histogram& duration = Metrics::histogram("loolwsd_tile_request_duration_us{kind=\"tilecombine\"}",
+        "Time to serve tile requests from the cache, or forward them to the kit.", "us");
+    requests.inc();
+    Metrics::ScopedTimer timer(duration);
+
     std::unique_lock<std::mutex> lock(_mutex);
 
     LOG_TRC("TileCombined request for " << tileCombined.serialize());
 
-    // Satisfy as many tiles from the cache.
+    // The client may have moved, look around it again.
+    _prefetchPending = true;
+
+    // Satisfy as many tiles from the cache, and render the others.
+    std::vector<TileDesc> cached;
+    std::vector<char> images;
     std::vector<TileDesc> tiles;
     for (auto& tile : tileCombined.getTiles())
     {
         std::unique_ptr<std::fstream> cachedTile = _tileCache->lookupTile(tile);
         if (cachedTile)
         {
-            //TODO: Combine the response to reduce latency.
-#if ENABLE_DEBUG
-            const std::string response = tile.serialize("tile:") + " renderid=cached\n";
-#else
-            const std::string response = tile.serialize("tile:") + "\n";
-#endif
-
-            std::vector<char> output;
-            output.reserve(static_cast<size_t>(4) * tile.getWidth() * tile.getHeight());
-            output.resize(response.size());
-            std::memcpy(output.data(), response.data(), response.size());
-
             assert(cachedTile->is_open());
             cachedTile->seekg(0, std::ios_base::end);
-            const auto pos = output.size();
+            const auto pos = images.size();
             std::streamsize size = cachedTile->tellg();
-            output.resize(pos + size);
+            images.resize(pos + size);
             cachedTile->seekg(0, std::ios_base::beg);
-            cachedTile->read(output.data() + pos, size);
+            cachedTile->read(images.data() + pos, size);
             cachedTile->close();
 
-            session->sendBinaryFrame(output.data(), output.size());
+            cached.push_back(tile);
+            cached.back().setImgSize(size);
         }
         else
         {
@@ -1298,13 +1458,49 @@ void DocumentBroker::handleTileCombinedRequest(TileCombined& tileCombined,
 
     if (!tiles.empty())
     {
+        // Don't keep the client waiting behind the tiles it may never need.
+        cancelPrefetch();
+
         auto newTileCombined = TileCombined::create(tiles);
 
-        // Forward to child to render.
+        // Forward to child to render, while we send the cached ones.
         const auto req = newTileCombined.serialize("tilecombine");
         LOG_DBG("Sending residual tilecombine: " << req);
         _childProcess->sendTextFrame(req);
     }
+
+    if (cached.size() == 1)
+    {
+#if ENABLE_DEBUG
+        const std::string response = cached[0].serialize("tile:") + " renderid=cached\n";
+#else
+        const std::string response = cached[0].serialize("tile:") + "\n";
+#endif
+
+        std::vector<char> output(response.begin(), response.end());
+        output.insert(output.end(), images.begin(), images.end());
+        session->sendBinaryFrame(output.data(), output.size());
+    }
+    else if (!cached.empty())
+    {
+        // All the cached tiles in one frame, which the client splits by imgsize.
+        auto cachedCombined = TileCombined::create(cached);
+        for (size_t i = 0; i < cached.size(); ++i)
+            cachedCombined.getTiles()[i].setImgSize(cached[i].getImgSize());
+
+#if ENABLE_DEBUG
+        const std::string response = cachedCombined.serialize("tilecombine:") + " renderid=cached\n";
+#else
+        const std::string response = cachedCombined.serialize("tilecombine:") + "\n";
+#endif
+
+        LOG_TRC("Sending " << cached.size() << " cached tiles in " << images.size() << " bytes: " << response);
+        std::vector<char> output;
+        output.reserve(response.size() + images.size());
+        output.insert(output.end(), response.begin(), response.end());
+        output.insert(output.end(), images.begin(), images.end());
+        session->sendBinaryFrame(output.data(), output.size());
+    }
 }
 
 void DocumentBroker::cancelTileRequests(const std::shared_ptr<ClientSession>& session)
@@ -1319,23 +1515,80 @@ void DocumentBroker::cancelTileRequests(const std::shared_ptr<ClientSession>& se
     }
 }
 
-void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
+void DocumentBroker::prefetchTiles()
+{
+    assertCorrectThread();
+
+    static const int PrefetchRows = LOOLWSD::getConfigValue<int>("per_document.tile_prefetch_rows", 1);
+    // Nothing changed since we last looked: the candidates are cached or being rendered.
+    if (PrefetchRows <= 0 || !_prefetchPending)
+        return;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // The requests of the clients come first, we look again once they are rendered.
+    if (tileCache().hasTilesBeingRendered())
+        return;
+
+    _prefetchPending = false;
+
+    std::vector<TileDesc> tiles;
+    for (const auto& it : _sessions)
+    {
+        const std::shared_ptr<ClientSession>& session = it.second;
+        if (!session->isViewLoaded())
+            continue;
+
+        for (auto& tile : session->getTilesAroundVisibleArea(PrefetchRows))
+        {
+            // One row at a time, so that a client request waits for it at most.
+            if (!tiles.empty() && tiles[0].getTilePosY() != tile.getTilePosY())
+                continue;
+
+            // Only spend a version on the tiles we actually request.
+            tile.setVersion(_tileVersion + 1);
+            if (tileCache().prefetchTile(tile))
+            {
+                ++_tileVersion;
+                tiles.push_back(tile);
+            }
+        }
+
+        if (!tiles.empty())
+            break;
+    }
+
+    if (tiles.empty())
+        return;
+
+    const auto req = TileCombined::create(tiles).serialize("tilecombine");
+    LOG_TRC("Prefetching " << req);
+    _childProcess->sendTextFrame(req);
+}
+
+void DocumentBroker::handleTileResponse(const std::shared_ptr<Message>& payload)
+{
+    const std::string& firstLine = payload->firstLine();
+    const size_t offset = std::min(firstLine.size() + 1, payload->size());
+    handleTileResponse(firstLine, payload->data().data() + offset, payload->size() - offset);
+}
+
+void DocumentBroker::handleTileResponse(const std::string& firstLine, const char* tiles,
+                                        const size_t size)
 {
-    const std::string firstLine = getFirstLine(payload);
     LOG_DBG("Handling tile: " << firstLine);
 
     try
     {
-        const auto length = payload.size();
-        if (firstLine.size() < static_cast<std::string::size_type>(length) - 1)
+        if (size > 0)
         {
             const auto tile = TileDesc::parse(firstLine);
-            const auto buffer = payload.data();
-            const auto offset = firstLine.size() + 1;
 
             std::unique_lock<std::mutex> lock(_mutex);
 
-            tileCache().saveTileAndNotify(tile, buffer + offset, length - offset);
+            tileCache().saveTileAndNotify(tile, tiles, size);
+            getRenderedTilesCounter().inc();
+            _prefetchPending = true;
         }
         else
         {
@@ -1349,27 +1602,42 @@ void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
     }
 }
 
-void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload)
+void DocumentBroker::handleTileCombinedResponse(const std::shared_ptr<Message>& payload)
+{
+    const std::string& firstLine = payload->firstLine();
+    const size_t offset = std::min(firstLine.size() + 1, payload->size());
+    handleTileCombinedResponse(firstLine, payload->data().data() + offset, payload->size() - offset);
+}
+
+void DocumentBroker::handleTileCombinedResponse(const std::string& firstLine, const char* tiles,
+                                                const size_t size)
 {
-    const std::string firstLine = getFirstLine(payload);
     LOG_DBG("Handling tile combined: " << firstLine);
 
     try
     {
-        const auto length = payload.size();
-        if (firstLine.size() < static_cast<std::string::size_type>(length) - 1)
+        if (size > 0)
         {
             const auto tileCombined = TileCombined::parse(firstLine);
-            const auto buffer = payload.data();
-            auto offset = firstLine.size() + 1;
+            size_t offset = 0;
 
             std::unique_lock<std::mutex> lock(_mutex);
 
             for (const auto& tile : tileCombined.getTiles())
             {
-                tileCache().saveTileAndNotify(tile, buffer + offset, tile.getImgSize());
-                offset += tile.getImgSize();
+                const size_t imgSize = tile.getImgSize();
+                if (imgSize > size - offset)
+                {
+                    LOG_ERR("Truncated tilecombine response: " << firstLine);
+                    break;
+                }
+
+                tileCache().saveTileAndNotify(tile, tiles + offset, imgSize);
+                offset += imgSize;
             }
+
+            getRenderedTilesCounter().inc(tileCombined.getTiles().size());
+            _prefetchPending = true;
         }
         else
         {
@@ -1421,6 +1689,9 @@ void DocumentBroker::destroyIfLastEditor(const std::string& id)
 
 void DocumentBroker::setModified(const bool value)
 {
+    if (value && !_isModified)
+        _modifiedSince = std::chrono::steady_clock::now();
+
     _tileCache->setUnsavedChanges(value);
     _isModified = value;
 }
@@ -1461,17 +1732,13 @@ bool DocumentBroker::forwardToClient(const std::shared_ptr<Message>& payload)
 {
     assertCorrectThread();
 
-    const std::string& msg = payload->abbr();
     const std::string& prefix = payload->forwardToken();
-    LOG_TRC("Forwarding payload to [" << prefix << "]: " << msg);
+    LOG_TRC("Forwarding payload to [" << prefix << "]: " << payload->abbr());
 
     std::string name;
     std::string sid;
     if (LOOLProtocol::parseNameValuePair(payload->forwardToken(), name, sid, '-') && name == "client")
     {
-        const auto& data = payload->data().data();
-        const auto& size = payload->size();
-
         if (sid == "all")
         {
             // Broadcast to all.
@@ -1479,7 +1746,7 @@ bool DocumentBroker::forwardToClient(const std::shared_ptr<Message>& payload)
             std::map<std::string, std::shared_ptr<ClientSession>> sessions(_sessions);
             for (const auto& pair : sessions)
             {
-                pair.second->handleKitToClientMessage(data, size);
+                pair.second->handleKitToClientMessage(payload);
             }
         }
         else
@@ -1490,11 +1757,11 @@ bool DocumentBroker::forwardToClient(const std::shared_ptr<Message>& payload)
                 // Take a ref as the session could be removed from _sessions
                 // if it's the save confirmation keeping a stopped session alive.
                 std::shared_ptr<ClientSession> session = it->second;
-                return session->handleKitToClientMessage(data, size);
+                return session->handleKitToClientMessage(payload);
             }
             else
             {
-                LOG_WRN("Client session [" << sid << "] not found to forward message: " << msg);
+                LOG_WRN("Client session [" << sid << "] not found to forward message: " << payload->abbr());
             }
         }
     }
@@ -1584,6 +1851,18 @@ void DocumentBroker::closeDocument(const std::string& reason)
     terminateChild(reason, true);
 }
 
+void DocumentBroker::unload(const std::string& reason)
+{
+    assertCorrectThread();
+
+    LOG_DBG("Unloading DocumentBroker for docKey [" << _docKey << "] requested with reason: " << reason);
+
+    // The poll loop saves first, if modified, without bypassing the
+    // scheduler: many documents may be unloaded at once.
+    _unloadReason = reason;
+    _unloadSaving = false;
+}
+
 void DocumentBroker::updateLastActivityTime()
 {
     _lastActivityTime = std::chrono::steady_clock::now();
@@ -1617,7 +1896,14 @@ void DocumentBroker::dumpState(std::ostream& os)
         + (_lastSaveTime - std::chrono::steady_clock::now()));
     os << "\n  last saved: " << std::ctime(&t);
     os << "\n  cursor " << _cursorPosX << ", " << _cursorPosY
-      << "( " << _cursorWidth << "," << _cursorHeight << ")\n";
+      << "( " << _cursorWidth << "," << _cursorHeight << ")";
+
+    const size_t prefetched = _tileCache ? _tileCache->getPrefetchCount() : 0;
+    const size_t prefetchHits = _tileCache ? _tileCache->getPrefetchHitCount() : 0;
+    os << "\n  prefetched tiles: " << prefetched << ", requested since: " << prefetchHits;
+    if (prefetched > 0)
+        os << " (" << prefetchHits * 100 / prefetched << "%)";
+    os << '\n';
 
     _poll->dumpState(os);
 }
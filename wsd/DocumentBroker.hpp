@@ -36,6 +36,7 @@
 // Forwards.
 class PrisonerRequestDispatcher;
 class DocumentBroker;
+class ConvertPool;
 class StorageBase;
 class TileCache;
 class Message;
@@ -92,6 +93,10 @@ public:
     void setDocumentBroker(const std::shared_ptr<DocumentBroker>& docBroker);
     std::shared_ptr<DocumentBroker> getDocumentBroker() const { return _docBroker.lock(); }
 
+    /// Lends the child to the ConvertPool instead of a DocumentBroker.
+    void setConvertPool(const std::shared_ptr<ConvertPool>& convertPool);
+    std::shared_ptr<ConvertPool> getConvertPool() const { return _convertPool.lock(); }
+
     void stop()
     {
         // Request the child to exit.
@@ -194,6 +199,7 @@ private:
     std::shared_ptr<WebSocketHandler> _ws;
     std::shared_ptr<Socket> _socket;
     std::weak_ptr<DocumentBroker> _docBroker;
+    std::weak_ptr<ConvertPool> _convertPool;
 };
 
 class ClientSession;
@@ -303,13 +309,34 @@ public:
     void handleTileCombinedRequest(TileCombined& tileCombined,
                                    const std::shared_ptr<ClientSession>& session);
     void cancelTileRequests(const std::shared_ptr<ClientSession>& session);
-    void handleTileResponse(const std::vector<char>& payload);
-    void handleTileCombinedResponse(const std::vector<char>& payload);
+
+    /// Requests the tiles around the visible areas of the clients, one row at
+    /// a time and only while no other tiles are being rendered, to have them
+    /// in the cache before the clients scroll there.
+    void prefetchTiles();
+
+    /// The visible area of a client changed, look for tiles to prefetch again.
+    void schedulePrefetch() { _prefetchPending = true; }
+
+    void handleTileResponse(const std::shared_ptr<Message>& payload);
+    void handleTileCombinedResponse(const std::shared_ptr<Message>& payload);
+
+    /// @param tiles the PNGs following the header line.
+    void handleTileResponse(const std::string& firstLine, const char* tiles, size_t size);
+    void handleTileCombinedResponse(const std::string& firstLine, const char* tiles, size_t size);
+
+    /// Merges the render timings reported by the kit into the metrics.
+    void handleKitMetrics(const std::string& metrics);
 
     void destroyIfLastEditor(const std::string& id);
     bool isMarkedToDestroy() const { return _markToDestroy || _stop; }
 
-    bool handleInput(const std::vector<char>& payload);
+    bool handleInput(std::vector<char>&& payload);
+
+    /// Handles the tiles the kit wrote to the tile ring, in place.
+    /// @param header the header line of the tile message.
+    /// @param tiles the PNGs, only valid for the duration of the call.
+    bool handleRingInput(std::vector<char>&& header, const char* tiles, size_t size);
 
     /// Forward a message from client session to its respective child session.
     bool forwardToChild(const std::string& viewId, const std::string& message);
@@ -318,6 +345,11 @@ public:
 
     void closeDocument(const std::string& reason);
 
+    /// Gracefully unload the document, as we do when idle.
+    /// If modified, it is saved first, as soon as the AutoSaveScheduler
+    /// lets it, and only unloaded once the save succeeded.
+    void unload(const std::string& reason);
+
     /// Called by the ChildProcess object to notify
     /// that it has terminated on its own.
     /// This happens either when the child exists
@@ -362,6 +394,9 @@ private:
     /// Forward a message from child session to its respective client session.
     bool forwardToClient(const std::shared_ptr<Message>& payload);
 
+    /// Cancels the prefetched tiles no client asked for yet. Call with _mutex held.
+    void cancelPrefetch();
+
     /// The thread function that all of the I/O for all sessions
     /// associated with this document.
     void pollThread();
@@ -388,6 +423,9 @@ private:
     /// The last time we sent a save request.
     std::chrono::steady_clock::time_point _lastSaveRequestTime;
 
+    /// When the document last went from unmodified to modified.
+    std::chrono::steady_clock::time_point _modifiedSince;
+
     /// The document's last-modified time on storage.
     Poco::Timestamp _documentLastModifiedTime;
 
@@ -413,10 +451,18 @@ private:
     /// painting and invalidation.
     std::atomic<size_t> _tileVersion;
 
+    /// Set when the visible areas or the tile cache changed since the last prefetch.
+    std::atomic<bool> _prefetchPending;
+
     int _debugRenderedTileCount;
 
     std::chrono::steady_clock::time_point _lastActivityTime;
     std::chrono::steady_clock::time_point _threadStart;
+
+    /// Non-empty when asked to unload, with the reason.
+    std::string _unloadReason;
+    /// Whether we already saved before unloading.
+    bool _unloadSaving;
     std::chrono::milliseconds _loadDuration;
 
     bool tokenUsed(std::string);
@@ -28,6 +28,7 @@
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/NameValueCollection.h>
 #include <Poco/Net/NetException.h>
+#include <Poco/Path.h>
 #include <Poco/RegularExpression.h>
 #include <Poco/Runnable.h>
 #include <Poco/StreamCopier.h>
@@ -52,6 +53,7 @@ using Poco::StreamCopier;
 using Poco::Util::Application;
 
 std::map<std::string, std::pair<std::string, std::string>> FileServerRequestHandler::FileHash;
+std::map<std::string, std::unique_ptr<PreprocessedFile>> FileServerRequestHandler::PreprocessedFiles;
 
 bool FileServerRequestHandler::isAdminLoggedIn(const HTTPRequest& request,
                                                HTTPResponse &response)
@@ -201,7 +203,6 @@ void FileServerRequestHandler::handleRequest(const HTTPRequest& request, Poco::M
                         << "Cache-Control: max-age=11059200\r\n"
                         << "\r\n";
                     socket->send(oss.str());
-                    socket->shutdown();
                     return;
                 }
             }
@@ -236,14 +237,12 @@ void FileServerRequestHandler::handleRequest(const HTTPRequest& request, Poco::M
                 response.set("ETag", "\"" LOOLWSD_VERSION_HASH "\"");
             }
             response.setContentType(mimeType);
+            response.setContentLength(content.size());
             response.add("X-Content-Type-Options", "nosniff");
 
-            std::ostringstream oss;
-            response.write(oss);
-            const std::string header = oss.str();
             LOG_TRC("#" << socket->getFD() << ": Sending " <<
-                    (!gzip ? "un":"") << "compressed : file [" << relPath << "]: " << header);
-            socket->send(header);
+                    (!gzip ? "un":"") << "compressed : file [" << relPath << "].");
+            socket->send(response);
             socket->send(content);
         }
     }
@@ -368,6 +367,26 @@ void FileServerRequestHandler::initialize()
             LOG_ERR("Failed to read from directory " << subdir);
         }
     }
+
+    // Only the access token and the host change between the requests.
+    const auto& config = Application::instance().config();
+    const std::string loleafletHtml = config.getString("loleaflet_html", "loleaflet.html");
+    const std::map<std::string, std::string> constants = {
+        { "VERSION", LOOLWSD_VERSION_HASH },
+        { "LOLEAFLET_LOGGING", config.getString("loleaflet_logging", "false") },
+        { "OUT_OF_FOCUS_TIMEOUT_SECS", config.getString("per_view.out_of_focus_timeout_secs", "60") },
+        { "IDLE_TIMEOUT_SECS", config.getString("per_view.idle_timeout_secs", "900") }
+    };
+
+    for (const auto& it : FileHash)
+    {
+        const std::string& relPath = it.first;
+        if (Poco::Path(relPath).getFileName() == loleafletHtml)
+        {
+            LOG_TRC("Preprocessing file: " << relPath);
+            PreprocessedFiles[relPath].reset(new PreprocessedFile(it.second.first, constants));
+        }
+    }
 }
 
 const std::string *FileServerRequestHandler::getCompressedFile(const std::string &path)
@@ -402,7 +421,8 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request, Poco::
     // Is this a file we read at startup - if not; its not for serving.
     const std::string relPath = getRequestPathname(request);
     LOG_DBG("Preprocessing file: " << relPath);
-    if (FileHash.find(relPath) == FileHash.end())
+    const auto itFile = PreprocessedFiles.find(relPath);
+    if (itFile == PreprocessedFiles.end())
     {
         LOG_ERR("File [" << relPath << "] does not exist.");
 
@@ -417,8 +437,6 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request, Poco::
         return;
     }
 
-    std::string preprocess = *getUncompressedFile(relPath);
-
     HTMLForm form(request, message);
     const std::string& accessToken = form.get("access_token", "");
     const std::string& accessTokenTtl = form.get("access_token_ttl", "");
@@ -450,19 +468,16 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request, Poco::
         }
     }
 
-    Poco::replaceInPlace(preprocess, std::string("%ACCESS_TOKEN%"), escapedAccessToken);
-    Poco::replaceInPlace(preprocess, std::string("%ACCESS_TOKEN_TTL%"), std::to_string(tokenTtl));
-    Poco::replaceInPlace(preprocess, std::string("%HOST%"), host);
-    Poco::replaceInPlace(preprocess, std::string("%VERSION%"), std::string(LOOLWSD_VERSION_HASH));
+    std::vector<std::string> values(static_cast<size_t>(PreprocessedFile::Slot::Count));
+    values[static_cast<size_t>(PreprocessedFile::Slot::AccessToken)] = escapedAccessToken;
+    values[static_cast<size_t>(PreprocessedFile::Slot::AccessTokenTtl)] = std::to_string(tokenTtl);
+    values[static_cast<size_t>(PreprocessedFile::Slot::Host)] = host;
 
-    const auto& config = Application::instance().config();
-    const auto loleafletLogging = config.getString("loleaflet_logging", "false");
-    Poco::replaceInPlace(preprocess, std::string("%LOLEAFLET_LOGGING%"), loleafletLogging);
-    const auto outOfFocusTimeoutSecs= config.getString("per_view.out_of_focus_timeout_secs", "60");
-    Poco::replaceInPlace(preprocess, std::string("%OUT_OF_FOCUS_TIMEOUT_SECS%"), outOfFocusTimeoutSecs);
-    const auto idleTimeoutSecs= config.getString("per_view.idle_timeout_secs", "900");
-    Poco::replaceInPlace(preprocess, std::string("%IDLE_TIMEOUT_SECS%"), idleTimeoutSecs);
+    const bool gzip = request.hasToken("Accept-Encoding", "gzip");
+    const std::string preprocess = (gzip ? itFile->second->renderCompressed(values)
+                                         : itFile->second->render(values));
 
+    const auto& config = Application::instance().config();
     const std::string mimeType = "text/html";
 
     std::ostringstream oss;
@@ -471,8 +486,11 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request, Poco::
         << "Last-Modified: " << Poco::DateTimeFormatter::format(Poco::Timestamp(), Poco::DateTimeFormat::HTTP_FORMAT) << "\r\n"
         << "User-Agent: " << WOPI_AGENT_STRING << "\r\n"
         << "Cache-Control:max-age=11059200\r\n"
-        << "ETag: \"" LOOLWSD_VERSION_HASH "\"\r\n"
+        // The gzipped representation is a different entity, as far as caches go.
+        << "ETag: \"" LOOLWSD_VERSION_HASH << (gzip ? "-gz" : "") << "\"\r\n"
         << "Content-Length: " << preprocess.size() << "\r\n"
+        << (gzip ? "Content-Encoding: gzip\r\n" : "")
+        << "Vary: Accept-Encoding\r\n"
         << "Content-Type: " << mimeType << "\r\n"
         << "X-Content-Type-Options: nosniff\r\n"
         << "X-XSS-Protection: 1; mode=block\r\n"
@@ -593,7 +611,8 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request, Poco::
         << preprocess;
 
     socket->send(oss.str());
-    LOG_DBG("Sent file: " << relPath << ": " << preprocess);
+    LOG_DBG("Sent file: " << relPath << " (" << preprocess.size() << " bytes" <<
+            (gzip ? ", gzipped" : "") << ").");
 }
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
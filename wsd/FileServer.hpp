@@ -10,7 +10,10 @@
 #ifndef INCLUDED_FILESERVER_HPP
 #define INCLUDED_FILESERVER_HPP
 
+#include <map>
 #include <string>
+#include <vector>
+#include "PreprocessedFile.hpp"
 #include "Socket.hpp"
 
 #include <Poco/MemoryStream.h>
@@ -39,6 +42,7 @@ public:
 
 private:
    static std::map<std::string, std::pair<std::string, std::string>> FileHash;
+   static std::map<std::string, std::unique_ptr<PreprocessedFile>> PreprocessedFiles;
 };
 
 #endif
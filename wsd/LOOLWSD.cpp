@@ -43,6 +43,7 @@
 #include <cstring>
 #include <ctime>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <mutex>
@@ -51,6 +52,7 @@
 #include <chrono>
 
 #include <Poco/DateTimeFormatter.h>
+#include <Poco/DeflatingStream.h>
 #include <Poco/DOM/AutoPtr.h>
 #include <Poco/DOM/DOMParser.h>
 #include <Poco/DOM/DOMWriter.h>
@@ -115,16 +117,20 @@
 
 #include "Admin.hpp"
 #include "Auth.hpp"
+#include "AutoSaveScheduler.hpp"
 #include "ClientSession.hpp"
+#include "ConvertPool.hpp"
 #include "Common.hpp"
 #include "DocumentBroker.hpp"
 #include "Exceptions.hpp"
 #include "FileServer.hpp"
 #include "IoUtil.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "Protocol.hpp"
 #include "ServerSocket.hpp"
 #include "Session.hpp"
+#include "ShmRing.hpp"
 #if ENABLE_SSL
 #  include "SslSocket.hpp"
 #endif
@@ -136,6 +142,8 @@
 #include "UserMessages.hpp"
 #include "Util.hpp"
 #include "FileUtil.hpp"
+#include "HttpRequestReader.hpp"
+#include "WebSocketDeflate.hpp"
 
 #ifdef KIT_IN_PROCESS
 #  include <Kit.hpp>
@@ -204,6 +212,14 @@ using Poco::Delegate;
 
 int ClientPortNumber = DEFAULT_CLIENT_PORT_NUMBER;
 int MasterPortNumber = DEFAULT_MASTER_PORT_NUMBER;
+bool UseLocalSocket = false;
+int TileRingSizeKb = 0;
+/// The largest request body accepted, 0 for no limit.
+uint64_t MaxRequestBodySize = 0;
+/// Requests whose bytes stop arriving for this long are rejected.
+int RequestTimeoutSecs = 30;
+/// Kept connections without a new request for this long are closed.
+int KeepAliveTimeoutSecs = 15;
 
 /// New LOK child processes ready to host documents.
 //TODO: Move to a more sensible namespace.
@@ -217,6 +233,9 @@ static std::mutex NewChildrenMutex;
 static std::condition_variable NewChildrenCV;
 static std::vector<std::shared_ptr<ChildProcess> > NewChildren;
 
+/// Serves /lool/convert-to with warm kits, unless disabled.
+static std::shared_ptr<ConvertPool> ConvertToPool;
+
 static std::chrono::steady_clock::time_point LastForkRequestTime = std::chrono::steady_clock::now();
 static std::atomic<int> OutstandingForks(0);
 static std::map<std::string, std::shared_ptr<DocumentBroker> > DocBrokers;
@@ -668,11 +687,36 @@ void LOOLWSD::initialize(Application& self)
             { "num_prespawn_children", "1" },
             { "per_document.max_concurrency", "4" },
             { "per_document.idle_timeout_secs", "3600" },
+            { "per_document.tile_prefetch_rows", "1" },
+            { "autosave.autosaving", "30" },
+            { "autosave.max_concurrent_uploads", "4" },
+            { "autosave.max_per_minute", "60" },
+            { "convert_pool.size", "2" },
+            { "convert_pool.max_queue", "100" },
+            { "convert_pool.max_conversions_per_kit", "100" },
+            { "convert_pool.timeout_secs", "60" },
+            { "memory.limit_kb", "0" },
+            { "memory.low_watermark_percent", "80" },
+            { "memory.min_idle_secs", "300" },
+            { "websocket_compression[@enable]", "true" },
+            { "websocket_compression.context_takeover", "true" },
+            { "websocket_compression.min_size", "256" },
+            { "websocket_compression.level", "3" },
+            { "kit_transport.unix_socket", "true" },
+            { "kit_transport.tile_ring_size_kb", "0" },
+            { "net.max_body_size_mb", "100" },
+            { "net.request_timeout_secs", "30" },
+            { "net.keep_alive_timeout_secs", "15" },
+            { "mergeodf.warmup", "false" },
+            { "mergeodf.warmup_threads", "0" },
             { "per_view.out_of_focus_timeout_secs", "60" },
             { "per_view.idle_timeout_secs", "900" },
             { "loleaflet_html", "loleaflet.html" },
             { "logging.color", "true" },
             { "logging.level", "trace" },
+            { "logging.async[@enable]", "false" },
+            { "logging.async.queue_size", "4096" },
+            { "logging.async.overflow", "drop" },
             { "loleaflet_logging", "false" },
             { "ssl.enable", "true" },
             { "ssl.termination", "true" },
@@ -772,6 +816,18 @@ void LOOLWSD::initialize(Application& self)
 
     Log::initialize("wsd", logLevel, withColor, logToFile, logProperties);
 
+    // The forkit logs synchronously, a background thread doesn't survive its forks.
+    if (getConfigValue<bool>(conf, "logging.async[@enable]", false))
+    {
+        const auto queueSize = getConfigValue<unsigned>(conf, "logging.async.queue_size", 4096);
+        const bool block = (getConfigValue<std::string>(conf, "logging.async.overflow", "drop") == "block");
+        Log::enableAsync(queueSize, !block);
+
+        setenv("LOOL_LOGASYNC", std::to_string(queueSize).c_str(), true);
+        if (block)
+            setenv("LOOL_LOGASYNCBLOCK", "1", true);
+    }
+
 #if ENABLE_SSL
     LOOLWSD::SSLEnabled.set(getConfigValue<bool>(conf, "ssl.enable", true));
 #else
@@ -828,6 +884,22 @@ void LOOLWSD::initialize(Application& self)
 
     TileCachePersistent = getConfigValue<bool>(conf, "tile_cache_persistent", true);
 
+    AutoSaveScheduler::instance().configure(getConfigValue<int>(conf, "autosave.max_concurrent_uploads", 4),
+                                            getConfigValue<int>(conf, "autosave.max_per_minute", 60));
+
+    WebSocketDeflate::configure(getConfigValue<bool>(conf, "websocket_compression[@enable]", true),
+                                getConfigValue<bool>(conf, "websocket_compression.context_takeover", true),
+                                getConfigValue<int>(conf, "websocket_compression.min_size", 256),
+                                getConfigValue<int>(conf, "websocket_compression.level", 3));
+
+    // Only used if we manage to listen on the Unix socket, see startPrisoners().
+    UseLocalSocket = getConfigValue<bool>(conf, "kit_transport.unix_socket", true);
+    TileRingSizeKb = std::max(getConfigValue<int>(conf, "kit_transport.tile_ring_size_kb", 0), 0);
+
+    MaxRequestBodySize = static_cast<uint64_t>(getConfigValue<unsigned int>(conf, "net.max_body_size_mb", 100)) * 1024 * 1024;
+    RequestTimeoutSecs = std::max(getConfigValue<int>(conf, "net.request_timeout_secs", 30), 1);
+    KeepAliveTimeoutSecs = std::max(getConfigValue<int>(conf, "net.keep_alive_timeout_secs", 15), 1);
+
     // Command Tracing.
     if (getConfigValue<bool>(conf, "trace[@enable]", false))
     {
@@ -1181,6 +1253,21 @@ void LOOLWSD::doHousekeeping()
     PrisonerPoll.wakeup();
 }
 
+void LOOLWSD::unloadDocument(const std::string& docKey, const std::string& reason)
+{
+    std::lock_guard<std::mutex> docBrokersLock(DocBrokersMutex);
+
+    auto it = DocBrokers.find(docKey);
+    if (it == DocBrokers.end())
+    {
+        LOG_WRN("No DocumentBroker with docKey [" << docKey << "] to unload.");
+        return;
+    }
+
+    std::shared_ptr<DocumentBroker> docBroker = it->second;
+    docBroker->addCallback([docBroker, reason](){ docBroker->unload(reason); });
+}
+
 /// Really do the house-keeping
 void PrisonerPoll::wakeupHook()
 {
@@ -1235,6 +1322,12 @@ bool LOOLWSD::createForKit()
     args.push_back("--childroot=" + ChildRoot);
     args.push_back("--clientport=" + std::to_string(ClientPortNumber));
     args.push_back("--masterport=" + std::to_string(MasterPortNumber));
+    if (UseLocalSocket)
+    {
+        args.push_back("--localsocket");
+        if (TileRingSizeKb > 0)
+            args.push_back("--tileringkb=" + std::to_string(TileRingSizeKb));
+    }
     if (UnitWSD::get().hasKitHooks())
     {
         args.push_back("--unitlib=" + UnitTestLibrary);
@@ -1449,12 +1542,17 @@ private:
         // Notify the broker that we're done.
         auto child = _childProcess.lock();
         auto docBroker = child ? child->getDocumentBroker() : nullptr;
+        auto convertPool = child ? child->getConvertPool() : nullptr;
         if (docBroker)
         {
             auto lock = docBroker->getLock();
             docBroker->assertCorrectThread();
             docBroker->stop();
         }
+        else if (convertPool)
+        {
+            convertPool->childDisconnected(child);
+        }
     }
 
     /// Called after successful socket reads.
@@ -1575,23 +1673,62 @@ private:
     /// Prisoner websocket fun ... (for now)
     virtual void handleMessage(bool /*fin*/, WSOpCode /* code */, std::vector<char> &data) override
     {
+        // Tiles the kit wrote to the ring: the header line comes over
+        // the socket, the PNGs are handed over in place, and their slot
+        // released once they are saved and queued to the clients.
+        uint64_t ringPos;
+        size_t ringSize;
+        size_t headerOffset;
+        if (ShmRing::parsePositionMessage(data.data(), data.size(), ringPos, ringSize, headerOffset))
+        {
+            const char* tiles = (_tileRing ? _tileRing->get(ringPos, ringSize) : nullptr);
+            if (!tiles)
+            {
+                LOG_ERR("Invalid tile ring message [" << getAbbreviatedMessage(data) << "].");
+                return;
+            }
+
+            data.erase(data.begin(), data.begin() + headerOffset);
+            if (!UnitWSD::get().filterChildMessage(data))
+            {
+                auto child = _childProcess.lock();
+                auto docBroker = child ? child->getDocumentBroker() : nullptr;
+                if (docBroker)
+                    docBroker->handleRingInput(std::move(data), tiles, ringSize);
+                else
+                    LOG_WRN("Dropping tiles from the ring without a DocumentBroker: [" <<
+                            getAbbreviatedMessage(data) << "].");
+            }
+
+            _tileRing->release(ringPos, ringSize);
+            return;
+        }
+
+        if (LOOLProtocol::matchPrefix("tileshm:", data))
+        {
+            attachTileRing();
+            return;
+        }
+
         if (UnitWSD::get().filterChildMessage(data))
             return;
 
-        const std::string abbr = getAbbreviatedMessage(data);
         auto socket = _socket.lock();
         if (socket)
-            LOG_TRC("#" << socket->getFD() << " Prisoner message [" << abbr << "].");
+            LOG_TRC("#" << socket->getFD() << " Prisoner message [" << getAbbreviatedMessage(data) << "].");
         else
             LOG_WRN("Message handler called but without valid socket.");
 
         auto child = _childProcess.lock();
         auto docBroker = child ? child->getDocumentBroker() : nullptr;
+        auto convertPool = child ? child->getConvertPool() : nullptr;
         if (docBroker)
-            docBroker->handleInput(data);
+            docBroker->handleInput(std::move(data));
+        else if (convertPool)
+            convertPool->handleInput(child, data);
         else
             LOG_WRN("Child " << child->getPid() <<
-                    " has no DocumentBroker to handle message: [" << abbr << "].");
+                    " has no DocumentBroker to handle message: [" << getAbbreviatedMessage(data) << "].");
     }
 
     int getPollEvents(std::chrono::steady_clock::time_point /* now */,
@@ -1603,13 +1740,34 @@ private:
     void performWrites() override
     {
     }
+
+    /// Maps the tile ring whose fd the kit passed along with tileshm:.
+    void attachTileRing()
+    {
+        auto socket = std::dynamic_pointer_cast<UnixStreamSocket>(_socket.lock());
+        const int fd = socket ? socket->takeReceivedFD() : -1;
+        if (fd < 0)
+        {
+            LOG_ERR("Got tileshm: without a tile ring fd.");
+            return;
+        }
+
+        _tileRing = ShmRing::attach(fd);
+    }
+
+    /// The shared memory the kit writes the tiles to, if any.
+    std::unique_ptr<ShmRing> _tileRing;
 };
 
 /// Handles incoming connections and dispatches to the appropriate handler.
 class ClientRequestDispatcher : public SocketHandlerInterface
 {
 public:
-    ClientRequestDispatcher()
+    ClientRequestDispatcher() :
+        _reader(MaxRequestBodySize),
+        _requestDone(false),
+        _keptAliveCount(0),
+        _idleSince(std::chrono::steady_clock::now())
     {
     }
 
@@ -1620,6 +1778,7 @@ private:
     {
         _id = LOOLWSD::GenSessionId();
         _socket = socket;
+        _idleSince = std::chrono::steady_clock::now();
         LOG_TRC("#" << socket->getFD() << " Connected to ClientRequestDispatcher.");
     }
     /// load api *.so
@@ -1712,63 +1871,97 @@ private:
     void handleIncomingMessage(SocketDisposition &disposition) override
     {
         auto socket = _socket.lock();
-        initApiModules();
         std::vector<char>& in = socket->_inBuffer;
         LOG_TRC("#" << socket->getFD() << " handling incoming " << in.size() << " bytes.");
 
-        // Find the end of the header, if any.
-        static const std::string marker("\r\n\r\n");
-        auto itBody = std::search(in.begin(), in.end(),
-                                  marker.begin(), marker.end());
-        if (itBody == in.end())
+        // Nothing is read after the response that ended the connection.
+        if (_requestDone)
         {
-            LOG_DBG("#" << socket->getFD() << " doesn't have enough data yet.");
+            in.clear();
             return;
         }
 
-        // Skip the marker.
-        itBody += marker.size();
-
-        Poco::MemoryInputStream message(&in[0], in.size());
-        Poco::Net::HTTPRequest request;
-        std::string cookie = "";
-        try
+        // Each request consumes only its own bytes, so the pipelined ones are handled in turn.
+        do
         {
-            request.read(message);
+            // Only the new bytes are scanned, and the body is
+            // moved out of the socket buffer as it arrives.
+            const HttpRequestReader::State state = _reader.consume(in);
+            if (state == HttpRequestReader::State::Error)
+            {
+                sendErrorAndShutdown(socket, _reader.getErrorStatus(), _reader.getErrorReason());
+                in.clear();
+                _requestDone = true;
+                return;
+            }
 
-            auto logger = Log::info();
-            if (logger.enabled())
+            if (state != HttpRequestReader::State::Complete)
             {
-                logger << "#" << socket->getFD() << ": Client HTTP Request: "
-                       << request.getMethod() << ' '
-                       << request.getURI() << ' '
-                       << request.getVersion();
+                // Let the client send the body, we didn't reject the header.
+                if (_reader.takeExpectContinue())
+                    socket->send("HTTP/1.1 100 Continue\r\n\r\n");
 
-                for (const auto& it : request)
-                {
-                    logger << " / " << it.first << ": " << it.second;
-                }
-                //fprintf(stderr, "cookie: %s\turi:%s\n", cookie.c_str(), request.getURI().c_str());
-                LOG_END(logger);
+                LOG_DBG("#" << socket->getFD() << " doesn't have enough data yet.");
+                return;
             }
 
-            const std::streamsize contentLength = request.getContentLength();
-            const auto offset = itBody - in.begin();
-            const std::streamsize available = in.size() - offset;
+            handleRequest(socket, disposition);
+            if (disposition.isMove())
+            {
+                // The socket belongs to another poll now.
+                _requestDone = true;
+                return;
+            }
 
-            if (contentLength != Poco::Net::HTTPMessage::UNKNOWN_CONTENT_LENGTH && available < contentLength)
+            if (!socket->isResponseEnded())
             {
-                LOG_DBG("Not enough content yet: ContentLength: " << contentLength << ", available: " << available);
+                // Shut down, or answered from a forked process.
+                _requestDone = true;
+                in.clear();
                 return;
             }
+
+            ++_keptAliveCount;
+            LOG_TRC("#" << socket->getFD() << " Keeping the connection after " <<
+                    _keptAliveCount << " requests.");
+            _reader.reset();
+            _idleSince = std::chrono::steady_clock::now();
         }
-        catch (const std::exception& exc)
+        while (!in.empty());
+    }
+
+    /// Routes the complete request of the reader.
+    void handleRequest(const std::shared_ptr<StreamSocket>& socket, SocketDisposition& disposition)
+    {
+        const Poco::Net::HTTPRequest& request = _reader.getRequest();
+        Poco::MemoryInputStream& message = _reader.getBody();
+
+        auto logger = Log::info();
+        if (logger.enabled())
         {
-            // Probably don't have enough data just yet.
-            // TODO: timeout if we never get enough.
-            return;
+            logger << "#" << socket->getFD() << ": Client HTTP Request: "
+                   << request.getMethod() << ' '
+                   << request.getURI() << ' '
+                   << request.getVersion()
+                   << " (body: " << _reader.getBodySize() << " bytes"
+                   << (_reader.isSpooled() ? ", spooled" : "") << ")";
+
+            for (const auto& it : request)
+            {
+                logger << " / " << it.first << ": " << it.second;
+            }
+
+            LOG_END(logger);
         }
 
+        initApiModules();
+
+        // Only the handlers answering here and now, with a known length, keep the connection:
+        // the others are moved to another poll, or answer from a forked process.
+        const bool keepAlive = (request.getVersion() == Poco::Net::HTTPMessage::HTTP_1_1 &&
+                                request.getKeepAlive());
+        socket->setKeepAlive(false);
+
         try
         {
             // Routing
@@ -1776,9 +1969,16 @@ private:
             std::vector<std::string> reqPathSegs;
             requestUri.getPathSegments(reqPathSegs);
 
+            // Plugins respond asynchronously, or from a forked
+            // process, so this is the time until they take over.
+            const EndpointMetrics& endpointMetrics = getEndpointMetrics(getEndpointName(reqPathSegs));
+            endpointMetrics.first->inc();
+            Metrics::ScopedTimer timer(*endpointMetrics.second);
+
             // File server
             if (reqPathSegs.size() >= 1 && reqPathSegs[0] == "loleaflet")
             {
+                socket->setKeepAlive(keepAlive && request.getMethod() == HTTPRequest::HTTP_GET);
                 handleFileServerRequest(request, message);
             }
             // Admin connections
@@ -1799,19 +1999,28 @@ private:
                       request.getMethod() == HTTPRequest::HTTP_HEAD) &&
                      request.getURI() == "/")
             {
+                socket->setKeepAlive(keepAlive);
                 handleRootRequest(request);
             }
             else if (request.getMethod() == HTTPRequest::HTTP_GET && request.getURI() == "/favicon.ico")
             {
+                socket->setKeepAlive(keepAlive);
                 handleFaviconRequest(request);
             }
             else if (request.getMethod() == HTTPRequest::HTTP_GET && request.getURI() == "/hosting/discovery")
             {
+                socket->setKeepAlive(keepAlive);
                 handleWopiDiscoveryRequest(request);
             }
+            else if (request.getMethod() == HTTPRequest::HTTP_GET && request.getURI() == "/lool/metrics")
+            {
+                socket->setKeepAlive(keepAlive);
+                handleMetricsRequest(request);
+            }
             else if (request.getMethod() == HTTPRequest::HTTP_GET &&
                      request.getURI() == "/api")
             {
+                socket->setKeepAlive(keepAlive);
                 if (_mergeodf)
                     handleAPIHelp(request);
                 else
@@ -1820,6 +2029,7 @@ private:
             else if (request.getMethod() == HTTPRequest::HTTP_GET &&
                      request.getURI() == "/yaml")
             {
+                socket->setKeepAlive(keepAlive);
                 if (_mergeodf)
                     handleAPIHelp(request, true, "", false, true);
                 else
@@ -1828,12 +2038,14 @@ private:
             else if (request.getMethod() == HTTPRequest::HTTP_GET &&
                       request.getURI() == "/lool/merge-to/api")
             {  // /lool/[merge-to]/api
+                socket->setKeepAlive(keepAlive);
                 bool showMerge = request.getURI() == "/lool/merge-to/api";
                 handleAPIHelp(request, showMerge);
             }
             else if (request.getMethod() == HTTPRequest::HTTP_GET &&
                       request.getURI() == "/lool/merge-to/yaml")
             {  // /lool/[merge-to]/yaml
+                socket->setKeepAlive(keepAlive);
                 bool showMerge = request.getURI() == "/lool/merge-to/yaml";
                 handleAPIHelp(request, showMerge, "", false, true);
             }
@@ -1841,6 +2053,7 @@ private:
                     request.getMethod() == HTTPRequest::HTTP_GET &&
                     !_mergeodf->isMergeToQueryAccessTime(request.getURI()).empty())
             {  // /lool/merge-to/doc_id/accessTime
+                socket->setKeepAlive(keepAlive);
                 auto endpoint = _mergeodf->isMergeToQueryAccessTime(request.getURI());
                 _mergeodf->responseAccessTime(_socket, endpoint);
             }
@@ -1848,6 +2061,7 @@ private:
                      request.getMethod() == HTTPRequest::HTTP_GET &&
                      !_mergeodf->isMergeToHelpUri(request.getURI()).empty())
             {  // /lool/merge-to/doc_id/api
+                socket->setKeepAlive(keepAlive);
                 auto endpoint = _mergeodf->isMergeToHelpUri(request.getURI());
                 handleAPIHelp(request, true, endpoint);
             }
@@ -1855,6 +2069,7 @@ private:
                      request.getMethod() == HTTPRequest::HTTP_GET &&
                      !_mergeodf->isMergeToHelpUri(request.getURI(), false, true).empty())
             {  // /lool/merge-to/doc_id/yaml
+                socket->setKeepAlive(keepAlive);
                 auto endpoint = _mergeodf->isMergeToHelpUri(request.getURI(), false, true);
                 handleAPIHelp(request, true, endpoint, false, true);
             }
@@ -1862,6 +2077,7 @@ private:
                      request.getMethod() == HTTPRequest::HTTP_GET &&
                      !_mergeodf->isMergeToHelpUri(request.getURI(), true).empty())
             {  // for another json help: /lool/merge-to/doc_id/json
+                socket->setKeepAlive(keepAlive);
                 auto endpoint = _mergeodf->isMergeToHelpUri(request.getURI(), true);
                 handleAPIHelp(request, true, endpoint, true);
             }
@@ -1870,6 +2086,8 @@ private:
                       request.getMethod() == HTTPRequest::HTTP_OPTIONS) &&
                      !_mergeodf->isMergeToUri(request.getURI()).empty())
             {  // /lool/merge-to/doc_id
+                // The merge itself is answered from a forked process.
+                socket->setKeepAlive(keepAlive && request.getMethod() == HTTPRequest::HTTP_OPTIONS);
                 _mergeodf->handleMergeTo(socket, request, message);
             }
             else if (_tbl2sc &&
@@ -1883,6 +2101,7 @@ private:
                     reqPathSegs[0] == "lool" && 
                     reqPathSegs[1]=="templaterepo")
             {
+                socket->setKeepAlive(keepAlive);
                 _templaterepo->doTemplateRepo(_socket, request, message);
             }
             else
@@ -1924,12 +2143,56 @@ private:
             // TODO: Send back failure.
             // NOTE: Check _wsState to choose between HTTP response or WebSocket (app-level) error.
             LOG_ERR("#" << socket->getFD() << " Exception while processing incoming request: [" <<
-                    LOOLProtocol::getAbbreviatedMessage(in) << "]: " << exc.what());
+                    request.getMethod() << ' ' << request.getURI() << "]: " << exc.what());
+        }
+    }
+
+    /// Reads or waits too long for a request.
+    void checkTimeout(std::chrono::steady_clock::time_point now) override
+    {
+        if (_requestDone)
+            return;
+
+        auto socket = _socket.lock();
+        if (!socket)
+            return;
+
+        // Idle kept connections are closed quietly, the client expects it.
+        if (!_reader.hasStarted() && _keptAliveCount > 0)
+        {
+            if (now - _idleSince < std::chrono::seconds(KeepAliveTimeoutSecs))
+                return;
+
+            LOG_DBG("#" << socket->getFD() << " Closing idle connection after " <<
+                    _keptAliveCount << " requests.");
+            socket->shutdown();
+            _requestDone = true;
+            return;
         }
 
-        // if we succeeded - remove the request from our input buffer
-        // we expect one request per socket
-        in.erase(in.begin(), itBody);
+        const auto lastReadTime = (_reader.hasStarted() ? _reader.getLastReadTime() : _idleSince);
+        if (now - lastReadTime < std::chrono::seconds(RequestTimeoutSecs))
+            return;
+
+        LOG_WRN("#" << socket->getFD() << " Timed out waiting for the request, closing.");
+        sendErrorAndShutdown(socket, HTTPResponse::HTTP_REQUEST_TIMEOUT, "Request Timeout");
+        socket->_inBuffer.clear();
+        _requestDone = true;
+    }
+
+    /// Replies with an empty error response, then closes.
+    static void sendErrorAndShutdown(const std::shared_ptr<StreamSocket>& socket,
+                                     const HTTPResponse::HTTPStatus status, const std::string& reason)
+    {
+        std::ostringstream oss;
+        oss << "HTTP/1.1 " << static_cast<int>(status) << ' ' << reason << "\r\n"
+            << "Date: " << Poco::DateTimeFormatter::format(Poco::Timestamp(), Poco::DateTimeFormat::HTTP_FORMAT) << "\r\n"
+            << "User-Agent: " << WOPI_AGENT_STRING << "\r\n"
+            << "Content-Length: 0\r\n"
+            << "Connection: close\r\n"
+            << "\r\n";
+        socket->send(oss.str());
+        socket->shutdown();
     }
 
     int getPollEvents(std::chrono::steady_clock::time_point /* now */,
@@ -1946,7 +2209,7 @@ private:
     {
         auto socket = _socket.lock();
         FileServerRequestHandler::handleRequest(request, message, socket);
-        socket->shutdown();
+        socket->endResponse();
     }
 
     void handleRootRequest(const Poco::Net::HTTPRequest& request)
@@ -1972,7 +2235,7 @@ private:
 
         auto socket = _socket.lock();
         socket->send(oss.str());
-        socket->shutdown();
+        socket->endResponse();
         LOG_INF("Sent / response successfully.");
     }
 
@@ -1989,7 +2252,96 @@ private:
         auto socket = _socket.lock();
         Poco::Net::HTTPResponse response;
         HttpHelper::sendFile(socket, faviconPath, mimeType, response);
-        socket->shutdown();
+        socket->endResponse();
+    }
+
+    /// Returns the name under which the metrics of a request are counted.
+    /// The request counter and duration histogram of an endpoint.
+    typedef std::pair<Metrics::Counter*, Histogram*> EndpointMetrics;
+
+    /// Returns the metrics of the endpoint, only looked up in the registry once.
+    static const EndpointMetrics& getEndpointMetrics(const std::string& endpoint)
+    {
+        static const std::map<std::string, EndpointMetrics> metrics = []()
+        {
+            std::map<std::string, EndpointMetrics> result;
+            for (const char* name : { "root", "loleaflet", "favicon", "discovery", "api", "adminws", "metrics",
+                                      "merge-to", "templaterepo", "convert-to", "tbl2sc", "ws", "other" })
+            {
+                const std::string labels = std::string("{endpoint=\"") + name + "\"}";
+                result[name] = EndpointMetrics(
+                    &Metrics::counter("loolwsd_http_requests_total" + labels,
+                                      "HTTP requests received, by endpoint."),
+                    &Metrics::histogram("loolwsd_http_request_duration_us" + labels,
+                                        "Time to handle HTTP requests, by endpoint.", "us"));
+            }
+
+            return result;
+        }();
+
+        const auto it = metrics.find(endpoint);
+        assert(it != metrics.end() && "Unknown endpoint.");
+        return (it != metrics.end() ? it->second : metrics.find("other")->second);
+    }
+
+    /// One of the names getEndpointMetrics() knows.
+    static std::string getEndpointName(const std::vector<std::string>& reqPathSegs)
+    {
+        if (reqPathSegs.empty())
+            return "root";
+
+        const std::string& first = reqPathSegs[0];
+        if (first == "loleaflet")
+            return first;
+        if (first == "favicon.ico")
+            return "favicon";
+        if (first == "hosting")
+            return "discovery";
+        if (first == "api" || first == "yaml")
+            return "api";
+        if (first != "lool" || reqPathSegs.size() < 2)
+            return "other";
+
+        const std::string& second = reqPathSegs[1];
+        if (second == "adminws" || second == "metrics" || second == "merge-to" ||
+            second == "templaterepo" || second == "convert-to")
+            return second;
+        if (second == "table2spreadsheet")
+            return "tbl2sc";
+        if (reqPathSegs.size() > 2 && reqPathSegs[2] == "ws")
+            return "ws";
+
+        return "other";
+    }
+
+    void handleMetricsRequest(const Poco::Net::HTTPRequest& request)
+    {
+        LOG_DBG("Metrics request: " << request.getURI());
+
+        auto socket = _socket.lock();
+        Poco::Net::HTTPResponse response;
+        if (!FileServerRequestHandler::isAdminLoggedIn(request, response))
+        {
+            LOG_ERR("Metrics request with invalid admin login.");
+            response.setStatusAndReason(HTTPResponse::HTTP_UNAUTHORIZED);
+            response.set("WWW-Authenticate", "Basic realm=\"online\"");
+            response.setContentLength(0);
+            socket->send(response);
+            socket->endResponse();
+            return;
+        }
+
+        // http://server/lool/metrics, in the Prometheus text format.
+        std::ostringstream oss;
+        Metrics::dumpPrometheus(oss);
+        const std::string metrics = oss.str();
+
+        response.set("Cache-Control", "no-cache");
+        response.setContentType("text/plain; version=0.0.4");
+        response.setContentLength(metrics.size());
+        socket->send(response);
+        socket->send(metrics);
+        socket->endResponse();
     }
 
     void handleWopiDiscoveryRequest(const Poco::Net::HTTPRequest& request)
@@ -2040,7 +2392,7 @@ private:
 
         auto socket = _socket.lock();
         socket->send(oss.str());
-        socket->shutdown();
+        socket->endResponse();
         LOG_INF("Sent discovery.xml successfully.");
     }
 
@@ -2068,7 +2420,7 @@ private:
                 "config server_name not set");
             response.setContentLength(0);
             socket->send(response);
-            socket->shutdown();
+            socket->endResponse();
             return;
         }
 #endif
@@ -2122,28 +2474,88 @@ paths:%s)MULTILINE";
                             !yaml ? "text/html; charset=utf-8" :
                                     "text/plain; charset=utf-8";
 
-        // TODO: Refactor this to some common handler.
-        std::ostringstream oss;
-        oss << "HTTP/1.1 200 OK\r\n"
-            << "Last-Modified: " << Poco::DateTimeFormatter::format(Poco::Timestamp(), Poco::DateTimeFormat::HTTP_FORMAT) << "\r\n"
-            << "Access-Control-Allow-Origin: *" << "\r\n"
-            << "User-Agent: " << WOPI_AGENT_STRING << "\r\n"
-            << "Content-Length: " << read.size() << "\r\n"
-            << "Content-Type: " << mediaType << "\r\n"
-            << "X-Content-Type-Options: nosniff\r\n"
-            << "\r\n"
-            << read;
+        // The help only changes with the templates: clients revalidate it,
+        // and the compressed body is kept for the next ones. Each encoding
+        // has its own ETag, a cache mustn't serve one for the other.
+        const bool gzip = request.hasToken("Accept-Encoding", "gzip");
+        std::ostringstream etagOss;
+        etagOss << '"' << std::hex << std::hash<std::string>()(read) << '-' << read.size()
+                << (gzip ? "-gz" : "") << '"';
+        const std::string etag = etagOss.str();
 
         auto socket = _socket.lock();
-        socket->send(oss.str());
-        //socket->send(read);
-        socket->shutdown();
-        LOG_INF("Sent api json successfully.");
+        const auto itMatch = request.find("If-None-Match");
+        if (itMatch != request.end() && itMatch->second == etag)
+        {
+            std::ostringstream oss;
+            oss << "HTTP/1.1 304 Not Modified\r\n"
+                << "Date: " << Poco::DateTimeFormatter::format(Poco::Timestamp(), Poco::DateTimeFormat::HTTP_FORMAT) << "\r\n"
+                << "Access-Control-Allow-Origin: *" << "\r\n"
+                << "User-Agent: " << WOPI_AGENT_STRING << "\r\n"
+                << "ETag: " << etag << "\r\n"
+                << "Cache-Control: no-cache\r\n"
+                << "\r\n";
+            socket->send(oss.str());
+            socket->endResponse();
+            LOG_INF("Api json not modified.");
+        }
+        else
+        {
+            if (gzip)
+            {
+                const std::string flavour = (yaml ? "yaml" : anotherJson ? "json" : "api");
+                read = getCompressedHelp(mergeEndPoint + '/' + flavour, etag, read);
+            }
+
+            // TODO: Refactor this to some common handler.
+            std::ostringstream oss;
+            oss << "HTTP/1.1 200 OK\r\n"
+                << "Last-Modified: " << Poco::DateTimeFormatter::format(Poco::Timestamp(), Poco::DateTimeFormat::HTTP_FORMAT) << "\r\n"
+                << "Access-Control-Allow-Origin: *" << "\r\n"
+                << "User-Agent: " << WOPI_AGENT_STRING << "\r\n"
+                << "Content-Length: " << read.size() << "\r\n"
+                << "Content-Type: " << mediaType << "\r\n"
+                << (gzip ? "Content-Encoding: gzip\r\n" : "")
+                << "Vary: Accept-Encoding\r\n"
+                << "ETag: " << etag << "\r\n"
+                << "Cache-Control: no-cache\r\n"
+                << "X-Content-Type-Options: nosniff\r\n"
+                << "\r\n"
+                << read;
+
+            socket->send(oss.str());
+            socket->endResponse();
+            LOG_INF("Sent api json successfully.");
+        }
 
         //TODO write correct destroy
         destroyModules();
     }
 
+    /// The gzipped help, compressed again only when its ETag changes.
+    /// @param key the endpoint and the flavour of the help, one entry each.
+    static std::string getCompressedHelp(const std::string& key, const std::string& etag,
+                                         const std::string& body)
+    {
+        static std::mutex mutex;
+        static std::map<std::string, std::pair<std::string, std::string>> cache;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::pair<std::string, std::string>& entry = cache[key];
+        if (entry.first != etag)
+        {
+            std::ostringstream oss;
+            Poco::DeflatingOutputStream deflater(oss, Poco::DeflatingStreamBuf::STREAM_GZIP);
+            deflater << body;
+            deflater.close();
+
+            entry.first = etag;
+            entry.second = oss.str();
+        }
+
+        return entry.second;
+    }
+
     static std::string getContentType(const std::string& fileName)
     {
         const std::string nodePath = Poco::format("//[@ext='%s']", Poco::Path(fileName).getExtension());
@@ -2187,12 +2599,50 @@ paths:%s)MULTILINE";
         {
             fprintf(stderr, "convert-to\n");
 
+            // Refuse before saving the upload when the pool is full.
+            std::shared_ptr<ConvertPool> convertPool = ConvertToPool;
+            if (convertPool && !convertPool->reserve())
+            {
+                LOG_WRN("Too many conversions in progress, refusing [" << request.getURI() << "].");
+                response.setStatusAndReason(HTTPResponse::HTTP_SERVICE_UNAVAILABLE,
+                                            "Too many conversions in progress");
+                response.set("Retry-After", "1");
+                response.setContentLength(0);
+                socket->send(response);
+                socket->shutdown();
+                return;
+            }
+
+            // Given back whatever happens to the upload, unless the conversion is queued.
+            ConvertPool::Reservation reservation(convertPool);
+
             std::string fromPath;
             ConvertToPartHandler handler(fromPath);
             HTMLForm form(request, message, handler);
             const std::string format = (form.has("format") ? form.get("format") : "");
             const bool queue = form.has("queue");
 
+            if (convertPool)
+            {
+                if (fromPath.empty() || !ConvertPool::isValidFormat(format))
+                {
+                    if (!fromPath.empty())
+                        FileUtil::removeFile(Path(fromPath).parent(), true);
+                    throw BadRequestException("Failed to convert and send file.");
+                }
+
+                LOG_INF("Conversion request for URI [" << fromPath << "] to " << format << ".");
+                reservation.release();
+                disposition.setMove([convertPool, fromPath, format, queue]
+                                    (const std::shared_ptr<Socket> &moveSocket)
+                {
+                    // Hand the socket over to the pool, which replies when done.
+                    convertPool->enqueue(std::static_pointer_cast<StreamSocket>(moveSocket),
+                                         fromPath, format, queue);
+                });
+                return;
+            }
+
             bool sent = false;
             if (!fromPath.empty())
             {
@@ -2439,7 +2889,7 @@ paths:%s)MULTILINE";
         LOG_INF("Client WS request: " << request.getURI() << ", url: " << url << ", socket #" << socket->getFD());
 
         // First Upgrade.
-        WebSocketHandler ws(_socket, request);
+        WebSocketHandler ws(_socket, request, true);
 
         // Response to clients beyond this point is done via WebSocket.
         try
@@ -2484,6 +2934,9 @@ paths:%s)MULTILINE";
                 auto clientSession = createNewClientSession(&ws, _id, uriPublic, docBroker, isReadOnly);
                 if (clientSession)
                 {
+                    // The session continues the compressed stream we started.
+                    clientSession->takeExtensions(ws);
+
                     // Transfer the client socket to the DocumentBroker when we get back to the poll:
                     disposition.setMove([docBroker, clientSession]
                                         (const std::shared_ptr<Socket> &moveSocket)
@@ -2553,6 +3006,13 @@ private:
     // The socket that owns us (we can't own it).
     std::weak_ptr<StreamSocket> _socket;
     std::string _id;
+    HttpRequestReader _reader;
+    /// Set once a response ended the connection.
+    bool _requestDone;
+    /// The requests after which the connection was kept.
+    unsigned _keptAliveCount;
+    /// Since when we wait for the next request to start.
+    std::chrono::steady_clock::time_point _idleSince;
     void* mergeodf_h;
     MergeODF* _mergeodf;
     Tbl2SC* _tbl2sc;
@@ -2597,11 +3057,24 @@ class SslSocketFactory : public SocketFactory
 
 class PrisonerSocketFactory : public SocketFactory
 {
+public:
+    PrisonerSocketFactory(bool local = false) :
+        _local(local)
+    {
+    }
+
+private:
     std::shared_ptr<Socket> create(const int fd) override
     {
         // No local delay.
+        if (_local)
+            return StreamSocket::create<UnixStreamSocket>(fd, std::unique_ptr<SocketHandlerInterface>{ new PrisonerRequestDispatcher });
+
         return StreamSocket::create<StreamSocket>(fd, std::unique_ptr<SocketHandlerInterface>{ new PrisonerRequestDispatcher });
     }
+
+    /// Whether the kits connect over the Unix socket, and can pass fds.
+    const bool _local;
 };
 
 /// The main server thread.
@@ -2627,6 +3100,16 @@ public:
     {
         PrisonerPoll.startThread();
         PrisonerPoll.insertNewSocket(findPrisonerServerPort(port));
+
+        // The kits still fall back to the port if they can't connect here.
+        if (UseLocalSocket)
+        {
+            std::shared_ptr<ServerSocket> socket = getLocalServerSocket(PRISONER_SOCKET_NAME + std::to_string(port));
+            if (socket)
+                PrisonerPoll.insertNewSocket(socket);
+            else
+                UseLocalSocket = false;
+        }
     }
 
     void stopPrisoners()
@@ -2640,12 +3123,30 @@ public:
         _acceptPoll.insertNewSocket(findServerPort(port));
         WebServerPoll.startThread();
         Admin::instance().start();
+
+        const unsigned convertPoolSize = LOOLWSD::getConfigValue<unsigned int>("convert_pool.size", 2);
+        if (convertPoolSize > 0)
+        {
+            ConvertToPool = std::make_shared<ConvertPool>(
+                convertPoolSize,
+                LOOLWSD::getConfigValue<unsigned int>("convert_pool.max_queue", 100),
+                LOOLWSD::getConfigValue<unsigned int>("convert_pool.max_conversions_per_kit", 100),
+                LOOLWSD::getConfigValue<unsigned int>("convert_pool.timeout_secs", 60));
+            ConvertToPool->start();
+        }
     }
 
     void stop()
     {
         _acceptPoll.joinThread();
         WebServerPoll.joinThread();
+
+        // No more requests, fail the conversions left.
+        if (ConvertToPool)
+        {
+            ConvertToPool->stop();
+            ConvertToPool.reset();
+        }
     }
 
     void dumpState(std::ostream& os)
@@ -2657,8 +3158,11 @@ public:
         os << "LOOLWSDServer:\n"
            << "  Ports: server " << ClientPortNumber
            <<          " prisoner " << MasterPortNumber << "\n"
+           << "  Kit transport: " << (UseLocalSocket ? "unix" : "tcp")
+           <<          ", tile ring: " << TileRingSizeKb << " KB\n"
            << "  SSL: " << (LOOLWSD::isSSLEnabled() ? "https" : "http") << "\n"
            << "  SSL-Termination: " << (LOOLWSD::isSSLTermination() ? "yes" : "no") << "\n"
+           << "  Log lines dropped: " << Log::getDroppedCount() << "\n"
            << "  TerminationFlag: " << TerminationFlag << "\n"
            << "  isShuttingDown: " << ShutdownRequestFlag << "\n"
            << "  NewChildren: " << NewChildren.size() << "\n"
@@ -2677,6 +3181,13 @@ public:
         os << "Admin poll:\n";
         Admin::instance().dumpState(os);
 
+        AutoSaveScheduler::instance().dumpState(os);
+
+        if (ConvertToPool)
+            ConvertToPool->dumpState(os);
+
+        WebSocketDeflate::dumpStats(os);
+
         // If we have any delaying work going on.
         Delay::dumpState(os);
 
@@ -2728,6 +3239,28 @@ private:
         return nullptr;
     }
 
+    /// Create the Unix server socket the kits connect to.
+    std::shared_ptr<ServerSocket> getLocalServerSocket(const std::string& name)
+    {
+        std::shared_ptr<SocketFactory> factory = std::make_shared<PrisonerSocketFactory>(true);
+        std::shared_ptr<LocalServerSocket> serverSocket = std::make_shared<LocalServerSocket>(PrisonerPoll, factory);
+
+        if (!serverSocket->bind(name))
+        {
+            LOG_SYS("Failed to bind to local socket [" << name << "].");
+            return nullptr;
+        }
+
+        if (!serverSocket->listen())
+        {
+            LOG_SYS("Failed to listen on local socket [" << name << "].");
+            return nullptr;
+        }
+
+        LOG_INF("Listening to prisoner connections on local socket [" << name << "].");
+        return serverSocket;
+    }
+
     std::shared_ptr<ServerSocket> findPrisonerServerPort(int& port)
     {
         std::shared_ptr<SocketFactory> factory = std::make_shared<PrisonerSocketFactory>();
@@ -2797,6 +3330,27 @@ bool LOOLWSD::handleShutdownRequest()
     return false;
 }
 
+/// Unzips and parses the merge-to templates in the library kept loaded for the requests.
+static void warmupMergeTemplates(const unsigned threads)
+{
+#if ENABLE_DEBUG
+    void* mergeodf_h = dlopen("./libmergeodf.so", RTLD_LAZY);
+#else
+    void* mergeodf_h = dlopen("libmergeodf.so", RTLD_LAZY);
+#endif
+    if (!mergeodf_h)
+    {
+        LOG_WRN("[ModuleLib] Load libmergeodf.so fail, no merge-to templates warmup.");
+        return;
+    }
+
+    MergeODF* (*create)() = (MergeODF* (*)())dlsym(mergeodf_h, "create_object");
+    void (*destroy)(MergeODF*) = (void (*)(MergeODF*))dlsym(mergeodf_h, "destroy_object");
+    MergeODF* mergeodf = create();
+    mergeodf->warmupTemplates(threads);
+    destroy(mergeodf);
+}
+
 int LOOLWSD::innerMain()
 {
 #ifndef FUZZER
@@ -2900,6 +3454,10 @@ int LOOLWSD::innerMain()
     }
 #endif
 
+    // Get the merge-to templates ready before their first requests.
+    if (getConfigValue<bool>("mergeodf.warmup", false))
+        warmupMergeTemplates(getConfigValue<unsigned int>("mergeodf.warmup_threads", 0));
+
     // Start the server.
     srv.start(ClientPortNumber);
 
@@ -3016,6 +3574,9 @@ int LOOLWSD::innerMain()
 
 void LOOLWSD::cleanup()
 {
+    // Write out the queued trace records.
+    TraceDumper.reset();
+
     // Finally, we no longer need SSL.
     if (LOOLWSD::isSSLEnabled())
     {
@@ -3046,6 +3607,7 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
     UnitWSD::get().returnValue(returnValue);
 
     LOG_INF("Process [loolwsd] finished.");
+    Log::shutdown();
     return returnValue;
 }
 
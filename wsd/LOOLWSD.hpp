@@ -114,6 +114,10 @@ public:
     /// child kit processes and cleans up DocBrokers.
     static void doHousekeeping();
 
+    /// Gracefully unloads the document with the given key,
+    /// disconnecting its clients with the given reason.
+    static void unloadDocument(const std::string& docKey, const std::string& reason);
+
 protected:
     void initialize(Poco::Util::Application& self) override;
     void defineOptions(Poco::Util::OptionSet& options) override;
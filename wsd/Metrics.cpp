@@ -0,0 +1,260 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include "Metrics.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <utility>
+
+#include "Log.hpp"
+#include "Util.hpp"
+
+namespace
+{
+    enum class Type { Counter, Gauge, Histogram };
+
+    struct Entry
+    {
+        Entry(const Type type, const std::string& help) :
+            MetricType(type),
+            Help(help)
+        {
+        }
+
+        Type MetricType;
+        std::string Help;
+        std::unique_ptr<Metrics::Counter> CounterMetric;
+        std::unique_ptr<Metrics::Gauge> GaugeMetric;
+        std::unique_ptr<Histogram> HistogramMetric;
+    };
+
+    /// The metrics by name and labels, so that
+    /// the series of a metric are listed together.
+    typedef std::map<std::pair<std::string, std::string>, Entry> Registry;
+
+    std::mutex& getMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    Registry& getRegistry()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    /// Splits name{labels} into the name and the labels, without the braces.
+    std::pair<std::string, std::string> splitName(const std::string& name)
+    {
+        const auto pos = name.find('{');
+        if (pos == std::string::npos || name.back() != '}')
+            return std::make_pair(name, std::string());
+
+        return std::make_pair(name.substr(0, pos), name.substr(pos + 1, name.size() - pos - 2));
+    }
+
+    Entry& getEntry(const std::string& name, const Type type, const std::string& help)
+    {
+        Util::assertIsLocked(getMutex());
+
+        Registry& registry = getRegistry();
+        auto it = registry.find(splitName(name));
+        if (it == registry.end())
+        {
+            it = registry.emplace(splitName(name), Entry(type, help)).first;
+        }
+        else if (it->second.MetricType != type)
+        {
+            LOG_ERR("Metric [" << name << "] registered again with another type.");
+        }
+
+        return it->second;
+    }
+
+    const char* toString(const Type type)
+    {
+        switch (type)
+        {
+            case Type::Counter: return "counter";
+            case Type::Gauge: return "gauge";
+            case Type::Histogram: return "histogram";
+        }
+
+        return "untyped";
+    }
+
+    /// Writes name{labels,extra}.
+    void writeSeries(std::ostream& os, const std::string& name, const std::string& labels,
+                     const std::string& extra = std::string())
+    {
+        os << name;
+        if (!labels.empty() || !extra.empty())
+        {
+            os << '{' << labels << (!labels.empty() && !extra.empty() ? "," : "") << extra << '}';
+        }
+
+        os << ' ';
+    }
+
+    /// Writes name{labels}= for the admin console, without the quotes of the labels.
+    void writeStat(std::ostream& os, const std::string& name, const std::string& labels)
+    {
+        os << ' ' << name;
+        if (!labels.empty())
+        {
+            os << '{';
+            for (const char c : labels)
+            {
+                if (c != '"')
+                    os << c;
+            }
+
+            os << '}';
+        }
+
+        os << '=';
+    }
+}
+
+namespace Metrics
+{
+    Counter& counter(const std::string& name, const std::string& help)
+    {
+        std::unique_lock<std::mutex> lock(getMutex());
+        Entry& entry = getEntry(name, Type::Counter, help);
+        if (!entry.CounterMetric)
+            entry.CounterMetric.reset(new Counter());
+        return *entry.CounterMetric;
+    }
+
+    Gauge& gauge(const std::string& name, const std::string& help)
+    {
+        std::unique_lock<std::mutex> lock(getMutex());
+        Entry& entry = getEntry(name, Type::Gauge, help);
+        if (!entry.GaugeMetric)
+            entry.GaugeMetric.reset(new Gauge());
+        return *entry.GaugeMetric;
+    }
+
+    Histogram& histogram(const std::string& name, const std::string& help, const std::string& unit)
+    {
+        std::unique_lock<std::mutex> lock(getMutex());
+        Entry& entry = getEntry(name, Type::Histogram, help);
+        if (!entry.HistogramMetric)
+            entry.HistogramMetric.reset(new Histogram(unit));
+        return *entry.HistogramMetric;
+    }
+
+    void dumpPrometheus(std::ostream& os)
+    {
+        std::unique_lock<std::mutex> lock(getMutex());
+
+        std::string lastName;
+        for (const auto& it : getRegistry())
+        {
+            const std::string& name = it.first.first;
+            const std::string& labels = it.first.second;
+            const Entry& entry = it.second;
+
+            if (name != lastName)
+            {
+                os << "# HELP " << name << ' ' << entry.Help << '\n'
+                   << "# TYPE " << name << ' ' << toString(entry.MetricType) << '\n';
+                lastName = name;
+            }
+
+            if (entry.CounterMetric)
+            {
+                writeSeries(os, name, labels);
+                os << entry.CounterMetric->get() << '\n';
+            }
+            else if (entry.GaugeMetric)
+            {
+                writeSeries(os, name, labels);
+                os << entry.GaugeMetric->get() << '\n';
+            }
+            else if (entry.HistogramMetric)
+            {
+                const Histogram& histogram = *entry.HistogramMetric;
+
+                // One bucket per power of two, all of them, so that
+                // the series are the same from one scrape to the next.
+                uint64_t count = 0;
+                for (int i = 0; i < Histogram::Buckets - 1; ++i)
+                {
+                    count += histogram.getBucket(i);
+                    if ((i + 1) % Histogram::SubBuckets == 0)
+                    {
+                        writeSeries(os, name + "_bucket", labels,
+                                    "le=\"" + std::to_string(Histogram::getUpperBound(i) - 1) + '"');
+                        os << count << '\n';
+                    }
+                }
+
+                count += histogram.getBucket(Histogram::Buckets - 1);
+                writeSeries(os, name + "_bucket", labels, "le=\"+Inf\"");
+                os << count << '\n';
+                writeSeries(os, name + "_sum", labels);
+                os << histogram.getSum() << '\n';
+                writeSeries(os, name + "_count", labels);
+                os << count << '\n';
+            }
+        }
+    }
+
+    std::string getStats()
+    {
+        std::unique_lock<std::mutex> lock(getMutex());
+
+        std::ostringstream oss;
+        for (const auto& it : getRegistry())
+        {
+            const std::string& name = it.first.first;
+            const std::string& labels = it.first.second;
+            const Entry& entry = it.second;
+
+            if (entry.CounterMetric)
+            {
+                writeStat(oss, name, labels);
+                oss << entry.CounterMetric->get();
+            }
+            else if (entry.GaugeMetric)
+            {
+                writeStat(oss, name, labels);
+                oss << entry.GaugeMetric->get();
+            }
+            else if (entry.HistogramMetric)
+            {
+                const Histogram& histogram = *entry.HistogramMetric;
+                const uint64_t count = histogram.getCount();
+                writeStat(oss, name + "_count", labels);
+                oss << count;
+                writeStat(oss, name + "_mean", labels);
+                oss << (count ? histogram.getSum() / count : 0);
+                writeStat(oss, name + "_p50", labels);
+                oss << histogram.getPercentile(50);
+                writeStat(oss, name + "_p99", labels);
+                oss << histogram.getPercentile(99);
+                writeStat(oss, name + "_max", labels);
+                oss << histogram.getMax();
+            }
+        }
+
+        const std::string stats = oss.str();
+        return stats.empty() ? stats : stats.substr(1);
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,93 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_METRICS_HPP
+#define INCLUDED_METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "Histogram.hpp"
+
+/// The performance metrics of wsd, shown in the admin console
+/// and exported in the Prometheus text format on /lool/metrics.
+///
+/// Metrics are registered by name, which may end with Prometheus
+/// labels, e.g. name{endpoint="convert-to"}, and live as long as the
+/// process. Registering takes a lock, so hot paths keep a reference
+/// to their metric, whose updates are lock-free.
+namespace Metrics
+{
+    class Counter
+    {
+    public:
+        Counter() : _value(0) {}
+
+        void inc(const uint64_t count = 1) { _value.fetch_add(count, std::memory_order_relaxed); }
+        uint64_t get() const { return _value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> _value;
+    };
+
+    class Gauge
+    {
+    public:
+        Gauge() : _value(0) {}
+
+        void set(const int64_t value) { _value.store(value, std::memory_order_relaxed); }
+        void add(const int64_t value) { _value.fetch_add(value, std::memory_order_relaxed); }
+        void sub(const int64_t value) { _value.fetch_sub(value, std::memory_order_relaxed); }
+        int64_t get() const { return _value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<int64_t> _value;
+    };
+
+    /// Adds the time until it goes out of scope to a histogram, in microseconds.
+    class ScopedTimer
+    {
+    public:
+        explicit ScopedTimer(Histogram& histogram) :
+            _histogram(histogram),
+            _start(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~ScopedTimer()
+        {
+            _histogram.add(std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - _start).count());
+        }
+
+    private:
+        Histogram& _histogram;
+        const std::chrono::steady_clock::time_point _start;
+    };
+
+    /// Returns the metric of the given name, registering it the first time.
+    Counter& counter(const std::string& name, const std::string& help);
+    Gauge& gauge(const std::string& name, const std::string& help);
+    Histogram& histogram(const std::string& name, const std::string& help, const std::string& unit);
+
+    /// Writes all metrics in the Prometheus text exposition format.
+    void dumpPrometheus(std::ostream& os);
+
+    /// Returns all metrics on one line, as name=value for counters and
+    /// gauges, and name_count, name_mean, name_p50, name_p99 and name_max
+    /// for histograms; the labels, if any, follow the name without quotes.
+    std::string getStats();
+}
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
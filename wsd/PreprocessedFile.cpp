@@ -0,0 +1,159 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include "PreprocessedFile.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <zlib.h>
+
+namespace
+{
+    /// Deflates to raw blocks ending on a byte boundary and not marked
+    /// final, which may be followed by the blocks of another stream.
+    std::string deflateSegment(const std::string& data, const int level)
+    {
+        if (data.empty())
+            return std::string();
+
+        z_stream strm;
+        std::memset(&strm, 0, sizeof(strm));
+        deflateInit2(&strm, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+
+        // The bound is for Z_FINISH, the sync flush adds an empty stored block.
+        std::string deflated(deflateBound(&strm, data.size()) + 16, '\0');
+        strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        strm.avail_in = data.size();
+        strm.next_out = reinterpret_cast<Bytef*>(&deflated[0]);
+        strm.avail_out = deflated.size();
+        deflate(&strm, Z_SYNC_FLUSH);
+        assert(strm.avail_in == 0 && strm.avail_out > 0);
+
+        deflated.resize(deflated.size() - strm.avail_out);
+        deflateEnd(&strm);
+        return deflated;
+    }
+
+    void appendLittleEndian32(std::string& out, const unsigned long value)
+    {
+        for (int i = 0; i < 4; ++i)
+            out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+PreprocessedFile::PreprocessedFile(const std::string& data, const std::map<std::string, std::string>& constants) :
+    _staticSize(0)
+{
+    static const std::map<std::string, Slot> slots = {
+        { "ACCESS_TOKEN", Slot::AccessToken },
+        { "ACCESS_TOKEN_TTL", Slot::AccessTokenTtl },
+        { "HOST", Slot::Host }
+    };
+
+    std::string segment;
+    size_t pos = 0;
+    while (pos < data.size())
+    {
+        const size_t start = data.find('%', pos);
+        const size_t end = (start == std::string::npos ? std::string::npos : data.find('%', start + 1));
+        if (end == std::string::npos)
+        {
+            segment.append(data, pos, std::string::npos);
+            break;
+        }
+
+        segment.append(data, pos, start - pos);
+        const std::string name = data.substr(start + 1, end - start - 1);
+        const auto itSlot = slots.find(name);
+        const auto itConstant = constants.find(name);
+        if (itSlot != slots.end())
+        {
+            _segments.push_back({ segment, std::string(), 0 });
+            _slots.push_back(itSlot->second);
+            segment.clear();
+        }
+        else if (itConstant != constants.end())
+        {
+            segment += itConstant->second;
+        }
+        else
+        {
+            // Not ours, the closing '%' may open the next one.
+            segment += '%';
+            pos = start + 1;
+            continue;
+        }
+
+        pos = end + 1;
+    }
+
+    _segments.push_back({ segment, std::string(), 0 });
+
+    for (Segment& it : _segments)
+    {
+        it.Deflated = deflateSegment(it.Data, Z_BEST_COMPRESSION);
+        it.Crc = crc32(0, reinterpret_cast<const Bytef*>(it.Data.data()), it.Data.size());
+        _staticSize += it.Data.size();
+    }
+}
+
+std::string PreprocessedFile::render(const std::vector<std::string>& values) const
+{
+    assert(values.size() == static_cast<size_t>(Slot::Count));
+
+    size_t size = _staticSize;
+    for (const Slot slot : _slots)
+        size += values[static_cast<size_t>(slot)].size();
+
+    std::string out;
+    out.reserve(size);
+    for (size_t i = 0; i < _segments.size(); ++i)
+    {
+        out += _segments[i].Data;
+        if (i < _slots.size())
+            out += values[static_cast<size_t>(_slots[i])];
+    }
+
+    return out;
+}
+
+std::string PreprocessedFile::renderCompressed(const std::vector<std::string>& values) const
+{
+    assert(values.size() == static_cast<size_t>(Slot::Count));
+
+    // The gzip header: deflate, no flags, no time, unknown OS.
+    std::string out("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+    unsigned long crc = crc32(0, Z_NULL, 0);
+    unsigned long size = 0;
+    for (size_t i = 0; i < _segments.size(); ++i)
+    {
+        const Segment& segment = _segments[i];
+        out += segment.Deflated;
+        crc = crc32_combine(crc, segment.Crc, segment.Data.size());
+        size += segment.Data.size();
+
+        if (i < _slots.size())
+        {
+            const std::string& value = values[static_cast<size_t>(_slots[i])];
+            out += deflateSegment(value, Z_BEST_SPEED);
+            crc = crc32(crc, reinterpret_cast<const Bytef*>(value.data()), value.size());
+            size += value.size();
+        }
+    }
+
+    // An empty final block, then the trailer.
+    out.append("\x03\x00", 2);
+    appendLittleEndian32(out, crc);
+    appendLittleEndian32(out, size);
+    return out;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
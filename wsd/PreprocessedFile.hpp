@@ -0,0 +1,61 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_PREPROCESSEDFILE_HPP
+#define INCLUDED_PREPROCESSEDFILE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+/// A file served with per-request substitutions, such as loleaflet.html.
+///
+/// Split once into the static segments and the slots between them, the
+/// values known at startup being substituted right away. The static
+/// segments are also kept deflated, so that a gzipped response only
+/// has to compress the values of the slots.
+class PreprocessedFile
+{
+public:
+    /// The values substituted for each request.
+    enum class Slot
+    {
+        AccessToken,
+        AccessTokenTtl,
+        Host,
+        Count
+    };
+
+    /// @param constants the values of the other placeholders, by name, without the '%'.
+    PreprocessedFile(const std::string& data, const std::map<std::string, std::string>& constants);
+
+    /// @param values the value of each Slot, in order.
+    std::string render(const std::vector<std::string>& values) const;
+
+    /// The same as render(), but gzipped.
+    std::string renderCompressed(const std::vector<std::string>& values) const;
+
+private:
+    struct Segment
+    {
+        std::string Data;
+        /// Raw deflate blocks, ending on a byte boundary.
+        std::string Deflated;
+        unsigned long Crc;
+    };
+
+    /// One more segment than slots: the slots go between them.
+    std::vector<Segment> _segments;
+    std::vector<Slot> _slots;
+    size_t _staticSize;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
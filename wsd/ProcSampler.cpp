@@ -0,0 +1,249 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include "ProcSampler.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+
+#include "Log.hpp"
+#include "Util.hpp"
+
+ProcSampler::ProcSampler(const SnapshotCallback& callback) :
+    _callback(callback),
+    _forKitPid(-1),
+    _intervalMs(5000),
+    _stop(false)
+{
+}
+
+ProcSampler::~ProcSampler()
+{
+    stop();
+}
+
+void ProcSampler::start()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_thread.joinable())
+        return;
+
+    _stop = false;
+    _thread = std::thread([this]{ samplingThread(); });
+}
+
+void ProcSampler::stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+
+    _cv.notify_all();
+    if (_thread.joinable() && _thread.get_id() != std::this_thread::get_id())
+        _thread.join();
+}
+
+void ProcSampler::setInterval(unsigned intervalMs)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _intervalMs = std::max(intervalMs, 100U);
+}
+
+void ProcSampler::setForKitPid(Poco::Process::PID pid)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _forKitPid = pid;
+}
+
+void ProcSampler::addDocument(const std::string& docKey, Poco::Process::PID pid)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _documents[docKey] = pid;
+}
+
+void ProcSampler::removeDocument(const std::string& docKey)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _documents.erase(docKey);
+}
+
+void ProcSampler::samplingThread()
+{
+    Util::setThreadName("proc_sampler");
+
+    LOG_INF("Starting process sampler thread.");
+
+    static const size_t ticksPerSec = sysconf(_SC_CLK_TCK);
+
+    auto lastPass = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stop)
+    {
+        _cv.wait_for(lock, std::chrono::milliseconds(_intervalMs), [this]{ return _stop; });
+        if (_stop)
+            break;
+
+        // Don't hold the lock while reading /proc.
+        const std::map<std::string, Poco::Process::PID> docs = _documents;
+        const Poco::Process::PID forKitPid = _forKitPid;
+        lock.unlock();
+
+        const auto now = std::chrono::steady_clock::now();
+        const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastPass).count();
+        lastPass = now;
+
+        Snapshot snapshot;
+        sample(snapshot, docs, forKitPid, std::max<size_t>(elapsedMs * ticksPerSec / 1000, 1));
+
+        try
+        {
+            _callback(snapshot);
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_ERR("Exception while handling process samples: " << exc.what());
+        }
+
+        lock.lock();
+    }
+
+    lock.unlock();
+
+    while (!_files.empty())
+    {
+        closeFiles(_files.begin()->first);
+    }
+
+    LOG_INF("Finished process sampler thread.");
+}
+
+void ProcSampler::sample(Snapshot& snapshot, const std::map<std::string, Poco::Process::PID>& docs,
+                         Poco::Process::PID forKitPid, size_t elapsedTicks)
+{
+    std::set<Poco::Process::PID> alive;
+
+    int pssKb = 0;
+    int dirtyKb = 0;
+    size_t deltaTicks = 0;
+    size_t totalTicks = 0;
+
+    const Poco::Process::PID wsdPid = Poco::Process::id();
+    alive.insert(wsdPid);
+    readProcess(wsdPid, pssKb, dirtyKb, deltaTicks);
+    snapshot.BaseMemKb = std::max(pssKb, 0);
+    totalTicks += deltaTicks;
+
+    if (forKitPid > 0)
+    {
+        // forkit has everything loaded and shared with the kits.
+        alive.insert(forKitPid);
+        if (readProcess(forKitPid, pssKb, dirtyKb, deltaTicks))
+            snapshot.BaseMemKb += Util::getMemoryUsageRSS(_files[forKitPid].Stat);
+        totalTicks += deltaTicks;
+    }
+
+    snapshot.Kits.reserve(docs.size());
+    for (const auto& pair : docs)
+    {
+        const Poco::Process::PID pid = pair.second;
+        alive.insert(pid);
+        if (readProcess(pid, pssKb, dirtyKb, deltaTicks))
+        {
+            Sample kit;
+            kit.DocKey = pair.first;
+            kit.Pid = pid;
+            kit.DirtyKb = dirtyKb;
+            kit.CpuPercent = deltaTicks * 100 / elapsedTicks;
+            snapshot.Kits.push_back(kit);
+            totalTicks += deltaTicks;
+        }
+    }
+
+    snapshot.TotalCpuPercent = totalTicks * 100 / elapsedTicks;
+
+    // Close the files of processes we no longer track.
+    for (auto it = _files.begin(); it != _files.end(); )
+    {
+        const Poco::Process::PID pid = it->first;
+        ++it;
+        if (alive.find(pid) == alive.end())
+            closeFiles(pid);
+    }
+
+    LOG_TRC("Sampled " << snapshot.Kits.size() << " kits, base memory: " <<
+            snapshot.BaseMemKb << " KB, total CPU: " << snapshot.TotalCpuPercent << "%.");
+}
+
+bool ProcSampler::readProcess(Poco::Process::PID pid, int& pssKb, int& dirtyKb, size_t& deltaTicks)
+{
+    pssKb = -1;
+    dirtyKb = -1;
+    deltaTicks = 0;
+
+    auto it = _files.find(pid);
+    const bool isNew = (it == _files.end());
+    if (isNew)
+    {
+        const std::string procPath = "/proc/" + std::to_string(pid);
+        ProcFiles files;
+        files.Stat = fopen((procPath + "/stat").c_str(), "r");
+        if (files.Stat == nullptr)
+        {
+            LOG_DBG("Failed to open " << procPath << "/stat, process gone?");
+            return false;
+        }
+
+        // smaps_rollup (Linux 4.14+) is much cheaper, as the
+        // kernel sums up all the mappings for us.
+        files.SMaps = fopen((procPath + "/smaps_rollup").c_str(), "r");
+        if (files.SMaps == nullptr)
+            files.SMaps = fopen((procPath + "/smaps").c_str(), "r");
+        if (files.SMaps == nullptr)
+            LOG_DBG("No permission to read the smaps of [" << pid << "].");
+
+        it = _files.emplace(pid, files).first;
+    }
+
+    ProcFiles& files = it->second;
+    if (files.SMaps)
+    {
+        const auto pssAndDirtyKb = Util::getPssAndDirtyFromSMaps(files.SMaps);
+        pssKb = pssAndDirtyKb.first;
+        dirtyKb = pssAndDirtyKb.second;
+    }
+
+    const size_t ticks = Util::getCpuUsage(files.Stat);
+    if (!isNew && ticks >= files.LastTicks)
+        deltaTicks = ticks - files.LastTicks;
+    files.LastTicks = ticks;
+
+    return true;
+}
+
+void ProcSampler::closeFiles(Poco::Process::PID pid)
+{
+    auto it = _files.find(pid);
+    if (it != _files.end())
+    {
+        if (it->second.SMaps)
+            fclose(it->second.SMaps);
+        if (it->second.Stat)
+            fclose(it->second.Stat);
+        _files.erase(it);
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
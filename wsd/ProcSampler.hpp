@@ -0,0 +1,119 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_PROCSAMPLER_HPP
+#define INCLUDED_PROCSAMPLER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Poco/Process.h>
+
+/// Samples the memory and CPU usage of wsd, forkit and all
+/// the kit processes in a single pass over /proc, on its own thread.
+/// The /proc files are kept open between passes and only rewound,
+/// and smaps_rollup is preferred over smaps where the kernel has it.
+class ProcSampler
+{
+public:
+    /// The usage of a single kit process.
+    struct Sample
+    {
+        std::string DocKey;
+        Poco::Process::PID Pid;
+        /// Private_Dirty in KB, or -1 when smaps isn't readable
+        /// (the kit then reports it via procmemstats: instead).
+        int DirtyKb;
+        /// CPU usage since the previous pass, in percent of one core.
+        unsigned CpuPercent;
+    };
+
+    /// The result of one sampling pass.
+    struct Snapshot
+    {
+        std::vector<Sample> Kits;
+        /// wsd PSS + forkit RSS, in KB. Everything else
+        /// forkit loaded is shared with the kits, so only
+        /// the dirty memory of the kits is added to this.
+        size_t BaseMemKb;
+        /// Total CPU usage of all the processes, in percent of one core.
+        unsigned TotalCpuPercent;
+    };
+
+    typedef std::function<void(const Snapshot&)> SnapshotCallback;
+
+    ProcSampler(const SnapshotCallback& callback);
+    ~ProcSampler();
+
+    void start();
+    void stop();
+
+    /// Set the time between two passes.
+    void setInterval(unsigned intervalMs);
+
+    void setForKitPid(Poco::Process::PID pid);
+
+    void addDocument(const std::string& docKey, Poco::Process::PID pid);
+    void removeDocument(const std::string& docKey);
+
+private:
+    /// The open /proc files of a process, owned by the sampling thread.
+    struct ProcFiles
+    {
+        ProcFiles() :
+            SMaps(nullptr),
+            Stat(nullptr),
+            LastTicks(0)
+        {
+        }
+
+        FILE* SMaps;
+        FILE* Stat;
+        size_t LastTicks;
+    };
+
+    void samplingThread();
+
+    /// Collect one snapshot of all the known processes.
+    void sample(Snapshot& snapshot, const std::map<std::string, Poco::Process::PID>& docs,
+                Poco::Process::PID forKitPid, size_t elapsedTicks);
+
+    /// Open (if necessary) and read the files of a process.
+    /// The memory is -1 when smaps isn't readable.
+    /// Returns false when the process is gone.
+    bool readProcess(Poco::Process::PID pid, int& pssKb, int& dirtyKb, size_t& deltaTicks);
+
+    void closeFiles(Poco::Process::PID pid);
+
+private:
+    const SnapshotCallback _callback;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::map<std::string, Poco::Process::PID> _documents;
+    Poco::Process::PID _forKitPid;
+    unsigned _intervalMs;
+    bool _stop;
+
+    /// Only accessed from the sampling thread.
+    std::map<Poco::Process::PID, ProcFiles> _files;
+
+    std::thread _thread;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -14,7 +14,9 @@
 #include <deque>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <Poco/Dynamic/Var.h>
@@ -24,28 +26,66 @@
 
 #include "common/SigUtil.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "TileDesc.hpp"
 
 /// A queue of data to send to certain Session's WS.
+/// Messages that supersede earlier ones replace them: the earlier
+/// entry is found through an index by deduplication key and left
+/// empty in place, so enqueueing doesn't scan the queue.
 template <typename Item>
 class SenderQueue final
 {
 public:
 
-    SenderQueue()
+    SenderQueue() :
+        _front(0),
+        _size(0),
+        _queued(Metrics::gauge("loolwsd_sender_queue_messages",
+                               "Messages queued to be sent to the clients.")),
+        _replaced(Metrics::counter("loolwsd_sender_queue_replaced_total",
+                                   "Queued messages superseded by a more recent one before being sent."))
     {
     }
 
+    ~SenderQueue()
+    {
+        _queued.sub(_size);
+    }
+
     bool stopping() const { return TerminationFlag; }
 
     size_t enqueue(const Item& item)
     {
+        std::string key = getDedupKey(item);
+
         std::unique_lock<std::mutex> lock(_mutex);
 
-        if (!stopping() && deduplicate(item))
-            _queue.push_back(item);
+        if (!stopping())
+        {
+            if (!key.empty())
+            {
+                // Remove previous identical entry, if any, and use most recent (incoming).
+                const uint64_t seq = _front + _queue.size();
+                const auto result = _index.emplace(key, seq);
+                if (!result.second)
+                {
+                    Entry& previous = _queue[result.first->second - _front];
+                    previous.Payload = Item();
+                    previous.Key.clear();
+                    --_size;
+                    _queued.sub(1);
+                    _replaced.inc();
+                    result.first->second = seq;
+                }
+            }
+
+            _queue.push_back(Entry(item, std::move(key)));
+            ++_size;
+            _queued.add(1);
+        }
 
-        return _queue.size();
+        return _size;
     }
 
     /// Dequeue an item if we have one - @returns true if we do, else false.
@@ -53,109 +93,109 @@ public:
     {
         std::unique_lock<std::mutex> lock(_mutex);
 
-        if (!_queue.empty() && !stopping())
+        if (stopping())
         {
-            item = _queue.front();
-            _queue.pop_front();
-            return true;
+            LOG_DBG("SenderQueue: stopping");
+            return false;
         }
-        else
+
+        while (!_queue.empty())
         {
-            if (stopping())
-                LOG_DBG("SenderQueue: stopping");
-            return false;
+            Entry& entry = _queue.front();
+            const bool found = (entry.Payload != nullptr);
+            if (found)
+            {
+                item = std::move(entry.Payload);
+                if (!entry.Key.empty())
+                    _index.erase(entry.Key);
+                --_size;
+                _queued.sub(1);
+            }
+
+            _queue.pop_front();
+            ++_front;
+
+            if (found)
+                return true;
         }
+
+        return false;
     }
 
     size_t size() const
     {
         std::lock_guard<std::mutex> lock(_mutex);
-        return _queue.size();
+        return _size;
     }
 
     void dumpState(std::ostream& os)
     {
-        os << "\n\t\tqueue size " << _queue.size() << "\n";
         std::lock_guard<std::mutex> lock(_mutex);
-        for (const Item &item : _queue)
+        os << "\n\t\tqueue size " << _size << " (" << _queue.size() - _size << " replaced)\n";
+        for (const Entry& entry : _queue)
         {
-            os << "\t\t\ttype: " << (item->isBinary() ? "binary" : "text") << "\n";
-            os << "\t\t\t" << item->abbr() << "\n";
+            if (entry.Payload == nullptr)
+                continue;
+
+            os << "\t\t\ttype: " << (entry.Payload->isBinary() ? "binary" : "text") << "\n";
+            os << "\t\t\t" << entry.Payload->abbr() << "\n";
         }
     }
 
 private:
-    /// Deduplicate messages based on the new one.
-    /// Returns true if the new message should be
-    /// enqueued, otherwise false.
-    bool deduplicate(const Item& item)
+    /// Returns the key under which the message supersedes
+    /// earlier ones, or an empty string if it doesn't.
+    static std::string getDedupKey(const Item& item)
     {
-        // Deduplicate messages based on the incoming one.
-        const std::string command = item->firstToken();
+        const std::string& command = item->firstToken();
         if (command == "tile:")
         {
-            // Remove previous identical tile, if any, and use most recent (incoming).
-            const TileDesc newTile = TileDesc::parse(item->firstLine());
-            const auto& pos = std::find_if(_queue.begin(), _queue.end(),
-                [&newTile](const queue_item_t& cur)
-                {
-                    return cur->firstToken() == "tile:" &&
-                           newTile == TileDesc::parse(cur->firstLine());
-                });
-
-            if (pos != _queue.end())
-                _queue.erase(pos);
+            // Only the most recent of identical tiles is sent.
+            const TileDesc tile = TileDesc::parse(item->firstLine());
+            return command + tile.getKey();
         }
         else if (command == "statusindicatorsetvalue:" ||
                  command == "invalidatecursor:" ||
                  command == "setpart:")
         {
-            // Remove previous identical enties of this command,
-            // if any, and use most recent (incoming).
-            const auto& pos = std::find_if(_queue.begin(), _queue.end(),
-                [&command](const queue_item_t& cur)
-                {
-                    return cur->firstToken() == command;
-                });
-
-            if (pos != _queue.end())
-                _queue.erase(pos);
+            // Only the most recent of these commands is sent.
+            return command;
         }
         else if (command == "invalidateviewcursor:")
         {
-            // Remove previous cursor invalidation for same view,
-            // if any, and use most recent (incoming).
+            // Only the most recent cursor invalidation of each view is sent.
             const std::string newMsg = item->jsonString();
             Poco::JSON::Parser newParser;
             const auto newResult = newParser.parse(newMsg);
             const auto& newJson = newResult.extract<Poco::JSON::Object::Ptr>();
-            const auto viewId = newJson->get("viewId").toString();
-            const auto& pos = std::find_if(_queue.begin(), _queue.end(),
-                [command, viewId](const queue_item_t& cur)
-                {
-                    if (cur->firstToken() == command)
-                    {
-                        const std::string msg = cur->jsonString();
-                        Poco::JSON::Parser parser;
-                        const auto result = parser.parse(msg);
-                        const auto& json = result.extract<Poco::JSON::Object::Ptr>();
-                        return viewId == json->get("viewId").toString();
-                    }
-
-                    return false;
-                });
-
-            if (pos != _queue.end())
-                _queue.erase(pos);
+            return command + newJson->get("viewId").toString();
         }
 
-        return true;
+        return std::string();
     }
 
+    struct Entry
+    {
+        Entry(const Item& item, std::string key) :
+            Payload(item),
+            Key(std::move(key))
+        {
+        }
+
+        /// Empty if replaced by a more recent message.
+        Item Payload;
+        std::string Key;
+    };
+
 private:
     mutable std::mutex _mutex;
-    std::deque<Item> _queue;
-    typedef typename std::deque<Item>::value_type queue_item_t;
+    std::deque<Entry> _queue;
+    /// The position of each deduplicated message, by key.
+    std::unordered_map<std::string, uint64_t> _index;
+    /// The position of the front of the queue since the start.
+    uint64_t _front;
+    /// The number of entries that aren't replaced.
+    size_t _size;
 };
 
 #endif
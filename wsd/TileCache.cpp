@@ -34,6 +34,7 @@
 #include "ClientSession.hpp"
 #include "Common.hpp"
 #include "common/FileUtil.hpp"
+#include "Metrics.hpp"
 #include "Protocol.hpp"
 #include "SenderQueue.hpp"
 #include "Unit.hpp"
@@ -50,7 +51,9 @@ TileCache::TileCache(const std::string& docURL,
                      const Timestamp& modifiedTime,
                      const std::string& cacheDir) :
     _docURL(docURL),
-    _cacheDir(cacheDir)
+    _cacheDir(cacheDir),
+    _prefetchCount(0),
+    _prefetchHitCount(0)
 {
     LOG_INF("TileCache ctor for uri [" << _docURL <<
             "], cacheDir: [" << _cacheDir <<
@@ -138,12 +141,22 @@ std::unique_ptr<std::fstream> TileCache::lookupTile(const TileDesc& tile)
                               tile.getTilePosX(), tile.getTilePosY(),
                               tile.getTileWidth(), tile.getTileHeight(), result);
 
+    static Metrics::Counter& hits = Metrics::counter("loolwsd_tile_cache_hits_total",
+                                                     "Tiles found in the tile cache.");
+    static Metrics::Counter& misses = Metrics::counter("loolwsd_tile_cache_misses_total",
+                                                       "Tiles not found in the tile cache.");
+
     if (result && result->is_open())
     {
         LOG_TRC("Found cache tile: " << fileName);
+        hits.inc();
+
+        std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+        countPrefetchHit(cacheFileName(tile));
         return result;
     }
 
+    misses.inc();
     return nullptr;
 }
 
@@ -217,6 +230,11 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
         // Remove subscriptions.
         if (tileBeingRendered->getVersion() <= tile.getVersion())
         {
+            static Histogram& renderLatency = Metrics::histogram("loolwsd_tile_render_latency_us",
+                "Time from requesting a tile from the kit until it is rendered.", "us");
+            renderLatency.add(std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - tileBeingRendered->getStartTime()).count());
+
             LOG_DBG("STATISTICS: tile " << tile.getVersion() << " internal roundtrip " <<
                     tileBeingRendered->getElapsedTimeMs() << " ms.");
             _tilesBeingRendered.erase(cachedName);
@@ -332,6 +350,7 @@ void TileCache::invalidateTiles(int part, int x, int y, int width, int height)
             {
                 LOG_DBG("Removing tile: " << tileIterator.path().toString());
                 FileUtil::removeFile(tileIterator.path());
+                _prefetched.erase(fileName);
             }
         }
     }
@@ -464,6 +483,7 @@ void TileCache::subscribeToTileRendering(const TileDesc& tile, const std::shared
         LOG_DBG("Subscribing " << subscriber->getName() << " to tile " << name << " which has " <<
                 tileBeingRendered->_subscribers.size() << " subscribers already.");
         tileBeingRendered->_subscribers.push_back(subscriber);
+        countPrefetchHit(tileBeingRendered->getCacheName());
 
         const auto duration = (std::chrono::steady_clock::now() - tileBeingRendered->getStartTime());
         if (std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() > COMMAND_TIMEOUT_MS)
@@ -487,6 +507,79 @@ void TileCache::subscribeToTileRendering(const TileDesc& tile, const std::shared
     }
 }
 
+bool TileCache::prefetchTile(const TileDesc& tile)
+{
+    const std::string cachedName = cacheFileName(tile);
+
+    std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+
+    if (_tilesBeingRendered.find(cachedName) != _tilesBeingRendered.end() ||
+        File(_cacheDir + "/" + cachedName).exists())
+    {
+        return false;
+    }
+
+    LOG_TRC("Prefetching tile " << cachedName << " ver=" << tile.getVersion() << ".");
+    _tilesBeingRendered[cachedName] = std::make_shared<TileBeingRendered>(cachedName, tile);
+    _prefetched.insert(cachedName);
+    ++_prefetchCount;
+
+    static Metrics::Counter& prefetched = Metrics::counter("loolwsd_tile_prefetch_total",
+                                                           "Tiles rendered ahead of the clients' requests.");
+    prefetched.inc();
+    return true;
+}
+
+std::string TileCache::cancelPrefetch()
+{
+    std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+
+    std::ostringstream oss;
+    for (auto it = _tilesBeingRendered.begin(); it != _tilesBeingRendered.end(); )
+    {
+        // Once a client subscribes, it's not a prefetch anymore.
+        if (it->second->_subscribers.empty() && _prefetched.erase(it->first))
+        {
+            oss << it->second->getVersion() << ',';
+            it = _tilesBeingRendered.erase(it);
+            continue;
+        }
+
+        ++it;
+    }
+
+    const auto canceltiles = oss.str();
+    return canceltiles.empty() ? canceltiles : "canceltiles " + canceltiles;
+}
+
+bool TileCache::hasTilesBeingRendered() const
+{
+    std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+
+    // Responses may never come, e.g. for tiles the client already has.
+    for (const auto& it : _tilesBeingRendered)
+    {
+        if (it.second->getElapsedTimeMs() < COMMAND_TIMEOUT_MS)
+            return true;
+    }
+
+    return false;
+}
+
+void TileCache::countPrefetchHit(const std::string& cachedName)
+{
+    Util::assertIsLocked(_tilesBeingRenderedMutex);
+
+    if (_prefetched.erase(cachedName))
+    {
+        ++_prefetchHitCount;
+
+        static Metrics::Counter& hits = Metrics::counter("loolwsd_tile_prefetch_hits_total",
+                                                         "Prefetched tiles requested by a client.");
+        hits.inc();
+    }
+}
+
 std::string TileCache::cancelTiles(const std::shared_ptr<ClientSession> &subscriber)
 {
     assert(subscriber && "cancelTiles expects valid subscriber");
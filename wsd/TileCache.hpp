@@ -10,10 +10,12 @@
 #ifndef INCLUDED_TILECACHE_HPP
 #define INCLUDED_TILECACHE_HPP
 
+#include <atomic>
 #include <iosfwd>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 
 #include <Poco/Timestamp.h>
@@ -48,6 +50,21 @@ public:
     /// Cancels all tile requests by the given subscriber.
     std::string cancelTiles(const std::shared_ptr<ClientSession>& subscriber);
 
+    /// Marks the tile as being rendered ahead of any request, without subscribers.
+    /// @return false if it's cached or already being rendered, so not to render.
+    bool prefetchTile(const TileDesc& tile);
+
+    /// Forgets the prefetched tiles not rendered yet, e.g. as they are invalidated.
+    /// @return the canceltiles command for the kit, empty if there are none.
+    std::string cancelPrefetch();
+
+    /// True while the kit renders tiles for us, ignoring the stalled ones.
+    bool hasTilesBeingRendered() const;
+
+    /// The number of tiles prefetched, and of those requested by a client since.
+    size_t getPrefetchCount() const { return _prefetchCount; }
+    size_t getPrefetchHitCount() const { return _prefetchHitCount; }
+
     std::unique_ptr<std::fstream> lookupTile(const TileDesc& tile);
 
     void saveTileAndNotify(const TileDesc& tile, const char* data, const size_t size);
@@ -94,6 +111,9 @@ private:
     /// Load the timestamp from modtime.txt.
     Poco::Timestamp getLastModified();
 
+    /// Counts a request of a tile that was prefetched, if it was.
+    void countPrefetchHit(const std::string& cachedName);
+
     const std::string _docURL;
 
     const std::string _cacheDir;
@@ -103,6 +123,12 @@ private:
     mutable std::mutex _tilesBeingRenderedMutex;
 
     std::map<std::string, std::shared_ptr<TileBeingRendered> > _tilesBeingRendered;
+
+    /// The prefetched tiles that no client requested yet, by cache name.
+    /// Guarded by _tilesBeingRenderedMutex.
+    std::set<std::string> _prefetched;
+    std::atomic<size_t> _prefetchCount;
+    std::atomic<size_t> _prefetchHitCount;
 };
 
 #endif
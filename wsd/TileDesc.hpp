@@ -84,6 +84,22 @@ public:
                _broadcast == other._broadcast;
     }
 
+    /// Identifies the tile, whatever its version: equal tiles have equal keys.
+    std::string getKey() const
+    {
+        std::string key = std::to_string(_part);
+        for (const int value : { _width, _height, _tilePosX, _tilePosY, _tileWidth, _tileHeight, _id })
+        {
+            key += ',';
+            key += std::to_string(value);
+        }
+
+        if (_broadcast)
+            key += ",b";
+
+        return key;
+    }
+
     static bool rectanglesIntersect(int x1, int y1, int w1, int h1, int x2, int y2, int w2, int h2)
     {
         return x1 + w1 >= x2 &&
@@ -171,31 +187,75 @@ public:
 
     /// Deserialize a TileDesc from a tokenized string.
     static TileDesc parse(const std::vector<std::string>& tokens)
+    {
+        return parseTokens(tokens);
+    }
+
+    /// Deserialize a TileDesc from the tokens of a message.
+    static TileDesc parse(const LOOLProtocol::Tokens& tokens)
+    {
+        return parseTokens(tokens);
+    }
+
+    /// Deserialize a TileDesc from a string format.
+    static TileDesc parse(const std::string& message)
+    {
+        return parseTokens(LOOLProtocol::Tokens(message));
+    }
+
+private:
+    template <typename T>
+    static TileDesc parseTokens(const T& tokens)
     {
         // We don't expect undocumented fields and
         // assume all values to be int.
-        std::map<std::string, int> pairs;
+        int part = 0;
+        int width = 0;
+        int height = 0;
+        int tilePosX = 0;
+        int tilePosY = 0;
+        int tileWidth = 0;
+        int tileHeight = 0;
 
         // Optional.
-        pairs["ver"] = -1;
-        pairs["imgsize"] = 0;
-        pairs["id"] = -1;
+        int ver = -1;
+        int imgSize = 0;
+        int id = -1;
 
         uint64_t oldHash = 0;
         uint64_t hash = 0;
-        for (size_t i = 0; i < tokens.size(); ++i)
+        for (const auto& token : tokens)
         {
-            if (LOOLProtocol::getTokenUInt64(tokens[i], "oldhash", oldHash))
+            if (LOOLProtocol::getTokenUInt64(token, "oldhash", oldHash))
                 ;
-            else if (LOOLProtocol::getTokenUInt64(tokens[i], "hash", hash))
+            else if (LOOLProtocol::getTokenUInt64(token, "hash", hash))
                 ;
             else
             {
-                std::string name;
+                LOOLProtocol::StringView name;
                 int value = -1;
-                if (LOOLProtocol::parseNameIntegerPair(tokens[i], name, value))
+                if (LOOLProtocol::parseNameIntegerPair(token, name, value))
                 {
-                    pairs[name] = value;
+                    if (name == "part")
+                        part = value;
+                    else if (name == "width")
+                        width = value;
+                    else if (name == "height")
+                        height = value;
+                    else if (name == "tileposx")
+                        tilePosX = value;
+                    else if (name == "tileposy")
+                        tilePosY = value;
+                    else if (name == "tilewidth")
+                        tileWidth = value;
+                    else if (name == "tileheight")
+                        tileHeight = value;
+                    else if (name == "ver")
+                        ver = value;
+                    else if (name == "imgsize")
+                        imgSize = value;
+                    else if (name == "id")
+                        id = value;
                 }
             }
         }
@@ -204,24 +264,14 @@ public:
         const bool broadcast = (LOOLProtocol::getTokenString(tokens, "broadcast", s) &&
                                 s == "yes");
 
-        auto result = TileDesc(pairs["part"], pairs["width"], pairs["height"],
-                               pairs["tileposx"], pairs["tileposy"],
-                               pairs["tilewidth"], pairs["tileheight"],
-                               pairs["ver"],
-                               pairs["imgsize"], pairs["id"], broadcast);
+        auto result = TileDesc(part, width, height, tilePosX, tilePosY,
+                               tileWidth, tileHeight, ver, imgSize, id, broadcast);
         result.setOldHash(oldHash);
         result.setHash(hash);
 
         return result;
     }
 
-    /// Deserialize a TileDesc from a string format.
-    static TileDesc parse(const std::string& message)
-    {
-        return parse(LOOLProtocol::tokenize(message.data(), message.size()));
-    }
-
-private:
     int _part;
     int _width;
     int _height;
@@ -402,15 +452,63 @@ public:
         return oss.str().substr(0, oss.tellp());
     }
 
-    /// Deserialize a TileDesc from a tokenized string.
+    /// Deserialize a TileCombined from a tokenized string.
     static TileCombined parse(const std::vector<std::string>& tokens)
+    {
+        return parseTokens(tokens);
+    }
+
+    /// Deserialize a TileCombined from the tokens of a message.
+    static TileCombined parse(const LOOLProtocol::Tokens& tokens)
+    {
+        return parseTokens(tokens);
+    }
+
+    /// Deserialize a TileCombined from a string format.
+    static TileCombined parse(const std::string& message)
+    {
+        return parseTokens(LOOLProtocol::Tokens(message));
+    }
+
+    static TileCombined create(const std::vector<TileDesc>& tiles)
+    {
+        assert(!tiles.empty());
+
+        std::ostringstream xs;
+        std::ostringstream ys;
+        std::ostringstream vers;
+        std::ostringstream oldhs;
+        std::ostringstream hs;
+
+        for (const auto& tile : tiles)
+        {
+            xs << tile.getTilePosX() << ',';
+            ys << tile.getTilePosY() << ',';
+            vers << tile.getVersion() << ',';
+            oldhs << tile.getOldHash() << ',';
+            hs << tile.getHash() << ',';
+        }
+
+        vers.seekp(-1, std::ios_base::cur); // Remove last comma.
+        return TileCombined(tiles[0].getPart(), tiles[0].getWidth(), tiles[0].getHeight(),
+                            xs.str(), ys.str(), tiles[0].getTileWidth(), tiles[0].getTileHeight(),
+                            vers.str(), "", -1, oldhs.str(), hs.str());
+    }
+
+private:
+    template <typename T>
+    static TileCombined parseTokens(const T& tokens)
     {
         // We don't expect undocumented fields and
         // assume all values to be int.
-        std::map<std::string, int> pairs;
+        int part = 0;
+        int width = 0;
+        int height = 0;
+        int tileWidth = 0;
+        int tileHeight = 0;
 
         // Optional.
-        pairs["id"] = -1;
+        int id = -1;
 
         std::string tilePositionsX;
         std::string tilePositionsY;
@@ -421,84 +519,63 @@ public:
 
         for (const auto& token : tokens)
         {
-            std::string name;
-            std::string value;
+            LOOLProtocol::StringView name;
+            LOOLProtocol::StringView value;
             if (LOOLProtocol::parseNameValuePair(token, name, value))
             {
                 if (name == "tileposx")
                 {
-                    tilePositionsX = value;
+                    tilePositionsX = value.toString();
                 }
                 else if (name == "tileposy")
                 {
-                    tilePositionsY = value;
+                    tilePositionsY = value.toString();
                 }
                 else if (name == "imgsize")
                 {
-                    imgSizes = value;
+                    imgSizes = value.toString();
                 }
                 else if (name == "ver")
                 {
-                    versions = value;
+                    versions = value.toString();
                 }
                 else if (name == "oldhash")
                 {
-                    oldhashes = value;
+                    oldhashes = value.toString();
                 }
                 else if (name == "hash")
                 {
-                    hashes = value;
+                    hashes = value.toString();
                 }
                 else
                 {
                     int v = 0;
                     if (LOOLProtocol::stringToInteger(value, v))
                     {
-                        pairs[name] = v;
+                        if (name == "part")
+                            part = v;
+                        else if (name == "width")
+                            width = v;
+                        else if (name == "height")
+                            height = v;
+                        else if (name == "tilewidth")
+                            tileWidth = v;
+                        else if (name == "tileheight")
+                            tileHeight = v;
+                        else if (name == "id")
+                            id = v;
                     }
                 }
             }
         }
 
-        return TileCombined(pairs["part"], pairs["width"], pairs["height"],
+        return TileCombined(part, width, height,
                             tilePositionsX, tilePositionsY,
-                            pairs["tilewidth"], pairs["tileheight"],
+                            tileWidth, tileHeight,
                             versions,
-                            imgSizes, pairs["id"], oldhashes, hashes);
-    }
-
-    /// Deserialize a TileDesc from a string format.
-    static TileCombined parse(const std::string& message)
-    {
-        return parse(LOOLProtocol::tokenize(message.data(), message.size()));
+                            imgSizes, id, oldhashes, hashes);
     }
 
-    static TileCombined create(const std::vector<TileDesc>& tiles)
-    {
-        assert(!tiles.empty());
-
-        std::ostringstream xs;
-        std::ostringstream ys;
-        std::ostringstream vers;
-        std::ostringstream oldhs;
-        std::ostringstream hs;
-
-        for (const auto& tile : tiles)
-        {
-            xs << tile.getTilePosX() << ',';
-            ys << tile.getTilePosY() << ',';
-            vers << tile.getVersion() << ',';
-            oldhs << tile.getOldHash() << ',';
-            hs << tile.getHash() << ',';
-        }
-
-        vers.seekp(-1, std::ios_base::cur); // Remove last comma.
-        return TileCombined(tiles[0].getPart(), tiles[0].getWidth(), tiles[0].getHeight(),
-                            xs.str(), ys.str(), tiles[0].getTileWidth(), tiles[0].getTileHeight(),
-                            vers.str(), "", -1, oldhs.str(), hs.str());
-    }
-
-private:
     std::vector<TileDesc> _tiles;
     int _part;
     int _width;
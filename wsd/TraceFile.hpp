@@ -10,16 +10,25 @@
 #ifndef INCLUDED_TRACEFILE_HPP
 #define INCLUDED_TRACEFILE_HPP
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <map>
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <Poco/DateTime.h>
 #include <Poco/DateTimeFormatter.h>
 #include <Poco/DeflatingStream.h>
+#include <Poco/File.h>
 #include <Poco/InflatingStream.h>
+#include <Poco/Path.h>
 #include <Poco/URI.h>
 
 #include "Protocol.hpp"
@@ -27,6 +36,16 @@
 #include "Util.hpp"
 
 /// Dumps commands and notification trace.
+///
+/// Trace files are binary: the magic "LOOLTRC1", then a sequence of
+/// length-prefixed records, all integers little-endian:
+///     uint32  size of the record following this field
+///     uint8   direction
+///     uint64  microseconds since the start of the trace
+///     uint32  session index
+///     payload
+/// A Session record defines its index as "id\0sessionId" the first
+/// time a session is seen, later records carry only the index.
 class TraceFileRecord
 {
 public:
@@ -35,13 +54,22 @@ public:
         Invalid = 0,
         Incoming = '>',
         Outgoing = '<',
-        Event = '~'
+        Event = '~',
+        Session = 'S'
     };
 
+    static constexpr size_t MagicSize = 8;
+    static constexpr size_t HeaderSize = 17;
+    /// The largest payload we record, that of WebSocketHandler::MaxMessageSize.
+    static constexpr size_t MaxPayloadSize = 100 * 1024 * 1024;
+
+    static const char* magic() { return "LOOLTRC1"; }
+
     TraceFileRecord() :
         Dir(Direction::Invalid),
         TimestampNs(0),
-        Pid(0)
+        Pid(0),
+        SessionIndex(0)
     {
     }
 
@@ -53,15 +81,49 @@ public:
         return oss.str();
     }
 
+    static void encodeHeader(char* header, const Direction dir, const uint64_t timestamp,
+                             const uint32_t sessionIndex, const size_t payloadSize)
+    {
+        encode(header, static_cast<uint32_t>(HeaderSize - 4 + payloadSize), 4);
+        header[4] = static_cast<char>(dir);
+        encode(header + 5, timestamp, 8);
+        encode(header + 13, sessionIndex, 4);
+    }
+
+    static uint64_t decode(const char* data, const int bytes)
+    {
+        uint64_t value = 0;
+        for (int i = bytes - 1; i >= 0; --i)
+        {
+            value = (value << 8) | static_cast<unsigned char>(data[i]);
+        }
+
+        return value;
+    }
+
     Direction Dir;
-    unsigned TimestampNs;
+    Poco::Int64 TimestampNs;
     unsigned Pid;
     std::string SessionId;
     std::string Payload;
+    /// Identifies the session of the record within its trace file.
+    unsigned SessionIndex;
+
+private:
+    static void encode(char* data, uint64_t value, const int bytes)
+    {
+        for (int i = 0; i < bytes; ++i)
+        {
+            data[i] = static_cast<char>(value & 0xff);
+            value >>= 8;
+        }
+    }
 };
 
 /// Trace-file generator class.
 /// Writes records into a trace file.
+/// Records are only queued by the callers, they are filtered,
+/// encoded, compressed and written by a thread of the writer.
 class TraceFileWriter
 {
 public:
@@ -76,31 +138,49 @@ public:
         _takeSnapshot(takeSnapshot),
         _path(Poco::Path(path).parent().toString()),
         _filter(true),
-        _stream(processPath(path), compress ? std::ios::binary : std::ios::out),
-        _deflater(_stream, Poco::DeflatingStreamBuf::STREAM_GZIP)
+        _stream(processPath(path), std::ios::binary),
+        _deflater(_stream, Poco::DeflatingStreamBuf::STREAM_GZIP),
+        _out(compress ? static_cast<std::ostream&>(_deflater) : _stream),
+        _stop(false),
+        _flush(false),
+        _nextSessionIndex(0)
     {
         for (const auto& f : filters)
         {
             _filter.deny(f);
         }
+
+        _out.write(TraceFileRecord::magic(), TraceFileRecord::MagicSize);
+        _thread = std::thread([this]() { run(); });
     }
 
     ~TraceFileWriter()
     {
-        std::unique_lock<std::mutex> lock(_mutex);
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+
+        _cond.notify_one();
+        _thread.join();
+
+        // An unused deflater would still write an empty gzip stream.
+        if (_compress)
+        {
+            _deflater.close();
+        }
 
-        _deflater.close();
         _stream.close();
     }
 
     void newSession(const std::string& id, const std::string& sessionId, const std::string& uri, const std::string& localPath)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-
         std::string snapshot = uri;
 
         if (_takeSnapshot)
         {
+            std::unique_lock<std::mutex> lock(_snapshotMutex);
+
             std::string decodedUri;
             Poco::URI::decode(uri, decodedUri);
             const auto url = Poco::URI(decodedUri).getPath();
@@ -128,140 +208,210 @@ public:
             }
         }
 
-        const auto data = "NewSession: " + snapshot;
-        writeLocked(id, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Event));
-        flushLocked();
+        enqueue(TraceFileRecord::Direction::Event, id, sessionId, "NewSession: " + snapshot, true);
     }
 
     void endSession(const std::string& id, const std::string& sessionId, const std::string& uri)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-
         std::string snapshot = uri;
 
-        const auto url = Poco::URI(uri).getPath();
-        const auto it = _urlToSnapshot.find(url);
-        if (it != _urlToSnapshot.end())
         {
-            snapshot = it->second.Snapshot;
-            if (it->second.SessionCount == 1)
-            {
-                // Last session, remove the mapping.
-                _urlToSnapshot.erase(it);
-            }
-            else
+            std::unique_lock<std::mutex> lock(_snapshotMutex);
+
+            const auto url = Poco::URI(uri).getPath();
+            const auto it = _urlToSnapshot.find(url);
+            if (it != _urlToSnapshot.end())
             {
-                it->second.SessionCount--;
+                snapshot = it->second.Snapshot;
+                if (it->second.SessionCount == 1)
+                {
+                    // Last session, remove the mapping.
+                    _urlToSnapshot.erase(it);
+                }
+                else
+                {
+                    it->second.SessionCount--;
+                }
             }
         }
 
-        const auto data = "EndSession: " + snapshot;
-        writeLocked(id, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Event));
-        flushLocked();
+        enqueue(TraceFileRecord::Direction::Event, id, sessionId, "EndSession: " + snapshot, true);
     }
 
     void writeEvent(const std::string& id, const std::string& sessionId, const std::string& data)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-
-        writeLocked(id, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Event));
-        flushLocked();
+        enqueue(TraceFileRecord::Direction::Event, id, sessionId, std::string(data), true);
     }
 
     void writeIncoming(const std::string& id, const std::string& sessionId, const std::string& data)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
-
-        if (_filter.match(data))
+        // Remap the URL to the snapshot.
+        if (LOOLProtocol::matchPrefix("load", data))
         {
-            // Remap the URL to the snapshot.
-            if (LOOLProtocol::matchPrefix("load", data))
+            auto tokens = LOOLProtocol::tokenize(data);
+            if (tokens.size() >= 2)
             {
-                auto tokens = LOOLProtocol::tokenize(data);
-                if (tokens.size() >= 2)
+                std::string url;
+                if (LOOLProtocol::getTokenString(tokens[1], "url", url))
                 {
-                    std::string url;
-                    if (LOOLProtocol::getTokenString(tokens[1], "url", url))
+                    std::string decodedUrl;
+                    Poco::URI::decode(url, decodedUrl);
+                    auto uriPublic = Poco::URI(decodedUrl);
+                    if (uriPublic.isRelative() || uriPublic.getScheme() == "file")
                     {
-                        std::string decodedUrl;
-                        Poco::URI::decode(url, decodedUrl);
-                        auto uriPublic = Poco::URI(decodedUrl);
-                        if (uriPublic.isRelative() || uriPublic.getScheme() == "file")
-                        {
-                            uriPublic.normalize();
-                        }
+                        uriPublic.normalize();
+                    }
+
+                    url = uriPublic.getPath();
 
-                        url = uriPublic.getPath();
-                        const auto it = _urlToSnapshot.find(url);
-                        if (it != _urlToSnapshot.end())
+                    std::unique_lock<std::mutex> lock(_snapshotMutex);
+                    const auto it = _urlToSnapshot.find(url);
+                    if (it != _urlToSnapshot.end())
+                    {
+                        LOG_TRC("TraceFile: Mapped URL: " << url << " to " << it->second.Snapshot);
+                        tokens[1] = "url=" + it->second.Snapshot;
+                        std::string newData;
+                        for (const auto& token : tokens)
                         {
-                            LOG_TRC("TraceFile: Mapped URL: " << url << " to " << it->second.Snapshot);
-                            tokens[1] = "url=" + it->second.Snapshot;
-                            std::string newData;
-                            for (const auto& token : tokens)
-                            {
-                                newData += token + ' ';
-                            }
-
-                            writeLocked(id, sessionId, newData, static_cast<char>(TraceFileRecord::Direction::Incoming));
-                            return;
+                            newData += token + ' ';
                         }
+
+                        lock.unlock();
+                        enqueue(TraceFileRecord::Direction::Incoming, id, sessionId, std::move(newData), false);
+                        return;
                     }
                 }
             }
-
-            writeLocked(id, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Incoming));
         }
+
+        enqueue(TraceFileRecord::Direction::Incoming, id, sessionId, std::string(data), false);
     }
 
     void writeOutgoing(const std::string& id, const std::string& sessionId, const std::string& data)
     {
+        if (_recordOutgoing)
+        {
+            enqueue(TraceFileRecord::Direction::Outgoing, id, sessionId, std::string(data), false);
+        }
+    }
+
+private:
+    /// Wake up the writer before this many records are queued.
+    static constexpr size_t MaxPending = 256;
+
+    struct Pending
+    {
+        TraceFileRecord::Direction Dir;
+        Poco::Int64 TimestampUs;
+        std::string Id;
+        std::string SessionId;
+        std::string Data;
+    };
+
+    void enqueue(const TraceFileRecord::Direction dir, const std::string& id, const std::string& sessionId,
+                 std::string&& data, const bool flush)
+    {
+        const Poco::Int64 usec = Poco::Timestamp().epochMicroseconds() - _epochStart;
+
         std::unique_lock<std::mutex> lock(_mutex);
 
-        if (_recordOutgoing && _filter.match(data))
+        _queue.push_back(Pending{ dir, usec, id, sessionId, std::move(data) });
+        _flush = _flush || flush;
+        if (flush || _queue.size() >= MaxPending)
         {
-            writeLocked(id, sessionId, data, static_cast<char>(TraceFileRecord::Direction::Outgoing));
+            lock.unlock();
+            _cond.notify_one();
         }
     }
 
-private:
-    void flushLocked()
+    void run()
     {
-        Util::assertIsLocked(_mutex);
+        Util::setThreadName("trace_writer");
+
+        std::vector<Pending> records;
+        for (;;)
+        {
+            bool stop;
+            bool flush;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                // Write the queued records at least every 100 ms.
+                _cond.wait_for(lock, std::chrono::milliseconds(100),
+                               [this]() { return _stop || _flush || _queue.size() >= MaxPending; });
+
+                records.swap(_queue);
+                stop = _stop;
+                flush = _flush;
+                _flush = false;
+            }
+
+            for (const auto& record : records)
+            {
+                try
+                {
+                    writeRecord(record);
+                }
+                catch (const std::exception& exc)
+                {
+                    LOG_ERR("TraceFile: Failed to write record: " << exc.what());
+                }
+            }
+
+            records.clear();
+
+            if (flush || stop)
+            {
+                _out.flush();
+                _stream.flush();
+            }
 
-        _deflater.flush();
-        _stream.flush();
+            if (stop)
+            {
+                break;
+            }
+        }
     }
 
-    void writeLocked(const std::string& id, const std::string& sessionId, const std::string& data, const char delim)
+    void writeRecord(const Pending& record)
     {
-        Util::assertIsLocked(_mutex);
+        if (record.Dir != TraceFileRecord::Direction::Event && !_filter.match(record.Data))
+        {
+            return;
+        }
 
-        const Poco::Int64 usec = Poco::Timestamp().epochMicroseconds() - _epochStart;
-        if (_compress)
+        std::string key = record.Id;
+        key += '\0';
+        key += record.SessionId;
+
+        uint32_t sessionIndex;
+        const auto it = _sessionIndexes.find(key);
+        if (it != _sessionIndexes.end())
         {
-            _deflater.write(&delim, 1);
-            _deflater << usec;
-            _deflater.write(&delim, 1);
-            _deflater << id;
-            _deflater.write(&delim, 1);
-            _deflater << sessionId;
-            _deflater.write(&delim, 1);
-            _deflater.write(data.c_str(), data.size());
-            _deflater.write("\n", 1);
+            sessionIndex = it->second;
         }
         else
         {
-            _stream.write(&delim, 1);
-            _stream << usec;
-            _stream.write(&delim, 1);
-            _stream << id;
-            _stream.write(&delim, 1);
-            _stream << sessionId;
-            _stream.write(&delim, 1);
-            _stream.write(data.c_str(), data.size());
-            _stream.write("\n", 1);
+            sessionIndex = _nextSessionIndex++;
+            write(TraceFileRecord::Direction::Session, record.TimestampUs, sessionIndex, key);
+            _sessionIndexes.emplace(key, sessionIndex);
         }
+
+        write(record.Dir, record.TimestampUs, sessionIndex, record.Data);
+
+        if (record.Dir == TraceFileRecord::Direction::Event &&
+            record.Data.compare(0, 12, "EndSession: ") == 0)
+        {
+            _sessionIndexes.erase(key);
+        }
+    }
+
+    void write(const TraceFileRecord::Direction dir, const Poco::Int64 usec, const uint32_t sessionIndex,
+               const std::string& payload)
+    {
+        char header[TraceFileRecord::HeaderSize];
+        TraceFileRecord::encodeHeader(header, dir, usec, sessionIndex, payload.size());
+        _out.write(header, sizeof(header));
+        _out.write(payload.data(), payload.size());
     }
 
     static std::string processPath(const std::string& path)
@@ -304,29 +454,61 @@ private:
     const bool _compress;
     const bool _takeSnapshot;
     const std::string _path;
+
+    /// Only used by the writer thread.
     Util::RegexListMatcher _filter;
     std::ofstream _stream;
     Poco::DeflatingOutputStream _deflater;
+    std::ostream& _out;
+    std::map<std::string, uint32_t> _sessionIndexes;
+
+    /// Protects the queue of records to write.
     std::mutex _mutex;
+    std::condition_variable _cond;
+    std::vector<Pending> _queue;
+    bool _stop;
+    bool _flush;
+    uint32_t _nextSessionIndex;
+    std::thread _thread;
+
+    std::mutex _snapshotMutex;
     std::map<std::string, SnapshotData> _urlToSnapshot;
 };
 
 /// Trace-file parser class.
-/// Reads records from a trace file.
+/// Reads records from a trace file, one at a time, decompressing as it
+/// goes. Reads the text format of older trace files too.
 class TraceFileReader
 {
 public:
     TraceFileReader(const std::string& path) :
         _compressed(path.size() > 2 && path.substr(path.size() - 2) == "gz"),
+        _binary(false),
         _epochStart(0),
-        _epochEnd(0),
-        _stream(path, _compressed ? std::ios::binary : std::ios::in),
+        _stream(path, std::ios::binary),
         _inflater(_stream, Poco::InflatingStreamBuf::STREAM_GZIP),
-        _index(0),
-        _indexIn(-1),
-        _indexOut(-1)
+        _in(_compressed ? static_cast<std::istream&>(_inflater) : _stream)
     {
-        readFile();
+        char magic[TraceFileRecord::MagicSize];
+        _in.read(magic, sizeof(magic));
+        const size_t read = _in.gcount();
+        _binary = (read == sizeof(magic) && std::memcmp(magic, TraceFileRecord::magic(), sizeof(magic)) == 0);
+        if (!_binary)
+        {
+            _textPending.assign(magic, read);
+            _in.clear();
+        }
+
+        _next = readRecord();
+        if (_next.Dir != TraceFileRecord::Direction::Event ||
+            _next.Payload.find("NewSession") != 0)
+        {
+            fprintf(stderr, "Invalid trace file [%s]. First record: %s\n", path.c_str(),
+                    _next.Dir == TraceFileRecord::Direction::Invalid ? "<empty>" : _next.Payload.c_str());
+            throw std::runtime_error("Invalid trace file.");
+        }
+
+        _epochStart = _next.TimestampNs;
     }
 
     ~TraceFileReader()
@@ -335,87 +517,146 @@ public:
     }
 
     Poco::Int64 getEpochStart() const { return _epochStart; }
-    Poco::Int64 getEpochEnd() const { return _epochEnd; }
 
+    /// Returns the next record, or an invalid one at the end of the file.
     TraceFileRecord getNextRecord()
     {
-        if (_index < _records.size())
+        TraceFileRecord rec;
+        std::swap(rec, _next);
+        if (rec.Dir != TraceFileRecord::Direction::Invalid)
         {
-            return _records[_index++];
+            _next = readRecord();
         }
 
-        // Invalid.
-        return TraceFileRecord();
+        return rec;
+    }
+
+private:
+    TraceFileRecord readRecord()
+    {
+        return _binary ? readBinaryRecord() : readTextRecord();
     }
 
-    TraceFileRecord getNextRecord(const TraceFileRecord::Direction dir)
+    TraceFileRecord readBinaryRecord()
     {
-        if (dir == TraceFileRecord::Direction::Incoming)
+        for (;;)
         {
-            if (_indexIn < _records.size())
+            TraceFileRecord rec;
+
+            char header[TraceFileRecord::HeaderSize];
+            _in.read(header, sizeof(header));
+            if (static_cast<size_t>(_in.gcount()) != sizeof(header))
             {
-                const TraceFileRecord rec = _records[_indexIn];
-                _indexIn = advance(_indexIn, dir);
-                return rec;
+                // End of trace file.
+                return TraceFileRecord();
             }
-        }
-        else
-        {
-            if (_indexOut < _records.size())
+
+            const uint64_t size = TraceFileRecord::decode(header, 4);
+            if (size < TraceFileRecord::HeaderSize - 4 ||
+                size - (TraceFileRecord::HeaderSize - 4) > TraceFileRecord::MaxPayloadSize)
             {
-                const TraceFileRecord rec = _records[_indexOut];
-                _indexOut = advance(_indexOut, dir);
-                return rec;
+                fprintf(stderr, "Invalid trace file record of %lu bytes.\n", static_cast<unsigned long>(size));
+                return TraceFileRecord();
             }
-        }
 
-        // Invalid.
-        return TraceFileRecord();
-    }
+            rec.Dir = static_cast<TraceFileRecord::Direction>(header[4]);
+            rec.TimestampNs = TraceFileRecord::decode(header + 5, 8);
+            rec.SessionIndex = TraceFileRecord::decode(header + 13, 4);
 
-private:
-    void readFile()
-    {
-        _records.clear();
-
-        std::string line;
-        for (;;)
-        {
-            if (_compressed)
+            // The sessions are numbered in order, each announced
+            // by a Session record before its first use.
+            const size_t maxSessionIndex = _sessions.size() +
+                (rec.Dir == TraceFileRecord::Direction::Session ? 1 : 0);
+            if (rec.SessionIndex >= maxSessionIndex)
             {
-                std::getline(_inflater, line);
+                fprintf(stderr, "Invalid trace file session index %u, %lu sessions so far.\n",
+                        rec.SessionIndex, static_cast<unsigned long>(_sessions.size()));
+                return TraceFileRecord();
             }
-            else
+
+            rec.Payload.resize(size - (TraceFileRecord::HeaderSize - 4));
+            if (!rec.Payload.empty())
             {
-                std::getline(_stream, line);
+                _in.read(&rec.Payload[0], rec.Payload.size());
+                if (static_cast<size_t>(_in.gcount()) != rec.Payload.size())
+                {
+                    fprintf(stderr, "Truncated trace file record.\n");
+                    return TraceFileRecord();
+                }
             }
 
-            if (line.empty())
+            if (rec.Dir == TraceFileRecord::Direction::Session)
             {
-                break;
+                if (rec.SessionIndex >= _sessions.size())
+                {
+                    _sessions.resize(rec.SessionIndex + 1);
+                }
+
+                const auto pos = rec.Payload.find('\0');
+                auto& session = _sessions[rec.SessionIndex];
+                session.first = std::atoi(rec.Payload.substr(0, pos).c_str());
+                session.second = (pos != std::string::npos ? rec.Payload.substr(pos + 1) : std::string());
+                continue;
             }
 
+            rec.Pid = _sessions[rec.SessionIndex].first;
+            rec.SessionId = _sessions[rec.SessionIndex].second;
+            return rec;
+        }
+    }
+
+    TraceFileRecord readTextRecord()
+    {
+        std::string line;
+        while (readLine(line))
+        {
             TraceFileRecord rec;
             if (extractRecord(line, rec))
-                _records.push_back(rec);
-            else
-                fprintf(stderr, "Invalid trace file record, expected 4 tokens. [%s]\n", line.c_str());
+            {
+                // Index the sessions as the binary format does.
+                const std::string key = std::to_string(rec.Pid) + '\0' + rec.SessionId;
+                const auto it = _textSessionIndexes.find(key);
+                if (it != _textSessionIndexes.end())
+                {
+                    rec.SessionIndex = it->second;
+                }
+                else
+                {
+                    rec.SessionIndex = _textSessionIndexes.size();
+                    _textSessionIndexes.emplace(key, rec.SessionIndex);
+                }
+
+                return rec;
+            }
+
+            fprintf(stderr, "Invalid trace file record, expected 4 tokens. [%s]\n", line.c_str());
         }
 
-        if (_records.empty() ||
-            _records[0].Dir != TraceFileRecord::Direction::Event ||
-            _records[0].Payload.find("NewSession") != 0)
+        // End of trace file.
+        return TraceFileRecord();
+    }
+
+    /// Reads a line, starting with what was read looking for the magic.
+    bool readLine(std::string& line)
+    {
+        line.clear();
+        if (!_textPending.empty())
         {
-            fprintf(stderr, "Invalid trace file with %ld records. First record: %s\n", _records.size(),
-                    _records.empty() ? "<empty>" : _records[0].Payload.c_str());
-            throw std::runtime_error("Invalid trace file.");
-        }
+            const auto pos = _textPending.find('\n');
+            if (pos != std::string::npos)
+            {
+                line = _textPending.substr(0, pos);
+                _textPending.erase(0, pos + 1);
+                return !line.empty();
+            }
 
-        _indexIn = advance(-1, TraceFileRecord::Direction::Incoming);
-        _indexOut = advance(-1, TraceFileRecord::Direction::Outgoing);
+            line.swap(_textPending);
+        }
 
-        _epochStart = _records[0].TimestampNs;
-        _epochEnd = _records[_records.size() - 1].TimestampNs;
+        std::string rest;
+        std::getline(_in, rest);
+        line += rest;
+        return !line.empty();
     }
 
     static bool extractRecord(const std::string& s, TraceFileRecord& rec)
@@ -435,7 +676,7 @@ private:
             switch (record)
             {
                 case 0:
-                    rec.TimestampNs = std::atoi(s.substr(pos, next - pos).c_str());
+                    rec.TimestampNs = std::atoll(s.substr(pos, next - pos).c_str());
                     break;
                 case 1:
                     rec.Pid = std::atoi(s.substr(pos, next - pos).c_str());
@@ -457,29 +698,21 @@ private:
         return false;
     }
 
-    unsigned advance(unsigned index, const TraceFileRecord::Direction dir)
-    {
-        while (++index < _records.size())
-        {
-            if (_records[index].Dir == dir)
-            {
-                break;
-            }
-        }
-
-        return index;
-    }
-
 private:
     const bool _compressed;
+    bool _binary;
     Poco::Int64 _epochStart;
-    Poco::Int64 _epochEnd;
     std::ifstream _stream;
     Poco::InflatingInputStream _inflater;
-    std::vector<TraceFileRecord> _records;
-    unsigned _index;
-    unsigned _indexIn;
-    unsigned _indexOut;
+    std::istream& _in;
+    TraceFileRecord _next;
+
+    /// The Pid and SessionId of each session index.
+    std::vector<std::pair<unsigned, std::string>> _sessions;
+
+    /// Text traces only.
+    std::string _textPending;
+    std::map<std::string, unsigned> _textSessionIndexes;
 };
 
 #endif